@@ -0,0 +1,92 @@
+//
+// Admission control: once a server is overloaded, shed requests early
+// with a cheap 503 rather than let its queues, and everyone's latency,
+// grow without bound.
+//
+// Overload is judged from queueing delay, the way CoDel judges a network
+// queue (Nichols and Jacobson, "Controlling Queue Delay", 2012), in the
+// form RPC servers use it. A queue that is only busy drains to a short
+// delay every now and then; a standing queue never does. So the
+// controller keeps the smallest delay seen in each interval. If even that
+// minimum was above the target, the queue is standing, and during the
+// next interval every request that waited longer than the target is
+// shed. Otherwise only requests that waited longer than a whole interval
+// are. Requests in flight (suspended handlers) can be capped as well.
+//
+// The settings are the server's; a controller holds one thread's state
+// and needs no locking. Each server thread keeps its own, and since they
+// all drain the same queues they reach the same verdict.
+//
+
+#ifndef __ADMISSION_CONTROL__
+#define __ADMISSION_CONTROL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// CoDel's defaults: a 5 ms target over a 100 ms interval.
+//
+const uint64_t default_shed_target_ns = 5 * 1000 * 1000;
+const uint64_t default_shed_interval_ns = 100 * 1000 * 1000;
+
+struct admission_settings
+{
+	bool enabled = false;
+	uint64_t target_ns = default_shed_target_ns;
+	uint64_t interval_ns = default_shed_interval_ns;
+	size_t max_in_flight = 0;                 // 0: no cap
+};
+
+struct admission_controller
+{
+	uint64_t interval_end = 0;
+	uint64_t interval_min = UINT64_MAX;       // smallest delay this interval
+	bool overloaded = false;                  // the last interval's minimum was above target
+
+	/***************************************************************************++
+
+	Routine Description:
+		Decides whether to serve a request.
+
+	Arguments:
+		settings  - The server's settings.
+		now_ns    - The current time, in any monotonic nanoseconds.
+		delay_ns  - How long the request waited before the server got to
+		            it.
+		in_flight - Requests the thread has already started and not
+		            finished.
+
+	Return Value:
+		false if the request should be shed.
+
+	--***************************************************************************/
+	bool admit(const admission_settings& settings, uint64_t now_ns, uint64_t delay_ns,
+		size_t in_flight)
+	{
+		if (!settings.enabled)
+			return true;
+
+		if (now_ns >= interval_end)
+		{
+			//
+			// A quiet thread may see no requests for several intervals;
+			// a minimum from that long ago says nothing about now.
+			//
+			overloaded = interval_min != UINT64_MAX && interval_min > settings.target_ns &&
+				now_ns - interval_end < settings.interval_ns;
+			interval_min = UINT64_MAX;
+			interval_end = now_ns + settings.interval_ns;
+		}
+
+		if (delay_ns < interval_min)
+			interval_min = delay_ns;
+
+		if (settings.max_in_flight != 0 && in_flight >= settings.max_in_flight)
+			return false;
+
+		return delay_ns <= (overloaded ? settings.target_ns : settings.interval_ns);
+	}
+};
+
+#endif
@@ -0,0 +1,92 @@
+//
+// CPU lists for pinning server threads, in the form taskset and
+// /sys/devices/system/cpu use: comma-separated CPU numbers and inclusive
+// ranges, for example "0-15,32-47".
+//
+
+#ifndef __CPU_LIST__
+#define __CPU_LIST__
+
+#include <stddef.h>
+
+#include <string_view>
+#include <vector>
+
+//
+// Highest CPU number accepted.
+//
+const unsigned max_cpu_number = 4095;
+
+/***************************************************************************++
+
+Routine Description:
+	Parses a CPU list. Thread i of a server is pinned to the i-th CPU of
+	the list, so the order given is kept and repeats are allowed.
+
+Arguments:
+	text  - The list.
+	pCpus - Receives the CPU numbers.
+
+Return Value:
+	false if the list is malformed or empty.
+
+--***************************************************************************/
+inline bool
+ParseCpuList(
+	std::string_view text,
+	std::vector<unsigned>* pCpus
+)
+{
+	pCpus->clear();
+
+	while (!text.empty())
+	{
+		size_t end = text.find(',');
+		std::string_view item = text.substr(0, end);
+		unsigned first = 0, last = 0;
+		size_t i = 0;
+		size_t digits = 0;
+
+		for (; i < item.size() && item[i] >= '0' && item[i] <= '9'; i++, digits++)
+		{
+			first = first * 10 + (item[i] - '0');
+
+			if (first > max_cpu_number)
+				return false;
+		}
+
+		last = first;
+
+		if (digits == 0)
+			return false;
+
+		if (i < item.size() && item[i] == '-')
+		{
+			last = 0;
+			digits = 0;
+
+			for (i++; i < item.size() && item[i] >= '0' && item[i] <= '9'; i++, digits++)
+			{
+				last = last * 10 + (item[i] - '0');
+
+				if (last > max_cpu_number)
+					return false;
+			}
+
+			if (digits == 0 || last < first)
+				return false;
+		}
+
+		if (i != item.size())
+			return false;
+
+		for (unsigned cpu = first; cpu <= last; cpu++)
+			pCpus->push_back(cpu);
+
+		text = end == std::string_view::npos ? std::string_view() : text.substr(end + 1);
+	}
+
+	return !pCpus->empty();
+}
+
+#endif
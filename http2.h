@@ -0,0 +1,1008 @@
+//
+// HTTP/2 framing and HPACK header compression (RFC 9113 and RFC 7541),
+// shared by the socket backend's h2c support and the load tester's h2
+// client.
+//
+// HPACK keeps most header fields out of the wire: a field found in the
+// 61-entry static table, or in the dynamic table of fields the peer was
+// recently sent, goes as a single index byte, and anything else as a
+// literal, Huffman coded when that is shorter. Both directions look the
+// static table up without touching the dynamic one - the decoder by
+// array index, the encoder through a small hash of the field names built
+// at startup - since most fields of a benchmark request or response are
+// in it. Huffman strings are decoded four bits at a time through a state
+// table built from the code lengths, emitting at most one symbol per
+// step (no code is shorter than five bits).
+//
+
+#ifndef __HTTP2__
+#define __HTTP2__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+#include <string>
+#include <string_view>
+
+//
+// The client connection preface, sent before its first SETTINGS frame.
+//
+const char http2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t http2_preface_length = sizeof(http2_preface) - 1;
+
+const size_t http2_frame_header_size = 9;
+const uint32_t http2_default_window = 65535;
+const uint32_t http2_max_window = 0x7fffffff;
+const uint32_t http2_default_frame_size = 16384;
+const uint32_t http2_max_frame_size = 0xffffff;
+const size_t hpack_default_table_size = 4096;
+
+enum http2_frame_type : uint8_t
+{
+	http2_data,
+	http2_headers,
+	http2_priority,
+	http2_rst_stream,
+	http2_settings,
+	http2_push_promise,
+	http2_ping,
+	http2_goaway,
+	http2_window_update,
+	http2_continuation,
+};
+
+const uint8_t http2_flag_end_stream = 0x01;
+const uint8_t http2_flag_ack = 0x01;
+const uint8_t http2_flag_end_headers = 0x04;
+const uint8_t http2_flag_padded = 0x08;
+const uint8_t http2_flag_priority = 0x20;
+
+enum http2_setting : uint16_t
+{
+	http2_settings_header_table_size = 1,
+	http2_settings_enable_push = 2,
+	http2_settings_max_concurrent_streams = 3,
+	http2_settings_initial_window_size = 4,
+	http2_settings_max_frame_size = 5,
+	http2_settings_max_header_list_size = 6,
+};
+
+enum http2_error : uint32_t
+{
+	http2_no_error,
+	http2_protocol_error,
+	http2_internal_error,
+	http2_flow_control_error,
+	http2_settings_timeout,
+	http2_stream_closed,
+	http2_frame_size_error,
+	http2_refused_stream,
+	http2_cancel,
+	http2_compression_error,
+	http2_connect_error,
+	http2_enhance_your_calm,
+	http2_inadequate_security,
+	http2_http_1_1_required,
+};
+
+struct http2_frame_header
+{
+	uint32_t length;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t stream;
+};
+
+//
+// Frames.
+//
+inline uint32_t
+Http2ReadUint32(
+	const void* pData
+)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(pData);
+
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+inline void
+Http2ReadFrameHeader(
+	const void* pData,
+	http2_frame_header* pHeader
+)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(pData);
+
+	pHeader->length = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+	pHeader->type = p[3];
+	pHeader->flags = p[4];
+	pHeader->stream = Http2ReadUint32(p + 5) & 0x7fffffff;
+}
+
+inline void
+Http2AppendUint32(
+	std::string& out,
+	uint32_t value
+)
+{
+	char bytes[4] = { (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value };
+
+	out.append(bytes, sizeof(bytes));
+}
+
+inline void
+Http2AppendFrameHeader(
+	std::string& out,
+	size_t length,
+	uint8_t type,
+	uint8_t flags,
+	uint32_t stream
+)
+{
+	char bytes[5] = { (char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags };
+
+	out.append(bytes, sizeof(bytes));
+	Http2AppendUint32(out, stream);
+}
+
+inline void
+Http2AppendSetting(
+	std::string& out,
+	http2_setting id,
+	uint32_t value
+)
+{
+	char bytes[2] = { (char)(id >> 8), (char)id };
+
+	out.append(bytes, sizeof(bytes));
+	Http2AppendUint32(out, value);
+}
+
+inline void
+Http2AppendWindowUpdate(
+	std::string& out,
+	uint32_t stream,
+	uint32_t increment
+)
+{
+	Http2AppendFrameHeader(out, 4, http2_window_update, 0, stream);
+	Http2AppendUint32(out, increment);
+}
+
+inline void
+Http2AppendRstStream(
+	std::string& out,
+	uint32_t stream,
+	http2_error error
+)
+{
+	Http2AppendFrameHeader(out, 4, http2_rst_stream, 0, stream);
+	Http2AppendUint32(out, error);
+}
+
+inline void
+Http2AppendGoaway(
+	std::string& out,
+	uint32_t last_stream,
+	http2_error error
+)
+{
+	Http2AppendFrameHeader(out, 8, http2_goaway, 0, 0);
+	Http2AppendUint32(out, last_stream);
+	Http2AppendUint32(out, error);
+}
+
+//
+// HPACK tables (RFC 7541 appendices A and B).
+//
+struct hpack_static_entry
+{
+	std::string_view name;
+	std::string_view value;
+};
+
+const size_t hpack_static_count = 61;
+
+inline constexpr hpack_static_entry hpack_static_table[hpack_static_count] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+struct hpack_huffman_code
+{
+	uint32_t code;
+	uint8_t bits;
+};
+
+const uint16_t hpack_huffman_eos = 256;
+
+inline constexpr hpack_huffman_code hpack_huffman_codes[257] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+//
+// The Huffman decoder's state table. A state is an inner node of the
+// code tree (0 is the root), and each (state, nibble) entry gives the
+// node reached after those four bits, and the symbol completed on the
+// way if any. A string may only end in a state reached from the root by
+// fewer than eight 1 bits (a prefix of EOS used as padding).
+//
+struct hpack_huffman_tables
+{
+	struct transition
+	{
+		uint16_t next;
+		uint8_t symbol;
+		uint8_t flags;
+	};
+
+	static const uint8_t emit = 1;
+	static const uint8_t fail = 2;
+
+	transition transitions[256][16];
+	bool accepting[256];
+
+	hpack_huffman_tables()
+	{
+		//
+		// The tree: children[node][bit] is an inner node, or 0x8000 | the
+		// symbol for a leaf.
+		//
+		uint16_t children[256][2] = {};
+		uint8_t depth[256] = {};
+		bool ones[256] = {};
+		uint16_t nodes = 1;
+
+		ones[0] = true;
+
+		for (uint16_t symbol = 0; symbol < 257; symbol++)
+		{
+			uint32_t code = hpack_huffman_codes[symbol].code;
+			int bits = hpack_huffman_codes[symbol].bits;
+			uint16_t node = 0;
+
+			for (int i = bits - 1; i > 0; i--)
+			{
+				int bit = (code >> i) & 1;
+
+				if (children[node][bit] == 0)
+				{
+					children[node][bit] = nodes;
+					depth[nodes] = depth[node] + 1;
+					ones[nodes] = ones[node] && bit;
+					nodes++;
+				}
+
+				node = children[node][bit];
+			}
+
+			children[node][code & 1] = 0x8000 | symbol;
+		}
+
+		for (uint16_t state = 0; state < 256; state++)
+		{
+			accepting[state] = ones[state] && depth[state] < 8;
+
+			for (int nibble = 0; nibble < 16; nibble++)
+			{
+				transition t = {};
+				uint16_t node = state;
+
+				for (int i = 3; i >= 0; i--)
+				{
+					uint16_t child = children[node][(nibble >> i) & 1];
+
+					if ((child & 0x8000) == 0)
+					{
+						node = child;
+						continue;
+					}
+
+					if ((child & 0x7fff) == hpack_huffman_eos)
+						t.flags |= fail;
+
+					t.symbol = (uint8_t)child;
+					t.flags |= emit;
+					node = 0;
+				}
+
+				t.next = node;
+				transitions[state][nibble] = t;
+			}
+		}
+	}
+};
+
+inline const hpack_huffman_tables hpack_huffman_data;
+
+//
+// Appends the Huffman decoding of length bytes at pData to out. Fails on
+// EOS or bad padding.
+//
+inline bool
+HpackHuffmanDecode(
+	const unsigned char* pData,
+	size_t length,
+	std::string& out
+)
+{
+	const auto& tables = hpack_huffman_data;
+	uint16_t state = 0;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		for (int nibble : { pData[i] >> 4, pData[i] & 15 })
+		{
+			const auto& t = tables.transitions[state][nibble];
+
+			if (t.flags & hpack_huffman_tables::fail)
+				return false;
+
+			if (t.flags & hpack_huffman_tables::emit)
+				out.push_back((char)t.symbol);
+
+			state = t.next;
+		}
+	}
+
+	return tables.accepting[state];
+}
+
+inline size_t
+HpackHuffmanLength(
+	std::string_view text
+)
+{
+	size_t bits = 0;
+
+	for (unsigned char c : text)
+		bits += hpack_huffman_codes[c].bits;
+
+	return (bits + 7) / 8;
+}
+
+inline void
+HpackHuffmanEncode(
+	std::string& out,
+	std::string_view text
+)
+{
+	uint64_t pending = 0;
+	int bits = 0;
+
+	for (unsigned char c : text)
+	{
+		pending = pending << hpack_huffman_codes[c].bits | hpack_huffman_codes[c].code;
+		bits += hpack_huffman_codes[c].bits;
+
+		for (; bits >= 8; bits -= 8)
+			out.push_back((char)(pending >> (bits - 8)));
+	}
+
+	//
+	// Padded with the high bits of EOS, which are all ones.
+	//
+	if (bits != 0)
+		out.push_back((char)(pending << (8 - bits) | 0xff >> bits));
+}
+
+//
+// Integers with an N-bit prefix; first holds the bits above the prefix.
+//
+inline void
+HpackAppendInteger(
+	std::string& out,
+	uint8_t first,
+	int prefix_bits,
+	uint64_t value
+)
+{
+	uint64_t limit = (1u << prefix_bits) - 1;
+
+	if (value < limit)
+	{
+		out.push_back((char)(first | value));
+		return;
+	}
+
+	out.push_back((char)(first | limit));
+
+	for (value -= limit; value >= 128; value >>= 7)
+		out.push_back((char)((value & 127) | 128));
+
+	out.push_back((char)value);
+}
+
+inline bool
+HpackReadInteger(
+	const unsigned char** pp,
+	const unsigned char* end,
+	int prefix_bits,
+	uint64_t* pValue
+)
+{
+	const unsigned char* p = *pp;
+	uint64_t limit = (1u << prefix_bits) - 1;
+
+	if (p == end)
+		return false;
+
+	uint64_t value = *p++ & limit;
+
+	if (value == limit)
+	{
+		for (int shift = 0;; shift += 7)
+		{
+			//
+			// Nothing we read is near 2^32; longer encodings are attacks.
+			//
+			if (p == end || shift > 28)
+				return false;
+
+			value += (uint64_t)(*p & 127) << shift;
+
+			if ((*p++ & 128) == 0)
+				break;
+		}
+	}
+
+	*pp = p;
+	*pValue = value;
+	return true;
+}
+
+inline void
+HpackAppendString(
+	std::string& out,
+	std::string_view text
+)
+{
+	size_t coded = HpackHuffmanLength(text);
+
+	if (coded < text.size())
+	{
+		HpackAppendInteger(out, 0x80, 7, coded);
+		HpackHuffmanEncode(out, text);
+	}
+	else
+	{
+		HpackAppendInteger(out, 0, 7, text.size());
+		out.append(text);
+	}
+}
+
+//
+// Reads a string literal. A Huffman coded one is decoded into scratch
+// (which must outlive the view); a raw one is viewed in place.
+//
+inline bool
+HpackReadString(
+	const unsigned char** pp,
+	const unsigned char* end,
+	std::string& scratch,
+	std::string_view* pText
+)
+{
+	bool huffman = *pp != end && (**pp & 0x80) != 0;
+	uint64_t length;
+
+	if (!HpackReadInteger(pp, end, 7, &length) || length > (uint64_t)(end - *pp))
+		return false;
+
+	const unsigned char* p = *pp;
+
+	*pp += length;
+
+	if (!huffman)
+	{
+		*pText = std::string_view(reinterpret_cast<const char*>(p), length);
+		return true;
+	}
+
+	scratch.clear();
+
+	if (!HpackHuffmanDecode(p, length, scratch))
+		return false;
+
+	*pText = scratch;
+	return true;
+}
+
+//
+// Finds static table entries by name: slot[hash of name] is the first
+// index (1-based) with that name. Entries with the same name are next to
+// each other, so the values are then a short scan.
+//
+struct hpack_static_index
+{
+	static const size_t slot_count = 128;
+
+	uint8_t slots[slot_count] = {};
+
+	static size_t
+	Slot(
+		std::string_view name
+	)
+	{
+		uint32_t hash = 2166136261u;
+
+		for (unsigned char c : name)
+			hash = (hash ^ c) * 16777619u;
+
+		return hash % slot_count;
+	}
+
+	hpack_static_index()
+	{
+		for (size_t i = hpack_static_count; i > 0; i--)
+		{
+			size_t slot = Slot(hpack_static_table[i - 1].name);
+
+			while (slots[slot] != 0 && hpack_static_table[slots[slot] - 1].name != hpack_static_table[i - 1].name)
+				slot = (slot + 1) % slot_count;
+
+			slots[slot] = (uint8_t)i;
+		}
+	}
+
+	//
+	// Returns the index of the entry matching name and value, or 0; the
+	// first entry matching the name alone goes to *pNameIndex (0 if none).
+	//
+	size_t
+	find(
+		std::string_view name,
+		std::string_view value,
+		size_t* pNameIndex
+	) const
+	{
+		size_t slot = Slot(name);
+
+		*pNameIndex = 0;
+
+		for (; slots[slot] != 0; slot = (slot + 1) % slot_count)
+		{
+			size_t index = slots[slot];
+
+			if (hpack_static_table[index - 1].name != name)
+				continue;
+
+			*pNameIndex = index;
+
+			for (; index <= hpack_static_count && hpack_static_table[index - 1].name == name; index++)
+			{
+				if (hpack_static_table[index - 1].value == value)
+					return index;
+			}
+
+			break;
+		}
+
+		return 0;
+	}
+};
+
+inline const hpack_static_index hpack_static_lookup;
+
+//
+// The dynamic table. Entry 0 is the newest, at HPACK index 62.
+//
+class hpack_table
+{
+public:
+	struct entry
+	{
+		std::string name;
+		std::string value;
+	};
+
+	explicit hpack_table(size_t capacity) : capacity_(capacity) {}
+
+	size_t count() const { return entries_.size(); }
+	size_t capacity() const { return capacity_; }
+	const entry& operator[](size_t i) const { return entries_[i]; }
+
+	void
+	insert(
+		std::string_view name,
+		std::string_view value
+	)
+	{
+		//
+		// Copied first: name or value may be in an entry about to go.
+		//
+		entry added = { std::string(name), std::string(value) };
+		size_t size = EntrySize(name, value);
+
+		evict(size > capacity_ ? capacity_ : capacity_ - size);
+
+		if (size <= capacity_)
+		{
+			entries_.push_front(std::move(added));
+			size_ += size;
+		}
+	}
+
+	void
+	resize(
+		size_t capacity
+	)
+	{
+		capacity_ = capacity;
+		evict(capacity);
+	}
+
+	//
+	// As hpack_static_index::find, with dynamic table indices.
+	//
+	size_t
+	find(
+		std::string_view name,
+		std::string_view value,
+		size_t* pNameIndex
+	) const
+	{
+		*pNameIndex = 0;
+
+		for (size_t i = 0; i < entries_.size(); i++)
+		{
+			if (entries_[i].name != name)
+				continue;
+
+			if (entries_[i].value == value)
+				return hpack_static_count + 1 + i;
+
+			if (*pNameIndex == 0)
+				*pNameIndex = hpack_static_count + 1 + i;
+		}
+
+		return 0;
+	}
+
+private:
+	static size_t
+	EntrySize(
+		std::string_view name,
+		std::string_view value
+	)
+	{
+		return 32 + name.size() + value.size();
+	}
+
+	void
+	evict(
+		size_t limit
+	)
+	{
+		while (size_ > limit)
+		{
+			size_ -= EntrySize(entries_.back().name, entries_.back().value);
+			entries_.pop_back();
+		}
+	}
+
+	std::deque<entry> entries_;
+	size_t size_ = 0;
+	size_t capacity_;
+};
+
+class hpack_decoder
+{
+public:
+	explicit hpack_decoder(size_t max_table_size = hpack_default_table_size)
+		: table_(max_table_size), max_table_size_(max_table_size) {}
+
+	hpack_decoder(const hpack_decoder&) = delete;
+
+	//
+	// Calls emit(name, value) for each field of a header block, in order.
+	// The views are valid during the call only. Returns false on a
+	// compression error, after which the connection has to be dropped.
+	//
+	template <typename Emit>
+	bool
+	decode(
+		const unsigned char* pData,
+		size_t length,
+		Emit&& emit
+	)
+	{
+		const unsigned char* p = pData;
+		const unsigned char* end = pData + length;
+
+		while (p != end)
+		{
+			uint64_t index;
+			std::string_view name;
+			std::string_view value;
+
+			if (*p & 0x80)
+			{
+				if (!HpackReadInteger(&p, end, 7, &index) || !field(index, &name, &value))
+					return false;
+
+				emit(name, value);
+				continue;
+			}
+
+			if ((*p & 0xe0) == 0x20)
+			{
+				if (!HpackReadInteger(&p, end, 5, &index) || index > max_table_size_)
+					return false;
+
+				table_.resize(index);
+				continue;
+			}
+
+			//
+			// A literal: with incremental indexing (01), or without it or
+			// never indexed (000x).
+			//
+			bool indexed = (*p & 0x40) != 0;
+
+			if (!HpackReadInteger(&p, end, indexed ? 6 : 4, &index))
+				return false;
+
+			if (index != 0 ? !field(index, &name, &value) : !HpackReadString(&p, end, name_, &name))
+				return false;
+
+			if (!HpackReadString(&p, end, value_, &value))
+				return false;
+
+			emit(name, value);
+
+			if (indexed)
+				table_.insert(name, value);
+		}
+
+		return true;
+	}
+
+private:
+	bool
+	field(
+		uint64_t index,
+		std::string_view* pName,
+		std::string_view* pValue
+	) const
+	{
+		if (index == 0)
+			return false;
+
+		if (index <= hpack_static_count)
+		{
+			*pName = hpack_static_table[index - 1].name;
+			*pValue = hpack_static_table[index - 1].value;
+			return true;
+		}
+
+		index -= hpack_static_count + 1;
+
+		if (index >= table_.count())
+			return false;
+
+		*pName = table_[index].name;
+		*pValue = table_[index].value;
+		return true;
+	}
+
+	hpack_table table_;
+	size_t max_table_size_;
+	std::string name_;
+	std::string value_;
+};
+
+class hpack_encoder
+{
+public:
+	hpack_encoder() : table_(hpack_default_table_size) {}
+
+	hpack_encoder(const hpack_encoder&) = delete;
+
+	//
+	// The peer's SETTINGS_HEADER_TABLE_SIZE. The table never grows past
+	// the default, and a change is announced at the start of the next
+	// header block.
+	//
+	void
+	set_table_size(
+		size_t size
+	)
+	{
+		if (size > hpack_default_table_size)
+			size = hpack_default_table_size;
+
+		if (size != table_.capacity())
+		{
+			table_.resize(size);
+			size_changed_ = true;
+		}
+	}
+
+	void
+	begin(
+		std::string& out
+	)
+	{
+		if (size_changed_)
+		{
+			HpackAppendInteger(out, 0x20, 5, table_.capacity());
+			size_changed_ = false;
+		}
+	}
+
+	//
+	// Appends a field. Fields whose value changes with every message
+	// (lengths, keys) should not be indexed, so they don't push the
+	// fields that repeat out of the dynamic table.
+	//
+	void
+	encode(
+		std::string& out,
+		std::string_view name,
+		std::string_view value,
+		bool index = true
+	)
+	{
+		size_t name_index;
+		size_t found = hpack_static_lookup.find(name, value, &name_index);
+
+		if (found == 0)
+		{
+			size_t dynamic_name;
+
+			found = table_.find(name, value, &dynamic_name);
+
+			if (name_index == 0)
+				name_index = dynamic_name;
+		}
+
+		if (found != 0)
+		{
+			HpackAppendInteger(out, 0x80, 7, found);
+			return;
+		}
+
+		HpackAppendInteger(out, index ? 0x40 : 0, index ? 6 : 4, name_index);
+
+		if (name_index == 0)
+			HpackAppendString(out, name);
+
+		HpackAppendString(out, value);
+
+		if (index)
+			table_.insert(name, value);
+	}
+
+private:
+	hpack_table table_;
+	bool size_changed_ = false;
+};
+
+#endif
@@ -0,0 +1,227 @@
+//
+// Allocation-free JSON writer.
+//
+// Writes a document straight into a caller's buffer, typically one kept
+// per thread, so building a response body costs no heap traffic. Numbers
+// go through std::to_chars, which never looks at the locale and writes a
+// double as the shortest text that reads back to the same value (the
+// MSVC and GNU libraries both do this with Ryu). Commas between members
+// and elements are added automatically.
+//
+// A document that does not fit is cut off and marked overflowed; callers
+// size the buffer for the largest document they write and check.
+//
+
+#ifndef __JSON_WRITER__
+#define __JSON_WRITER__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <charconv>
+#include <string_view>
+
+class json_writer
+{
+public:
+	//
+	// Deepest nesting of objects and arrays.
+	//
+	static const unsigned max_depth = 64;
+
+	json_writer(char* buffer, size_t capacity) : buffer_(buffer), capacity_(capacity) {}
+	json_writer(const json_writer&) = delete;
+	json_writer& operator=(const json_writer&) = delete;
+
+	void begin_object() { open('{'); }
+	void end_object() { close('}'); }
+	void begin_array() { open('['); }
+	void end_array() { close(']'); }
+
+	//
+	// The name of the next member of the current object; its value comes
+	// next.
+	//
+	void key(std::string_view name)
+	{
+		separate();
+		quote(name);
+		put(':');
+		after_key_ = true;
+	}
+
+	void value(std::string_view text)
+	{
+		separate();
+		quote(text);
+	}
+
+	void value(const char* text) { value(std::string_view(text)); }
+
+	void value(bool flag)
+	{
+		separate();
+		append(flag ? "true" : "false");
+	}
+
+	void value(int64_t number) { format(number); }
+	void value(uint64_t number) { format(number); }
+	void value(int number) { format((int64_t)number); }
+	void value(unsigned number) { format((uint64_t)number); }
+
+	//
+	// JSON has no infinities or NaN; they are written as null.
+	//
+	void value(double number)
+	{
+		if (number - number != 0)
+		{
+			null();
+			return;
+		}
+
+		format(number);
+	}
+
+	void null()
+	{
+		separate();
+		append("null");
+	}
+
+	bool overflowed() const { return overflowed_; }
+	size_t size() const { return length_; }
+	std::string_view view() const { return std::string_view(buffer_, length_); }
+
+private:
+	void put(char c)
+	{
+		if (length_ < capacity_)
+			buffer_[length_++] = c;
+		else
+			overflowed_ = true;
+	}
+
+	void append(std::string_view text)
+	{
+		if (capacity_ - length_ < text.size())
+		{
+			overflowed_ = true;
+			return;
+		}
+
+		memcpy(buffer_ + length_, text.data(), text.size());
+		length_ += text.size();
+	}
+
+	//
+	// Writes the comma before anything but the first member or element,
+	// and notes that the current container is no longer empty.
+	//
+	void separate()
+	{
+		if (after_key_)
+		{
+			after_key_ = false;
+			return;
+		}
+
+		if (depth_ != 0 && depth_ <= max_depth)
+		{
+			uint64_t bit = (uint64_t)1 << (depth_ - 1);
+
+			if (nonempty_ & bit)
+				put(',');
+
+			nonempty_ |= bit;
+		}
+	}
+
+	void open(char bracket)
+	{
+		separate();
+		put(bracket);
+
+		if (++depth_ <= max_depth)
+			nonempty_ &= ~((uint64_t)1 << (depth_ - 1));
+		else
+			overflowed_ = true;
+	}
+
+	void close(char bracket)
+	{
+		if (depth_ != 0)
+			depth_--;
+
+		put(bracket);
+	}
+
+	template <typename Number>
+	void format(Number number)
+	{
+		separate();
+
+		auto result = std::to_chars(buffer_ + length_, buffer_ + capacity_, number);
+
+		if (result.ec != std::errc())
+		{
+			overflowed_ = true;
+			return;
+		}
+
+		length_ = (size_t)(result.ptr - buffer_);
+	}
+
+	//
+	// A string with the quotes and escapes JSON requires. Runs of plain
+	// characters are copied in one go.
+	//
+	void quote(std::string_view text)
+	{
+		static const char hex[] = "0123456789abcdef";
+		size_t run = 0;
+
+		put('"');
+
+		for (size_t i = 0; i < text.size(); i++)
+		{
+			unsigned char c = (unsigned char)text[i];
+
+			if (c >= 0x20 && c != '"' && c != '\\')
+				continue;
+
+			append(text.substr(run, i - run));
+			run = i + 1;
+
+			switch (c)
+			{
+			case '"':  append("\\\""); break;
+			case '\\': append("\\\\"); break;
+			case '\n': append("\\n"); break;
+			case '\r': append("\\r"); break;
+			case '\t': append("\\t"); break;
+			default:
+			{
+				char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+
+				append(std::string_view(escape, sizeof(escape)));
+				break;
+			}
+			}
+		}
+
+		append(text.substr(run));
+		put('"');
+	}
+
+	char* buffer_;
+	size_t capacity_;
+	size_t length_ = 0;
+	unsigned depth_ = 0;
+	uint64_t nonempty_ = 0;      // bit d-1: the container at depth d has an entry
+	bool after_key_ = false;
+	bool overflowed_ = false;
+};
+
+#endif
@@ -0,0 +1,597 @@
+//
+// In-process concurrent key-value store for the /kv/ routes.
+//
+// Keys are spread over kv_shard_count shards by hash. Each shard is an
+// open-addressing table of 64-byte buckets, one cache line each: a
+// version word, a tag byte per slot (8 more bits of the key's hash) and 6
+// record pointers. A lookup reads one line in the common case and only
+// compares keys whose tag matches. A key that finds its home bucket full
+// goes to the next bucket along, and the full bucket is marked as having
+// overflowed, so a lookup stops at the first bucket that never did.
+//
+// Reads take no lock. Every bucket is a seqlock: a writer makes the
+// version odd while it changes the bucket and even again after, and a
+// reader copies the value out and then checks the version did not move,
+// retrying if it did. Writers to a shard take its mutex, so contention
+// is per shard and only between writers; a hot key slows down the other
+// writers of its shard and no reader.
+//
+// Records (key and value together) live in a per-shard arena of 1 MB
+// chunks with a free list per power-of-two size class. Freed records are
+// reused but arena memory is never returned while the store lives, so a
+// reader racing a writer may copy a reused record, but always from valid
+// memory, and the version check throws the copy away. When a shard grows
+// it moves into a table twice the size and marks every bucket of the old
+// one as being written forever, so readers still in it start over in the
+// new table; old tables are freed with the store.
+//
+
+#ifndef __KV_STORE__
+#define __KV_STORE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+const size_t kv_shard_count = 64;
+const size_t kv_slots_per_bucket = 6;
+const size_t kv_initial_buckets = 16;
+const size_t kv_max_key = 250;
+const size_t kv_max_value = 64 * 1024;
+
+enum kv_put_result
+{
+	kv_created,
+	kv_replaced,
+	kv_too_large,
+};
+
+inline uint64_t
+KvHash(
+	std::string_view key
+)
+{
+	//
+	// FNV-1a, finished with a mixer so that the shard, bucket and tag can
+	// each take their own bits.
+	//
+	uint64_t h = 14695981039346656037ull;
+
+	for (char c : key)
+	{
+		h ^= (unsigned char)c;
+		h *= 1099511628211ull;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+//
+// A key and its value, laid out after the header.
+//
+struct kv_record
+{
+	uint64_t hash;
+	std::atomic<uint32_t> key_length;
+	std::atomic<uint32_t> value_length;
+	unsigned size_class;
+
+	char* key() { return reinterpret_cast<char*>(this + 1); }
+	char* value() { return key() + key_length.load(std::memory_order_relaxed); }
+};
+
+struct alignas(64) kv_bucket
+{
+	std::atomic<uint32_t> version;             // odd while a writer is changing it
+	std::atomic<uint8_t> overflowed;           // a key homed here was placed further on
+	std::atomic<uint8_t> tags[kv_slots_per_bucket];
+	std::atomic<kv_record*> records[kv_slots_per_bucket];
+};
+
+static_assert(sizeof(kv_bucket) == 64, "a bucket is one cache line");
+
+//
+// Version of the buckets of a table that has been replaced: odd, so
+// readers never accept it.
+//
+const uint32_t kv_bucket_moved = 0xffffffff;
+
+class kv_arena
+{
+public:
+	static const size_t chunk_size = 1024 * 1024;
+	static const unsigned min_class_bits = 5;          // 32 bytes
+	static const unsigned class_count = 16;            // up to 1 MB
+
+	kv_arena() = default;
+	kv_arena(const kv_arena&) = delete;
+	kv_arena& operator=(const kv_arena&) = delete;
+
+	~kv_arena()
+	{
+		for (char* chunk : chunks_)
+			delete[] chunk;
+	}
+
+	//
+	// A block of at least size bytes, and its class for release.
+	//
+	void* allocate(size_t size, unsigned* pClass)
+	{
+		unsigned sizeClass = 0;
+
+		while (((size_t)1 << (sizeClass + min_class_bits)) < size)
+			sizeClass++;
+
+		*pClass = sizeClass;
+
+		if (free_[sizeClass] != nullptr)
+		{
+			free_block* block = free_[sizeClass];
+
+			free_[sizeClass] = block->next;
+			return block;
+		}
+
+		size_t blockSize = (size_t)1 << (sizeClass + min_class_bits);
+
+		if (chunks_.empty() || chunk_size - used_ < blockSize)
+		{
+			chunks_.push_back(new char[chunk_size]);
+			used_ = 0;
+		}
+
+		void* block = chunks_.back() + used_;
+
+		used_ += blockSize;
+		return block;
+	}
+
+	void release(void* p, unsigned sizeClass)
+	{
+		free_block* block = static_cast<free_block*>(p);
+
+		block->next = free_[sizeClass];
+		free_[sizeClass] = block;
+	}
+
+	size_t bytes_reserved() const { return chunks_.size() * chunk_size; }
+
+private:
+	struct free_block
+	{
+		free_block* next;
+	};
+
+	std::vector<char*> chunks_;
+	size_t used_ = 0;                          // bytes handed out of the last chunk
+	free_block* free_[class_count] = {};
+};
+
+class kv_store
+{
+public:
+	kv_store()
+	{
+		for (shard& s : shards_)
+			s.current.store(new_table(kv_initial_buckets), std::memory_order_relaxed);
+	}
+
+	kv_store(const kv_store&) = delete;
+	kv_store& operator=(const kv_store&) = delete;
+
+	~kv_store()
+	{
+		for (shard& s : shards_)
+		{
+			delete s.current.load(std::memory_order_relaxed);
+
+			for (table* old : s.retired)
+				delete old;
+		}
+	}
+
+	/***************************************************************************++
+
+	Routine Description:
+		Copies out a key's value without taking any lock.
+
+	Arguments:
+		key      - The key.
+		pBuffer  - Receives the value.
+		capacity - Size of pBuffer; at least kv_max_value to be sure of
+		           getting all of any value.
+		pLength  - Receives the value's length.
+
+	Return Value:
+		false if the key is not there.
+
+	--***************************************************************************/
+	bool get(std::string_view key, char* pBuffer, size_t capacity, size_t* pLength) const
+	{
+		uint64_t hash = KvHash(key);
+		const shard& s = shards_[hash >> 58];
+		uint8_t tag = tag_of(hash);
+
+		for (;;)
+		{
+			const table* pTable = s.current.load(std::memory_order_acquire);
+			size_t index = hash & pTable->mask;
+			bool retry = false;
+
+			for (size_t probes = 0; probes <= pTable->mask; probes++)
+			{
+				const kv_bucket& bucket = pTable->buckets[(index + probes) & pTable->mask];
+				uint32_t version = bucket.version.load(std::memory_order_acquire);
+
+				if (version & 1)
+				{
+					retry = true;
+					break;
+				}
+
+				int found = find_in_bucket(bucket, version, key, hash, tag, pBuffer, capacity, pLength);
+
+				if (found != 0)
+				{
+					if (found > 0)
+						return true;
+
+					retry = true;
+					break;
+				}
+
+				bool overflowed = bucket.overflowed.load(std::memory_order_relaxed) != 0;
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if (bucket.version.load(std::memory_order_relaxed) != version)
+				{
+					retry = true;
+					break;
+				}
+
+				if (!overflowed)
+					break;
+			}
+
+			if (!retry)
+				return false;
+		}
+	}
+
+	kv_put_result put(std::string_view key, std::string_view value)
+	{
+		if (key.size() > kv_max_key || value.size() > kv_max_value)
+			return kv_too_large;
+
+		uint64_t hash = KvHash(key);
+		shard& s = shards_[hash >> 58];
+		std::lock_guard<std::mutex> guard(s.lock);
+		unsigned sizeClass;
+		kv_record* pRecord = static_cast<kv_record*>(
+			s.arena.allocate(sizeof(kv_record) + key.size() + value.size(), &sizeClass));
+
+		pRecord->hash = hash;
+		pRecord->key_length.store((uint32_t)key.size(), std::memory_order_relaxed);
+		pRecord->value_length.store((uint32_t)value.size(), std::memory_order_relaxed);
+		pRecord->size_class = sizeClass;
+		memcpy(pRecord->key(), key.data(), key.size());
+		memcpy(pRecord->value(), value.data(), value.size());
+
+		table* pTable = s.current.load(std::memory_order_relaxed);
+		kv_bucket* pBucket;
+		size_t slot;
+
+		if (locate(pTable, key, hash, &pBucket, &slot))
+		{
+			kv_record* pOld = pBucket->records[slot].load(std::memory_order_relaxed);
+
+			begin_write(pBucket);
+			pBucket->records[slot].store(pRecord, std::memory_order_relaxed);
+			end_write(pBucket);
+
+			s.arena.release(pOld, pOld->size_class);
+			return kv_replaced;
+		}
+
+		if ((s.count + 1) * 4 > (pTable->mask + 1) * kv_slots_per_bucket * 3 ||
+			s.overflowed * 2 > pTable->mask + 1)
+		{
+			//
+			// Over three quarters full: grow. Half the buckets marked as
+			// overflowed (deletes never clear the mark): rehash in place
+			// at the same size to clear them.
+			//
+			bool grow = (s.count + 1) * 4 > (pTable->mask + 1) * kv_slots_per_bucket * 3;
+
+			pTable = rehash(s, grow ? (pTable->mask + 1) * 2 : pTable->mask + 1);
+		}
+
+		insert(s, pTable, pRecord, tag_of(hash));
+		s.count++;
+		return kv_created;
+	}
+
+	bool erase(std::string_view key)
+	{
+		uint64_t hash = KvHash(key);
+		shard& s = shards_[hash >> 58];
+		std::lock_guard<std::mutex> guard(s.lock);
+		table* pTable = s.current.load(std::memory_order_relaxed);
+		kv_bucket* pBucket;
+		size_t slot;
+
+		if (!locate(pTable, key, hash, &pBucket, &slot))
+			return false;
+
+		kv_record* pOld = pBucket->records[slot].load(std::memory_order_relaxed);
+
+		begin_write(pBucket);
+		pBucket->records[slot].store(nullptr, std::memory_order_relaxed);
+		pBucket->tags[slot].store(0, std::memory_order_relaxed);
+		end_write(pBucket);
+
+		s.arena.release(pOld, pOld->size_class);
+		s.count--;
+		return true;
+	}
+
+	size_t size()
+	{
+		size_t total = 0;
+
+		for (shard& s : shards_)
+		{
+			std::lock_guard<std::mutex> guard(s.lock);
+			total += s.count;
+		}
+
+		return total;
+	}
+
+private:
+	struct table
+	{
+		size_t mask;                           // bucket count - 1
+		kv_bucket* buckets;
+
+		~table() { delete[] buckets; }
+	};
+
+	struct alignas(64) shard
+	{
+		std::atomic<table*> current;           // readers start here
+		std::mutex lock;                       // writers
+		kv_arena arena;                        // under lock
+		size_t count = 0;                      // under lock
+		size_t overflowed = 0;                 // buckets marked, under lock
+		std::vector<table*> retired;           // under lock
+	};
+
+	static table* new_table(size_t bucketCount)
+	{
+		table* pTable = new table;
+
+		pTable->mask = bucketCount - 1;
+		pTable->buckets = new kv_bucket[bucketCount];
+
+		for (size_t i = 0; i < bucketCount; i++)
+		{
+			kv_bucket& bucket = pTable->buckets[i];
+
+			bucket.version.store(0, std::memory_order_relaxed);
+			bucket.overflowed.store(0, std::memory_order_relaxed);
+
+			for (size_t slot = 0; slot < kv_slots_per_bucket; slot++)
+			{
+				bucket.tags[slot].store(0, std::memory_order_relaxed);
+				bucket.records[slot].store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		return pTable;
+	}
+
+	//
+	// Tags are never 0, which marks an empty slot.
+	//
+	static uint8_t tag_of(uint64_t hash)
+	{
+		uint8_t tag = (uint8_t)(hash >> 48);
+
+		return tag != 0 ? tag : 1;
+	}
+
+	static void begin_write(kv_bucket* pBucket)
+	{
+		pBucket->version.store(pBucket->version.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	static void end_write(kv_bucket* pBucket)
+	{
+		pBucket->version.store(pBucket->version.load(std::memory_order_relaxed) + 1,
+			std::memory_order_release);
+	}
+
+	/***************************************************************************++
+
+	Routine Description:
+		Looks for a key in one bucket on behalf of a reader, copying out
+		its value if found. Everything read is checked against the
+		bucket's version before it is trusted: the lengths before the
+		bytes are copied, and the copy before it is returned.
+
+	Arguments:
+		bucket   - The bucket.
+		version  - Its version, even, read before this was called.
+		key      - The key.
+		hash     - The key's hash.
+		tag      - The key's tag.
+		pBuffer  - Receives the value.
+		capacity - Size of pBuffer.
+		pLength  - Receives the value's length.
+
+	Return Value:
+		1 if found, 0 if not in this bucket, -1 if a writer got in the way
+		and the lookup has to start over.
+
+	--***************************************************************************/
+	static int find_in_bucket(const kv_bucket& bucket, uint32_t version, std::string_view key,
+		uint64_t hash, uint8_t tag, char* pBuffer, size_t capacity, size_t* pLength)
+	{
+		for (size_t slot = 0; slot < kv_slots_per_bucket; slot++)
+		{
+			if (bucket.tags[slot].load(std::memory_order_relaxed) != tag)
+				continue;
+
+			kv_record* pRecord = bucket.records[slot].load(std::memory_order_relaxed);
+
+			if (pRecord == nullptr)
+				continue;
+
+			uint64_t recordHash = pRecord->hash;
+			size_t keyLength = pRecord->key_length.load(std::memory_order_relaxed);
+			size_t valueLength = pRecord->value_length.load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (bucket.version.load(std::memory_order_relaxed) != version)
+				return -1;
+
+			if (recordHash != hash || keyLength != key.size() ||
+				memcmp(pRecord->key(), key.data(), keyLength) != 0)
+			{
+				continue;
+			}
+
+			size_t length = valueLength < capacity ? valueLength : capacity;
+
+			memcpy(pBuffer, pRecord->key() + keyLength, length);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (bucket.version.load(std::memory_order_relaxed) != version)
+				return -1;
+
+			*pLength = length;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	//
+	// Finds a key's slot; writers only, under the shard's lock.
+	//
+	static bool locate(table* pTable, std::string_view key, uint64_t hash,
+		kv_bucket** ppBucket, size_t* pSlot)
+	{
+		uint8_t tag = tag_of(hash);
+		size_t index = hash & pTable->mask;
+
+		for (size_t probes = 0; probes <= pTable->mask; probes++)
+		{
+			kv_bucket* pBucket = &pTable->buckets[(index + probes) & pTable->mask];
+
+			for (size_t slot = 0; slot < kv_slots_per_bucket; slot++)
+			{
+				kv_record* pRecord = pBucket->records[slot].load(std::memory_order_relaxed);
+
+				if (pBucket->tags[slot].load(std::memory_order_relaxed) == tag &&
+					pRecord->hash == hash &&
+					pRecord->key_length.load(std::memory_order_relaxed) == key.size() &&
+					memcmp(pRecord->key(), key.data(), key.size()) == 0)
+				{
+					*ppBucket = pBucket;
+					*pSlot = slot;
+					return true;
+				}
+			}
+
+			if (!pBucket->overflowed.load(std::memory_order_relaxed))
+				break;
+		}
+
+		return false;
+	}
+
+	//
+	// Places a record in the first free slot from its home bucket on,
+	// marking the full buckets passed over. The table always has room.
+	//
+	static void insert(shard& s, table* pTable, kv_record* pRecord, uint8_t tag)
+	{
+		size_t index = pRecord->hash & pTable->mask;
+
+		for (;; index++)
+		{
+			kv_bucket* pBucket = &pTable->buckets[index & pTable->mask];
+
+			for (size_t slot = 0; slot < kv_slots_per_bucket; slot++)
+			{
+				if (pBucket->records[slot].load(std::memory_order_relaxed) == nullptr)
+				{
+					begin_write(pBucket);
+					pBucket->records[slot].store(pRecord, std::memory_order_relaxed);
+					pBucket->tags[slot].store(tag, std::memory_order_relaxed);
+					end_write(pBucket);
+					return;
+				}
+			}
+
+			if (!pBucket->overflowed.load(std::memory_order_relaxed))
+			{
+				begin_write(pBucket);
+				pBucket->overflowed.store(1, std::memory_order_relaxed);
+				end_write(pBucket);
+				s.overflowed++;
+			}
+		}
+	}
+
+	//
+	// Moves a shard into a new table of the given size. Readers of the old
+	// table are sent to the new one by its buckets' versions.
+	//
+	static table* rehash(shard& s, size_t bucketCount)
+	{
+		table* pOld = s.current.load(std::memory_order_relaxed);
+		table* pNew = new_table(bucketCount);
+
+		s.overflowed = 0;
+
+		for (size_t i = 0; i <= pOld->mask; i++)
+		{
+			for (size_t slot = 0; slot < kv_slots_per_bucket; slot++)
+			{
+				kv_record* pRecord = pOld->buckets[i].records[slot].load(std::memory_order_relaxed);
+
+				if (pRecord != nullptr)
+					insert(s, pNew, pRecord, tag_of(pRecord->hash));
+			}
+		}
+
+		s.current.store(pNew, std::memory_order_release);
+
+		for (size_t i = 0; i <= pOld->mask; i++)
+			pOld->buckets[i].version.store(kv_bucket_moved, std::memory_order_release);
+
+		s.retired.push_back(pOld);
+		return pNew;
+	}
+
+	shard shards_[kv_shard_count];
+};
+
+#endif
@@ -0,0 +1,225 @@
+//
+// Latency histogram for the load tester, laid out as HdrHistogram lays
+// out one tracking values from 1 to latency_histogram_highest with 3
+// significant digits: every power of two is split into 1024 linear
+// sub-buckets, so a value is known to within 1 part in 1024 (0.1%)
+// however large it is, and the counts array has a fixed length.
+//
+// Each thread records into a histogram of its own, which costs a few
+// shifts and an add and never allocates. The threads' histograms are
+// added together when they finish, and the percentile distribution is
+// printed in HdrHistogram's .hgrm format, so it can be plotted with the
+// HdrHistogram tools alongside wrk2's.
+//
+
+#ifndef __LATENCY_HISTOGRAM__
+#define __LATENCY_HISTOGRAM__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <bit>
+#include <cmath>
+#include <vector>
+
+// Values are recorded in nanoseconds; anything above an hour counts as an
+// hour.
+const uint64_t latency_histogram_highest = 3600ull * 1000 * 1000 * 1000;
+
+// 2 * 10^3 values need 11 bits of single-unit resolution; the top half of
+// each bucket is what a power of two adds.
+const unsigned latency_histogram_sub_bucket_bits = 11;
+const uint64_t latency_histogram_sub_buckets = 1ull << latency_histogram_sub_bucket_bits;
+const uint64_t latency_histogram_half_buckets = latency_histogram_sub_buckets / 2;
+
+// Buckets, each twice as wide as the last, needed to reach past the
+// highest value: the first holds sub_buckets values.
+const unsigned latency_histogram_bucket_count =
+	static_cast<unsigned>(std::bit_width(latency_histogram_highest >> latency_histogram_sub_bucket_bits)) + 1;
+
+struct latency_histogram
+{
+	std::vector<uint64_t> counts;
+	uint64_t total = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+
+	latency_histogram()
+		: counts((latency_histogram_bucket_count + 1) * latency_histogram_half_buckets)
+	{
+	}
+
+	static size_t index_of(uint64_t value)
+	{
+		unsigned bucket = static_cast<unsigned>(std::bit_width(value | (latency_histogram_sub_buckets - 1))) -
+			latency_histogram_sub_bucket_bits;
+		uint64_t sub_bucket = value >> bucket;
+
+		return static_cast<size_t>(((bucket + 1ull) << (latency_histogram_sub_bucket_bits - 1)) +
+			sub_bucket - latency_histogram_half_buckets);
+	}
+
+	// Smallest value counted at an index, and how many values share it.
+	static uint64_t lowest_at(size_t index)
+	{
+		int bucket = static_cast<int>(index >> (latency_histogram_sub_bucket_bits - 1)) - 1;
+		uint64_t sub_bucket = (index & (latency_histogram_half_buckets - 1)) + latency_histogram_half_buckets;
+
+		if (bucket < 0)
+		{
+			sub_bucket -= latency_histogram_half_buckets;
+			bucket = 0;
+		}
+
+		return sub_bucket << bucket;
+	}
+
+	static uint64_t range_at(size_t index)
+	{
+		int bucket = static_cast<int>(index >> (latency_histogram_sub_bucket_bits - 1)) - 1;
+
+		return 1ull << (bucket < 0 ? 0 : bucket);
+	}
+
+	// Largest value counted with a given one, which is what HdrHistogram
+	// reports for percentiles and the maximum.
+	static uint64_t highest_equivalent(uint64_t value)
+	{
+		size_t index = index_of(value);
+
+		return lowest_at(index) + range_at(index) - 1;
+	}
+
+	void record(uint64_t value)
+	{
+		if (value > latency_histogram_highest)
+			value = latency_histogram_highest;
+
+		counts[index_of(value)]++;
+		total++;
+
+		if (value < min)
+			min = value;
+
+		if (value > max)
+			max = value;
+	}
+
+	void add(const latency_histogram& other)
+	{
+		for (size_t i = 0; i < counts.size(); i++)
+			counts[i] += other.counts[i];
+
+		total += other.total;
+
+		if (other.min < min)
+			min = other.min;
+
+		if (other.max > max)
+			max = other.max;
+	}
+
+	// Value at or below which the given percentage of the counts fall.
+	uint64_t value_at_percentile(double percentile) const
+	{
+		uint64_t rank = static_cast<uint64_t>(percentile / 100 * total + 0.5);
+		uint64_t seen = 0;
+
+		if (rank == 0)
+			rank = 1;
+
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			seen += counts[i];
+
+			if (seen >= rank)
+				return lowest_at(i) + range_at(i) - 1;
+		}
+
+		return 0;
+	}
+
+	double mean() const
+	{
+		double sum = 0;
+
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			if (counts[i] != 0)
+				sum += counts[i] * (lowest_at(i) + range_at(i) / 2.0);
+		}
+
+		return total ? sum / total : 0;
+	}
+
+	double standard_deviation() const
+	{
+		double average = mean();
+		double sum = 0;
+
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			if (counts[i] != 0)
+			{
+				double deviation = lowest_at(i) + range_at(i) / 2.0 - average;
+
+				sum += counts[i] * deviation * deviation;
+			}
+		}
+
+		return total ? std::sqrt(sum / total) : 0;
+	}
+
+	// Prints the percentile distribution as HdrHistogram does, values
+	// divided by scale, with ticks_per_half reporting steps for every
+	// halving of the distance to 100%.
+	void print_distribution(FILE* out, double scale, unsigned ticks_per_half = 5) const
+	{
+		double next = 0;
+		uint64_t seen = 0;
+		size_t last = 0;
+
+		fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+		for (size_t i = 0; i < counts.size() && seen < total; i++)
+		{
+			if (counts[i] == 0)
+				continue;
+
+			seen += counts[i];
+			last = i;
+
+			double reached = 100.0 * seen / total;
+			double value = (lowest_at(i) + range_at(i) - 1) / scale;
+
+			// A bucket can cross several reporting steps, but the last
+			// one reports once before the 100% line.
+			if (next > reached)
+				continue;
+
+			do
+			{
+				fprintf(out, "%12.3f %2.12f %10llu %14.2f\n", value, next / 100,
+					static_cast<unsigned long long>(seen), 1 / (1 - next / 100));
+
+				double half = std::exp2(std::floor(std::log2(100 / (100 - next))) + 1);
+
+				next += 100 / (ticks_per_half * half);
+			} while (next <= reached && seen < total);
+		}
+
+		if (total != 0)
+		{
+			fprintf(out, "%12.3f %2.12f %10llu\n", (lowest_at(last) + range_at(last) - 1) / scale, 1.0,
+				static_cast<unsigned long long>(total));
+		}
+
+		fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / scale, standard_deviation() / scale);
+		fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n",
+			(total ? highest_equivalent(max) : 0) / scale, static_cast<unsigned long long>(total));
+		fprintf(out, "#[Buckets = %12u, SubBuckets     = %12llu]\n", latency_histogram_bucket_count,
+			static_cast<unsigned long long>(latency_histogram_sub_buckets));
+	}
+};
+
+#endif
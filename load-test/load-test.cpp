@@ -7,142 +7,1865 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <unordered_map>
+#include <chrono>
 
-#define WIN32_LEAN_AND_MEAN 1
-#include <conio.h>
-#include <windows.h>
-#include <winhttp.h>
+#include "socket_compat.h"
+#include "latency_histogram.h"
 
 #include "../common.h"
+#include "../crc32c.h"
+#include "../http2.h"
+#include "../websocket.h"
 
+// TLS mode (--tls) needs OpenSSL and is only built with LOAD_TEST_TLS
+// defined, which the Visual Studio project does when OPENSSL_DIR is set.
+#ifdef LOAD_TEST_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
-#pragma comment(lib, "winhttp.lib")
+#ifdef _WIN32
+#pragma comment(lib, "libssl.lib")
+#pragma comment(lib, "libcrypto.lib")
+#endif
+#endif
+
+// Requests written back to back on one connection before reading any
+// response; 0 keeps one request in flight on each connection instead.
+static int pipeline_depth = 0;
+
+// Keep-alive connections each thread holds open when not pipelining. A
+// connection is reopened only after the server closes it.
+static size_t connections_per_thread = 1;
+
+// Requests per second sent open loop (--rate), on a fixed timeline shared
+// out over the threads and started at rate_start; 0 sends closed loop.
+static double request_rate = 0;
+static double rate_start = 0;
+
+// Streams kept in flight on each connection in HTTP/2 mode (--h2); 0
+// speaks HTTP/1.1. Connections are cleartext and start with the HTTP/2
+// preface (prior knowledge).
+static int h2_streams = 0;
+
+// The url every request asks for, and the Accept-Encoding header sent
+// with it (none if empty).
+static std::string request_path = "/sync";
+static std::string accept_encoding;
+
+// Key-value workload (--kv-keys): requests go to /kv/<key> for keys drawn
+// from kv_keys of them with Zipfian skew zipf_theta (0 is uniform), and
+// each is a GET with probability read_ratio and otherwise a PUT of a
+// value_size byte value.
+static size_t kv_keys = 0;
+static double read_ratio = 0.9;
+static double zipf_theta = 0.99;
+static size_t value_size = 100;
+
+// Upload workload (--upload): every request POSTs upload_body to /sink,
+// which answers with its length and CRC32C; the CRC is checked against
+// upload_crc.
+static size_t upload_size = 0;
+static std::string upload_body;
+static std::string upload_crc;
+
+// WebSocket workload (--ws): ws_connections connections to /ws, spread
+// over the threads, each with one message of ws_message in flight at a
+// time. Every round trip is timed.
+static bool ws_mode = false;
+static size_t ws_connections = 64;
+static std::string ws_message;
+
+// TLS workload (--tls): every request goes out on a new TLS connection to
+// port 8443, so each one pays for a handshake. A connection offers the
+// session of the thread's previous one with probability tls_resume_ratio,
+// and the server decides whether to resume it. The server's certificate
+// is not verified, since it is normally self-signed.
+static bool tls_mode = false;
+static double tls_resume_ratio = 1.0;
+#ifdef LOAD_TEST_TLS
+static SSL_CTX* tls_context = nullptr;
+#endif
 
 
 double now()
 {
-	LARGE_INTEGER tps = { 0 };
-	QueryPerformanceFrequency(&tps);
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static std::atomic<size_t> total_result_count = 0;
+
+// TCP connections opened to run the test, for requests per connection.
+static std::atomic<size_t> total_connections = 0;
+
+// Keep-alive connections reopened after the server closed them.
+static std::atomic<size_t> total_reconnects = 0;
+
+// Request latencies in nanoseconds, added up from the threads' own
+// histograms as they finish: from when each request was due (which open
+// loop can be well before it was sent), and from when it was sent. Only
+// the keep-alive mode has due times; in TLS mode a request is timed from
+// before its connection is opened.
+static std::mutex request_latency_lock;
+static latency_histogram request_latencies;
+static latency_histogram request_service_times;
+static std::atomic<size_t> pool_thread_index = 0;
+
+// HTTP/2 streams the server reset or refused; not in total_result_count.
+static std::atomic<size_t> total_reset_streams = 0;
+
+// Response body bytes received, as sent: compressed bodies count at their
+// compressed size.
+static std::atomic<size_t> total_body_bytes = 0;
+
+// Requests the server refused with 503 Service Unavailable to shed load.
+// They are included in total_result_count.
+static std::atomic<size_t> total_shed_count = 0;
+
+// Key-value requests by outcome; reads are hits (200) or misses (404).
+static std::atomic<size_t> total_kv_hits = 0;
+static std::atomic<size_t> total_kv_misses = 0;
+static std::atomic<size_t> total_kv_writes = 0;
+
+// Upload bytes sent, and /sink answers whose CRC didn't match.
+static std::atomic<size_t> total_upload_bytes = 0;
+static std::atomic<size_t> total_upload_errors = 0;
+
+// WebSocket round trips in nanoseconds, added up from every thread, and
+// echoes that differed from the message sent.
+static std::mutex ws_latency_lock;
+static latency_histogram ws_latencies;
+static std::atomic<size_t> total_ws_mismatches = 0;
+static std::atomic<size_t> ws_thread_index = 0;
+
+// TLS handshakes by kind, and the total time spent in each kind in
+// nanoseconds. Resumptions the client offered but the server declined
+// count as full handshakes.
+static std::atomic<size_t> total_tls_full = 0;
+static std::atomic<size_t> total_tls_resumed = 0;
+static std::atomic<uint64_t> total_tls_full_ns = 0;
+static std::atomic<uint64_t> total_tls_resumed_ns = 0;
+
+// Checks a /sink answer against the uploaded body.
+bool upload_answer_matches(const char* body, size_t length)
+{
+	return std::string_view(body, length).find(upload_crc) != std::string_view::npos;
+}
+
+// Draws key ranks 0..n-1 with probability proportional to 1/(rank+1)^theta,
+// in constant time per draw, by the method of Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases" (SIGMOD 1994), as YCSB
+// does. Rank 0 is the hottest key. theta must be below 1.
+struct zipf_generator
+{
+	size_t n = 1;
+	double theta = 0;
+	double zeta_n = 1;
+	double alpha = 1;
+	double eta = 1;
+
+	void init(size_t count, double skew)
+	{
+		double zeta_2 = 1 + std::pow(0.5, skew);
+
+		n = count;
+		theta = skew;
+		zeta_n = 0;
+
+		for (size_t i = 1; i <= n; i++)
+			zeta_n += 1 / std::pow(static_cast<double>(i), theta);
+
+		alpha = 1 / (1 - theta);
+		eta = n > 2 ? (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zeta_n) : 1;
+	}
+
+	// u is uniform in [0, 1).
+	size_t next(double u) const
+	{
+		double uz = u * zeta_n;
+
+		if (uz < 1)
+			return 0;
+
+		if (uz < 1 + std::pow(0.5, theta) && n > 1)
+			return 1;
+
+		size_t rank = static_cast<size_t>(n * std::pow(eta * u - eta + 1, alpha));
+
+		return rank < n ? rank : n - 1;
+	}
+};
+
+static zipf_generator key_popularity;
+
+// The next key-value request of one thread: a key and whether to write it.
+struct kv_operation
+{
+	std::string path;
+	bool write;
+};
+
+kv_operation next_kv_operation(std::mt19937_64& random)
+{
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	size_t rank = key_popularity.next(uniform(random));
+
+	return kv_operation{ "/kv/key" + std::to_string(rank), uniform(random) >= read_ratio };
+}
+
+// Counts a key-value response by its status.
+void count_kv_response(bool write, int status, size_t* hits, size_t* misses, size_t* writes)
+{
+	if (write)
+	{
+		if (status == 200 || status == 201)
+			*writes += 1;
+	}
+	else if (status == 200)
+		*hits += 1;
+	else if (status == 404)
+		*misses += 1;
+}
+
+SOCKET connect_to_server(const char* server, const char* port)
+{
+	addrinfo hints = {};
+	addrinfo* addresses = nullptr;
+	SOCKET s = INVALID_SOCKET;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(server, port, &hints, &addresses) != 0)
+	{
+		printf("Error %d resolving %s.\n", WSAGetLastError(), server);
+		return INVALID_SOCKET;
+	}
+
+	for (addrinfo* a = addresses; a != nullptr; a = a->ai_next)
+	{
+		s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+		if (s == INVALID_SOCKET)
+			continue;
+
+		if (connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0)
+			break;
+
+		closesocket(s);
+		s = INVALID_SOCKET;
+	}
+
+	freeaddrinfo(addresses);
+
+	if (s == INVALID_SOCKET)
+	{
+		printf("Error %d connecting to %s:%s.\n", WSAGetLastError(), server, port);
+		return INVALID_SOCKET;
+	}
+
+	BOOL one = TRUE;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+
+	total_connections += 1;
+	return s;
+}
+
+// Length of the complete response at the start of data (head plus
+// Content-Length body), or 0 if more bytes are needed. The body length
+// goes to *body_length, and whether the server closes the connection
+// after it ("Connection: close") to *close, if given.
+size_t complete_response_length(const std::string& data, size_t start, size_t* body_length,
+	bool* close = nullptr)
+{
+	size_t head_end = data.find("\r\n\r\n", start);
+
+	if (head_end == std::string::npos)
+		return 0;
+
+	size_t content_length = 0;
+	size_t line = data.find("\r\n", start) + 2;
+
+	if (close)
+		*close = false;
+
+	while (line < head_end)
+	{
+		size_t line_end = data.find("\r\n", line);
+		const char name[] = "content-length:";
+		const char connection[] = "connection:";
+
+		if (line_end - line > sizeof(name) - 1 &&
+			_strnicmp(data.data() + line, name, sizeof(name) - 1) == 0)
+		{
+			content_length = strtoul(data.data() + line + sizeof(name) - 1, nullptr, 10);
+		}
+		else if (close && line_end - line > sizeof(connection) - 1 &&
+			_strnicmp(data.data() + line, connection, sizeof(connection) - 1) == 0)
+		{
+			std::string_view value(data.data() + line + sizeof(connection) - 1,
+				line_end - line - (sizeof(connection) - 1));
+
+			*close = value.find("close") != std::string_view::npos ||
+				value.find("Close") != std::string_view::npos;
+		}
+
+		line = line_end + 2;
+	}
+
+	size_t length = head_end + 4 - start + content_length;
+
+	*body_length = content_length;
+
+	return data.size() - start >= length ? length : 0;
+}
+
+// A connection of the keep-alive pool, with at most one request in flight.
+struct pooled_connection
+{
+	SOCKET s;
+	const std::string* request;  // the request in flight, or nullptr
+	std::string kv_request;      // holds it in key-value mode
+	bool write;                  // it is a key-value PUT
+	double due_at;               // when it was due to be sent
+	double sent_at;              // when it was sent
+	size_t sent;
+	std::string received;
+};
+
+// Opens a pool connection, non-blocking, so one poll drives all of a
+// thread's connections.
+bool pool_connect(pooled_connection& c)
+{
+	c.s = connect_to_server("localhost", "8080");
+	c.sent = 0;
+	c.received.clear();
+
+	if (c.s == INVALID_SOCKET)
+		return false;
+
+	u_long nonblocking = 1;
+	ioctlsocket(c.s, FIONBIO, &nonblocking);
+	return true;
+}
+
+// Sends as much of the request in flight as the socket takes. Returns
+// false if the connection failed.
+bool pool_send(pooled_connection& c)
+{
+	while (c.request != nullptr && c.sent < c.request->size())
+	{
+		int n = send(c.s, c.request->data() + c.sent, static_cast<int>(c.request->size() - c.sent), 0);
+
+		if (n < 0)
+			return WSAGetLastError() == WSAEWOULDBLOCK;
+
+		c.sent += n;
+	}
+
+	return true;
+}
+
+// Holds connections_per_thread keep-alive connections open and keeps one
+// request in flight on each until the thread has had requests_per_thread
+// answered. A connection the server closes, or asks to close, is
+// reopened, and a request it left unanswered is sent again on the new
+// one.
+//
+// Closed loop (the default), the next request goes out as soon as the
+// response to the last is in. Open loop (--rate), the thread's requests
+// are due at fixed times, whether or not the server keeps up, and each
+// goes out on the first free connection once it is due. Its latency runs
+// from when it was due, so time spent waiting behind a stalled server is
+// counted rather than omitted; the time from when it was actually sent
+// is kept too.
+void keep_alive_task_func()
+{
+	std::string request;
+	std::vector<pooled_connection> pool(connections_per_thread);
+	std::vector<WSAPOLLFD> fds;
+	std::vector<size_t> polled;
+	latency_histogram latencies, service_times;
+	std::mt19937_64 random(std::random_device{}());
+	std::string value(value_size, 'v');
+	char buffer[64 * 1024];
+	size_t started = 0;
+	size_t completed = 0;
+	size_t body_bytes = 0, shed = 0;
+	size_t hits = 0, misses = 0, writes = 0;
+	size_t uploaded = 0, upload_errors = 0;
+	size_t reconnects = 0;
+	bool failed = false;
+
+	// Request k of this thread is due at schedule_start + k * interval.
+	// The threads' timelines are staggered, so together they send at an
+	// even request_rate.
+	const bool open_loop = request_rate > 0;
+	const double interval = open_loop ? request_thread_count / request_rate : 0;
+	const double schedule_start = open_loop ? rate_start + pool_thread_index++ / request_rate : 0;
+
+	if (upload_size != 0)
+	{
+		request = "POST /sink HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+			std::to_string(upload_size) + "\r\n\r\n" + upload_body;
+	}
+	else
+	{
+		request = "GET " + request_path + " HTTP/1.1\r\nHost: localhost\r\n";
+
+		if (!accept_encoding.empty())
+			request += "Accept-Encoding: " + accept_encoding + "\r\n";
+
+		request += "\r\n";
+	}
+
+	// Puts the thread's next request on an idle connection, if one is
+	// left and, open loop, it is due.
+	auto start_next = [&](pooled_connection& c)
+	{
+		c.sent = 0;
+		c.request = nullptr;
+
+		if (started == requests_per_thread)
+			return;
+
+		double time = now();
+
+		if (open_loop)
+		{
+			double due = schedule_start + started * interval;
+
+			if (time < due)
+				return;
+
+			c.due_at = due;
+		}
+		else
+			c.due_at = time;
+
+		c.sent_at = time;
+		started++;
+
+		if (kv_keys != 0)
+		{
+			kv_operation operation = next_kv_operation(random);
+
+			c.kv_request = (operation.write ? "PUT " : "GET ") + operation.path + " HTTP/1.1\r\nHost: localhost\r\n";
+
+			if (operation.write)
+				c.kv_request += "Content-Length: " + std::to_string(value.size()) + "\r\n\r\n" + value;
+			else
+				c.kv_request += "\r\n";
+
+			c.write = operation.write;
+			c.request = &c.kv_request;
+		}
+		else
+			c.request = &request;
+	};
+
+	// Reopens a connection the server closed, if it still has work, and
+	// sends its request again. Returns false if that failed.
+	auto reopen = [&](pooled_connection& c)
+	{
+		if (c.s != INVALID_SOCKET)
+			closesocket(c.s);
+
+		c.s = INVALID_SOCKET;
+
+		if (c.request == nullptr && started == requests_per_thread)
+			return true;
+
+		reconnects++;
+
+		if (pool_connect(c) && pool_send(c))
+			return true;
+
+		printf("Connection lost after %zu responses.\n", completed);
+		return false;
+	};
+
+	for (auto& c : pool)
+	{
+		c.s = INVALID_SOCKET;
+		c.request = nullptr;
+	}
+
+	for (auto& c : pool)
+	{
+		if (!pool_connect(c))
+		{
+			failed = true;
+			break;
+		}
+	}
+
+	while (!failed && completed < requests_per_thread)
+	{
+		fds.clear();
+		polled.clear();
+
+		bool idle = false;
+
+		for (size_t i = 0; i < pool.size() && !failed; i++)
+		{
+			pooled_connection& c = pool[i];
+
+			if (c.request == nullptr)
+			{
+				start_next(c);
+
+				if (c.request != nullptr && !pool_send(c))
+					failed = !reopen(c);
+			}
+
+			if (c.request == nullptr)
+			{
+				idle = true;
+				continue;
+			}
+
+			WSAPOLLFD fd = {};
+
+			fd.fd = c.s;
+			fd.events = POLLIN | (c.sent < c.request->size() ? POLLOUT : 0);
+			fds.push_back(fd);
+			polled.push_back(i);
+		}
+
+		if (failed)
+			break;
+
+		//
+		// With a connection free, wake up when the next request is due.
+		//
+		double timeout = 10;
+		bool scheduled = false;
+
+		if (open_loop && idle && started < requests_per_thread)
+		{
+			double wait = schedule_start + started * interval - now();
+
+			timeout = wait > 0 ? wait : 0;
+			scheduled = true;
+		}
+
+		if (fds.empty())
+		{
+			std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+			continue;
+		}
+
+		int ready = PollSockets(fds.data(), static_cast<ULONG>(fds.size()), timeout);
+
+		if (ready < 0 || (ready == 0 && !scheduled))
+		{
+			printf("Error %d polling, or no response for 10 seconds.\n", WSAGetLastError());
+			break;
+		}
+
+		for (size_t f = 0; f < fds.size() && !failed; f++)
+		{
+			pooled_connection& c = pool[polled[f]];
+			bool closed = false;
+
+			if (fds[f].revents & POLLOUT)
+				closed = !pool_send(c);
+
+			if (!closed && (fds[f].revents & (POLLIN | POLLERR | POLLHUP)))
+			{
+				int n = recv(c.s, buffer, sizeof(buffer), 0);
+
+				if (n == 0 || (n < 0 && WSAGetLastError() != WSAEWOULDBLOCK))
+					closed = true;
+				else if (n > 0)
+					c.received.append(buffer, n);
+			}
+
+			size_t body_length;
+			size_t length;
+			bool close_after;
+
+			while (c.request != nullptr &&
+				(length = complete_response_length(c.received, 0, &body_length, &close_after)) != 0)
+			{
+				double time = now();
+
+				latencies.record(static_cast<uint64_t>((time - c.due_at) * 1e9));
+				service_times.record(static_cast<uint64_t>((time - c.sent_at) * 1e9));
+
+				// "HTTP/1.1 503 "
+				if (c.received.compare(8, 5, " 503 ") == 0)
+					shed++;
+				else if (upload_size != 0)
+				{
+					uploaded += upload_size;
+					if (!upload_answer_matches(c.received.data() + length - body_length, body_length))
+						upload_errors++;
+				}
+
+				if (kv_keys != 0)
+					count_kv_response(c.write, atoi(c.received.c_str() + 9), &hits, &misses, &writes);
+
+				body_bytes += body_length;
+				c.received.erase(0, length);
+				completed++;
+
+				auto before = total_result_count.fetch_add(1);
+				if (before % 1000 == 999)
+					std::cout << ".";
+
+				start_next(c);
+
+				if (close_after)
+				{
+					closed = true;
+					break;
+				}
+
+				closed = !pool_send(c);
+			}
+
+			if (closed)
+				failed = !reopen(c);
+		}
+	}
+
+	for (auto& c : pool)
+	{
+		if (c.s != INVALID_SOCKET)
+			closesocket(c.s);
+	}
+
+	total_body_bytes += body_bytes;
+	total_shed_count += shed;
+	total_upload_bytes += uploaded;
+	total_upload_errors += upload_errors;
+	total_kv_hits += hits;
+	total_kv_misses += misses;
+	total_kv_writes += writes;
+	total_reconnects += reconnects;
+
+	std::lock_guard<std::mutex> lock(request_latency_lock);
+	request_latencies.add(latencies);
+	request_service_times.add(service_times);
+}
+
+// Asks the server to stop. Both servers exit once they have had
+// request_thread_count of these.
+void send_kill_request()
+{
+	const char request[] = "GET /kill HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+	std::string received;
+	char buffer[4096];
+	size_t body_length;
+	SOCKET s = connect_to_server("localhost", "8080");
+
+	if (s == INVALID_SOCKET)
+		return;
+
+	send(s, request, static_cast<int>(sizeof(request) - 1), 0);
+
+	while (complete_response_length(received, 0, &body_length) == 0)
+	{
+		int n = recv(s, buffer, sizeof(buffer), 0);
+
+		if (n <= 0)
+			break;
+
+		received.append(buffer, n);
+	}
+
+	closesocket(s);
+}
+
+// Writes pipeline_depth requests at a time on one keep-alive connection
+// and then reads all of their responses. In key-value mode every batch is
+// drawn afresh. Each request is timed from when its batch was sent.
+void pipelined_task_func()
+{
+	std::string request = "GET " + request_path + " HTTP/1.1\r\nHost: localhost\r\n";
+	std::string batch;
+	std::string received;
+	char buffer[64 * 1024];
+	latency_histogram service_times;
+	size_t body_bytes = 0;
+	size_t shed = 0;
+	std::mt19937_64 random(std::random_device{}());
+	std::string value(value_size, 'v');
+	std::vector<bool> writes_in_batch;
+	size_t hits = 0, misses = 0, writes = 0;
+	size_t uploaded = 0, upload_errors = 0;
+
+	if (!accept_encoding.empty())
+		request += "Accept-Encoding: " + accept_encoding + "\r\n";
+
+	if (upload_size != 0)
+	{
+		// Uploads are sent one by one rather than copied into a batch.
+		request = "POST /sink HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+			std::to_string(upload_size) + "\r\n\r\n" + upload_body;
+	}
+	else
+	{
+		request += "\r\n";
+
+		for (int i = 0; i < pipeline_depth; i++)
+			batch += request;
+	}
+
+	SOCKET s = connect_to_server("localhost", "8080");
+
+	if (s == INVALID_SOCKET)
+		return;
+
+	for (size_t done = 0; done < requests_per_thread;)
+	{
+		size_t count = requests_per_thread - done;
+
+		if (count > static_cast<size_t>(pipeline_depth))
+			count = pipeline_depth;
+
+		size_t batch_size = count * request.size();
+
+		if (kv_keys != 0)
+		{
+			batch.clear();
+			writes_in_batch.clear();
+
+			for (size_t i = 0; i < count; i++)
+			{
+				kv_operation operation = next_kv_operation(random);
+
+				batch += (operation.write ? "PUT " : "GET ") + operation.path + " HTTP/1.1\r\nHost: localhost\r\n";
+
+				if (operation.write)
+					batch += "Content-Length: " + std::to_string(value.size()) + "\r\n\r\n" + value;
+				else
+					batch += "\r\n";
+
+				writes_in_batch.push_back(operation.write);
+			}
+
+			batch_size = batch.size();
+		}
+
+		bool sent = true;
+		double sent_at = now();
+		double received_at = sent_at;
+
+		if (upload_size != 0)
+		{
+			for (size_t i = 0; i < count && sent; i++)
+				sent = send(s, request.data(), static_cast<int>(request.size()), 0) != SOCKET_ERROR;
+		}
+		else
+			sent = send(s, batch.data(), static_cast<int>(batch_size), 0) != SOCKET_ERROR;
+
+		if (!sent)
+		{
+			printf("Error %d in send.\n", WSAGetLastError());
+			break;
+		}
+
+		size_t responses = 0;
+		size_t parsed = 0;
+		bool closed = false;
+
+		while (responses < count)
+		{
+			size_t body_length;
+			size_t length = complete_response_length(received, parsed, &body_length);
+
+			if (length != 0)
+			{
+				service_times.record(static_cast<uint64_t>((received_at - sent_at) * 1e9));
+
+				// "HTTP/1.1 503 "
+				if (received.compare(parsed + 8, 5, " 503 ") == 0)
+					shed++;
+				else if (upload_size != 0)
+				{
+					uploaded += upload_size;
+					if (!upload_answer_matches(received.data() + parsed + length - body_length, body_length))
+						upload_errors++;
+				}
+
+				if (kv_keys != 0)
+					count_kv_response(writes_in_batch[responses], atoi(received.c_str() + parsed + 9),
+						&hits, &misses, &writes);
+
+				parsed += length;
+				body_bytes += body_length;
+				responses++;
+				continue;
+			}
+
+			int n = recv(s, buffer, sizeof(buffer), 0);
+
+			if (n <= 0)
+			{
+				printf("Connection closed after %zu responses.\n", done + responses);
+				closed = true;
+				break;
+			}
+
+			received_at = now();
+			received.append(buffer, n);
+		}
+
+		if (closed)
+			break;
+
+		received.erase(0, parsed);
+		done += count;
+		total_body_bytes += body_bytes;
+		total_shed_count += shed;
+		body_bytes = 0;
+		shed = 0;
+
+		auto before = total_result_count.fetch_add(count);
+		if (before / 1000 != (before + count) / 1000)
+			std::cout << ".";
+	}
+
+	closesocket(s);
+	total_upload_bytes += uploaded;
+	total_upload_errors += upload_errors;
+	total_kv_hits += hits;
+	total_kv_misses += misses;
+	total_kv_writes += writes;
+
+	std::lock_guard<std::mutex> lock(request_latency_lock);
+	request_service_times.add(service_times);
+}
+
+// A request in flight on an HTTP/2 connection.
+struct h2_request
+{
+	bool write;                // a key-value PUT
+	int status;
+	size_t body_bytes;
+	std::string body;          // kept for /sink answers only
+	size_t upload_sent;        // request body bytes sent
+	int64_t send_window;
+	double sent_at;            // when its headers were queued
+};
+
+// Sends as much of a request body as the flow-control windows allow.
+// Returns false once all of it has gone.
+bool h2_send_body(std::string& out, uint32_t id, h2_request& request, const std::string& body,
+	int64_t* connection_window, uint32_t max_frame)
+{
+	while (request.upload_sent < body.size())
+	{
+		int64_t window = request.send_window < *connection_window ? request.send_window : *connection_window;
+		size_t length = body.size() - request.upload_sent;
+
+		if (window <= 0)
+			return true;
+
+		if (length > static_cast<size_t>(window))
+			length = static_cast<size_t>(window);
+
+		if (length > max_frame)
+			length = max_frame;
+
+		bool last = request.upload_sent + length == body.size();
+
+		Http2AppendFrameHeader(out, length, http2_data, last ? http2_flag_end_stream : 0, id);
+		out.append(body, request.upload_sent, length);
+		request.upload_sent += length;
+		request.send_window -= length;
+		*connection_window -= length;
+	}
+
+	return false;
+}
+
+// Keeps h2_streams requests in flight on one HTTP/2 connection, opening a
+// new stream as each response ends, so the server sees requests arrive
+// and complete independently instead of in pipelined batches. Each
+// stream is timed from its headers to the end of its response.
+void h2_task_func()
+{
+	std::string out;
+	std::string received;
+	std::string header_block;
+	char buffer[64 * 1024];
+	latency_histogram service_times;
+	std::mt19937_64 random(std::random_device{}());
+	std::string value(value_size, 'v');
+	std::unordered_map<uint32_t, h2_request> in_flight;
+	std::vector<uint32_t> uploading;
+	hpack_encoder encoder;
+	hpack_decoder decoder;
+	uint32_t next_stream = 1;
+	uint32_t continuation = 0;
+	uint8_t continuation_flags = 0;
+	int64_t connection_window = http2_default_window;
+	uint32_t peer_initial_window = http2_default_window;
+	uint32_t peer_max_frame = http2_default_frame_size;
+	size_t peer_max_streams = h2_streams;
+	size_t started = 0;
+	size_t completed = 0;
+	size_t receive_unacked = 0;
+	size_t body_bytes = 0, shed = 0, resets = 0;
+	size_t hits = 0, misses = 0, writes = 0;
+	size_t uploaded = 0, upload_errors = 0;
+	bool failed = false;
+
+	SOCKET s = connect_to_server("localhost", "8080");
+
+	if (s == INVALID_SOCKET)
+		return;
+
+	// The preface, and windows big enough that responses never wait for
+	// us to return them, short of the connection's.
+	out.append(http2_preface, http2_preface_length);
+	Http2AppendFrameHeader(out, 12, http2_settings, 0, 0);
+	Http2AppendSetting(out, http2_settings_enable_push, 0);
+	Http2AppendSetting(out, http2_settings_initial_window_size, http2_max_window);
+	Http2AppendWindowUpdate(out, 0, http2_max_window - http2_default_window);
+
+	while (!failed && completed < requests_per_thread)
+	{
+		// Top up the streams in flight.
+		while (in_flight.size() < peer_max_streams && started < requests_per_thread)
+		{
+			uint32_t id = next_stream;
+			h2_request& request = in_flight[id];
+			std::string_view method = "GET";
+			std::string path = request_path;
+			const std::string* body = nullptr;
+
+			next_stream += 2;
+			started++;
+			request = h2_request{};
+			request.send_window = peer_initial_window;
+			request.sent_at = now();
+
+			if (kv_keys != 0)
+			{
+				kv_operation operation = next_kv_operation(random);
+
+				request.write = operation.write;
+				path = operation.path;
+
+				if (operation.write)
+				{
+					method = "PUT";
+					body = &value;
+				}
+			}
+			else if (upload_size != 0)
+			{
+				method = "POST";
+				path = "/sink";
+				body = &upload_body;
+			}
+
+			header_block.clear();
+			encoder.begin(header_block);
+			encoder.encode(header_block, ":method", method);
+			encoder.encode(header_block, ":scheme", "http");
+			encoder.encode(header_block, ":authority", "localhost:8080");
+			encoder.encode(header_block, ":path", path, kv_keys == 0);
+
+			if (!accept_encoding.empty())
+				encoder.encode(header_block, "accept-encoding", accept_encoding);
+
+			if (body != nullptr)
+				encoder.encode(header_block, "content-length", std::to_string(body->size()), false);
+
+			// Request headers are far below the smallest frame size.
+			Http2AppendFrameHeader(out, header_block.size(), http2_headers,
+				http2_flag_end_headers | (body == nullptr ? http2_flag_end_stream : 0), id);
+			out += header_block;
+
+			if (body != nullptr && h2_send_body(out, id, request, *body, &connection_window, peer_max_frame))
+				uploading.push_back(id);
+		}
+
+		if (!out.empty())
+		{
+			if (send(s, out.data(), static_cast<int>(out.size()), 0) == SOCKET_ERROR)
+			{
+				printf("Error %d in send.\n", WSAGetLastError());
+				break;
+			}
+
+			out.clear();
+		}
+
+		int n = recv(s, buffer, sizeof(buffer), 0);
+
+		if (n <= 0)
+		{
+			printf("Connection closed after %zu responses.\n", completed);
+			break;
+		}
+
+		received.append(buffer, n);
+
+		size_t parsed = 0;
+
+		while (received.size() - parsed >= http2_frame_header_size)
+		{
+			http2_frame_header frame;
+
+			Http2ReadFrameHeader(received.data() + parsed, &frame);
+
+			if (received.size() - parsed - http2_frame_header_size < frame.length)
+				break;
+
+			const unsigned char* payload =
+				reinterpret_cast<const unsigned char*>(received.data() + parsed + http2_frame_header_size);
+			size_t length = frame.length;
+			uint8_t flags = frame.flags;
+			auto found = in_flight.find(frame.stream);
+			bool ended = false;
+
+			parsed += http2_frame_header_size + frame.length;
 
-	LARGE_INTEGER pc = { 0 };
-	QueryPerformanceCounter(&pc);
-	return static_cast<double>(pc.QuadPart) / static_cast<double>(tps.QuadPart);
+			switch (frame.type)
+			{
+			case http2_data:
+				if (flags & http2_flag_padded)
+				{
+					length -= 1 + payload[0];
+					payload++;
+				}
+
+				receive_unacked += frame.length;
+
+				if (found != in_flight.end())
+				{
+					found->second.body_bytes += length;
+
+					if (upload_size != 0)
+						found->second.body.append(reinterpret_cast<const char*>(payload), length);
+				}
+
+				ended = (flags & http2_flag_end_stream) != 0;
+				break;
+
+			case http2_headers:
+			case http2_continuation:
+				if (frame.type == http2_headers)
+				{
+					size_t pad = 0;
+
+					if (flags & http2_flag_padded)
+					{
+						pad = payload[0];
+						payload++;
+						length--;
+					}
+
+					if (flags & http2_flag_priority)
+					{
+						payload += 5;
+						length -= 5;
+					}
+
+					length -= pad;
+					header_block.clear();
+					continuation = frame.stream;
+					continuation_flags = flags;
+				}
+
+				header_block.append(reinterpret_cast<const char*>(payload), length);
+
+				if ((flags & http2_flag_end_headers) == 0)
+					break;
+
+				found = in_flight.find(continuation);
+
+				if (!decoder.decode(reinterpret_cast<const unsigned char*>(header_block.data()), header_block.size(),
+					[&](std::string_view name, std::string_view field)
+				{
+					if (name == ":status" && found != in_flight.end())
+						found->second.status = atoi(std::string(field).c_str());
+				}))
+				{
+					printf("Bad header block from the server.\n");
+					failed = true;
+				}
+
+				ended = (continuation_flags & http2_flag_end_stream) != 0;
+				break;
+
+			case http2_rst_stream:
+				if (found != in_flight.end())
+				{
+					resets++;
+					in_flight.erase(found);
+					completed++;
+				}
+				break;
+
+			case http2_settings:
+				if (flags & http2_flag_ack)
+					break;
+
+				for (size_t i = 0; i + 6 <= length; i += 6)
+				{
+					uint16_t id = static_cast<uint16_t>(payload[i] << 8 | payload[i + 1]);
+					uint32_t setting = Http2ReadUint32(payload + i + 2);
+
+					if (id == http2_settings_max_concurrent_streams && setting < peer_max_streams)
+						peer_max_streams = setting;
+					else if (id == http2_settings_max_frame_size)
+						peer_max_frame = setting;
+					else if (id == http2_settings_header_table_size)
+						encoder.set_table_size(setting);
+					else if (id == http2_settings_initial_window_size)
+					{
+						for (auto& entry : in_flight)
+							entry.second.send_window += static_cast<int64_t>(setting) - peer_initial_window;
+
+						peer_initial_window = setting;
+					}
+				}
+
+				Http2AppendFrameHeader(out, 0, http2_settings, http2_flag_ack, 0);
+				break;
+
+			case http2_ping:
+				if ((flags & http2_flag_ack) == 0)
+				{
+					Http2AppendFrameHeader(out, 8, http2_ping, http2_flag_ack, 0);
+					out.append(reinterpret_cast<const char*>(payload), 8);
+				}
+				break;
+
+			case http2_window_update:
+				if (frame.stream == 0)
+					connection_window += Http2ReadUint32(payload) & 0x7fffffff;
+				else if (found != in_flight.end())
+					found->second.send_window += Http2ReadUint32(payload) & 0x7fffffff;
+				break;
+
+			case http2_goaway:
+				printf("The server ended the connection (error %u) after %zu responses.\n",
+					Http2ReadUint32(payload + 4), completed);
+				failed = true;
+				break;
+			}
+
+			if (ended && found != in_flight.end())
+			{
+				h2_request& request = found->second;
+
+				service_times.record(static_cast<uint64_t>((now() - request.sent_at) * 1e9));
+
+				if (request.status == 503)
+					shed++;
+				else if (upload_size != 0)
+				{
+					uploaded += upload_size;
+					if (!upload_answer_matches(request.body.data(), request.body.size()))
+						upload_errors++;
+				}
+
+				if (kv_keys != 0)
+					count_kv_response(request.write, request.status, &hits, &misses, &writes);
+
+				body_bytes += request.body_bytes;
+				in_flight.erase(found);
+				completed++;
+
+				auto before = total_result_count.fetch_add(1);
+				if (before % 1000 == 999)
+					std::cout << ".";
+			}
+		}
+
+		received.erase(0, parsed);
+
+		// Give the connection window back once half of it is used.
+		if (receive_unacked >= http2_max_window / 2)
+		{
+			Http2AppendWindowUpdate(out, 0, static_cast<uint32_t>(receive_unacked));
+			receive_unacked = 0;
+		}
+
+		// Bodies that were waiting for window.
+		for (size_t i = 0; i < uploading.size();)
+		{
+			auto found = in_flight.find(uploading[i]);
+			const std::string& body = kv_keys != 0 ? value : upload_body;
+
+			if (found == in_flight.end() ||
+				!h2_send_body(out, uploading[i], found->second, body, &connection_window, peer_max_frame))
+			{
+				uploading.erase(uploading.begin() + i);
+				continue;
+			}
+
+			i++;
+		}
+	}
+
+	closesocket(s);
+	total_body_bytes += body_bytes;
+	total_shed_count += shed;
+	total_reset_streams += resets;
+	total_upload_bytes += uploaded;
+	total_upload_errors += upload_errors;
+	total_kv_hits += hits;
+	total_kv_misses += misses;
+	total_kv_writes += writes;
+
+	std::lock_guard<std::mutex> lock(request_latency_lock);
+	request_service_times.add(service_times);
 }
 
+// A WebSocket connection of the --ws workload.
+struct ws_client
+{
+	SOCKET s;
+	std::string out;           // frame being sent
+	size_t out_sent;
+	std::string received;
+	double sent_at;
+	bool waiting;              // a message is out and its echo not back yet
+};
 
-std::string send_get_request(const wchar_t *server, const int port, const wchar_t* path)
+// Opens a connection to /ws. Returns INVALID_SOCKET if the handshake
+// fails.
+SOCKET ws_connect()
 {
-	DWORD dwSize = 0;
-	DWORD dwDownloaded = 0;
-	void *pszOutBuffer = nullptr;
-	BOOL  bResults = FALSE;
-	HINTERNET  hSession = nullptr,
-		hConnect = nullptr,
-		hRequest = nullptr;
+	const char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+	std::string request = "GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+		"Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: ";
+	std::string response;
+	char accept[websocket_accept_length];
+	char buffer[1024];
+
+	SOCKET s = connect_to_server("localhost", "8080");
+
+	if (s == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	request += key;
+	request += "\r\n\r\n";
+	send(s, request.data(), static_cast<int>(request.size()), 0);
 
-	std::string result;
+	// The server sends nothing after the 101 until we do.
+	while (response.find("\r\n\r\n") == std::string::npos)
+	{
+		int n = recv(s, buffer, sizeof(buffer), 0);
+
+		if (n <= 0)
+			break;
+
+		response.append(buffer, n);
+	}
+
+	WebSocketAcceptKey(key, accept);
+
+	if (response.compare(0, 12, "HTTP/1.1 101") != 0 ||
+		response.find(std::string_view(accept, sizeof(accept))) == std::string::npos)
+	{
+		printf("WebSocket handshake failed: %.*s\n", static_cast<int>(response.find('\r')), response.c_str());
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
 
-	hSession = WinHttpOpen(L"load-test/1.0",
-		WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-		WINHTTP_NO_PROXY_NAME,
-		WINHTTP_NO_PROXY_BYPASS, 0);
+	u_long nonblocking = 1;
+	ioctlsocket(s, FIONBIO, &nonblocking);
 
-	if (hSession)
-		hConnect = WinHttpConnect(hSession, server, port, 
-			// INTERNET_DEFAULT_HTTPS_PORT
-			0);
+	return s;
+}
+
+// Holds this thread's share of ws_connections open and keeps one message
+// in flight on each, sending the next as soon as the echo of the last is
+// back, until the thread has had requests_per_thread messages echoed.
+// Sends and receives are interleaved, since the server echoes a large
+// message while it is still arriving.
+void ws_task_func()
+{
+	size_t index = ws_thread_index++;
+	size_t count = ws_connections / request_thread_count + (index < ws_connections % request_thread_count);
+	std::vector<ws_client> clients(count);
+	std::vector<WSAPOLLFD> fds(count);
+	latency_histogram latencies;
+	std::mt19937_64 random(std::random_device{}());
+	char buffer[64 * 1024];
+	size_t started = 0;
+	size_t completed = 0;
+	size_t mismatches = 0;
 
-	if (hConnect)
-		hRequest = WinHttpOpenRequest(hConnect, L"GET", path,
-			NULL, WINHTTP_NO_REFERER,
-			WINHTTP_DEFAULT_ACCEPT_TYPES,
-			0 // WINHTTP_FLAG_SECURE
-		);
+	for (size_t i = 0; i < count; i++)
+	{
+		clients[i].s = ws_connect();
 
-	if (hRequest)
-		bResults = WinHttpSendRequest(hRequest,
-			WINHTTP_NO_ADDITIONAL_HEADERS, 0,
-			WINHTTP_NO_REQUEST_DATA, 0,
-			0, 0);
+		if (clients[i].s == INVALID_SOCKET)
+		{
+			while (i-- > 0)
+				closesocket(clients[i].s);
 
+			return;
+		}
 
-	if (bResults)
-		bResults = WinHttpReceiveResponse(hRequest, NULL);
+		fds[i].fd = clients[i].s;
+	}
 
-	// Keep checking for data until there is nothing left.
-	if (bResults)
+	while (completed < requests_per_thread)
 	{
-		do
+		for (size_t i = 0; i < count; i++)
+		{
+			ws_client& client = clients[i];
+
+			if (!client.waiting && started < requests_per_thread)
+			{
+				uint64_t key = random();
+				uint8_t mask[4];
+
+				memcpy(mask, &key, sizeof(mask));
+				client.out.clear();
+				WebSocketAppendFrameHeader(client.out, websocket_binary, true, ws_message.size(), mask);
+
+				size_t at = client.out.size();
+
+				client.out += ws_message;
+				WebSocketMask(&client.out[at], &client.out[at], ws_message.size(), mask, 0);
+				client.out_sent = 0;
+				client.sent_at = now();
+				client.waiting = true;
+				started++;
+			}
+
+			fds[i].events = POLLIN | (client.out_sent < client.out.size() ? POLLOUT : 0);
+			fds[i].revents = 0;
+		}
+
+		if (WSAPoll(fds.data(), static_cast<ULONG>(count), 10000) <= 0)
+		{
+			printf("Error %d polling, or no echo for 10 seconds.\n", WSAGetLastError());
+			break;
+		}
+
+		bool failed = false;
+
+		for (size_t i = 0; i < count && !failed; i++)
 		{
-			// Check for available data.
-			dwSize = 0;
-			if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
-				printf("Error %u in WinHttpQueryDataAvailable.\n",
-					GetLastError());
+			ws_client& client = clients[i];
 
-			// Allocate space for the buffer.
-			pszOutBuffer = new char[dwSize + 1];
-			if (!pszOutBuffer)
+			if (fds[i].revents & POLLOUT)
 			{
-				printf("Out of memory\n");
-				dwSize = 0;
+				int n = send(client.s, client.out.data() + client.out_sent,
+					static_cast<int>(client.out.size() - client.out_sent), 0);
+
+				if (n > 0)
+					client.out_sent += n;
 			}
-			else
+
+			if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) == 0)
+				continue;
+
+			int n = recv(client.s, buffer, sizeof(buffer), 0);
+
+			if (n == 0 || (n < 0 && WSAGetLastError() != WSAEWOULDBLOCK))
+			{
+				printf("Connection closed after %zu messages.\n", completed);
+				failed = true;
+				break;
+			}
+
+			if (n < 0)
+				continue;
+
+			client.received.append(buffer, n);
+
+			websocket_frame frame;
+			ptrdiff_t header = WebSocketReadFrameHeader(client.received.data(), client.received.size(), &frame);
+
+			if (header < 0 || (header > 0 && frame.opcode == websocket_close))
 			{
-				// Read the data.
-				ZeroMemory(pszOutBuffer, dwSize + 1);
+				printf("The server closed the WebSocket after %zu messages.\n", completed);
+				failed = true;
+				break;
+			}
 
-				if (!WinHttpReadData(hRequest, (LPVOID)pszOutBuffer,
-					dwSize, &dwDownloaded))
-					printf("Error %u in WinHttpReadData.\n", GetLastError());
-				else
-					result.append(static_cast<const char*>(pszOutBuffer), dwDownloaded);
+			if (header == 0 || client.received.size() - header < frame.length)
+				continue;
+
+			latencies.record(static_cast<uint64_t>((now() - client.sent_at) * 1e9));
 
-				// Free the memory allocated to the buffer.
-				delete[] pszOutBuffer;
+			if (frame.length != ws_message.size() ||
+				memcmp(client.received.data() + header, ws_message.data(), ws_message.size()) != 0)
+			{
+				mismatches++;
 			}
-		} while (dwSize > 0);
+
+			client.received.erase(0, header + static_cast<size_t>(frame.length));
+			client.waiting = false;
+			completed++;
+
+			auto before = total_result_count.fetch_add(1);
+			if (before % 1000 == 999)
+				std::cout << ".";
+		}
+
+		if (failed)
+			break;
 	}
 
+	// Say goodbye; the server answers and closes.
+	for (auto& client : clients)
+	{
+		std::string goodbye;
+		uint8_t mask[4] = {};
+		const char code[2] = { static_cast<char>(websocket_close_normal >> 8),
+			static_cast<char>(websocket_close_normal & 0xff) };
 
-	if (!bResults)
-		printf("Error %d has occurred.\n", GetLastError());
+		WebSocketAppendFrameHeader(goodbye, websocket_close, true, sizeof(code), mask);
+		goodbye.append(code, sizeof(code));
+		send(client.s, goodbye.data(), static_cast<int>(goodbye.size()), 0);
+		closesocket(client.s);
+	}
 
-	if (hRequest) WinHttpCloseHandle(hRequest);
-	if (hConnect) WinHttpCloseHandle(hConnect);
-	if (hSession) WinHttpCloseHandle(hSession);
+	total_body_bytes += completed * ws_message.size();
+	total_ws_mismatches += mismatches;
 
-	return result;
+	std::lock_guard<std::mutex> lock(ws_latency_lock);
+	ws_latencies.add(latencies);
 }
 
-static std::atomic<size_t> total_result_count = 0;
-
-void task_func()
+#ifdef LOAD_TEST_TLS
+// Makes every request on a connection of its own over TLS, timing the
+// handshake and sorting it into full or resumed, and timing the request
+// from before the connection is opened to the end of the response.
+void tls_task_func()
 {
-	for (int i = 0; i < requests_per_thread; i++)
+	std::string request = "GET " + request_path + " HTTP/1.1\r\nHost: localhost\r\n";
+	std::string received;
+	char buffer[64 * 1024];
+	std::mt19937_64 random(std::random_device{}());
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	SSL_SESSION* session = nullptr;
+	latency_histogram service_times;
+	size_t full = 0, resumed = 0;
+	uint64_t full_ns = 0, resumed_ns = 0;
+	size_t body_bytes = 0, shed = 0;
+
+	if (!accept_encoding.empty())
+		request += "Accept-Encoding: " + accept_encoding + "\r\n";
+
+	request += "Connection: close\r\n\r\n";
+
+	for (size_t i = 0; i < requests_per_thread; i++)
 	{
-		auto result = send_get_request(L"localhost", 8080, L"/sync");
-		total_result_count += 1;
-		if (total_result_count.load() % 1000 == 999)
+		double opened = now();
+		SOCKET s = connect_to_server("localhost", "8443");
+
+		if (s == INVALID_SOCKET)
+			break;
+
+		SSL* ssl = SSL_new(tls_context);
+
+		SSL_set_fd(ssl, static_cast<int>(s));
+		SSL_set_tlsext_host_name(ssl, "localhost");
+
+		if (session != nullptr && uniform(random) < tls_resume_ratio)
+			SSL_set_session(ssl, session);
+
+		double started = now();
+
+		if (SSL_connect(ssl) != 1)
+		{
+			printf("TLS handshake failed: %s\n", ERR_error_string(ERR_get_error(), nullptr));
+			SSL_free(ssl);
+			closesocket(s);
+			break;
+		}
+
+		uint64_t handshake_ns = static_cast<uint64_t>((now() - started) * 1e9);
+
+		if (SSL_session_reused(ssl))
+		{
+			resumed++;
+			resumed_ns += handshake_ns;
+		}
+		else
+		{
+			full++;
+			full_ns += handshake_ns;
+		}
+
+		bool ok = SSL_write(ssl, request.data(), static_cast<int>(request.size())) > 0;
+		size_t body_length = 0;
+		size_t length = 0;
+
+		received.clear();
+
+		while (ok && (length = complete_response_length(received, 0, &body_length)) == 0)
+		{
+			int n = SSL_read(ssl, buffer, sizeof(buffer));
+
+			if (n <= 0)
+				ok = false;
+			else
+				received.append(buffer, n);
+		}
+
+		//
+		// Any session ticket arrived ahead of the response, so the
+		// session is ready to be offered by the next connection.
+		//
+		if (ok)
+		{
+			SSL_SESSION_free(session);
+			session = SSL_get1_session(ssl);
+		}
+
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+		closesocket(s);
+
+		if (!ok)
+		{
+			printf("Connection closed after %zu responses.\n", i);
+			ERR_clear_error();
+			break;
+		}
+
+		service_times.record(static_cast<uint64_t>((now() - opened) * 1e9));
+
+		// "HTTP/1.1 503 "
+		if (received.compare(8, 5, " 503 ") == 0)
+			shed++;
+
+		body_bytes += body_length;
+
+		auto before = total_result_count.fetch_add(1);
+		if (before % 1000 == 999)
 			std::cout << ".";
 	}
+
+	SSL_SESSION_free(session);
+	total_body_bytes += body_bytes;
+	total_shed_count += shed;
+	total_tls_full += full;
+	total_tls_resumed += resumed;
+	total_tls_full_ns += full_ns;
+	total_tls_resumed_ns += resumed_ns;
+
+	std::lock_guard<std::mutex> lock(request_latency_lock);
+	request_service_times.add(service_times);
+}
+#endif
+
+// Stores a value under every key before the clock starts, so reads hit
+// from the first request on. Writes are pipelined on one connection.
+bool preload_keys()
+{
+	std::string value(value_size, 'v');
+	std::string received;
+	char buffer[64 * 1024];
+	const size_t depth = 64;
+
+	SOCKET s = connect_to_server("localhost", "8080");
+
+	if (s == INVALID_SOCKET)
+		return false;
+
+	for (size_t done = 0; done < kv_keys;)
+	{
+		size_t count = kv_keys - done < depth ? kv_keys - done : depth;
+		std::string batch;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			batch += "PUT /kv/key" + std::to_string(done + i) + " HTTP/1.1\r\nHost: localhost\r\n"
+				"Content-Length: " + std::to_string(value.size()) + "\r\n\r\n" + value;
+		}
+
+		if (send(s, batch.data(), static_cast<int>(batch.size()), 0) == SOCKET_ERROR)
+		{
+			printf("Error %d in send.\n", WSAGetLastError());
+			closesocket(s);
+			return false;
+		}
+
+		size_t parsed = 0;
+
+		for (size_t responses = 0; responses < count;)
+		{
+			size_t body_length;
+			size_t length = complete_response_length(received, parsed, &body_length);
+
+			if (length != 0)
+			{
+				parsed += length;
+				responses++;
+				continue;
+			}
+
+			int n = recv(s, buffer, sizeof(buffer), 0);
+
+			if (n <= 0)
+			{
+				printf("Connection closed while loading keys.\n");
+				closesocket(s);
+				return false;
+			}
+
+			received.append(buffer, n);
+		}
+
+		received.erase(0, parsed);
+		done += count;
+	}
+
+	closesocket(s);
+	return true;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+		{
+			pipeline_depth = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc)
+		{
+			request_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--accept-encoding") == 0 && i + 1 < argc)
+		{
+			accept_encoding = argv[++i];
+		}
+		else if (strcmp(argv[i], "--kv-keys") == 0 && i + 1 < argc)
+		{
+			kv_keys = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--read-ratio") == 0 && i + 1 < argc)
+		{
+			read_ratio = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--zipf") == 0 && i + 1 < argc)
+		{
+			zipf_theta = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--value-size") == 0 && i + 1 < argc)
+		{
+			value_size = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--upload") == 0 && i + 1 < argc)
+		{
+			upload_size = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc)
+		{
+			connections_per_thread = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+		{
+			request_rate = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--h2") == 0 && i + 1 < argc)
+		{
+			h2_streams = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--ws") == 0 && i + 1 < argc)
+		{
+			ws_mode = true;
+			ws_message.resize(strtoul(argv[++i], nullptr, 10));
+		}
+		else if (strcmp(argv[i], "--ws-connections") == 0 && i + 1 < argc)
+		{
+			ws_connections = strtoul(argv[++i], nullptr, 10);
+		}
+#ifdef LOAD_TEST_TLS
+		else if (strcmp(argv[i], "--tls") == 0)
+		{
+			tls_mode = true;
+		}
+		else if (strcmp(argv[i], "--tls-resume") == 0 && i + 1 < argc)
+		{
+			tls_mode = true;
+			tls_resume_ratio = atof(argv[++i]);
+		}
+#endif
+		else
+		{
+			printf("usage: %s [--connections N] [--rate R] [--pipeline DEPTH] [--path URL] [--accept-encoding CODINGS]\n"
+				"       [--kv-keys N [--read-ratio R] [--zipf THETA] [--value-size BYTES]]\n"
+				"       [--upload BYTES] [--h2 STREAMS] [--ws BYTES [--ws-connections N]]\n"
+#ifdef LOAD_TEST_TLS
+				"       [--tls [--tls-resume RATIO]]\n"
+#endif
+				, argv[0]);
+			return 1;
+		}
+	}
+
+	if (read_ratio < 0 || read_ratio > 1)
+	{
+		printf("--read-ratio must be between 0 and 1\n");
+		return 1;
+	}
+
+	if (zipf_theta < 0 || zipf_theta >= 1)
+	{
+		printf("--zipf must be at least 0 and below 1\n");
+		return 1;
+	}
+
+	if (pipeline_depth < 0)
+	{
+		printf("--pipeline must be 1 or more\n");
+		return 1;
+	}
+
+	if (connections_per_thread == 0)
+	{
+		printf("--connections must be 1 or more\n");
+		return 1;
+	}
+
+	if ((connections_per_thread != 1 || request_rate != 0) && (pipeline_depth > 0 || h2_streams > 0 || ws_mode || tls_mode))
+	{
+		printf("--connections and --rate can't be used with --pipeline, --h2, --ws or --tls\n");
+		return 1;
+	}
+
+	if (request_rate < 0)
+	{
+		printf("--rate must be above 0\n");
+		return 1;
+	}
+
+	if (h2_streams < 0 || (h2_streams > 0 && pipeline_depth > 0))
+	{
+		printf("--h2 must be 1 or more, and not used with --pipeline\n");
+		return 1;
+	}
+
+	if (ws_mode && ws_connections < request_thread_count)
+	{
+		printf("--ws-connections must be at least %zu, one per thread\n", request_thread_count);
+		return 1;
+	}
+
+	if (tls_mode && (pipeline_depth > 0 || h2_streams > 0 || ws_mode || kv_keys != 0 || upload_size != 0))
+	{
+		printf("--tls makes one GET per connection; it can't be used with --pipeline, --h2, --ws, --kv-keys or --upload\n");
+		return 1;
+	}
+
+	if (tls_resume_ratio < 0 || tls_resume_ratio > 1)
+	{
+		printf("--tls-resume must be between 0 and 1\n");
+		return 1;
+	}
+
+#ifdef LOAD_TEST_TLS
+	if (tls_mode)
+	{
+		tls_context = SSL_CTX_new(TLS_client_method());
+		SSL_CTX_set_verify(tls_context, SSL_VERIFY_NONE, nullptr);
+	}
+#endif
+
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+
 	// Wait for server to start
-	Sleep(100);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
 	
-	std::cout << "Test HTTP GET\n";
+	if (ws_mode)
+	{
+		std::mt19937_64 random(42);
+
+		for (auto& c : ws_message)
+			c = static_cast<char>(random());
+
+		std::cout << "Test WebSocket echo on /ws with " << ws_message.size() << " byte messages on "
+			<< ws_connections << " connections\n";
+	}
+	else if (upload_size != 0)
+	{
+		// Incompressible, and different in every byte position.
+		std::mt19937_64 random(42);
+		char hex[8];
+
+		upload_body.resize(upload_size);
+		for (auto& c : upload_body)
+			c = static_cast<char>(random());
+
+		Crc32cToHex(Crc32c(0, upload_body.data(), upload_body.size()), hex);
+		upload_crc.assign(hex, sizeof(hex));
+
+		std::cout << "Test HTTP POST /sink with " << upload_size << " byte bodies\n";
+	}
+	else if (kv_keys != 0)
+	{
+		key_popularity.init(kv_keys, zipf_theta);
+
+		std::cout << "Loading " << kv_keys << " keys\n";
+
+		if (!preload_keys())
+			return 1;
+
+		// The loading connection doesn't count towards the test.
+		total_connections = 0;
+
+		std::cout << "Test key-value GET/PUT /kv/ on " << kv_keys << " keys, " << read_ratio * 100
+			<< "% reads, Zipf theta " << zipf_theta << ", " << value_size << " byte values\n";
+	}
+	else
+		std::cout << "Test HTTP GET " << request_path << "\n";
 	std::cout << "Sending " << requests_per_thread * request_thread_count << " requests on " << request_thread_count << " threads\n";
 
+	if (pipeline_depth > 0)
+		std::cout << "Pipelining " << pipeline_depth << " requests per connection\n";
+	else if (h2_streams == 0 && !ws_mode && !tls_mode)
+		std::cout << "Keeping " << connections_per_thread << " connections per thread alive, one request in flight on each\n";
+
+	if (request_rate > 0)
+		std::cout << "Open loop at " << request_rate << " requests per second\n";
+
+	if (h2_streams > 0)
+		std::cout << "HTTP/2 with " << h2_streams << " streams per connection\n";
+
+	if (tls_mode)
+		std::cout << "HTTPS on port 8443, one request per connection, offering to resume "
+			<< tls_resume_ratio * 100 << "% of sessions\n";
+
+	if (!accept_encoding.empty())
+		std::cout << "Accept-Encoding: " << accept_encoding << "\n";
+
 	const auto start_seconds = now();
 
+	rate_start = start_seconds;
+
 	std::vector<std::thread> threads;
+	void (*task)() = ws_mode ? ws_task_func : h2_streams > 0 ? h2_task_func :
+		pipeline_depth > 0 ? pipelined_task_func : keep_alive_task_func;
+
+#ifdef LOAD_TEST_TLS
+	if (tls_mode)
+		task = tls_task_func;
+#endif
 
 	for (int i = 0; i < request_thread_count; i++)
 	{
-		threads.emplace_back(std::thread(task_func));
+		threads.emplace_back(std::thread(task));
 	}
 
 	for (auto& t : threads)
@@ -153,16 +1876,110 @@ int main()
 
 	std::cout << std::endl;
 
+	const size_t connections = total_connections;
+
 	for (int i = 0; i < request_thread_count; i++)
 	{
-		send_get_request(L"localhost", 8080, L"/kill");
+		send_kill_request();
 	}
 
 	const auto elapsed = now() - start_seconds;
 	std::cout << "Completed " << total_result_count << " requests in " << elapsed << " seconds\n";
 	std::cout << total_result_count / elapsed << " requests per second\n";
+	std::cout << (total_result_count - total_shed_count) / elapsed << " served and "
+		<< total_shed_count / elapsed << " shed (503) per second\n";
+	std::cout << total_body_bytes / elapsed / (1024 * 1024) << " MB of response bodies per second ("
+		<< (total_result_count ? total_body_bytes / total_result_count : 0) << " bytes each)\n";
+	std::cout << connections << " connections, "
+		<< (connections ? total_result_count / connections : 0) << " requests per connection\n";
+
+	if (total_reconnects != 0)
+		std::cout << total_reconnects << " connections reopened after the server closed them\n";
+
+	if (total_reset_streams != 0)
+		std::cout << total_reset_streams << " streams reset or refused by the server\n";
+
+	// Prints the usual percentiles of a nanosecond histogram in
+	// microseconds.
+	auto print_percentiles = [](const char* label, const latency_histogram& histogram)
+	{
+		auto percentile = [&histogram](double percentile)
+		{
+			return histogram.value_at_percentile(percentile) / 1000.0;
+		};
+
+		if (histogram.total == 0)
+			return;
+
+		std::cout << label << " (us): p50 " << percentile(50) << ", p90 " << percentile(90)
+			<< ", p99 " << percentile(99) << ", p99.9 " << percentile(99.9)
+			<< ", p99.99 " << percentile(99.99)
+			<< ", max " << latency_histogram::highest_equivalent(histogram.max) / 1000.0 << "\n";
+	};
+
+	// The latencies the full distribution is printed for: those a
+	// service level objective would be written against.
+	const latency_histogram* distribution = &request_service_times;
+	const char* distribution_label = "Latency";
+
+	if (ws_mode)
+	{
+		std::cout << total_result_count / elapsed << " messages per second, "
+			<< total_ws_mismatches << " echo mismatches\n";
+		print_percentiles("Message round trip", ws_latencies);
+		distribution = &ws_latencies;
+		distribution_label = "Message round trip";
+	}
+	else if (request_rate > 0)
+	{
+		std::cout << "Target " << request_rate << " requests per second, achieved "
+			<< total_result_count / elapsed << "\n";
+		print_percentiles("Latency from when due", request_latencies);
+		print_percentiles("Latency from when sent", request_service_times);
+		distribution = &request_latencies;
+		distribution_label = "Latency from when due";
+	}
+	else
+		print_percentiles("Latency", request_service_times);
+
+	if (tls_mode)
+	{
+		auto mean_ms = [](uint64_t ns, size_t count)
+		{
+			return count ? ns / 1e6 / count : 0.0;
+		};
+
+		std::cout << total_tls_full << " full handshakes (" << total_tls_full / elapsed << " per second, "
+			<< mean_ms(total_tls_full_ns, total_tls_full) << " ms each) and " << total_tls_resumed
+			<< " resumed (" << total_tls_resumed / elapsed << " per second, "
+			<< mean_ms(total_tls_resumed_ns, total_tls_resumed) << " ms each)\n";
+	}
+
+	if (upload_size != 0)
+	{
+		std::cout << total_upload_bytes / elapsed / (1024 * 1024) << " MB uploaded per second, "
+			<< total_upload_errors << " checksum mismatches\n";
+	}
+
+	if (kv_keys != 0)
+	{
+		std::cout << (total_kv_hits + total_kv_misses) / elapsed << " reads ("
+			<< total_kv_hits << " hits, " << total_kv_misses << " misses) and "
+			<< total_kv_writes / elapsed << " writes per second\n";
+	}
+
+	if (distribution->total != 0)
+	{
+		std::cout << "\n" << distribution_label << " distribution (us):\n" << std::flush;
+		distribution->print_distribution(stdout, 1000);
+	}
+
 	std::cout << "\npress any key\n";
 
 	_getch();
+#ifdef LOAD_TEST_TLS
+	SSL_CTX_free(tls_context);
+#endif
+	WSACleanup();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,168 @@
+//
+// The Winsock calls the load tester makes, on Windows or mapped onto POSIX
+// sockets, so the same source builds on Linux (see README.md).
+//
+// Only what the load tester uses is mapped, with the Winsock meaning:
+// WSAGetLastError returns errno, WSAPoll is poll, ioctlsocket handles
+// FIONBIO only, and WSAStartup ignores SIGPIPE, so a send to a closed
+// connection fails the way it does on Windows instead of killing the
+// process.
+//
+// PollSockets is WSAPoll with a timeout in seconds. Windows rounds it up
+// to whole milliseconds; Linux waits to within the timer slack.
+//
+
+#ifndef __SOCKET_COMPAT__
+#define __SOCKET_COMPAT__
+
+#include <math.h>
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN 1
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <conio.h>
+#include <windows.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+inline int
+PollSockets(
+	WSAPOLLFD* pFds,
+	ULONG count,
+	double timeout
+)
+{
+	return WSAPoll(pFds, count, (int)ceil(timeout * 1000));
+}
+
+#else
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+typedef int SOCKET;
+typedef int BOOL;
+typedef unsigned long u_long;
+typedef unsigned long ULONG;
+typedef pollfd WSAPOLLFD;
+
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+const int WSAEWOULDBLOCK = EWOULDBLOCK;
+const BOOL TRUE = 1;
+
+struct WSADATA
+{
+};
+
+inline unsigned short
+MAKEWORD(
+	int low,
+	int high
+)
+{
+	return (unsigned short)(low | (high << 8));
+}
+
+inline int
+WSAStartup(
+	[[maybe_unused]] unsigned short version,
+	[[maybe_unused]] WSADATA* pData
+)
+{
+	signal(SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+inline int
+WSACleanup()
+{
+	return 0;
+}
+
+inline int
+WSAGetLastError()
+{
+	return errno;
+}
+
+inline int
+WSAPoll(
+	WSAPOLLFD* pFds,
+	ULONG count,
+	int timeout
+)
+{
+	return poll(pFds, count, timeout);
+}
+
+inline int
+PollSockets(
+	WSAPOLLFD* pFds,
+	ULONG count,
+	double timeout
+)
+{
+	timespec wait;
+
+	wait.tv_sec = (time_t)timeout;
+	wait.tv_nsec = (long)((timeout - (double)wait.tv_sec) * 1e9);
+
+	return ppoll(pFds, count, &wait, nullptr);
+}
+
+inline int
+ioctlsocket(
+	SOCKET s,
+	long command,
+	u_long* pArgument
+)
+{
+	int flags = fcntl(s, F_GETFL);
+
+	if (command != FIONBIO || flags < 0)
+		return SOCKET_ERROR;
+
+	return fcntl(s, F_SETFL, *pArgument ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+inline int
+closesocket(
+	SOCKET s
+)
+{
+	return close(s);
+}
+
+inline int
+_strnicmp(
+	const char* pLeft,
+	const char* pRight,
+	size_t length
+)
+{
+	return strncasecmp(pLeft, pRight, length);
+}
+
+inline int
+_getch()
+{
+	return getchar();
+}
+
+#endif
+
+#endif
@@ -0,0 +1,326 @@
+//
+// Compile-time perfect-hash router.
+//
+// A route table is a constexpr array of { method, path, handler }. At
+// compile time the routes are grouped by path and the paths are placed in
+// a hash-and-displace perfect hash table, so dispatch is:
+//
+//   1. one FNV-1a pass over the request path,
+//   2. one displacement lookup and one mix to find the only slot the path
+//      can be in,
+//   3. one comparison against that slot to reject unknown paths,
+//   4. an index by method into the slot's handler array.
+//
+// None of that depends on how many routes there are.
+//
+// A path ending in "/*" is a prefix route: "/files/*" matches every path
+// under "/files/". Lookup tries the exact path first and then the path's
+// first segment, so prefix routes cost at most one extra probe.
+//
+
+#ifndef __ROUTER__
+#define __ROUTER__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+
+enum http_method : unsigned char
+{
+	method_get,
+	method_head,
+	method_post,
+	method_put,
+	method_delete,
+	method_options,
+	method_other,
+	method_count
+};
+
+inline http_method ParseHttpMethod(std::string_view method)
+{
+	switch (method.size())
+	{
+	case 3:
+		if (memcmp(method.data(), "GET", 3) == 0) return method_get;
+		if (memcmp(method.data(), "PUT", 3) == 0) return method_put;
+		break;
+	case 4:
+		if (memcmp(method.data(), "POST", 4) == 0) return method_post;
+		if (memcmp(method.data(), "HEAD", 4) == 0) return method_head;
+		break;
+	case 6:
+		if (memcmp(method.data(), "DELETE", 6) == 0) return method_delete;
+		break;
+	case 7:
+		if (memcmp(method.data(), "OPTIONS", 7) == 0) return method_options;
+		break;
+	}
+
+	return method_other;
+}
+
+template <typename Handler>
+struct route
+{
+	http_method method;
+	std::string_view path;
+	Handler handler;
+};
+
+enum route_result
+{
+	route_found,
+	route_method_not_allowed,      // the path exists but not for this method
+	route_not_found
+};
+
+constexpr uint64_t RouteHash(std::string_view s)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (char c : s)
+	{
+		h ^= static_cast<unsigned char>(c);
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+constexpr uint64_t RouteMix(uint64_t h, uint64_t seed)
+{
+	h ^= seed * 0x9e3779b97f4a7c15ull;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return h;
+}
+
+const size_t max_route_bucket = 16;
+
+constexpr size_t RouteTableSize(size_t n)
+{
+	size_t size = 1;
+	while (size < n)
+		size <<= 1;
+	return size;
+}
+
+template <typename Handler, size_t N>
+class router
+{
+public:
+	static constexpr size_t bucket_count = RouteTableSize(N);
+	static constexpr size_t slot_count = bucket_count * 2;
+
+	struct slot
+	{
+		std::string_view path;
+		uint64_t hash = 0;
+		bool used = false;
+		bool prefix = false;
+		Handler handlers[method_count] = {};
+	};
+
+	constexpr explicit router(const route<Handler>* routes)
+	{
+		//
+		// Group the routes by path.
+		//
+		std::string_view keys[N] = {};
+		bool prefixes[N] = {};
+		uint64_t hashes[N] = {};
+		size_t key_of_route[N] = {};
+		size_t key_count = 0;
+
+		for (size_t i = 0; i < N; i++)
+		{
+			std::string_view key = routes[i].path;
+			bool prefix = key.size() >= 2 && key.substr(key.size() - 2) == "/*";
+
+			if (prefix)
+				key.remove_suffix(1);
+
+			uint64_t hash = RouteHash(key);
+			size_t k = 0;
+			while (k < key_count && (hashes[k] != hash || keys[k] != key))
+				k++;
+
+			if (k == key_count)
+			{
+				keys[k] = key;
+				prefixes[k] = prefix;
+				hashes[k] = hash;
+				key_count++;
+			}
+
+			key_of_route[i] = k;
+		}
+
+		//
+		// Hash and displace: bucket the keys by their hash, then place the
+		// biggest buckets first, searching for a seed that sends every key
+		// in the bucket to a distinct free slot. Single-key buckets point
+		// straight at a free slot.
+		//
+		size_t bucket_sizes[bucket_count] = {};
+		size_t slot_of_key[N] = {};
+
+		for (size_t k = 0; k < key_count; k++)
+		{
+			if (++bucket_sizes[hashes[k] & (bucket_count - 1)] > max_route_bucket)
+				throw "router: too many paths share a hash bucket";
+		}
+
+		for (size_t size = max_route_bucket; size >= 1; size--)
+		{
+			for (size_t b = 0; b < bucket_count; b++)
+			{
+				if (bucket_sizes[b] != size)
+					continue;
+
+				size_t members[max_route_bucket] = {};
+				size_t member_count = 0;
+
+				for (size_t k = 0; k < key_count; k++)
+				{
+					if ((hashes[k] & (bucket_count - 1)) == b)
+						members[member_count++] = k;
+				}
+
+				if (size == 1)
+				{
+					size_t free = 0;
+					while (slots[free].used)
+						free++;
+
+					displacements[b] = -static_cast<int32_t>(free) - 1;
+					slots[free].used = true;
+					slot_of_key[members[0]] = free;
+					continue;
+				}
+
+				for (int32_t seed = 1;; seed++)
+				{
+					if (seed == (1 << 20))
+						throw "router: no perfect hash seed found";
+
+					size_t candidate[max_route_bucket] = {};
+					bool ok = true;
+
+					for (size_t m = 0; ok && m < member_count; m++)
+					{
+						candidate[m] = RouteMix(hashes[members[m]], seed) & (slot_count - 1);
+
+						if (slots[candidate[m]].used)
+							ok = false;
+
+						for (size_t p = 0; ok && p < m; p++)
+						{
+							if (candidate[p] == candidate[m])
+								ok = false;
+						}
+					}
+
+					if (!ok)
+						continue;
+
+					displacements[b] = seed;
+
+					for (size_t m = 0; m < member_count; m++)
+					{
+						slots[candidate[m]].used = true;
+						slot_of_key[members[m]] = candidate[m];
+					}
+					break;
+				}
+			}
+		}
+
+		for (size_t k = 0; k < key_count; k++)
+		{
+			slot& s = slots[slot_of_key[k]];
+			s.path = keys[k];
+			s.hash = hashes[k];
+			s.prefix = prefixes[k];
+		}
+
+		for (size_t i = 0; i < N; i++)
+		{
+			slots[slot_of_key[key_of_route[i]]].handlers[routes[i].method] = routes[i].handler;
+		}
+	}
+
+	//
+	// Finds the handler for a request. path may carry a query string.
+	//
+	Handler lookup(http_method method, std::string_view path, route_result* pResult) const
+	{
+		auto query = path.find('?');
+		if (query != std::string_view::npos)
+			path = path.substr(0, query);
+
+		const slot* s = probe(path);
+
+		if (s == nullptr || s->prefix)
+		{
+			//
+			// Try the first segment as a prefix route.
+			//
+			auto segment_end = path.size() > 1 ? path.find('/', 1) : std::string_view::npos;
+
+			s = segment_end == std::string_view::npos ? nullptr : probe(path.substr(0, segment_end + 1));
+
+			if (s != nullptr && !s->prefix)
+				s = nullptr;
+		}
+
+		if (s == nullptr)
+		{
+			*pResult = route_not_found;
+			return Handler();
+		}
+
+		Handler handler = s->handlers[method];
+		*pResult = handler ? route_found : route_method_not_allowed;
+		return handler;
+	}
+
+	//
+	// Visits each distinct path once (for example to register it with
+	// http.sys). Prefix routes are reported with their trailing '/'.
+	//
+	template <typename Callback>
+	void for_each_path(Callback callback) const
+	{
+		for (const slot& s : slots)
+		{
+			if (s.used)
+				callback(s.path);
+		}
+	}
+
+private:
+	const slot* probe(std::string_view path) const
+	{
+		uint64_t h = RouteHash(path);
+		int32_t d = displacements[h & (bucket_count - 1)];
+		size_t index = d < 0 ? static_cast<size_t>(-d - 1) : RouteMix(h, d) & (slot_count - 1);
+		const slot& s = slots[index];
+
+		if (s.hash != h || s.path.size() != path.size() ||
+			memcmp(s.path.data(), path.data(), path.size()) != 0)
+		{
+			return nullptr;
+		}
+
+		return &s;
+	}
+
+	slot slots[slot_count] = {};
+	int32_t displacements[bucket_count] = {};
+};
+
+#endif
@@ -13,9 +13,10 @@
 //#include "common.h"
 
 #ifndef _WIN32_WINNT            
-// Specifies that the minimum required platform is Windows Vista.
-// Change this to the appropriate value to target other versions of Windows.
-#define _WIN32_WINNT 0x0600     
+// Specifies that the minimum required platform is Windows 8: processor
+// groups (PinThreadToCpu) need Windows 7, and opaque responses for /ws
+// need Windows 8.
+#define _WIN32_WINNT 0x0602     
 #endif
 
 #pragma warning(disable:4201)   // nameless struct/union
@@ -36,8 +37,23 @@
 
 #include <thread>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
 
 #include "../common.h"
+#include "../slab_pool.h"
+#include "../server_stats.h"
+#include "../router.h"
+#include "../static_files.h"
+#include "../cpu_list.h"
+#include "../admission_control.h"
+#include "../json_writer.h"
+#include "../kv_store.h"
+#include "../crc32c.h"
+#include "../websocket.h"
 
 #define INITIALIZE_HTTP_RESPONSE( resp, status, reason )                    \
     do                                                                      \
@@ -58,34 +74,328 @@
             (USHORT) strlen(RawValue);                                      \
     } while(FALSE)
 
+//
+// Hands the connection over to us after the response headers, for /ws.
+// Windows 8 and later.
+//
+#ifndef HTTP_SEND_RESPONSE_FLAG_OPAQUE
+#define HTTP_SEND_RESPONSE_FLAG_OPAQUE 0x00000040
+#endif
+
 #define ALLOC_MEM(cb) HeapAlloc(GetProcessHeap(), 0, (cb))
 #define FREE_MEM(ptr) HeapFree(GetProcessHeap(), 0, (ptr))
 
-#define kill_url_context 19
+//
+// A complete response that is built once at startup and then sent as-is.
+// HttpSendHttpResponse only reads the HTTP_RESPONSE, so every thread can
+// share the same read-only copy and the hot path does no formatting.
+//
+typedef struct _STATIC_RESPONSE
+{
+	HTTP_RESPONSE   Response;
+	HTTP_DATA_CHUNK DataChunk;
+} STATIC_RESPONSE, *PSTATIC_RESPONSE;
+
+STATIC_RESPONSE SyncResponse;
+STATIC_RESPONSE PlaintextResponse;
+STATIC_RESPONSE StoredResponse;
+STATIC_RESPONSE CreatedResponse;
+STATIC_RESPONSE BadRequestResponse;
+STATIC_RESPONSE NotFoundResponse;
+STATIC_RESPONSE ContentTooLargeResponse;
+STATIC_RESPONSE NotImplementedResponse;
+STATIC_RESPONSE ServiceUnavailableResponse;
+
+//
+// POST bodies are echoed through one pool buffer of this size, framed as
+// a chunked response.
+//
+const size_t echo_buffer_size = 64 * 1024;
+
+//
+// Largest JSON body /json writes; it goes in a pool buffer this size.
+//
+const size_t json_buffer_size = 2 * 1024;
+
+//
+// Backs /kv/. Values are read into and sent from pool buffers of
+// kv_max_value bytes, the pool's largest class.
+//
+kv_store KeyValues;
+
+//
+// /sink uploads are drained through a buffer of this size per thread,
+// filled completely by each receive, so a large upload takes few calls.
+//
+const size_t sink_buffer_size = 1024 * 1024;
+
+//
+// A /ws session's frames are received into a buffer of this size.
+//
+const size_t websocket_buffer_size = 64 * 1024;
+
+//
+// /ws sessions last for as long as the client keeps them open, so they
+// run on a pool of their own rather than holding up receiving threads:
+// up to MaxWebSocketSessions threads (--ws-sessions), started as sessions
+// need them, each with its own stats block. An upgrade that would go
+// past the limit is answered 503. The pool is under WebSocketLock;
+// running sessions also poll WebSocketStopping, set once wmain is done
+// receiving requests, without taking it.
+//
+const ULONG default_websocket_sessions = 64;
+
+typedef struct _WEBSOCKET_POOL
+{
+	std::vector<std::thread>     Threads;
+	std::vector<HTTP_REQUEST_ID> Waiting;      // upgraded, not yet picked up
+	size_t                       Sessions;     // admitted and not yet finished
+	size_t                       Idle;         // threads waiting for a session
+} WEBSOCKET_POOL;
+
+ULONG MaxWebSocketSessions = default_websocket_sessions;
+SRWLOCK WebSocketLock = SRWLOCK_INIT;
+CONDITION_VARIABLE WebSocketReady = CONDITION_VARIABLE_INIT;
+WEBSOCKET_POOL WebSocketPool = {};
+std::atomic<bool> WebSocketStopping = false;
+
+CHAR ChunkTrailer[] = "\r\n";
+CHAR LastChunk[] = "0\r\n\r\n";
+
+//
+// What a route handler gets to work with.
+//
+typedef struct _REQUEST_CONTEXT
+{
+	HANDLE          hReqQueue;
+	PHTTP_REQUEST   pRequest;
+	slab_pool*      pPool;
+} REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+
+typedef DWORD (*REQUEST_HANDLER)(IN PREQUEST_CONTEXT pContext);
+
+//
+// An open file served under /files/. Entries are shared by all threads
+// through FileCache and stay open while any response still uses them;
+// http.sys sends their contents straight from the handle.
+//
+typedef struct _FILE_ENTRY
+{
+	HANDLE          hFile;
+	ULONGLONG       Size;
+	FILETIME        LastWriteTime;
+	ULONGLONG       CheckedTick;    // when the metadata was last validated
+	CHAR            szLastModified[40];
+
+	~_FILE_ENTRY() { CloseHandle(hFile); }
+} FILE_ENTRY, *PFILE_ENTRY;
+
+WCHAR FileRoot[MAX_PATH];
+SRWLOCK FileCacheLock = SRWLOCK_INIT;
+std::unordered_map<std::string, std::shared_ptr<FILE_ENTRY>> FileCache;
+
+//
+// Most distinct files kept open at once.
+//
+const size_t max_cached_files = 1024;
+
+//
+// Receiving threads (--threads) and the CPUs they are pinned to (--cpus);
+// thread i runs on ServerCpus[i % count]. Empty means not pinned.
+//
+ULONG ServerThreadCount = request_thread_count;
+std::vector<unsigned> ServerCpus;
+
+//
+// The server stops once the load tester's request_thread_count /kill
+// requests have all arrived, however many threads are receiving.
+//
+std::atomic<size_t> KillRequests = 0;
+
+//
+// Admission control (--shed, see admission_control.h). A request's
+// queueing delay runs from when http.sys routed it to our queue, as told
+// by the timing information recent versions of Windows attach to each
+// request. Without it nothing is shed. Handlers here run to completion
+// on the receiving thread, so there is no in-flight limit to apply.
+//
+admission_settings Admission;
+LARGE_INTEGER QpcFrequency;
 
 //
 // Prototypes.
 //
 DWORD
-DoReceiveRequests(
-	HANDLE hReqQueue
+ServerThread(
+	IN HANDLE hReqQueue,
+	IN LONG Cpu
 );
 
 DWORD
-SendHttpResponse(
+DoReceiveRequests(
 	IN HANDLE hReqQueue,
-	IN PHTTP_REQUEST pRequest,
+	IN slab_pool* pPool
+);
+
+BOOL
+PinThreadToCpu(
+	IN ULONG Cpu
+);
+
+BOOL
+AdmitRequest(
+	IN admission_controller* pController,
+	IN PHTTP_REQUEST pRequest
+);
+
+VOID
+InitializeStaticResponse(
+	OUT PSTATIC_RESPONSE pStaticResponse,
 	IN USHORT StatusCode,
 	__in IN PSTR pReason,
+	__in IN PSTR pContentType,
 	__in_opt IN PSTR pEntity
 );
 
+DWORD
+SendHttpResponse(
+	IN HANDLE hReqQueue,
+	IN PHTTP_REQUEST pRequest,
+	IN PSTATIC_RESPONSE pStaticResponse
+);
+
 DWORD
 SendHttpPostResponse(
 	IN HANDLE hReqQueue,
+	IN PHTTP_REQUEST pRequest,
+	IN slab_pool* pPool
+);
+
+http_method
+HttpVerbToMethod(
+	IN HTTP_VERB Verb
+);
+
+std::string_view
+RawUrlPath(
 	IN PHTTP_REQUEST pRequest
 );
 
+DWORD
+HandleSync(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleEcho(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandlePlaintext(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleJson(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleKill(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleFile(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleStats(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleKv(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleSink(
+	IN PREQUEST_CONTEXT pContext
+);
+
+DWORD
+HandleWebSocket(
+	IN PREQUEST_CONTEXT pContext
+);
+
+VOID
+RunWebSocketSession(
+	IN HANDLE hReqQueue,
+	IN HTTP_REQUEST_ID RequestId
+);
+
+VOID
+WebSocketThread(
+	IN HANDLE hReqQueue
+);
+
+VOID
+StopWebSocketSessions(
+	IN HANDLE hReqQueue
+);
+
+DWORD
+ReceiveEntity(
+	IN HANDLE hReqQueue,
+	IN PHTTP_REQUEST pRequest,
+	OUT PUCHAR pBuffer,
+	IN ULONG BufferLength,
+	OUT PULONG pBytesReceived
+);
+
+VOID
+RecordSend(
+	IN DWORD Result,
+	IN USHORT StatusCode,
+	IN DWORD BytesSent
+);
+
+std::shared_ptr<FILE_ENTRY>
+OpenCachedFile(
+	IN const std::string& Path
+);
+
+//
+// The route table. Every distinct path is registered with http.sys at
+// startup, and requests are dispatched on { verb, path } through a perfect
+// hash built at compile time, so adding routes does not slow dispatch.
+//
+constexpr route<REQUEST_HANDLER> routes[] = {
+	{ method_get,  "/sync", HandleSync },
+	{ method_post, "/sync", HandleEcho },
+	{ method_get,  "/plaintext", HandlePlaintext },
+	{ method_get,  "/json", HandleJson },
+	{ method_get,  "/kill", HandleKill },
+	{ method_post, "/kill", HandleKill },
+	{ method_get,  "/files/*", HandleFile },
+	{ method_head, "/files/*", HandleFile },
+	{ method_get,  "/stats", HandleStats },
+	{ method_get,  "/kv/*", HandleKv },
+	{ method_put,  "/kv/*", HandleKv },
+	{ method_delete, "/kv/*", HandleKv },
+	{ method_post, "/sink", HandleSink },
+	{ method_put,  "/sink", HandleSink },
+	{ method_get,  "/ws", HandleWebSocket },
+};
+
+constexpr router<REQUEST_HANDLER, _countof(routes)> Router(routes);
+
+const std::string_view files_prefix = "/files/";
+const std::string_view kv_prefix = "/kv/";
+
 /***************************************************************************++
 
 Routine Description:
@@ -116,6 +426,142 @@ wmain(
 
 	wprintf(L"Starting server\n");
 
+	//
+	// --root <dir> sets the directory served under /files/, --threads <n>
+	// the number of receiving threads, and --cpus <list> (e.g. 0-15,32-47)
+	// pins thread i to the i-th CPU of the list, counting CPUs across
+	// processor groups. --shed turns on admission control, and
+	// --shed-target <ms> and --shed-interval <ms> set its target delay and
+	// interval (5 and 100); either implies --shed. --ws-sessions <n> sets
+	// how many /ws sessions can be open at once.
+	//
+	MultiByteToWideChar(CP_UTF8, 0, default_file_root, -1, FileRoot, _countof(FileRoot));
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (wcscmp(argv[i], L"--root") == 0 && i + 1 < argc)
+		{
+			StringCchCopyW(FileRoot, _countof(FileRoot), argv[++i]);
+		}
+		else if (wcscmp(argv[i], L"--threads") == 0 && i + 1 < argc &&
+			(ServerThreadCount = wcstoul(argv[i + 1], NULL, 10)) != 0)
+		{
+			i++;
+		}
+		else if (wcscmp(argv[i], L"--cpus") == 0 && i + 1 < argc &&
+			ParseCpuList(std::string(argv[i + 1], argv[i + 1] + wcslen(argv[i + 1])), &ServerCpus))
+		{
+			i++;
+		}
+		else if (wcscmp(argv[i], L"--ws-sessions") == 0 && i + 1 < argc &&
+			(MaxWebSocketSessions = wcstoul(argv[i + 1], NULL, 10)) != 0)
+		{
+			i++;
+		}
+		else if (wcscmp(argv[i], L"--shed") == 0)
+		{
+			Admission.enabled = true;
+		}
+		else if (wcscmp(argv[i], L"--shed-target") == 0 && i + 1 < argc)
+		{
+			Admission.enabled = true;
+			Admission.target_ns = wcstoull(argv[++i], NULL, 10) * 1000000;
+		}
+		else if (wcscmp(argv[i], L"--shed-interval") == 0 && i + 1 < argc)
+		{
+			Admission.enabled = true;
+			Admission.interval_ns = wcstoull(argv[++i], NULL, 10) * 1000000;
+		}
+		else
+		{
+			wprintf(L"usage: %s [--root <dir>] [--threads <n>] [--cpus <list>] [--ws-sessions <n>]\n"
+				L"       [--shed] [--shed-target <ms>] [--shed-interval <ms>]\n", argv[0]);
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	wprintf(L"%lu receiving threads, %s\n", ServerThreadCount,
+		ServerCpus.empty() ? L"not pinned" : L"pinned");
+
+	if (Admission.enabled)
+	{
+		wprintf(L"shedding requests queued over %llu ms when overloaded (interval %llu ms)\n",
+			Admission.target_ns / 1000000, Admission.interval_ns / 1000000);
+	}
+
+	QueryPerformanceFrequency(&QpcFrequency);
+
+	InitializeStaticResponse(
+		&SyncResponse,
+		200,
+		"OK",
+		"text/html",
+		"Hey! You hit the server \r\n"
+	);
+
+	InitializeStaticResponse(
+		&PlaintextResponse,
+		200,
+		"OK",
+		"text/plain",
+		"Hello, World!"
+	);
+
+	InitializeStaticResponse(
+		&StoredResponse,
+		200,
+		"OK",
+		"text/plain",
+		NULL
+	);
+
+	InitializeStaticResponse(
+		&CreatedResponse,
+		201,
+		"Created",
+		"text/plain",
+		NULL
+	);
+
+	InitializeStaticResponse(
+		&BadRequestResponse,
+		400,
+		"Bad Request",
+		"text/html",
+		NULL
+	);
+
+	InitializeStaticResponse(
+		&NotFoundResponse,
+		404,
+		"Not Found",
+		"text/html",
+		NULL
+	);
+
+	InitializeStaticResponse(
+		&ContentTooLargeResponse,
+		413,
+		"Content Too Large",
+		"text/html",
+		NULL
+	);
+
+	InitializeStaticResponse(
+		&NotImplementedResponse,
+		503,
+		"Not Implemented",
+		"text/html",
+		NULL
+	);
+
+	InitializeStaticResponse(
+		&ServiceUnavailableResponse,
+		503,
+		"Service Unavailable",
+		"text/html",
+		NULL
+	);
 
 	retCode = HttpInitialize(
 		HttpApiVersion,
@@ -223,56 +669,64 @@ wmain(
 
 	//
 	// Add the URLs on URL Group
-	// The command line arguments represent URIs that we want to listen on.
-	// We will call HttpAddUrlToUrlGroup for each of these URIs.
+	// Every path in the route table is registered; http.sys matches them
+	// by prefix and we dispatch on the exact path ourselves.
 	//
 	// The URI is a fully qualified URI and MUST include the terminating '/'
 	//
+	{
+		std::vector<std::wstring> urls;
 
-	wchar_t* urls[] = { L"http://localhost:8080/kill",
-			L"http://localhost:8080/sync",
-	};
-
-	HTTP_URL_CONTEXT url_contexts[] = { kill_url_context,
-		0 };
-
+		Router.for_each_path([&urls](std::string_view path) {
+			urls.emplace_back(L"http://localhost:8080");
+			urls.back().append(path.begin(), path.end());
+		});
 
-	for (int i = 0; i < _countof(urls); i++)
-	{
-		wprintf(
-			L"listening for requests on url: %s\n",
-			urls[i]);
+		for (const auto& url : urls)
+		{
+			wprintf(
+				L"listening for requests on url: %s\n",
+				url.c_str());
 
 
-		retCode = HttpAddUrlToUrlGroup(urlGroupId,
-			urls[i],
-			url_contexts[i],
-			0);
+			retCode = HttpAddUrlToUrlGroup(urlGroupId,
+				url.c_str(),
+				0,
+				0);
 
 
-		if (retCode != NO_ERROR)
-		{
-			wprintf(L"HttpAddUrl failed with %lu \n", retCode);
-			goto CleanUp;
+			if (retCode != NO_ERROR)
+			{
+				wprintf(L"HttpAddUrl failed with %lu \n", retCode);
+				goto CleanUp;
+			}
 		}
 	}
 
 	{	
 		std::vector<std::thread> threads;
 
-		for (int i = 0; i < request_thread_count; i++)
+		for (ULONG i = 0; i < ServerThreadCount; i++)
 		{
-			threads.emplace_back(std::thread([q = hReqQueue]() { DoReceiveRequests(q); }));
+			LONG cpu = ServerCpus.empty() ? -1 : (LONG)ServerCpus[i % ServerCpus.size()];
+
+			threads.emplace_back(std::thread([q = hReqQueue, cpu]() { ServerThread(q, cpu); }));
 		}
 
 		for (auto & t : threads)
 		{
 			t.join();
 		}
+
+		//
+		// The WebSocket sessions use the queue too, so they have to be
+		// finished before it is closed.
+		//
+		StopWebSocketSessions(hReqQueue);
 	}
 
 	// Loop while receiving requests
-	//DoReceiveRequests(hReqQueue);
+	//DoReceiveRequests(hReqQueue, &pool);
 
 CleanUp:
 
@@ -351,115 +805,342 @@ CleanUp:
 /***************************************************************************++
 
 Routine Description:
-	The routine to receive a request. This routine calls the corresponding
-	routine to deal with the response.
+	Maps an http.sys verb onto the router's method index.
 
 Arguments:
-	hReqQueue - Handle to the request queue.
+	Verb - The verb http.sys parsed.
 
 Return Value:
-	Success/Failure.
+	The method, method_other for verbs without routes.
 
 --***************************************************************************/
-DWORD
-DoReceiveRequests(
-	IN HANDLE hReqQueue
+http_method
+HttpVerbToMethod(
+	IN HTTP_VERB Verb
 )
 {
-	ULONG              result;
-	HTTP_REQUEST_ID    requestId;
-	DWORD              bytesRead;
-	PHTTP_REQUEST      pRequest;
-	PCHAR              pRequestBuffer;
-	ULONG              RequestBufferLength;
-	int kill_server = 0;
-	int requests_handled = 0;
-
-	//
-	// Allocate a 2K buffer. Should be good for most requests, we'll grow
-	// this if required. We also need space for a HTTP_REQUEST structure.
-	//
-	RequestBufferLength = sizeof(HTTP_REQUEST) + 2048;
-	pRequestBuffer = (PCHAR)ALLOC_MEM(RequestBufferLength);
-
-	if (pRequestBuffer == NULL)
+	switch (Verb)
 	{
-		return ERROR_NOT_ENOUGH_MEMORY;
+	case HttpVerbGET:       return method_get;
+	case HttpVerbHEAD:      return method_head;
+	case HttpVerbPOST:      return method_post;
+	case HttpVerbPUT:       return method_put;
+	case HttpVerbDELETE:    return method_delete;
+	case HttpVerbOPTIONS:   return method_options;
+	default:                return method_other;
 	}
+}
 
-	pRequest = (PHTTP_REQUEST)pRequestBuffer;
-
-	//
-	// Wait for a new request -- This is indicated by a NULL request ID.
-	//
+/***************************************************************************++
 
-	HTTP_SET_NULL_ID(&requestId);
+Routine Description:
+	Returns the path (and query) of the request as the client sent it.
+	An absolute-form target ("http://host/path") is cut down to its path.
 
-	while (!kill_server)
-	{
-		RtlZeroMemory(pRequest, RequestBufferLength);
+Arguments:
+	pRequest - The parsed HTTP request.
 
-		result = HttpReceiveHttpRequest(
-			hReqQueue,          // Req Queue
-			requestId,          // Req ID
-			0,                  // Flags
-			pRequest,           // HTTP request buffer
-			RequestBufferLength,// req buffer length
-			&bytesRead,         // bytes received
-			NULL                // LPOVERLAPPED
-		);
+Return Value:
+	The path, pointing into the request buffer.
 
-		if (NO_ERROR == result)
-		{
-			requests_handled += 1;
+--***************************************************************************/
+std::string_view
+RawUrlPath(
+	IN PHTTP_REQUEST pRequest
+)
+{
+	std::string_view url(pRequest->pRawUrl, pRequest->RawUrlLength);
 
-			if (kill_url_context == pRequest->UrlContext)
-			{
-				kill_server = 1;
-			}
+	if (!url.empty() && url[0] != '/')
+	{
+		auto scheme = url.find("://");
+		auto path = scheme == std::string_view::npos ? scheme : url.find('/', scheme + 3);
 
-			//
-			// Worked!
-			//
-			switch (pRequest->Verb)
-			{
-			case HttpVerbGET:
-				//wprintf(L"Got a GET request for %ws \n",
-						//pRequest->CookedUrl.pFullUrl);
+		url = path == std::string_view::npos ? std::string_view("/") : url.substr(path);
+	}
 
+	return url;
+}
 
+/***************************************************************************++
 
-				result = SendHttpResponse(
-					hReqQueue,
-					pRequest,
-					200,
-					"OK",
-					"Hey! You hit the server \r\n"
-				);
-				break;
+Routine Description:
+	A receiving thread. A thread with a CPU is pinned to it first and
+	then given a heap of its own for its buffer pool; Windows commits the
+	heap's pages on the NUMA node of the thread that first touches them,
+	so its request and entity buffers stay local.
 
-			case HttpVerbPOST:
+Arguments:
+	hReqQueue - Handle to the request queue.
+	Cpu       - CPU to run on, or -1 to leave the thread unpinned.
 
-				wprintf(L"Got a POST request for %ws \n",
-					pRequest->CookedUrl.pFullUrl);
+Return Value:
+	Success/Failure.
 
-				result = SendHttpPostResponse(hReqQueue, pRequest);
-				break;
+--***************************************************************************/
+DWORD
+ServerThread(
+	IN HANDLE hReqQueue,
+	IN LONG Cpu
+)
+{
+	HANDLE hHeap = NULL;
+	DWORD result;
 
-			default:
+	if (Cpu >= 0)
+	{
+		if (!PinThreadToCpu((ULONG)Cpu))
+		{
+			wprintf(L"pinning a thread to CPU %ld failed with %lu \n", Cpu, GetLastError());
+		}
+
+		hHeap = HeapCreate(HEAP_NO_SERIALIZE, 0, 0);
+	}
+
+	{
+		slab_pool pool(hHeap == NULL ? malloc_backing : slab_backing{
+			[](void* context, size_t size) { return HeapAlloc((HANDLE)context, 0, size); },
+			[](void* context, void* p) { HeapFree((HANDLE)context, 0, p); },
+			hHeap });
+
+		result = DoReceiveRequests(hReqQueue, &pool);
+	}
+
+	if (hHeap != NULL)
+	{
+		HeapDestroy(hHeap);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Pins the calling thread to one logical processor. CPUs are numbered
+	across processor groups in order, so hosts with more than 64 logical
+	processors can use all of them.
+
+Arguments:
+	Cpu - The CPU number.
+
+Return Value:
+	TRUE if the thread is now pinned.
+
+--***************************************************************************/
+BOOL
+PinThreadToCpu(
+	IN ULONG Cpu
+)
+{
+	GROUP_AFFINITY affinity = {};
+	WORD groupCount = GetActiveProcessorGroupCount();
+
+	for (WORD group = 0; group < groupCount; group++)
+	{
+		DWORD count = GetActiveProcessorCount(group);
+
+		if (Cpu < count)
+		{
+			affinity.Group = group;
+			affinity.Mask = (KAFFINITY)1 << Cpu;
+			return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+		}
+
+		Cpu -= count;
+	}
+
+	SetLastError(ERROR_INVALID_PARAMETER);
+	return FALSE;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Asks a thread's admission controller whether to serve a request. The
+	request's queueing delay is the time since http.sys finished routing
+	it, from its timing information; a request without one counts as not
+	having waited.
+
+Arguments:
+	pController - The receiving thread's controller.
+	pRequest    - The parsed HTTP request.
+
+Return Value:
+	FALSE if the request should be shed.
+
+--***************************************************************************/
+BOOL
+AdmitRequest(
+	IN admission_controller* pController,
+	IN PHTTP_REQUEST pRequest
+)
+{
+	LARGE_INTEGER now;
+	ULONGLONG delay = 0;
+
+	auto toNs = [](ULONGLONG ticks)
+	{
+		ULONGLONG frequency = (ULONGLONG)QpcFrequency.QuadPart;
+
+		return ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency;
+	};
+
+	if (!Admission.enabled)
+	{
+		return TRUE;
+	}
+
+	QueryPerformanceCounter(&now);
+
+	for (USHORT i = 0; i < pRequest->RequestInfoCount; i++)
+	{
+		PHTTP_REQUEST_INFO pInfo = &pRequest->pRequestInfo[i];
+
+		if (pInfo->InfoType == HttpRequestInfoTypeRequestTiming)
+		{
+			PHTTP_REQUEST_TIMING_INFO pTiming = (PHTTP_REQUEST_TIMING_INFO)pInfo->pInfo;
+			ULONGLONG routed = pTiming->RequestTimingCount > HttpRequestTimingTypeRequestRoutingEnd ?
+				pTiming->RequestTiming[HttpRequestTimingTypeRequestRoutingEnd] : 0;
+
+			if (routed != 0 && (ULONGLONG)now.QuadPart > routed)
+			{
+				delay = toNs((ULONGLONG)now.QuadPart - routed);
+			}
+		}
+	}
+
+	return pController->admit(Admission, toNs((ULONGLONG)now.QuadPart), delay, 0);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	The routine to receive a request. This routine calls the corresponding
+	routine to deal with the response.
+
+Arguments:
+	hReqQueue - Handle to the request queue.
+	pPool     - The thread's buffer pool.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+DoReceiveRequests(
+	IN HANDLE hReqQueue,
+	IN slab_pool* pPool
+)
+{
+	ULONG              result;
+	HTTP_REQUEST_ID    requestId;
+	DWORD              bytesRead;
+	PHTTP_REQUEST      pRequest;
+	PCHAR              pRequestBuffer;
+	ULONG              RequestBufferLength;
+	size_t             RequestBufferCapacity;
+	slab_pool&         pool = *pPool;
+	int requests_handled = 0;
+	server_thread_stats* pStats = RegisterStatsThread();
+	admission_controller admission;
+
+	//
+	// Take a 2K buffer from this thread's pool. It holds the HTTP_REQUEST
+	// structure and the headers of most requests; we'll grow it if
+	// required. Buffers are reused as-is, http.sys fills in what it
+	// returns so there is no need to clear them first.
+	//
+	pRequestBuffer = (PCHAR)pool.allocate(slab_class_sizes[0], &RequestBufferCapacity);
+	RequestBufferLength = (ULONG)RequestBufferCapacity;
+
+	if (pRequestBuffer == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	pRequest = (PHTTP_REQUEST)pRequestBuffer;
+
+	//
+	// Wait for a new request -- This is indicated by a NULL request ID.
+	//
+
+	HTTP_SET_NULL_ID(&requestId);
+
+	for (;;)
+	{
+		result = HttpReceiveHttpRequest(
+			hReqQueue,          // Req Queue
+			requestId,          // Req ID
+			0,                  // Flags
+			pRequest,           // HTTP request buffer
+			RequestBufferLength,// req buffer length
+			&bytesRead,         // bytes received
+			NULL                // LPOVERLAPPED
+		);
+
+		if (NO_ERROR == result)
+		{
+			REQUEST_CONTEXT context = { hReqQueue, pRequest, &pool };
+			REQUEST_HANDLER handler;
+			route_result routeResult;
+			auto received = std::chrono::steady_clock::now();
+
+			requests_handled += 1;
+
+			//
+			// Worked! Dispatch on verb and path.
+			//
+			handler = Router.lookup(
+				HttpVerbToMethod(pRequest->Verb),
+				RawUrlPath(pRequest),
+				&routeResult);
+
+			//
+			// /kill and /stats are never shed: an overloaded server still
+			// has to be observable and to stop when told.
+			//
+			if (routeResult == route_found && handler != HandleKill &&
+				handler != HandleStats && !AdmitRequest(&admission, pRequest))
+			{
+				StatAdd(pStats->shed, 1);
+
+				result = SendHttpResponse(
+					hReqQueue,
+					pRequest,
+					&ServiceUnavailableResponse
+				);
+			}
+			else switch (routeResult)
+			{
+			case route_found:
+				result = handler(&context);
+				break;
+
+			case route_method_not_allowed:
 				wprintf(L"Got a unknown request for %ws \n",
 					pRequest->CookedUrl.pFullUrl);
 
 				result = SendHttpResponse(
 					hReqQueue,
 					pRequest,
-					503,
-					"Not Implemented",
-					NULL
+					&NotImplementedResponse
+				);
+				break;
+
+			default:
+				result = SendHttpResponse(
+					hReqQueue,
+					pRequest,
+					&NotFoundResponse
 				);
 				break;
 			}
 
+			StatAdd(pStats->requests, 1);
+			StatAdd(pStats->bytes_in, pRequest->BytesReceived);
+			pStats->record_latency(std::chrono::steady_clock::now() - received);
+
 			if (result != NO_ERROR)
 			{
 				break;
@@ -469,6 +1150,25 @@ DoReceiveRequests(
 			// Reset the Request ID so that we pick up the next request.
 			//
 			HTTP_SET_NULL_ID(&requestId);
+
+			//
+			// If this request needed a bigger buffer, go back to a small
+			// one so a rare huge request doesn't pin memory.
+			//
+			if (RequestBufferCapacity > slab_class_sizes[0])
+			{
+				pool.release(pRequestBuffer, RequestBufferCapacity);
+				pRequestBuffer = (PCHAR)pool.allocate(slab_class_sizes[0], &RequestBufferCapacity);
+				RequestBufferLength = (ULONG)RequestBufferCapacity;
+
+				if (pRequestBuffer == NULL)
+				{
+					result = ERROR_NOT_ENOUGH_MEMORY;
+					break;
+				}
+
+				pRequest = (PHTTP_REQUEST)pRequestBuffer;
+			}
 		}
 		else if (result == ERROR_MORE_DATA)
 		{
@@ -482,13 +1182,15 @@ DoReceiveRequests(
 			// This RequestID is picked from the old buffer.
 			//
 			requestId = pRequest->RequestId;
+			StatAdd(pStats->buffer_regrowths, 1);
 
 			//
-			// Free the old buffer and allocate a new one.
+			// Return the old buffer and take one from the size class that
+			// fits.
 			//
-			RequestBufferLength = bytesRead;
-			FREE_MEM(pRequestBuffer);
-			pRequestBuffer = (PCHAR)ALLOC_MEM(RequestBufferLength);
+			pool.release(pRequestBuffer, RequestBufferCapacity);
+			pRequestBuffer = (PCHAR)pool.allocate(bytesRead, &RequestBufferCapacity);
+			RequestBufferLength = (ULONG)RequestBufferCapacity;
 
 			if (pRequestBuffer == NULL)
 			{
@@ -508,8 +1210,17 @@ DoReceiveRequests(
 
 			HTTP_SET_NULL_ID(&requestId);
 		}
+		else if (ERROR_OPERATION_ABORTED == result && KillRequests >= request_thread_count)
+		{
+			//
+			// /kill shut the queue down.
+			//
+			result = NO_ERROR;
+			break;
+		}
 		else
 		{
+			StatAdd(pStats->io_errors, 1);
 			wprintf(L"HttpReceiveHttpRequest failed. Error %lu \n", result);
 			break;
 		}
@@ -518,77 +1229,109 @@ DoReceiveRequests(
 
 	if (pRequestBuffer)
 	{
-		FREE_MEM(pRequestBuffer);
+		pool.release(pRequestBuffer, RequestBufferCapacity);
 	}
 
 	wprintf(L"Thread completed after %d requests \n", requests_handled);
 
+	wprintf(L"  buffer pool: 2K high water %zu, 16K high water %zu, "
+		L"64K high water %zu, oversize %zu, heap allocations %zu \n",
+		pool.stats.high_water[0],
+		pool.stats.high_water[1],
+		pool.stats.high_water[2],
+		pool.stats.allocations[slab_class_count],
+		pool.stats.heap_allocations[0] + pool.stats.heap_allocations[1] +
+		pool.stats.heap_allocations[2] + pool.stats.heap_allocations[slab_class_count]);
+
 	return result;
 }
 
 /***************************************************************************++
 
 Routine Description:
-	The routine sends a HTTP response.
+	The routine builds a response that will be sent unchanged for every
+	request on a fixed route. Called once at startup.
 
 Arguments:
-	hReqQueue     - Handle to the request queue.
-	pRequest      - The parsed HTTP request.
-	StatusCode    - Response Status Code.
-	pReason       - Response reason phrase.
-	pEntityString - Response entity body.
+	pStaticResponse - Receives the response.
+	StatusCode      - Response Status Code.
+	pReason         - Response reason phrase.
+	pContentType    - Response Content-Type.
+	pEntityString   - Response entity body.
 
 Return Value:
-	Success/Failure.
+	None.
 
 --***************************************************************************/
-DWORD
-SendHttpResponse(
-	IN HANDLE hReqQueue,
-	IN PHTTP_REQUEST pRequest,
+VOID
+InitializeStaticResponse(
+	OUT PSTATIC_RESPONSE pStaticResponse,
 	IN USHORT StatusCode,
 	__in IN PSTR pReason,
+	__in IN PSTR pContentType,
 	__in_opt IN PSTR pEntityString
 )
 {
-	HTTP_RESPONSE   response;
-	HTTP_DATA_CHUNK dataChunk;
-	DWORD           result;
-	DWORD           bytesSent;
-
 	//
 	// Initialize the HTTP response structure.
 	//
-	INITIALIZE_HTTP_RESPONSE(&response, StatusCode, pReason);
+	INITIALIZE_HTTP_RESPONSE(&pStaticResponse->Response, StatusCode, pReason);
 
 	//
 	// Add a known header.
 	//
-	ADD_KNOWN_HEADER(response, HttpHeaderContentType, "text/html");
+	ADD_KNOWN_HEADER(pStaticResponse->Response, HttpHeaderContentType, pContentType);
 
 	if (pEntityString)
 	{
 		//
 		// Add an entity chunk
 		//
-		dataChunk.DataChunkType = HttpDataChunkFromMemory;
-		dataChunk.FromMemory.pBuffer = pEntityString;
-		dataChunk.FromMemory.BufferLength = (ULONG)strlen(pEntityString);
+		pStaticResponse->DataChunk.DataChunkType = HttpDataChunkFromMemory;
+		pStaticResponse->DataChunk.FromMemory.pBuffer = pEntityString;
+		pStaticResponse->DataChunk.FromMemory.BufferLength = (ULONG)strlen(pEntityString);
 
-		response.EntityChunkCount = 1;
-		response.pEntityChunks = &dataChunk;
+		pStaticResponse->Response.EntityChunkCount = 1;
+		pStaticResponse->Response.pEntityChunks = &pStaticResponse->DataChunk;
 	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	The routine sends a HTTP response that was built at startup. The
+	status line, headers and entity go to http.sys in a single call
+	straight from the read-only STATIC_RESPONSE.
+
+Arguments:
+	hReqQueue       - Handle to the request queue.
+	pRequest        - The parsed HTTP request.
+	pStaticResponse - The prebuilt response.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+SendHttpResponse(
+	IN HANDLE hReqQueue,
+	IN PHTTP_REQUEST pRequest,
+	IN PSTATIC_RESPONSE pStaticResponse
+)
+{
+	DWORD           result;
+	DWORD           bytesSent = 0;
 
 	//
 	// Since we are sending all the entity body in one call, we don't have
-	// to specify the Content-Length.
+	// to specify the Content-Length. http.sys adds the Date header.
 	//
 
 	result = HttpSendHttpResponse(
 		hReqQueue,           // ReqQueueHandle
 		pRequest->RequestId, // Request ID
 		0,                   // Flags
-		&response,           // HTTP response
+		&pStaticResponse->Response, // HTTP response
 		NULL,                // pReserved1
 		&bytesSent,          // bytes sent   (OPTIONAL)
 		NULL,                // pReserved2   (must be NULL)
@@ -597,6 +1340,8 @@ SendHttpResponse(
 		NULL                 // pReserved4   (must be NULL)
 	);
 
+	RecordSend(result, pStaticResponse->Response.StatusCode, bytesSent);
+
 	if (result != NO_ERROR)
 	{
 		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
@@ -608,11 +1353,15 @@ SendHttpResponse(
 /***************************************************************************++
 
 Routine Description:
-	The routine sends a HTTP response after reading the entity body.
+	The routine echoes the request entity body back to the client. Each
+	piece of the body is sent back as soon as it is received, framed as
+	a chunk of a chunked response, so the body only ever occupies one
+	pool buffer and its length is not limited.
 
 Arguments:
 	hReqQueue     - Handle to the request queue.
 	pRequest      - The parsed HTTP request.
+	pPool         - The calling thread's buffer pool.
 
 Return Value:
 	Success/Failure.
@@ -621,31 +1370,32 @@ Return Value:
 DWORD
 SendHttpPostResponse(
 	IN HANDLE hReqQueue,
-	IN PHTTP_REQUEST pRequest
+	IN PHTTP_REQUEST pRequest,
+	IN slab_pool* pPool
 )
 {
 	HTTP_RESPONSE   response;
 	DWORD           result;
-	DWORD           bytesSent;
+	DWORD           bytesSent = 0;
 	PUCHAR          pEntityBuffer;
 	ULONG           EntityBufferLength;
+	size_t          EntityBufferCapacity;
 	ULONG           BytesRead;
-	ULONG           TempFileBytesWritten;
-	HANDLE          hTempFile;
-	TCHAR           szTempName[MAX_PATH + 1];
-#define MAX_ULONG_STR ((ULONG) sizeof("4294967295"))
-	CHAR            szContentLength[MAX_ULONG_STR];
-	HTTP_DATA_CHUNK dataChunk;
-	ULONG           TotalBytesRead = 0;
+	BOOL            Chunked;
+	USHORT          ChunkCount;
+	ULONG           SendFlags;
+	CHAR            szChunkSize[sizeof("ffffffff\r\n")];
+	HTTP_DATA_CHUNK dataChunks[3];
 
 	BytesRead = 0;
-	hTempFile = INVALID_HANDLE_VALUE;
 
 	//
-	// Allocate some space for an entity buffer. We'll grow this on demand.
+	// Take an entity buffer from the thread's pool. Every receive fills
+	// it and every send drains it, so it is the only memory the body
+	// passes through.
 	//
-	EntityBufferLength = 2048;
-	pEntityBuffer = (PUCHAR)ALLOC_MEM(EntityBufferLength);
+	pEntityBuffer = (PUCHAR)pPool->allocate(echo_buffer_size, &EntityBufferCapacity);
+	EntityBufferLength = (ULONG)EntityBufferCapacity;
 
 	if (pEntityBuffer == NULL)
 	{
@@ -671,41 +1421,47 @@ SendHttpPostResponse(
 
 	if (pRequest->Flags & HTTP_REQUEST_FLAG_MORE_ENTITY_BODY_EXISTS)
 	{
-		// The entity body is send over multiple calls. Let's collect all
-		// of these in a file & send it back. We'll create a temp file
 		//
+		// We don't know the length up front, so HTTP/1.1 clients get a
+		// chunked response that we frame ourselves; http.sys passes the
+		// entity through as-is. HTTP/1.0 clients get the raw body and the
+		// connection is closed to end it.
+		//
+		Chunked = pRequest->Version.MajorVersion > 1 ||
+			(pRequest->Version.MajorVersion == 1 && pRequest->Version.MinorVersion >= 1);
 
-		if (GetTempFileName(
-			L".",
-			L"New",
-			0,
-			szTempName
-		) == 0)
+		if (Chunked)
 		{
-			result = GetLastError();
-			wprintf(L"GetTempFileName failed with %lu \n", result);
-			goto Done;
+			ADD_KNOWN_HEADER(response, HttpHeaderTransferEncoding, "chunked");
 		}
 
-		hTempFile = CreateFile(
-			szTempName,
-			GENERIC_READ | GENERIC_WRITE,
-			0,                             // don't share.
-			NULL,                          // no security descriptor
-			CREATE_ALWAYS,                 // overrwrite existing
-			FILE_ATTRIBUTE_NORMAL,         // normal file.
-			NULL
-		);
+		result =
+			HttpSendHttpResponse(
+				hReqQueue,           // ReqQueueHandle
+				pRequest->RequestId, // Request ID
+				HTTP_SEND_RESPONSE_FLAG_MORE_DATA,
+				&response,           // HTTP response
+				NULL,                // pReserved1
+				&bytesSent,          // bytes sent (optional)
+				NULL,                // pReserved2
+				0,                   // Reserved3
+				NULL,                // LPOVERLAPPED
+				NULL                 // pReserved4
+			);
 
-		if (hTempFile == INVALID_HANDLE_VALUE)
+		RecordSend(result, response.StatusCode, bytesSent);
+
+		if (result != NO_ERROR)
 		{
-			result = GetLastError();
-			wprintf(L"Could not create temporary file. Error %lu \n", result);
+			wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
 			goto Done;
 		}
 
 		do
 		{
+			ChunkCount = 0;
+			SendFlags = HTTP_SEND_RESPONSE_FLAG_MORE_DATA;
+
 			//
 			// Read the entity chunk from the request.
 			//
@@ -720,142 +1476,96 @@ SendHttpPostResponse(
 				NULL
 			);
 
-			switch (result)
+			if (result != NO_ERROR && result != ERROR_HANDLE_EOF)
 			{
-			case NO_ERROR:
+				StatAdd(thread_stats->io_errors, 1);
+				wprintf(L"HttpReceiveRequestEntityBody failed with %lu \n",
+					result);
+				goto Done;
+			}
 
-				if (BytesRead != 0)
+			if (BytesRead != 0)
+			{
+				if (Chunked)
 				{
-					TotalBytesRead += BytesRead;
-					WriteFile(
-						hTempFile,
-						pEntityBuffer,
-						BytesRead,
-						&TempFileBytesWritten,
-						NULL
+					StringCchPrintfA(
+						szChunkSize,
+						sizeof(szChunkSize),
+						"%lx\r\n",
+						BytesRead
 					);
-				}
-				break;
 
-			case ERROR_HANDLE_EOF:
+					dataChunks[ChunkCount].DataChunkType = HttpDataChunkFromMemory;
+					dataChunks[ChunkCount].FromMemory.pBuffer = szChunkSize;
+					dataChunks[ChunkCount].FromMemory.BufferLength = (ULONG)strlen(szChunkSize);
+					ChunkCount++;
+				}
 
-				//
-				// We have read the last request entity body. We can send
-				// back a response.
-				//
-				// To illustrate entity sends via
-				// HttpSendResponseEntityBody, we will send the response
-				// over multiple calls. This is achieved by passing the
-				// HTTP_SEND_RESPONSE_FLAG_MORE_DATA flag.
+				dataChunks[ChunkCount].DataChunkType = HttpDataChunkFromMemory;
+				dataChunks[ChunkCount].FromMemory.pBuffer = pEntityBuffer;
+				dataChunks[ChunkCount].FromMemory.BufferLength = BytesRead;
+				ChunkCount++;
 
-				if (BytesRead != 0)
+				if (Chunked)
 				{
-					TotalBytesRead += BytesRead;
-					WriteFile(
-						hTempFile,
-						pEntityBuffer,
-						BytesRead,
-						&TempFileBytesWritten,
-						NULL
-					);
+					dataChunks[ChunkCount].DataChunkType = HttpDataChunkFromMemory;
+					dataChunks[ChunkCount].FromMemory.pBuffer = ChunkTrailer;
+					dataChunks[ChunkCount].FromMemory.BufferLength = sizeof(ChunkTrailer) - 1;
+					ChunkCount++;
 				}
+			}
 
+			if (result == ERROR_HANDLE_EOF)
+			{
 				//
-				// Since we are sending the response over multiple API
-				// calls, we have to add a content-length.
-				//
-				// Alternatively, we could have sent using chunked transfer
-				// encoding, by passing "Transfer-Encoding: Chunked".
-				//
-
-				// NOTE: Since we are accumulating the TotalBytesRead in
-				//       a ULONG, this will not work for entity bodies that
-				//       are larger than 4 GB. For supporting large entity
-				//       bodies, we would have to use a ULONGLONG.
+				// We have read the last request entity body. Send what is
+				// left along with the terminating chunk.
 				//
+				SendFlags = Chunked ? 0 : HTTP_SEND_RESPONSE_FLAG_DISCONNECT;
 
-
-				StringCchPrintfA(
-					szContentLength,
-					sizeof(szContentLength),
-					"%lu",
-					TotalBytesRead
-				);
-
-				ADD_KNOWN_HEADER(
-					response,
-					HttpHeaderContentLength,
-					szContentLength
-				);
-
-				result =
-					HttpSendHttpResponse(
-						hReqQueue,           // ReqQueueHandle
-						pRequest->RequestId, // Request ID
-						HTTP_SEND_RESPONSE_FLAG_MORE_DATA,
-						&response,           // HTTP response
-						NULL,                // pReserved1
-						&bytesSent,          // bytes sent (optional)
-						NULL,                // pReserved2
-						0,                   // Reserved3
-						NULL,                // LPOVERLAPPED
-						NULL                 // pReserved4
-					);
-
-				if (result != NO_ERROR)
+				if (Chunked)
 				{
-					wprintf(L"HttpSendHttpResponse failed with %lu \n",
-						result);
-					goto Done;
+					dataChunks[ChunkCount].DataChunkType = HttpDataChunkFromMemory;
+					dataChunks[ChunkCount].FromMemory.pBuffer = LastChunk;
+					dataChunks[ChunkCount].FromMemory.BufferLength = sizeof(LastChunk) - 1;
+					ChunkCount++;
 				}
+			}
 
-				//
-				// Send entity body from a file handle.
-				//
-				dataChunk.DataChunkType =
-					HttpDataChunkFromFileHandle;
-
-				dataChunk.FromFileHandle.
-					ByteRange.StartingOffset.QuadPart = 0;
+			if (ChunkCount == 0 && (SendFlags & HTTP_SEND_RESPONSE_FLAG_MORE_DATA))
+			{
+				continue;
+			}
 
-				dataChunk.FromFileHandle.
-					ByteRange.Length.QuadPart = HTTP_BYTE_RANGE_TO_EOF;
+			//
+			// The send completes before we receive into the buffer again,
+			// so the data chunks can point straight at it.
+			//
+			result = HttpSendResponseEntityBody(
+				hReqQueue,
+				pRequest->RequestId,
+				SendFlags,
+				ChunkCount,
+				ChunkCount ? dataChunks : NULL,
+				&bytesSent,
+				NULL,
+				0,
+				NULL,
+				NULL
+			);
 
-				dataChunk.FromFileHandle.FileHandle = hTempFile;
+			RecordSend(result, 0, bytesSent);
 
-				result = HttpSendResponseEntityBody(
-					hReqQueue,
-					pRequest->RequestId,
-					0,                    // This is the last send.
-					1,                    // Entity Chunk Count.
-					&dataChunk,
-					NULL,
-					NULL,
-					0,
-					NULL,
-					NULL
+			if (result != NO_ERROR)
+			{
+				wprintf(
+					L"HttpSendResponseEntityBody failed with %lu \n",
+					result
 				);
-
-				if (result != NO_ERROR)
-				{
-					wprintf(
-						L"HttpSendResponseEntityBody failed with %lu \n",
-						result
-					);
-				}
-
-				goto Done;
-
-				break;
-
-
-			default:
-				wprintf(L"HttpReceiveRequestEntityBody failed with %lu \n",
-					result);
 				goto Done;
 			}
 
-		} while (TRUE);
+		} while (SendFlags & HTTP_SEND_RESPONSE_FLAG_MORE_DATA);
 	}
 	else
 	{
@@ -874,6 +1584,9 @@ SendHttpPostResponse(
 			NULL,                // LPOVERLAPPED
 			NULL                 // pReserved4
 		);
+
+		RecordSend(result, response.StatusCode, bytesSent);
+
 		if (result != NO_ERROR)
 		{
 			wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
@@ -884,14 +1597,1231 @@ Done:
 
 	if (pEntityBuffer)
 	{
-		FREE_MEM(pEntityBuffer);
+		pPool->release(pEntityBuffer, EntityBufferCapacity);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /sync - sends the fixed greeting.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleSync(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	//wprintf(L"Got a GET request for %ws \n",
+			//pContext->pRequest->CookedUrl.pFullUrl);
+
+	return SendHttpResponse(
+		pContext->hReqQueue,
+		pContext->pRequest,
+		&SyncResponse
+	);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /plaintext - the TechEmpower plaintext test: "Hello, World!" as
+	text/plain. The rules allow the body to be reused, so it is a
+	response built at startup. http.sys adds the Server and Date headers
+	the rules ask for.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandlePlaintext(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	return SendHttpResponse(
+		pContext->hReqQueue,
+		pContext->pRequest,
+		&PlaintextResponse
+	);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /json - the TechEmpower JSON test: {"message":"Hello, World!"},
+	serialized afresh for every request as the rules require, into a
+	buffer from the thread's pool.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleJson(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	HTTP_RESPONSE   response;
+	HTTP_DATA_CHUNK dataChunk;
+	DWORD           result;
+	DWORD           bytesSent = 0;
+	size_t          capacity;
+	PCHAR           pBuffer = (PCHAR)pContext->pPool->allocate(json_buffer_size, &capacity);
+
+	if (pBuffer == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	json_writer writer(pBuffer, capacity);
+
+	writer.begin_object();
+	writer.key("message");
+	writer.value("Hello, World!");
+	writer.end_object();
+
+	INITIALIZE_HTTP_RESPONSE(&response, 200, "OK");
+	ADD_KNOWN_HEADER(response, HttpHeaderContentType, "application/json");
+
+	dataChunk.DataChunkType = HttpDataChunkFromMemory;
+	dataChunk.FromMemory.pBuffer = pBuffer;
+	dataChunk.FromMemory.BufferLength = (ULONG)writer.size();
+
+	response.EntityChunkCount = 1;
+	response.pEntityChunks = &dataChunk;
+
+	result = HttpSendHttpResponse(
+		pContext->hReqQueue,           // ReqQueueHandle
+		pContext->pRequest->RequestId, // Request ID
+		0,                             // Flags
+		&response,                     // HTTP response
+		NULL,                          // pReserved1
+		&bytesSent,                    // bytes sent   (OPTIONAL)
+		NULL,                          // pReserved2   (must be NULL)
+		0,                             // Reserved3    (must be 0)
+		NULL,                          // LPOVERLAPPED (OPTIONAL)
+		NULL                           // pReserved4   (must be NULL)
+	);
+
+	pContext->pPool->release(pBuffer, capacity);
+	RecordSend(result, response.StatusCode, bytesSent);
+
+	if (result != NO_ERROR)
+	{
+		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	POST /sync - echoes the entity body back.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleEcho(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	wprintf(L"Got a POST request for %ws \n",
+		pContext->pRequest->CookedUrl.pFullUrl);
+
+	return SendHttpPostResponse(
+		pContext->hReqQueue,
+		pContext->pRequest,
+		pContext->pPool
+	);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	/kill - answers like GET /sync (or echoes a POST). The load tester
+	sends request_thread_count of them when it is done; the last one
+	shuts the request queue down, which ends every receiving thread.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleKill(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	DWORD result;
+
+	if (pContext->pRequest->Verb == HttpVerbPOST)
+	{
+		result = HandleEcho(pContext);
+	}
+	else
+	{
+		result = HandleSync(pContext);
+	}
+
+	if (++KillRequests == request_thread_count)
+	{
+		HttpShutdownRequestQueue(pContext->hReqQueue);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Returns the cached entry for a file under FileRoot, opening it (or
+	reopening it if it changed on disk) as needed. Metadata is trusted
+	for file_revalidate_seconds between checks.
+
+Arguments:
+	Path - Path relative to FileRoot, already checked by DecodeFilePath.
+
+Return Value:
+	The entry, or NULL if the file cannot be opened.
+
+--***************************************************************************/
+std::shared_ptr<FILE_ENTRY>
+OpenCachedFile(
+	IN const std::string& Path
+)
+{
+	std::shared_ptr<FILE_ENTRY> pEntry;
+	ULONGLONG now = GetTickCount64();
+	WCHAR szPath[MAX_PATH];
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	size_t rootLength;
+	int pathLength;
+
+	AcquireSRWLockShared(&FileCacheLock);
+
+	auto it = FileCache.find(Path);
+	if (it != FileCache.end())
+	{
+		pEntry = it->second;
+	}
+
+	ReleaseSRWLockShared(&FileCacheLock);
+
+	if (pEntry && now - pEntry->CheckedTick < file_revalidate_seconds * 1000ull)
+	{
+		return pEntry;
+	}
+
+	//
+	// Build "<root>\<path>" with Windows separators.
+	//
+	StringCchCopyW(szPath, _countof(szPath), FileRoot);
+	StringCchCatW(szPath, _countof(szPath), L"\\");
+	rootLength = wcslen(szPath);
+
+	pathLength = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, Path.data(), (int)Path.size(),
+		szPath + rootLength, (int)(_countof(szPath) - rootLength - 1));
+
+	if (pathLength <= 0)
+	{
+		return NULL;
+	}
+
+	szPath[rootLength + pathLength] = L'\0';
+
+	for (WCHAR* p = szPath + rootLength; *p; p++)
+	{
+		if (*p == L'/')
+			*p = L'\\';
+	}
+
+	if (pEntry)
+	{
+		//
+		// Still the same file?
+		//
+		if (GetFileAttributesExW(szPath, GetFileExInfoStandard, &attributes) &&
+			CompareFileTime(&attributes.ftLastWriteTime, &pEntry->LastWriteTime) == 0 &&
+			(((ULONGLONG)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow) == pEntry->Size)
+		{
+			pEntry->CheckedTick = now;
+			return pEntry;
+		}
+	}
+
+	HANDLE hFile = CreateFileW(
+		szPath,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL
+	);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	BY_HANDLE_FILE_INFORMATION information;
+	SYSTEMTIME lastWrite;
+
+	if (!GetFileInformationByHandle(hFile, &information) ||
+		(information.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		CloseHandle(hFile);
+		return NULL;
+	}
+
+	pEntry = std::make_shared<FILE_ENTRY>();
+	pEntry->hFile = hFile;
+	pEntry->Size = ((ULONGLONG)information.nFileSizeHigh << 32) | information.nFileSizeLow;
+	pEntry->LastWriteTime = information.ftLastWriteTime;
+	pEntry->CheckedTick = now;
+
+	FileTimeToSystemTime(&information.ftLastWriteTime, &lastWrite);
+
+	static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	StringCchPrintfA(
+		pEntry->szLastModified,
+		sizeof(pEntry->szLastModified),
+		"%s, %02u %s %u %02u:%02u:%02u GMT",
+		days[lastWrite.wDayOfWeek],
+		lastWrite.wDay,
+		months[lastWrite.wMonth - 1],
+		lastWrite.wYear,
+		lastWrite.wHour,
+		lastWrite.wMinute,
+		lastWrite.wSecond
+	);
+
+	AcquireSRWLockExclusive(&FileCacheLock);
+
+	if (FileCache.size() >= max_cached_files && FileCache.find(Path) == FileCache.end())
+	{
+		FileCache.erase(FileCache.begin());
+	}
+
+	FileCache[Path] = pEntry;
+
+	ReleaseSRWLockExclusive(&FileCacheLock);
+
+	return pEntry;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET/HEAD /files/<path> - serves a file from FileRoot, whole or as a
+	single byte range. The body is a file-handle data chunk, so http.sys
+	sends it from the file system cache without copying it through this
+	process.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleFile(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	PHTTP_REQUEST   pRequest = pContext->pRequest;
+	HTTP_RESPONSE   response;
+	HTTP_DATA_CHUNK dataChunk;
+	DWORD           result;
+	DWORD           bytesSent = 0;
+	std::string     path;
+	std::string_view urlPath = RawUrlPath(pRequest);
+	std::shared_ptr<FILE_ENTRY> pEntry;
+	ULONGLONG       first = 0;
+	ULONGLONG       length;
+	byte_range_result range = range_none;
+	CHAR            szContentRange[80];
+	CHAR            szContentLength[24];
+
+	if (!DecodeFilePath(urlPath.substr(files_prefix.size()), &path) ||
+		(pEntry = OpenCachedFile(path)) == NULL)
+	{
+		return SendHttpResponse(pContext->hReqQueue, pRequest, &NotFoundResponse);
+	}
+
+	length = pEntry->Size;
+
+	if (pRequest->Headers.KnownHeaders[HttpHeaderRange].RawValueLength != 0)
+	{
+		range = ParseByteRange(
+			std::string_view(pRequest->Headers.KnownHeaders[HttpHeaderRange].pRawValue,
+				pRequest->Headers.KnownHeaders[HttpHeaderRange].RawValueLength),
+			pEntry->Size,
+			&first,
+			&length);
+	}
+
+	switch (range)
+	{
+	case range_satisfiable:
+		INITIALIZE_HTTP_RESPONSE(&response, 206, "Partial Content");
+		StringCchPrintfA(szContentRange, sizeof(szContentRange), "bytes %I64u-%I64u/%I64u",
+			first, first + length - 1, pEntry->Size);
+		ADD_KNOWN_HEADER(response, HttpHeaderContentRange, szContentRange);
+		break;
+
+	case range_unsatisfiable:
+		INITIALIZE_HTTP_RESPONSE(&response, 416, "Range Not Satisfiable");
+		StringCchPrintfA(szContentRange, sizeof(szContentRange), "bytes */%I64u",
+			pEntry->Size);
+		ADD_KNOWN_HEADER(response, HttpHeaderContentRange, szContentRange);
+		length = 0;
+		break;
+
+	default:
+		INITIALIZE_HTTP_RESPONSE(&response, 200, "OK");
+		break;
+	}
+
+	ADD_KNOWN_HEADER(response, HttpHeaderContentType, ContentTypeForPath(path).data());
+	ADD_KNOWN_HEADER(response, HttpHeaderAcceptRanges, "bytes");
+	ADD_KNOWN_HEADER(response, HttpHeaderLastModified, pEntry->szLastModified);
+
+	if (pRequest->Verb == HttpVerbHEAD || length == 0)
+	{
+		StringCchPrintfA(szContentLength, sizeof(szContentLength), "%I64u", length);
+		ADD_KNOWN_HEADER(response, HttpHeaderContentLength, szContentLength);
 	}
+	else
+	{
+		dataChunk.DataChunkType = HttpDataChunkFromFileHandle;
+		dataChunk.FromFileHandle.ByteRange.StartingOffset.QuadPart = first;
+		dataChunk.FromFileHandle.ByteRange.Length.QuadPart = length;
+		dataChunk.FromFileHandle.FileHandle = pEntry->hFile;
+
+		response.EntityChunkCount = 1;
+		response.pEntityChunks = &dataChunk;
+	}
+
+	result = HttpSendHttpResponse(
+		pContext->hReqQueue,  // ReqQueueHandle
+		pRequest->RequestId,  // Request ID
+		0,                    // Flags
+		&response,            // HTTP response
+		NULL,                 // pReserved1
+		&bytesSent,           // bytes sent   (OPTIONAL)
+		NULL,                 // pReserved2   (must be NULL)
+		0,                    // Reserved3    (must be 0)
+		NULL,                 // LPOVERLAPPED (OPTIONAL)
+		NULL                  // pReserved4   (must be NULL)
+	);
+
+	RecordSend(result, response.StatusCode, bytesSent);
 
-	if (INVALID_HANDLE_VALUE != hTempFile)
+	if (result != NO_ERROR)
 	{
-		CloseHandle(hTempFile);
-		DeleteFile(szTempName);
+		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
 	}
 
 	return result;
 }
+
+/***************************************************************************++
+
+Routine Description:
+	GET /stats - reports the counters and latency histograms of all
+	server threads as JSON (see server_stats.h). The threads' stats are
+	summed without locking, so scraping under load does not slow them.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleStats(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	HTTP_RESPONSE   response;
+	HTTP_DATA_CHUNK dataChunk;
+	DWORD           result;
+	DWORD           bytesSent = 0;
+	std::string     report;
+
+	FormatServerStats(&report);
+
+	INITIALIZE_HTTP_RESPONSE(&response, 200, "OK");
+	ADD_KNOWN_HEADER(response, HttpHeaderContentType, "application/json");
+
+	dataChunk.DataChunkType = HttpDataChunkFromMemory;
+	dataChunk.FromMemory.pBuffer = report.data();
+	dataChunk.FromMemory.BufferLength = (ULONG)report.size();
+
+	response.EntityChunkCount = 1;
+	response.pEntityChunks = &dataChunk;
+
+	result = HttpSendHttpResponse(
+		pContext->hReqQueue,           // ReqQueueHandle
+		pContext->pRequest->RequestId, // Request ID
+		0,                             // Flags
+		&response,                     // HTTP response
+		NULL,                          // pReserved1
+		&bytesSent,                    // bytes sent   (OPTIONAL)
+		NULL,                          // pReserved2   (must be NULL)
+		0,                             // Reserved3    (must be 0)
+		NULL,                          // LPOVERLAPPED (OPTIONAL)
+		NULL                           // pReserved4   (must be NULL)
+	);
+
+	RecordSend(result, response.StatusCode, bytesSent);
+
+	if (result != NO_ERROR)
+	{
+		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET/PUT/DELETE /kv/<key> - reads, stores or deletes a value in the
+	in-process store. The key is the raw path after the prefix, up to any
+	query string. GET copies the value into a pool buffer without taking
+	a lock; PUT answers 201 for a new key and 200 for a replaced one.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleKv(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	PHTTP_REQUEST   pRequest = pContext->pRequest;
+	HTTP_RESPONSE   response;
+	HTTP_DATA_CHUNK dataChunk;
+	DWORD           result;
+	DWORD           bytesSent = 0;
+	std::string_view key = RawUrlPath(pRequest).substr(kv_prefix.size());
+	size_t          capacity;
+	size_t          length;
+	ULONG           received;
+	PSTATIC_RESPONSE pStaticResponse;
+	PUCHAR          pBuffer;
+
+	key = key.substr(0, key.find('?'));
+
+	if (key.empty() || key.size() > kv_max_key)
+	{
+		return SendHttpResponse(pContext->hReqQueue, pRequest, &BadRequestResponse);
+	}
+
+	if (pRequest->Verb == HttpVerbDELETE)
+	{
+		return SendHttpResponse(
+			pContext->hReqQueue,
+			pRequest,
+			KeyValues.erase(key) ? &StoredResponse : &NotFoundResponse
+		);
+	}
+
+	pBuffer = (PUCHAR)pContext->pPool->allocate(kv_max_value, &capacity);
+
+	if (pBuffer == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (pRequest->Verb == HttpVerbPUT)
+	{
+		result = ReceiveEntity(
+			pContext->hReqQueue,
+			pRequest,
+			pBuffer,
+			(ULONG)kv_max_value,
+			&received
+		);
+
+		if (result == NO_ERROR)
+		{
+			switch (KeyValues.put(key, std::string_view((PCHAR)pBuffer, received)))
+			{
+			case kv_created:  pStaticResponse = &CreatedResponse; break;
+			case kv_replaced: pStaticResponse = &StoredResponse; break;
+			default:          pStaticResponse = &ContentTooLargeResponse; break;
+			}
+		}
+		else if (result == ERROR_MORE_DATA)
+		{
+			pStaticResponse = &ContentTooLargeResponse;
+		}
+		else
+		{
+			pContext->pPool->release(pBuffer, capacity);
+			return result;
+		}
+
+		pContext->pPool->release(pBuffer, capacity);
+		return SendHttpResponse(pContext->hReqQueue, pRequest, pStaticResponse);
+	}
+
+	if (!KeyValues.get(key, (PCHAR)pBuffer, kv_max_value, &length))
+	{
+		pContext->pPool->release(pBuffer, capacity);
+		return SendHttpResponse(pContext->hReqQueue, pRequest, &NotFoundResponse);
+	}
+
+	INITIALIZE_HTTP_RESPONSE(&response, 200, "OK");
+	ADD_KNOWN_HEADER(response, HttpHeaderContentType, "application/octet-stream");
+
+	dataChunk.DataChunkType = HttpDataChunkFromMemory;
+	dataChunk.FromMemory.pBuffer = pBuffer;
+	dataChunk.FromMemory.BufferLength = (ULONG)length;
+
+	response.EntityChunkCount = 1;
+	response.pEntityChunks = &dataChunk;
+
+	result = HttpSendHttpResponse(
+		pContext->hReqQueue,           // ReqQueueHandle
+		pRequest->RequestId,           // Request ID
+		0,                             // Flags
+		&response,                     // HTTP response
+		NULL,                          // pReserved1
+		&bytesSent,                    // bytes sent   (OPTIONAL)
+		NULL,                          // pReserved2   (must be NULL)
+		0,                             // Reserved3    (must be 0)
+		NULL,                          // LPOVERLAPPED (OPTIONAL)
+		NULL                           // pReserved4   (must be NULL)
+	);
+
+	pContext->pPool->release(pBuffer, capacity);
+	RecordSend(result, response.StatusCode, bytesSent);
+
+	if (result != NO_ERROR)
+	{
+		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	POST/PUT /sink - takes an upload of any size and answers with its
+	length and CRC32C as {"bytes":N,"crc32c":"xxxxxxxx"}. The body is
+	read into a buffer of the thread's, sink_buffer_size bytes at a time,
+	and checksummed there.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleSink(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	static thread_local std::unique_ptr<UCHAR[]> pSinkBuffer;
+	PHTTP_REQUEST   pRequest = pContext->pRequest;
+	HTTP_RESPONSE   response;
+	HTTP_DATA_CHUNK dataChunk;
+	DWORD           result = NO_ERROR;
+	DWORD           bytesSent = 0;
+	ULONG           bytesRead;
+	ULONGLONG       length = 0;
+	uint32_t        crc = 0;
+	CHAR            body[64];
+	CHAR            hex[8];
+
+	if (pSinkBuffer == NULL)
+	{
+		pSinkBuffer.reset(new UCHAR[sink_buffer_size]);
+	}
+
+	while ((pRequest->Flags & HTTP_REQUEST_FLAG_MORE_ENTITY_BODY_EXISTS) &&
+		result != ERROR_HANDLE_EOF)
+	{
+		//
+		// FILL_BUFFER makes http.sys wait until the buffer is full or the
+		// body ends, rather than returning whatever has arrived so far.
+		//
+		bytesRead = 0;
+		result = HttpReceiveRequestEntityBody(
+			pContext->hReqQueue,
+			pRequest->RequestId,
+			HTTP_RECEIVE_REQUEST_ENTITY_BODY_FLAG_FILL_BUFFER,
+			pSinkBuffer.get(),
+			(ULONG)sink_buffer_size,
+			&bytesRead,
+			NULL
+		);
+
+		if (result != NO_ERROR && result != ERROR_HANDLE_EOF)
+		{
+			StatAdd(thread_stats->io_errors, 1);
+			wprintf(L"HttpReceiveRequestEntityBody failed with %lu \n", result);
+			return result;
+		}
+
+		crc = Crc32c(crc, pSinkBuffer.get(), bytesRead);
+		length += bytesRead;
+	}
+
+	json_writer writer(body, sizeof(body));
+
+	Crc32cToHex(crc, hex);
+
+	writer.begin_object();
+	writer.key("bytes");
+	writer.value((uint64_t)length);
+	writer.key("crc32c");
+	writer.value(std::string_view(hex, sizeof(hex)));
+	writer.end_object();
+
+	INITIALIZE_HTTP_RESPONSE(&response, 200, "OK");
+	ADD_KNOWN_HEADER(response, HttpHeaderContentType, "application/json");
+
+	dataChunk.DataChunkType = HttpDataChunkFromMemory;
+	dataChunk.FromMemory.pBuffer = body;
+	dataChunk.FromMemory.BufferLength = (ULONG)writer.size();
+
+	response.EntityChunkCount = 1;
+	response.pEntityChunks = &dataChunk;
+
+	result = HttpSendHttpResponse(
+		pContext->hReqQueue,           // ReqQueueHandle
+		pRequest->RequestId,           // Request ID
+		0,                             // Flags
+		&response,                     // HTTP response
+		NULL,                          // pReserved1
+		&bytesSent,                    // bytes sent   (OPTIONAL)
+		NULL,                          // pReserved2   (must be NULL)
+		0,                             // Reserved3    (must be 0)
+		NULL,                          // LPOVERLAPPED (OPTIONAL)
+		NULL                           // pReserved4   (must be NULL)
+	);
+
+	RecordSend(result, response.StatusCode, bytesSent);
+
+	if (result != NO_ERROR)
+	{
+		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
+	}
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /ws - opens a WebSocket that echoes every message back. The 101
+	response is sent opaque, after which http.sys passes the connection's
+	bytes through untouched in both directions, and the session is handed
+	to the WebSocket pool. Once MaxWebSocketSessions are open, upgrades
+	are refused with 503.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+DWORD
+HandleWebSocket(
+	IN PREQUEST_CONTEXT pContext
+)
+{
+	PHTTP_REQUEST       pRequest = pContext->pRequest;
+	HTTP_RESPONSE       response;
+	HTTP_UNKNOWN_HEADER acceptHeader;
+	DWORD               result;
+	DWORD               bytesSent = 0;
+	CHAR                accept[websocket_accept_length];
+	std::string_view    version;
+	std::string_view    key;
+
+	auto known = [pRequest](HTTP_HEADER_ID id)
+	{
+		return std::string_view(pRequest->Headers.KnownHeaders[id].pRawValue,
+			pRequest->Headers.KnownHeaders[id].RawValueLength);
+	};
+
+	for (USHORT i = 0; i < pRequest->Headers.UnknownHeaderCount; i++)
+	{
+		const HTTP_UNKNOWN_HEADER& header = pRequest->Headers.pUnknownHeaders[i];
+		std::string_view value(header.pRawValue, header.RawValueLength);
+
+		if (header.NameLength == sizeof("Sec-WebSocket-Version") - 1 &&
+			_strnicmp(header.pName, "Sec-WebSocket-Version", header.NameLength) == 0)
+		{
+			version = value;
+		}
+		else if (header.NameLength == sizeof("Sec-WebSocket-Key") - 1 &&
+			_strnicmp(header.pName, "Sec-WebSocket-Key", header.NameLength) == 0)
+		{
+			key = value;
+		}
+	}
+
+	if (pRequest->Version.MajorVersion != 1 || pRequest->Version.MinorVersion < 1 ||
+		(pRequest->Flags & HTTP_REQUEST_FLAG_MORE_ENTITY_BODY_EXISTS) ||
+		!WebSocketIsUpgrade(known(HttpHeaderUpgrade), known(HttpHeaderConnection), version, key))
+	{
+		return SendHttpResponse(pContext->hReqQueue, pRequest, &BadRequestResponse);
+	}
+
+	AcquireSRWLockExclusive(&WebSocketLock);
+
+	bool admitted = !WebSocketStopping && WebSocketPool.Sessions < MaxWebSocketSessions;
+
+	if (admitted)
+	{
+		WebSocketPool.Sessions++;
+	}
+
+	ReleaseSRWLockExclusive(&WebSocketLock);
+
+	if (!admitted)
+	{
+		return SendHttpResponse(pContext->hReqQueue, pRequest, &ServiceUnavailableResponse);
+	}
+
+	WebSocketAcceptKey(key, accept);
+
+	INITIALIZE_HTTP_RESPONSE(&response, 101, "Switching Protocols");
+	ADD_KNOWN_HEADER(response, HttpHeaderUpgrade, "websocket");
+	ADD_KNOWN_HEADER(response, HttpHeaderConnection, "Upgrade");
+
+	acceptHeader.pName = "Sec-WebSocket-Accept";
+	acceptHeader.NameLength = (USHORT)strlen(acceptHeader.pName);
+	acceptHeader.pRawValue = accept;
+	acceptHeader.RawValueLength = (USHORT)sizeof(accept);
+
+	response.Headers.UnknownHeaderCount = 1;
+	response.Headers.pUnknownHeaders = &acceptHeader;
+
+	result = HttpSendHttpResponse(
+		pContext->hReqQueue,           // ReqQueueHandle
+		pRequest->RequestId,           // Request ID
+		HTTP_SEND_RESPONSE_FLAG_OPAQUE | HTTP_SEND_RESPONSE_FLAG_MORE_DATA,
+		&response,                     // HTTP response
+		NULL,                          // pReserved1
+		&bytesSent,                    // bytes sent   (OPTIONAL)
+		NULL,                          // pReserved2   (must be NULL)
+		0,                             // Reserved3    (must be 0)
+		NULL,                          // LPOVERLAPPED (OPTIONAL)
+		NULL                           // pReserved4   (must be NULL)
+	);
+
+	RecordSend(result, response.StatusCode, bytesSent);
+
+	AcquireSRWLockExclusive(&WebSocketLock);
+
+	if (result != NO_ERROR)
+	{
+		WebSocketPool.Sessions--;
+		ReleaseSRWLockExclusive(&WebSocketLock);
+
+		wprintf(L"HttpSendHttpResponse failed with %lu \n", result);
+		return result;
+	}
+
+	//
+	// Every admitted session that is not running has a thread coming for
+	// it: an idle one, or one started here. The admission limit keeps the
+	// threads to MaxWebSocketSessions.
+	//
+	WebSocketPool.Waiting.push_back(pRequest->RequestId);
+
+	if (WebSocketPool.Idle < WebSocketPool.Waiting.size())
+	{
+		WebSocketPool.Threads.emplace_back(WebSocketThread, pContext->hReqQueue);
+	}
+
+	ReleaseSRWLockExclusive(&WebSocketLock);
+	WakeConditionVariable(&WebSocketReady);
+
+	return NO_ERROR;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	A WebSocket pool thread. Runs the sessions HandleWebSocket admits, one
+	at a time, until StopWebSocketSessions finds it waiting for another.
+
+Arguments:
+	hReqQueue - Handle to the request queue.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+VOID
+WebSocketThread(
+	IN HANDLE hReqQueue
+)
+{
+	RegisterStatsThread();
+
+	AcquireSRWLockExclusive(&WebSocketLock);
+
+	for (;;)
+	{
+		while (WebSocketPool.Waiting.empty() && !WebSocketStopping)
+		{
+			WebSocketPool.Idle++;
+			SleepConditionVariableSRW(&WebSocketReady, &WebSocketLock, INFINITE, 0);
+			WebSocketPool.Idle--;
+		}
+
+		//
+		// Sessions still waiting when the pool stops are run too; they see
+		// WebSocketStopping and disconnect at once.
+		//
+		if (WebSocketPool.Waiting.empty())
+		{
+			break;
+		}
+
+		HTTP_REQUEST_ID requestId = WebSocketPool.Waiting.front();
+
+		WebSocketPool.Waiting.erase(WebSocketPool.Waiting.begin());
+		ReleaseSRWLockExclusive(&WebSocketLock);
+
+		RunWebSocketSession(hReqQueue, requestId);
+
+		AcquireSRWLockExclusive(&WebSocketLock);
+		WebSocketPool.Sessions--;
+	}
+
+	ReleaseSRWLockExclusive(&WebSocketLock);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Ends the open WebSocket sessions and joins the pool's threads, once
+	the receiving threads have finished. A session blocked in a receive
+	or send is woken by cancelling the I/O on the queue, which is repeated
+	until all have finished, in case one was between calls.
+
+Arguments:
+	hReqQueue - Handle to the request queue.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+VOID
+StopWebSocketSessions(
+	IN HANDLE hReqQueue
+)
+{
+	AcquireSRWLockExclusive(&WebSocketLock);
+	WebSocketStopping = true;
+	ReleaseSRWLockExclusive(&WebSocketLock);
+
+	WakeAllConditionVariable(&WebSocketReady);
+
+	for (;;)
+	{
+		AcquireSRWLockShared(&WebSocketLock);
+
+		size_t sessions = WebSocketPool.Sessions;
+
+		ReleaseSRWLockShared(&WebSocketLock);
+
+		if (sessions == 0)
+		{
+			break;
+		}
+
+		CancelIoEx(hReqQueue, NULL);
+		Sleep(100);
+	}
+
+	//
+	// No other thread touches the pool now.
+	//
+	for (auto & t : WebSocketPool.Threads)
+	{
+		t.join();
+	}
+
+	WebSocketPool.Threads.clear();
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Echoes a WebSocket client's messages until it closes the session.
+	Data frames are echoed as their bytes arrive, and every echo is sent
+	before the next receive, so a client that doesn't read is not read
+	from either.
+
+Arguments:
+	hReqQueue - Handle to the request queue.
+	RequestId - The /ws request, answered with an opaque 101.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+VOID
+RunWebSocketSession(
+	IN HANDLE hReqQueue,
+	IN HTTP_REQUEST_ID RequestId
+)
+{
+	std::unique_ptr<CHAR[]> pBuffer(new CHAR[websocket_buffer_size]);
+	websocket_echo  echo;
+	std::string     out;
+	HTTP_DATA_CHUNK dataChunk;
+	DWORD           result = NO_ERROR;
+	DWORD           bytesSent;
+	ULONG           bytesRead;
+	size_t          pending = 0;
+	uint64_t        messages = 0;
+
+	while (!echo.closed() && !WebSocketStopping)
+	{
+		bytesRead = 0;
+		result = HttpReceiveRequestEntityBody(
+			hReqQueue,
+			RequestId,
+			0,
+			pBuffer.get() + pending,
+			(ULONG)(websocket_buffer_size - pending),
+			&bytesRead,
+			NULL
+		);
+
+		if (result == ERROR_HANDLE_EOF ||
+			(result == ERROR_OPERATION_ABORTED && (KillRequests >= request_thread_count || WebSocketStopping)))
+		{
+			//
+			// The client went away, /kill shut the queue down, or
+			// StopWebSocketSessions cancelled the receive.
+			//
+			break;
+		}
+
+		if (result != NO_ERROR)
+		{
+			StatAdd(thread_stats->io_errors, 1);
+			wprintf(L"HttpReceiveRequestEntityBody failed with %lu \n", result);
+			break;
+		}
+
+		//
+		// What is left over is the start of a frame header or a control
+		// frame, a few dozen bytes at most.
+		//
+		pending += bytesRead;
+
+		size_t used = echo.consume(pBuffer.get(), pending, out, &messages);
+
+		StatAdd(thread_stats->ws_messages, messages);
+		messages = 0;
+
+		memmove(pBuffer.get(), pBuffer.get() + used, pending - used);
+		pending -= used;
+
+		if (out.empty())
+		{
+			continue;
+		}
+
+		dataChunk.DataChunkType = HttpDataChunkFromMemory;
+		dataChunk.FromMemory.pBuffer = out.data();
+		dataChunk.FromMemory.BufferLength = (ULONG)out.size();
+
+		//
+		// Once our Close is out, the connection is done.
+		//
+		result = HttpSendResponseEntityBody(
+			hReqQueue,
+			RequestId,
+			echo.closed() ? HTTP_SEND_RESPONSE_FLAG_DISCONNECT : HTTP_SEND_RESPONSE_FLAG_MORE_DATA,
+			1,
+			&dataChunk,
+			&bytesSent,
+			NULL,
+			0,
+			NULL,
+			NULL
+		);
+
+		RecordSend(result, 0, bytesSent);
+		out.clear();
+
+		if (result != NO_ERROR)
+		{
+			wprintf(L"HttpSendResponseEntityBody failed with %lu \n", result);
+			break;
+		}
+	}
+
+	//
+	// Otherwise end the response, which closes the connection.
+	//
+	if (!echo.closed() || result != NO_ERROR)
+	{
+		HttpSendResponseEntityBody(hReqQueue, RequestId, HTTP_SEND_RESPONSE_FLAG_DISCONNECT,
+			0, NULL, NULL, NULL, 0, NULL, NULL);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Reads a whole request entity body into a buffer.
+
+Arguments:
+	hReqQueue      - Handle to the request queue.
+	pRequest       - The parsed HTTP request.
+	pBuffer        - Receives the body.
+	BufferLength   - Size of pBuffer.
+	pBytesReceived - Receives the length of the body.
+
+Return Value:
+	NO_ERROR, ERROR_MORE_DATA if the body does not fit, or the error
+	receiving it.
+
+--***************************************************************************/
+DWORD
+ReceiveEntity(
+	IN HANDLE hReqQueue,
+	IN PHTTP_REQUEST pRequest,
+	OUT PUCHAR pBuffer,
+	IN ULONG BufferLength,
+	OUT PULONG pBytesReceived
+)
+{
+	DWORD           result;
+	ULONG           bytesRead;
+	UCHAR           spill[16];
+
+	*pBytesReceived = 0;
+
+	if (!(pRequest->Flags & HTTP_REQUEST_FLAG_MORE_ENTITY_BODY_EXISTS))
+	{
+		return NO_ERROR;
+	}
+
+	for (;;)
+	{
+		//
+		// Once the buffer is full, read on into a scratch one: the body
+		// may end exactly at the buffer's end.
+		//
+		BOOL full = *pBytesReceived == BufferLength;
+
+		bytesRead = 0;
+		result = HttpReceiveRequestEntityBody(
+			hReqQueue,
+			pRequest->RequestId,
+			0,
+			full ? spill : pBuffer + *pBytesReceived,
+			full ? (ULONG)sizeof(spill) : BufferLength - *pBytesReceived,
+			&bytesRead,
+			NULL
+		);
+
+		if (result != NO_ERROR && result != ERROR_HANDLE_EOF)
+		{
+			StatAdd(thread_stats->io_errors, 1);
+			wprintf(L"HttpReceiveRequestEntityBody failed with %lu \n", result);
+			return result;
+		}
+
+		if (full && bytesRead != 0)
+		{
+			return ERROR_MORE_DATA;
+		}
+
+		*pBytesReceived += bytesRead;
+
+		if (result == ERROR_HANDLE_EOF)
+		{
+			return NO_ERROR;
+		}
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Counts a send in the calling thread's stats.
+
+Arguments:
+	Result     - What the send returned.
+	StatusCode - The response status, or 0 for more of a response body.
+	BytesSent  - Bytes http.sys reported sent.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+VOID
+RecordSend(
+	IN DWORD Result,
+	IN USHORT StatusCode,
+	IN DWORD BytesSent
+)
+{
+	if (Result != NO_ERROR)
+	{
+		StatAdd(thread_stats->io_errors, 1);
+		return;
+	}
+
+	StatAdd(thread_stats->bytes_out, BytesSent);
+
+	if (StatusCode != 0)
+	{
+		thread_stats->record_status(StatusCode);
+	}
+}
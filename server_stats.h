@@ -0,0 +1,313 @@
+//
+// Per-thread server metrics and the /stats report.
+//
+// Every server thread claims its own server_thread_stats block, aligned to
+// cache lines so no two threads ever write the same line, and is the only
+// thread that writes it. Counters are bumped with a relaxed load and
+// store instead of a locked read-modify-write, so recording a request
+// costs a few plain adds. A /stats request sums the blocks of all threads
+// without locking anything; the totals it reports can be a request or two
+// apart from field to field under load, but no writer ever waits for it.
+//
+// Latencies go into a log-linear histogram: values below 8 have a bucket
+// each, and every power of two above that is split into 8 linear buckets,
+// so any recorded value is known to within 12.5%.
+//
+
+#ifndef __SERVER_STATS__
+#define __SERVER_STATS__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <string>
+
+const unsigned histogram_sub_bucket_bits = 3;
+const size_t histogram_sub_buckets = (size_t)1 << histogram_sub_bucket_bits;
+const size_t histogram_bucket_count = (64 - histogram_sub_bucket_bits + 1) * histogram_sub_buckets;
+
+//
+// Status codes 100-599 are counted individually.
+//
+const unsigned stats_first_status = 100;
+const unsigned stats_status_count = 500;
+
+//
+// Threads that can claim a block of their own, in slots 1 and up. Slot 0
+// is shared by any thread that records without having claimed one.
+//
+const size_t max_stats_threads = 128;
+
+inline size_t
+HistogramBucket(
+	uint64_t value
+)
+{
+	if (value < histogram_sub_buckets)
+		return (size_t)value;
+
+	unsigned shift = (unsigned)std::bit_width(value) - 1 - histogram_sub_bucket_bits;
+
+	return (size_t)(shift + 1) * histogram_sub_buckets +
+		(size_t)((value >> shift) & (histogram_sub_buckets - 1));
+}
+
+//
+// Smallest and largest value that falls into a bucket.
+//
+inline uint64_t
+HistogramBucketLow(
+	size_t bucket
+)
+{
+	if (bucket < histogram_sub_buckets)
+		return bucket;
+
+	unsigned shift = (unsigned)(bucket / histogram_sub_buckets) - 1;
+
+	return (uint64_t)(histogram_sub_buckets + bucket % histogram_sub_buckets) << shift;
+}
+
+inline uint64_t
+HistogramBucketHigh(
+	size_t bucket
+)
+{
+	if (bucket < histogram_sub_buckets)
+		return bucket;
+
+	unsigned shift = (unsigned)(bucket / histogram_sub_buckets) - 1;
+
+	return HistogramBucketLow(bucket) + (((uint64_t)1 << shift) - 1);
+}
+
+//
+// Bumps a counter that only the calling thread writes.
+//
+inline void
+StatAdd(
+	std::atomic<uint64_t>& counter,
+	uint64_t value
+)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+struct alignas(64) server_thread_stats
+{
+	std::atomic<uint64_t> requests;
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> bytes_out;
+	std::atomic<uint64_t> buffer_regrowths;   // request buffer too small, grown and received again
+	std::atomic<uint64_t> io_errors;          // failed receives and sends
+	std::atomic<uint64_t> timeouts;           // connections closed for a timeout
+	std::atomic<uint64_t> shed;               // requests refused by admission control
+	std::atomic<uint64_t> ws_messages;        // WebSocket messages echoed on /ws
+	std::atomic<uint64_t> tls_full;           // TLS handshakes that created a session
+	std::atomic<uint64_t> tls_resumed;        // TLS handshakes that resumed one
+	std::atomic<uint64_t> ktls;               // TLS connections sending through kernel TLS
+	std::atomic<uint64_t> latency_sum_ns;
+	std::atomic<uint64_t> status[stats_status_count];
+	std::atomic<uint64_t> latency[histogram_bucket_count];   // receive to send, ns
+
+	void record_status(unsigned code)
+	{
+		if (code - stats_first_status < stats_status_count)
+			StatAdd(status[code - stats_first_status], 1);
+	}
+
+	void record_latency(std::chrono::steady_clock::duration elapsed)
+	{
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+		StatAdd(latency[HistogramBucket(ns)], 1);
+		StatAdd(latency_sum_ns, ns);
+	}
+};
+
+inline server_thread_stats stats_slots[max_stats_threads + 1];
+inline std::atomic<size_t> stats_slots_used{ 1 };
+
+//
+// The calling thread's block; slot 0 until it calls RegisterStatsThread.
+//
+inline thread_local server_thread_stats* thread_stats = &stats_slots[0];
+
+/***************************************************************************++
+
+Routine Description:
+	Gives the calling thread a stats block of its own. Once all are taken,
+	further threads keep sharing slot 0, whose counts may then lose the
+	odd update.
+
+Arguments:
+	None.
+
+Return Value:
+	The thread's block, also left in thread_stats.
+
+--***************************************************************************/
+inline server_thread_stats*
+RegisterStatsThread()
+{
+	size_t slot = stats_slots_used.fetch_add(1, std::memory_order_relaxed);
+
+	thread_stats = slot <= max_stats_threads ? &stats_slots[slot] : &stats_slots[0];
+	return thread_stats;
+}
+
+//
+// Value below which the given fraction of the counts fall, as the upper
+// end of its bucket.
+//
+inline uint64_t
+HistogramPercentile(
+	const uint64_t* pCounts,
+	uint64_t total,
+	double fraction
+)
+{
+	uint64_t rank = (uint64_t)(fraction * (double)total + 0.5);
+	uint64_t seen = 0;
+
+	if (rank == 0)
+		rank = 1;
+
+	for (size_t i = 0; i < histogram_bucket_count; i++)
+	{
+		seen += pCounts[i];
+
+		if (seen >= rank)
+			return HistogramBucketHigh(i);
+	}
+
+	return 0;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sums the stats of every thread and formats them as the /stats JSON
+	document: totals, responses by status code, receive-to-send latency
+	percentiles in microseconds, the non-empty histogram buckets as
+	[lowest ns, count] pairs, and requests per registered thread; the
+	shared slot 0 only counts towards the totals.
+
+Arguments:
+	pOut - Receives the document.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+inline void
+FormatServerStats(
+	std::string* pOut
+)
+{
+	uint64_t requests = 0, bytesIn = 0, bytesOut = 0, regrowths = 0, ioErrors = 0, timeouts = 0, shed = 0, latencySum = 0;
+	uint64_t wsMessages = 0, tlsFull = 0, tlsResumed = 0, ktls = 0;
+	uint64_t status[stats_status_count] = {};
+	uint64_t latency[histogram_bucket_count] = {};
+	uint64_t latencyCount = 0;
+	size_t threads = stats_slots_used.load(std::memory_order_relaxed);
+	char buffer[256];
+
+	if (threads > max_stats_threads + 1)
+		threads = max_stats_threads + 1;
+
+	for (size_t t = 0; t < threads; t++)
+	{
+		const server_thread_stats& stats = stats_slots[t];
+
+		requests += stats.requests.load(std::memory_order_relaxed);
+		bytesIn += stats.bytes_in.load(std::memory_order_relaxed);
+		bytesOut += stats.bytes_out.load(std::memory_order_relaxed);
+		regrowths += stats.buffer_regrowths.load(std::memory_order_relaxed);
+		ioErrors += stats.io_errors.load(std::memory_order_relaxed);
+		timeouts += stats.timeouts.load(std::memory_order_relaxed);
+		shed += stats.shed.load(std::memory_order_relaxed);
+		wsMessages += stats.ws_messages.load(std::memory_order_relaxed);
+		tlsFull += stats.tls_full.load(std::memory_order_relaxed);
+		tlsResumed += stats.tls_resumed.load(std::memory_order_relaxed);
+		ktls += stats.ktls.load(std::memory_order_relaxed);
+		latencySum += stats.latency_sum_ns.load(std::memory_order_relaxed);
+
+		for (size_t i = 0; i < stats_status_count; i++)
+			status[i] += stats.status[i].load(std::memory_order_relaxed);
+
+		for (size_t i = 0; i < histogram_bucket_count; i++)
+			latency[i] += stats.latency[i].load(std::memory_order_relaxed);
+	}
+
+	for (size_t i = 0; i < histogram_bucket_count; i++)
+		latencyCount += latency[i];
+
+	auto append = [&](const char* format, auto... args)
+	{
+		int length = snprintf(buffer, sizeof(buffer), format, args...);
+		pOut->append(buffer, length);
+	};
+
+	pOut->clear();
+
+	append("{\"requests\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+		"\"buffer_regrowths\":%llu,\"io_errors\":%llu,\"timeouts\":%llu,\"shed\":%llu,\"ws_messages\":%llu,",
+		(unsigned long long)requests, (unsigned long long)bytesIn, (unsigned long long)bytesOut,
+		(unsigned long long)regrowths, (unsigned long long)ioErrors, (unsigned long long)timeouts,
+		(unsigned long long)shed, (unsigned long long)wsMessages);
+
+	append("\"tls_full\":%llu,\"tls_resumed\":%llu,\"ktls\":%llu,\"status\":{",
+		(unsigned long long)tlsFull, (unsigned long long)tlsResumed, (unsigned long long)ktls);
+
+	const char* separator = "";
+
+	for (size_t i = 0; i < stats_status_count; i++)
+	{
+		if (status[i] != 0)
+		{
+			append("%s\"%u\":%llu", separator, (unsigned)(stats_first_status + i),
+				(unsigned long long)status[i]);
+			separator = ",";
+		}
+	}
+
+	append("},\"latency_us\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,",
+		(unsigned long long)latencyCount,
+		latencyCount ? latencySum / 1000.0 / latencyCount : 0.0,
+		HistogramPercentile(latency, latencyCount, 0.50) / 1000.0,
+		HistogramPercentile(latency, latencyCount, 0.90) / 1000.0);
+
+	append("\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},\"latency_buckets_ns\":[",
+		HistogramPercentile(latency, latencyCount, 0.99) / 1000.0,
+		HistogramPercentile(latency, latencyCount, 0.999) / 1000.0,
+		HistogramPercentile(latency, latencyCount, 1.0) / 1000.0);
+
+	separator = "";
+
+	for (size_t i = 0; i < histogram_bucket_count; i++)
+	{
+		if (latency[i] != 0)
+		{
+			append("%s[%llu,%llu]", separator, (unsigned long long)HistogramBucketLow(i),
+				(unsigned long long)latency[i]);
+			separator = ",";
+		}
+	}
+
+	pOut->append("],\"thread_requests\":[");
+
+	for (size_t t = 1; t < threads; t++)
+	{
+		append(t > 1 ? ",%llu" : "%llu",
+			(unsigned long long)stats_slots[t].requests.load(std::memory_order_relaxed));
+	}
+
+	pOut->append("]}");
+}
+
+#endif
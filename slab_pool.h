@@ -0,0 +1,150 @@
+//
+// Per-thread buffer pool with fixed size classes.
+//
+// Request and entity buffers are recycled through a free list per size
+// class instead of going back to the heap, and they are handed out as-is
+// (not cleared). Each class keeps only a bounded number of free buffers,
+// and requests larger than the biggest class come straight from the heap
+// and go straight back, so a rare huge request does not leave a huge
+// buffer behind.
+//
+// A pool is not thread safe; give each worker thread its own. Its memory
+// comes from malloc unless it is given another slab_backing, such as a
+// heap private to a thread pinned to one NUMA node.
+//
+
+#ifndef __SLAB_POOL__
+#define __SLAB_POOL__
+
+#include <stdlib.h>
+
+const size_t slab_class_count = 3;
+const size_t slab_class_sizes[slab_class_count] = { 2 * 1024, 16 * 1024, 64 * 1024 };
+const size_t slab_class_max_free[slab_class_count] = { 64, 8, 2 };
+
+struct slab_pool_stats
+{
+	size_t allocations[slab_class_count + 1];       // last entry is oversize
+	size_t heap_allocations[slab_class_count + 1];
+	size_t outstanding[slab_class_count + 1];
+	size_t high_water[slab_class_count + 1];
+};
+
+struct slab_backing
+{
+	void* (*allocate)(void* context, size_t size);
+	void (*release)(void* context, void* p);
+	void* context;
+
+	static void* MallocAllocate(void*, size_t size) { return ::malloc(size); }
+	static void MallocRelease(void*, void* p) { ::free(p); }
+};
+
+const slab_backing malloc_backing = { slab_backing::MallocAllocate, slab_backing::MallocRelease, nullptr };
+
+struct slab_pool
+{
+	struct free_block
+	{
+		free_block* next;
+	};
+
+	free_block* free_lists[slab_class_count] = {};
+	size_t free_counts[slab_class_count] = {};
+	slab_pool_stats stats = {};
+	slab_backing backing = malloc_backing;
+
+	slab_pool() = default;
+	explicit slab_pool(const slab_backing& source) : backing(source) {}
+	slab_pool(const slab_pool&) = delete;
+	slab_pool& operator=(const slab_pool&) = delete;
+
+	~slab_pool()
+	{
+		for (size_t i = 0; i < slab_class_count; i++)
+		{
+			while (free_lists[i])
+			{
+				free_block* block = free_lists[i];
+				free_lists[i] = block->next;
+				backing.release(backing.context, block);
+			}
+		}
+	}
+
+	static size_t class_of(size_t size)
+	{
+		for (size_t i = 0; i < slab_class_count; i++)
+		{
+			if (size <= slab_class_sizes[i])
+				return i;
+		}
+
+		return slab_class_count;
+	}
+
+	//
+	// Returns a buffer of at least size bytes and stores its real
+	// capacity in *pCapacity. The contents are not initialized.
+	//
+	void* allocate(size_t size, size_t* pCapacity)
+	{
+		size_t c = class_of(size);
+		void* p;
+
+		stats.allocations[c] += 1;
+
+		if (c < slab_class_count && free_lists[c])
+		{
+			free_block* block = free_lists[c];
+			free_lists[c] = block->next;
+			free_counts[c] -= 1;
+			p = block;
+		}
+		else
+		{
+			p = backing.allocate(backing.context, c < slab_class_count ? slab_class_sizes[c] : size);
+
+			if (p == nullptr)
+				return nullptr;
+
+			stats.heap_allocations[c] += 1;
+		}
+
+		stats.outstanding[c] += 1;
+
+		if (stats.outstanding[c] > stats.high_water[c])
+			stats.high_water[c] = stats.outstanding[c];
+
+		*pCapacity = c < slab_class_count ? slab_class_sizes[c] : size;
+		return p;
+	}
+
+	//
+	// Returns a buffer obtained from allocate; capacity is the value that
+	// allocate reported.
+	//
+	void release(void* p, size_t capacity)
+	{
+		if (p == nullptr)
+			return;
+
+		size_t c = class_of(capacity);
+
+		stats.outstanding[c] -= 1;
+
+		if (c < slab_class_count && free_counts[c] < slab_class_max_free[c])
+		{
+			free_block* block = static_cast<free_block*>(p);
+			block->next = free_lists[c];
+			free_lists[c] = block;
+			free_counts[c] += 1;
+		}
+		else
+		{
+			backing.release(backing.context, p);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,1021 @@
+//
+// Coroutine route handlers: starting, resuming and cancelling them, and
+// the per-thread timers and descriptor waits they suspend on.
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <mutex>
+
+#include "async_handler.h"
+#include "http2_session.h"
+#include "response_cache.h"
+
+const int max_async_events = 64;
+
+//
+// A coroutine handler in flight on a connection.
+//
+struct async_call
+{
+	connection* pConnection;
+	async_request request;               // declared first: the frame refers to it
+	task<http_response> handler_task;
+	std::coroutine_handle<> body_waiter; // suspended in read_body
+	bool on_pool;                        // suspended in run_on_pool
+	bool suspended;                      // outlived the request's receive pass
+	std::chrono::steady_clock::time_point started;
+};
+
+//
+// Pool jobs that have run and are waiting for their thread to resume
+// them. Workers add to it and signal the eventfd; it is shared with the
+// jobs in flight so a worker never posts to a freed queue.
+//
+struct pool_completions
+{
+	int event_fd = -1;
+	std::mutex lock;
+	std::vector<pool_job*> jobs;    // under lock
+	bool closed = false;            // under lock: the thread has exited
+
+	~pool_completions()
+	{
+		if (event_fd >= 0)
+			close(event_fd);
+	}
+};
+
+static thread_local int async_epoll_fd = -1;
+static thread_local int timer_fd = -1;
+static thread_local std::unique_ptr<timing_wheel> timers;
+static thread_local uint64_t timer_fd_tick = timing_wheel::never;   // what timer_fd is set for
+static thread_local std::shared_ptr<pool_completions> completions;
+
+//
+// The call whose coroutine is running, for awaiters to record, and where
+// RunAsyncEvents collects connections whose handler finished.
+//
+static thread_local async_call* current_call = nullptr;
+static thread_local std::vector<connection*>* finished_connections = nullptr;
+static thread_local std::vector<connection*>* expired_connections = nullptr;
+
+//
+// Connections of this thread with a handler running, for admission
+// control's in-flight limit.
+//
+static thread_local size_t calls_in_flight = 0;
+
+//
+// Timing wheel ticks are milliseconds of steady_clock (CLOCK_MONOTONIC).
+// Deadlines round up, so a timer never fires early.
+//
+static uint64_t
+TickAt(
+	std::chrono::steady_clock::time_point time,
+	bool round_up
+)
+{
+	auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+
+	return (uint64_t)(since_epoch / 1000000) + (round_up && since_epoch % 1000000 != 0 ? 1 : 0);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Creates the calling thread's timer, descriptor-wait and pool
+	completion instance.
+
+Arguments:
+	None.
+
+Return Value:
+	A descriptor that becomes readable when RunAsyncEvents has work to
+	do, or -1 on failure.
+
+--***************************************************************************/
+int
+InitializeAsyncEvents()
+{
+	epoll_event ev = {};
+	epoll_event completion_ev = {};
+
+	async_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	timers = std::make_unique<timing_wheel>(TickAt(std::chrono::steady_clock::now(), false));
+	timer_fd_tick = timing_wheel::never;
+	completions = std::make_shared<pool_completions>();
+	completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+
+	completion_ev.events = EPOLLIN;
+	completion_ev.data.ptr = completions.get();
+
+	if (async_epoll_fd < 0 || timer_fd < 0 || completions->event_fd < 0 ||
+		epoll_ctl(async_epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) != 0 ||
+		epoll_ctl(async_epoll_fd, EPOLL_CTL_ADD, completions->event_fd, &completion_ev) != 0)
+	{
+		printf("async event setup failed with %d \n", errno);
+		CleanupAsyncEvents();
+		return -1;
+	}
+
+	return async_epoll_fd;
+}
+
+void
+CleanupAsyncEvents()
+{
+	if (completions)
+	{
+		std::vector<pool_job*> jobs;
+
+		{
+			std::lock_guard<std::mutex> guard(completions->lock);
+			completions->closed = true;
+			jobs.swap(completions->jobs);
+		}
+
+		//
+		// Every connection has been closed by now, so this just frees the
+		// calls. Jobs still running are freed by their worker.
+		//
+		for (auto pJob : jobs)
+		{
+			pJob->resume();
+		}
+
+		completions.reset();
+	}
+
+	if (timer_fd >= 0)
+		close(timer_fd);
+
+	if (async_epoll_fd >= 0)
+		close(async_epoll_fd);
+
+	timers.reset();
+
+	timer_fd = -1;
+	async_epoll_fd = -1;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Points the thread's timerfd at the next tick the timing wheel has work
+	for, or disarms it if there is none. Skips the system call when that
+	has not changed.
+
+Arguments:
+	None.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+ArmTimer()
+{
+	itimerspec spec = {};
+	uint64_t tick = timers->next_event();
+
+	if (tick == timer_fd_tick)
+		return;
+
+	if (tick != timing_wheel::never)
+	{
+		spec.it_value.tv_sec = (time_t)(tick / 1000);
+		spec.it_value.tv_nsec = (long)(tick % 1000) * 1000000;
+
+		//
+		// A zero it_value disarms the timer.
+		//
+		if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+			spec.it_value.tv_nsec = 1;
+	}
+
+	timer_fd_tick = tick;
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Arms (or re-arms) a timer on the calling thread's timing wheel. Its
+	fire function runs from RunAsyncEvents. Moving a deadline later, as
+	connection timeouts do on every request, costs no system call.
+
+Arguments:
+	pTimer   - The timer.
+	deadline - When it fires.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+ArmThreadTimer(
+	wheel_timer* pTimer,
+	std::chrono::steady_clock::time_point deadline
+)
+{
+	if (!timers)
+		return;
+
+	timers->schedule(pTimer, TickAt(deadline, true));
+
+	if (pTimer->expires < timer_fd_tick)
+		ArmTimer();
+}
+
+void
+CancelThreadTimer(
+	wheel_timer* pTimer
+)
+{
+	if (timers)
+		timers->cancel(pTimer);
+}
+
+//
+// A connection timer went off; the engine closes the connection once
+// RunAsyncEvents returns.
+//
+void
+ConnectionTimerFired(
+	wheel_timer* pTimer
+)
+{
+	if (expired_connections != nullptr)
+		expired_connections->push_back(static_cast<connection_timer*>(pTimer)->pConnection);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Queues a coroutine handler's response on its connection and frees the
+	call.
+
+Arguments:
+	pCall - A call whose handler has finished.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+CompleteAsyncCall(
+	async_call* pCall
+)
+{
+	connection* pConnection = pCall->pConnection;
+	http_response response;
+
+	try
+	{
+		response = pCall->handler_task.result();
+	}
+	catch (...)
+	{
+		response = { 500, "text/plain", "Internal Server Error\r\n" };
+	}
+
+	//
+	// Handlers that finish straight away are timed with the other
+	// requests by HandleRequestBuffer.
+	//
+	if (pCall->suspended)
+		thread_stats->record_latency(std::chrono::steady_clock::now() - pCall->started);
+
+	pConnection->async = nullptr;
+	calls_in_flight--;
+	delete pCall;
+
+	SendHttpResponse(pConnection, response);
+
+	//
+	// An HTTP/2 stream's response goes out on its connection, where other
+	// streams may have finished already.
+	//
+	if (pConnection->stream != nullptr)
+		pConnection = FinishHttp2Stream(pConnection);
+
+	if (finished_connections != nullptr &&
+		std::find(finished_connections->begin(), finished_connections->end(), pConnection) ==
+			finished_connections->end())
+	{
+		finished_connections->push_back(pConnection);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Runs a call's coroutine until it next suspends, and completes the
+	call if the handler has finished.
+
+Arguments:
+	pCall  - The call.
+	handle - The suspended coroutine to resume (the handler itself or a
+	         task it is awaiting), or NULL to start the handler.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+RunAsyncCall(
+	async_call* pCall,
+	std::coroutine_handle<> handle
+)
+{
+	async_call* previous = current_call;
+
+	current_call = pCall;
+
+	if (handle)
+		handle.resume();
+	else
+		pCall->handler_task.start();
+
+	current_call = previous;
+
+	if (pCall->handler_task.done())
+	{
+		CompleteAsyncCall(pCall);
+	}
+	else
+	{
+		pCall->suspended = true;
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Starts a coroutine handler for a request. The request head and any
+	body received so far are copied so the handler can outlive the
+	receive buffer. If the handler finishes without suspending, its
+	response is queued before this returns.
+
+Arguments:
+	pConnection   - The connection the request arrived on.
+	request       - The parsed request.
+	head          - The raw request head that request points into.
+	entity        - The body, if body_complete.
+	body_complete - The whole body has arrived.
+	handler       - The coroutine handler.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+StartAsyncCall(
+	connection* pConnection,
+	const http_request& request,
+	std::string_view head,
+	std::string_view entity,
+	bool body_complete,
+	async_handler handler
+)
+{
+	if (!body_complete && request.content_length > max_async_body)
+	{
+		pConnection->close_after_send = true;
+		pConnection->body = {};
+		SendHttpResponse(pConnection, http_response{ 413, "text/plain", "Content Too Large\r\n" });
+		return;
+	}
+
+	async_call* pCall = new async_call{};
+	async_request& copy = pCall->request;
+
+	copy.head.assign(head.data(), head.size());
+	copy.parsed = request;
+	copy.body_complete = body_complete;
+
+	auto rebase = [&](std::string_view view)
+	{
+		return std::string_view(copy.head.data() + (view.data() - head.data()), view.size());
+	};
+
+	copy.parsed.method = rebase(request.method);
+	copy.parsed.path = rebase(request.path);
+
+	for (size_t i = 0; i < request.header_count; i++)
+	{
+		copy.parsed.headers[i].name = rebase(request.headers[i].name);
+		copy.parsed.headers[i].value = rebase(request.headers[i].value);
+	}
+
+	if (body_complete)
+		copy.body.assign(entity.data(), entity.size());
+	else
+		copy.body.reserve((size_t)request.content_length);
+
+	pCall->pConnection = pConnection;
+	pCall->started = std::chrono::steady_clock::now();
+	pCall->handler_task = handler(copy);
+	pConnection->async = pCall;
+	calls_in_flight++;
+
+	RunAsyncCall(pCall, nullptr);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Destroys a connection's suspended handler, if any, along with the
+	timers and waits it was suspended on. Called when the connection is
+	closed. A handler whose run_on_pool function is still running is
+	detached from the connection instead, and destroyed when the function
+	returns.
+
+Arguments:
+	pConnection - The connection.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+CancelAsyncCall(
+	connection* pConnection
+)
+{
+	async_call* pCall = pConnection->async;
+
+	pConnection->async = nullptr;
+
+	if (pCall != nullptr)
+		calls_in_flight--;
+
+	if (pCall != nullptr && pCall->on_pool)
+	{
+		pCall->pConnection = nullptr;
+		return;
+	}
+
+	delete pCall;
+}
+
+size_t
+AsyncCallsInFlight()
+{
+	return calls_in_flight;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Collects a piece of the request body for the connection's handler.
+
+Arguments:
+	pConnection - The connection.
+	pData       - Body bytes.
+	length      - Number of bytes at pData.
+
+Return Value:
+	false if the body is too big; the handler has then been cancelled and
+	a 413 queued, and the connection must be closed once it is sent.
+
+--***************************************************************************/
+bool
+AppendAsyncBody(
+	connection* pConnection,
+	const char* pData,
+	size_t length
+)
+{
+	async_request& request = pConnection->async->request;
+
+	if (request.body.size() + length > max_async_body)
+	{
+		CancelAsyncCall(pConnection);
+		pConnection->close_after_send = true;
+		SendHttpResponse(pConnection, http_response{ 413, "text/plain", "Content Too Large\r\n" });
+		return false;
+	}
+
+	request.body.append(pData, length);
+	return true;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Marks the connection's request body complete and resumes a handler
+	waiting for it.
+
+Arguments:
+	pConnection - The connection.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+FinishAsyncBody(
+	connection* pConnection
+)
+{
+	async_call* pCall = pConnection->async;
+
+	pCall->request.body_complete = true;
+
+	if (pCall->body_waiter)
+	{
+		RunAsyncCall(pCall, std::exchange(pCall->body_waiter, {}));
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Resumes the handlers whose timers expired, whose descriptors became
+	ready or whose pool jobs finished, and collects the connections whose
+	timeout passed. Called by the engine when the descriptor from
+	InitializeAsyncEvents is readable.
+
+Arguments:
+	pReady   - Receives the connections whose handler finished; their
+	           responses are queued and held-back requests can proceed.
+	pExpired - Receives the connections that timed out, to be closed.
+	           None of them is also in pReady.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+RunAsyncEvents(
+	std::vector<connection*>* pReady,
+	std::vector<connection*>* pExpired
+)
+{
+	epoll_event events[max_async_events];
+	int count = epoll_wait(async_epoll_fd, events, max_async_events, 0);
+
+	finished_connections = pReady;
+	expired_connections = pExpired;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (events[i].data.ptr == nullptr)
+		{
+			uint64_t expirations;
+			ssize_t ignored = read(timer_fd, &expirations, sizeof(expirations));
+			(void)ignored;
+			continue;
+		}
+
+		if (events[i].data.ptr == completions.get())
+		{
+			std::vector<pool_job*> jobs;
+			uint64_t posted;
+			ssize_t ignored = read(completions->event_fd, &posted, sizeof(posted));
+			(void)ignored;
+
+			{
+				std::lock_guard<std::mutex> guard(completions->lock);
+				jobs.swap(completions->jobs);
+			}
+
+			for (auto pJob : jobs)
+			{
+				pJob->resume();
+			}
+
+			continue;
+		}
+
+		static_cast<wait_for_fd*>(events[i].data.ptr)->fire(events[i].events);
+	}
+
+	timers->advance(TickAt(std::chrono::steady_clock::now(), false));
+	ArmTimer();
+
+	finished_connections = nullptr;
+	expired_connections = nullptr;
+}
+
+//
+// Responses formatted at request time.
+//
+static const char*
+ReasonPhrase(
+	int status
+)
+{
+	switch (status)
+	{
+	case 200: return "OK";
+	case 201: return "Created";
+	case 202: return "Accepted";
+	case 206: return "Partial Content";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 408: return "Request Timeout";
+	case 413: return "Content Too Large";
+	case 416: return "Range Not Satisfiable";
+	case 429: return "Too Many Requests";
+	case 500: return "Internal Server Error";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+	default:  return status < 400 ? "OK" : "Error";
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Formats a number onto a response with to_chars, which never looks
+	at the locale and needs no format string.
+
+Arguments:
+	out   - Receives the digits.
+	value - The number.
+	base  - 10, or 16 for chunk sizes.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+AppendNumber(
+	std::string& out,
+	uint64_t value,
+	int base
+)
+{
+	char number[24];
+	char* end = std::to_chars(number, number + sizeof(number), value, base).ptr;
+
+	out.append(number, end - number);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Response heads built at request time are assembled from pieces with
+	to_chars rather than printf, so a small dynamic response costs little
+	more than a cached one, and nothing is allocated once the output
+	buffer has grown. BeginResponseHead writes the status line and the
+	Server header and counts the status; EndResponseHead adds the Date,
+	Connection: close if the connection ends after this response, and
+	the blank line.
+
+Arguments:
+	pConnection - The connection to respond on.
+	status      - The status code.
+	name        - A header name, without the colon.
+	value       - Its value.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+BeginResponseHead(
+	connection* pConnection,
+	int status
+)
+{
+	std::string& out = pConnection->out;
+
+	out.append("HTTP/1.1 ");
+	AppendNumber(out, (uint64_t)status);
+	out.append(" ");
+	out.append(ReasonPhrase(status));
+	out.append("\r\n");
+	out.append(server_header);
+
+	thread_stats->record_status(status);
+}
+
+void
+AppendHeader(
+	connection* pConnection,
+	std::string_view name,
+	std::string_view value
+)
+{
+	std::string& out = pConnection->out;
+
+	out.append(name);
+	out.append(": ");
+	out.append(value);
+	out.append("\r\n");
+}
+
+void
+AppendHeader(
+	connection* pConnection,
+	std::string_view name,
+	uint64_t value
+)
+{
+	std::string& out = pConnection->out;
+
+	out.append(name);
+	out.append(": ");
+	AppendNumber(out, value);
+	out.append("\r\n");
+}
+
+void
+EndResponseHead(
+	connection* pConnection
+)
+{
+	std::string& out = pConnection->out;
+
+	out.append(GetDateHeader());
+
+	if (pConnection->close_after_send)
+		out.append("Connection: close\r\n");
+
+	out.append("\r\n");
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Formats a response built at request time onto the connection.
+
+Arguments:
+	pConnection - The connection to respond on.
+	status      - The status code.
+	contentType - The Content-Type.
+	entity      - The body.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SendHttpResponse(
+	connection* pConnection,
+	int status,
+	std::string_view contentType,
+	std::string_view entity
+)
+{
+	BeginResponseHead(pConnection, status);
+	AppendHeader(pConnection, "Content-Type", contentType);
+	AppendHeader(pConnection, "Content-Length", (uint64_t)entity.size());
+	EndResponseHead(pConnection);
+	pConnection->out.append(entity);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Formats a coroutine handler's response onto the connection.
+
+Arguments:
+	pConnection - The connection to respond on.
+	response    - The response.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SendHttpResponse(
+	connection* pConnection,
+	const http_response& response
+)
+{
+	SendHttpResponse(pConnection, response.status, response.content_type, response.body);
+}
+
+//
+// async_request
+//
+std::string_view
+async_request::header(
+	std::string_view name
+) const
+{
+	for (size_t i = 0; i < parsed.header_count; i++)
+	{
+		if (HeaderNameEquals(parsed.headers[i].name, name))
+			return parsed.headers[i].value;
+	}
+
+	return {};
+}
+
+std::string_view
+async_request::query(
+	std::string_view name
+) const
+{
+	std::string_view path = parsed.path;
+	auto start = path.find('?');
+
+	while (start != std::string_view::npos)
+	{
+		std::string_view rest = path.substr(start + 1);
+		auto end = rest.find('&');
+		std::string_view pair = rest.substr(0, end);
+
+		if (pair.size() > name.size() && pair.substr(0, name.size()) == name && pair[name.size()] == '=')
+			return pair.substr(name.size() + 1);
+
+		start = end == std::string_view::npos ? end : start + 1 + end;
+	}
+
+	return {};
+}
+
+//
+// sleep_for
+//
+sleep_for::sleep_for(
+	std::chrono::steady_clock::duration duration
+)
+	: wheel_timer(Fire), deadline_(std::chrono::steady_clock::now() + duration)
+{
+}
+
+sleep_for::~sleep_for()
+{
+	CancelThreadTimer(this);
+}
+
+bool
+sleep_for::await_ready() const noexcept
+{
+	return deadline_ <= std::chrono::steady_clock::now();
+}
+
+void
+sleep_for::await_suspend(
+	std::coroutine_handle<> handle
+)
+{
+	call_ = current_call;
+	handle_ = handle;
+	ArmThreadTimer(this, deadline_);
+}
+
+void
+sleep_for::await_resume() noexcept
+{
+}
+
+void
+sleep_for::Fire(
+	wheel_timer* pTimer
+)
+{
+	sleep_for* pSleep = static_cast<sleep_for*>(pTimer);
+
+	RunAsyncCall(pSleep->call_, pSleep->handle_);
+}
+
+//
+// read_body
+//
+void
+read_body::await_suspend(
+	std::coroutine_handle<> handle
+)
+{
+	current_call->body_waiter = handle;
+}
+
+//
+// pool_job
+//
+bool
+pool_job::queue(
+	work_pool* pPool,
+	std::coroutine_handle<> handle
+)
+{
+	//
+	// Outside a handler on an engine thread there is nobody to post back
+	// to; the function then runs inline in await_resume.
+	//
+	if (!completions || current_call == nullptr)
+		return false;
+
+	call_ = current_call;
+	handle_ = handle;
+	completions_ = completions;
+	call_->on_pool = true;
+
+	pPool->submit(this);
+	return true;
+}
+
+void
+pool_job::post()
+{
+	//
+	// Once the job is on the list its thread may resume and free it, so
+	// only locals are used after that.
+	//
+	std::shared_ptr<pool_completions> pCompletions = std::move(completions_);
+	async_call* pCall = call_;
+	bool closed;
+
+	{
+		std::lock_guard<std::mutex> guard(pCompletions->lock);
+		closed = pCompletions->closed;
+
+		if (!closed)
+			pCompletions->jobs.push_back(this);
+	}
+
+	if (closed)
+	{
+		//
+		// The thread has exited and closed the connection; the call (and
+		// this job, which lives in its coroutine frame) is ours to free.
+		//
+		delete pCall;
+		return;
+	}
+
+	uint64_t one = 1;
+	ssize_t ignored = write(pCompletions->event_fd, &one, sizeof(one));
+	(void)ignored;
+}
+
+void
+pool_job::resume()
+{
+	async_call* pCall = call_;
+
+	pCall->on_pool = false;
+
+	if (pCall->pConnection == nullptr)
+	{
+		delete pCall;
+		return;
+	}
+
+	RunAsyncCall(pCall, handle_);
+}
+
+//
+// wait_for_fd
+//
+wait_for_fd::~wait_for_fd()
+{
+	if (registered_)
+		epoll_ctl(async_epoll_fd, EPOLL_CTL_DEL, fd_, nullptr);
+}
+
+bool
+wait_for_fd::await_suspend(
+	std::coroutine_handle<> handle
+)
+{
+	epoll_event ev = {};
+
+	ev.events = events_ | EPOLLONESHOT;
+	ev.data.ptr = this;
+
+	if (epoll_ctl(async_epoll_fd, EPOLL_CTL_ADD, fd_, &ev) != 0)
+	{
+		result_ = -errno;
+		return false;
+	}
+
+	call_ = current_call;
+	handle_ = handle;
+	registered_ = true;
+	return true;
+}
+
+void
+wait_for_fd::fire(
+	uint32_t events
+)
+{
+	epoll_ctl(async_epoll_fd, EPOLL_CTL_DEL, fd_, nullptr);
+	registered_ = false;
+	result_ = (int)events;
+
+	RunAsyncCall(call_, handle_);
+}
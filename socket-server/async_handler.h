@@ -0,0 +1,348 @@
+//
+// Coroutine route handlers for the socket backend.
+//
+// A plain route handler runs to completion on the worker thread that
+// received the request. A handler that has to wait - for a timer, for the
+// rest of the request body, or for an upstream socket - is written as a
+// coroutine instead:
+//
+//	task<http_response> HandleSomething(async_request& request)
+//	{
+//		co_await read_body(request);
+//		co_await sleep_for(std::chrono::milliseconds(10));
+//		co_return http_response{ 200, "text/plain", request.body };
+//	}
+//
+// and routed through HandleAsync<HandleSomething>. While it is suspended
+// the thread goes back to its event loop and serves other connections.
+// Later requests pipelined on the same connection wait until the
+// response has been queued, so responses stay in order, and closing the
+// connection destroys the suspended coroutine.
+//
+// CPU-heavy work is handed to a work_pool with run_on_pool, so it doesn't
+// hold up the other connections on the thread.
+//
+// Timers, descriptor waits and finished pool jobs are kept in a
+// per-thread epoll instance. Each engine watches its descriptor (returned
+// by InitializeAsyncEvents) like any other and calls RunAsyncEvents when
+// it becomes readable. Timers, including the engines' connection
+// timeouts, live on a per-thread timing wheel (timing_wheel.h) behind a
+// single timerfd.
+//
+
+#ifndef __ASYNC_HANDLER__
+#define __ASYNC_HANDLER__
+
+#include <stdint.h>
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "server.h"
+#include "http_parser.h"
+#include "task.h"
+#include "work_pool.h"
+
+//
+// Largest request body collected for a coroutine handler; bigger bodies
+// are answered with 413.
+//
+const size_t max_async_body = 1024 * 1024;
+
+struct async_call;
+struct pool_completions;
+
+//
+// The request a coroutine handler gets. Unlike http_request it owns its
+// bytes, so it stays valid while the handler is suspended.
+//
+struct async_request
+{
+	std::string head;        // the request head as received
+	http_request parsed;     // views into head
+	std::string body;
+	bool body_complete;      // body holds all of it (see read_body)
+
+	std::string_view header(std::string_view name) const;
+	std::string_view query(std::string_view name) const;
+};
+
+struct http_response
+{
+	int status = 200;
+	std::string content_type = "text/plain";
+	std::string body;
+};
+
+typedef task<http_response> (*async_handler)(async_request& request);
+
+//
+// co_await sleep_for(duration) resumes the handler after the duration.
+//
+class sleep_for : private wheel_timer
+{
+public:
+	explicit sleep_for(std::chrono::steady_clock::duration duration);
+	sleep_for(const sleep_for&) = delete;
+	~sleep_for();
+
+	bool await_ready() const noexcept;
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() noexcept;
+
+private:
+	static void Fire(wheel_timer* pTimer);
+
+	std::chrono::steady_clock::time_point deadline_;
+	async_call* call_ = nullptr;
+	std::coroutine_handle<> handle_;
+};
+
+//
+// co_await read_body(request) resumes the handler once the whole request
+// body has arrived in request.body.
+//
+class read_body
+{
+public:
+	explicit read_body(async_request& request) : request_(request) {}
+
+	bool await_ready() const noexcept { return request_.body_complete; }
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() noexcept {}
+
+private:
+	async_request& request_;
+};
+
+//
+// co_await wait_for_fd(fd, EPOLLIN) resumes the handler once a descriptor
+// (for example a non-blocking upstream connection) is ready. The result
+// is the ready events, or -errno if the descriptor cannot be waited on.
+//
+class wait_for_fd
+{
+public:
+	wait_for_fd(int fd, uint32_t events) : fd_(fd), events_(events) {}
+	wait_for_fd(const wait_for_fd&) = delete;
+	~wait_for_fd();
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> handle);
+	int await_resume() noexcept { return result_; }
+
+	void fire(uint32_t events);
+
+private:
+	int fd_;
+	uint32_t events_;
+	int result_ = 0;
+	async_call* call_ = nullptr;
+	std::coroutine_handle<> handle_;
+	bool registered_ = false;
+};
+
+//
+// The part of run_on_pool that doesn't depend on the function: handing
+// the job to the pool, and passing it back to the thread that awaited it
+// once the function has run.
+//
+class pool_job : public work_item
+{
+public:
+	pool_job(const pool_job&) = delete;
+
+	void resume();
+
+protected:
+	explicit pool_job(void (*run)(work_item* pItem)) : work_item{ run } {}
+
+	bool queue(work_pool* pPool, std::coroutine_handle<> handle);
+	void post();
+
+private:
+	async_call* call_ = nullptr;
+	std::coroutine_handle<> handle_;
+	std::shared_ptr<pool_completions> completions_;
+};
+
+//
+// co_await run_on_pool(pPool, function) runs function() on one of the
+// pool's workers and resumes the handler with its result (or exception)
+// back on the thread that awaited it. The function may use ParallelFor to
+// spread itself over the pool. If the connection closes in the meantime
+// the handler is destroyed once the function returns. With a NULL pool
+// the function runs inline.
+//
+template <typename Function>
+class run_on_pool : private pool_job
+{
+public:
+	typedef std::invoke_result_t<Function&> result_type;
+
+	run_on_pool(work_pool* pPool, Function function)
+		: pool_job(Run), pool_(pPool), function_(std::move(function)) {}
+
+	bool await_ready() const noexcept { return pool_ == nullptr; }
+	bool await_suspend(std::coroutine_handle<> handle) { return queue(pool_, handle); }
+
+	result_type await_resume()
+	{
+		if (!ran_)
+			invoke();
+
+		if (exception_)
+			std::rethrow_exception(exception_);
+
+		if constexpr (!std::is_void_v<result_type>)
+			return std::move(*result_);
+	}
+
+private:
+	void invoke()
+	{
+		ran_ = true;
+
+		try
+		{
+			if constexpr (std::is_void_v<result_type>)
+				function_();
+			else
+				result_.emplace(function_());
+		}
+		catch (...)
+		{
+			exception_ = std::current_exception();
+		}
+	}
+
+	static void Run(work_item* pItem)
+	{
+		run_on_pool* pSelf = static_cast<run_on_pool*>(static_cast<pool_job*>(pItem));
+
+		pSelf->invoke();
+		pSelf->post();
+	}
+
+	work_pool* pool_;
+	Function function_;
+	bool ran_ = false;
+	std::optional<std::conditional_t<std::is_void_v<result_type>, char, result_type>> result_;
+	std::exception_ptr exception_;
+};
+
+//
+// Prototypes.
+//
+int
+InitializeAsyncEvents();
+
+void
+CleanupAsyncEvents();
+
+void
+RunAsyncEvents(
+	std::vector<connection*>* pReady,
+	std::vector<connection*>* pExpired
+);
+
+void
+ArmThreadTimer(
+	wheel_timer* pTimer,
+	std::chrono::steady_clock::time_point deadline
+);
+
+void
+CancelThreadTimer(
+	wheel_timer* pTimer
+);
+
+void
+ConnectionTimerFired(
+	wheel_timer* pTimer
+);
+
+void
+StartAsyncCall(
+	connection* pConnection,
+	const http_request& request,
+	std::string_view head,
+	std::string_view entity,
+	bool body_complete,
+	async_handler handler
+);
+
+void
+CancelAsyncCall(
+	connection* pConnection
+);
+
+size_t
+AsyncCallsInFlight();
+
+bool
+AppendAsyncBody(
+	connection* pConnection,
+	const char* pData,
+	size_t length
+);
+
+void
+FinishAsyncBody(
+	connection* pConnection
+);
+
+void
+AppendNumber(
+	std::string& out,
+	uint64_t value,
+	int base = 10
+);
+
+void
+BeginResponseHead(
+	connection* pConnection,
+	int status
+);
+
+void
+AppendHeader(
+	connection* pConnection,
+	std::string_view name,
+	std::string_view value
+);
+
+void
+AppendHeader(
+	connection* pConnection,
+	std::string_view name,
+	uint64_t value
+);
+
+void
+EndResponseHead(
+	connection* pConnection
+);
+
+void
+SendHttpResponse(
+	connection* pConnection,
+	int status,
+	std::string_view contentType,
+	std::string_view entity
+);
+
+void
+SendHttpResponse(
+	connection* pConnection,
+	const http_response& response
+);
+
+#endif
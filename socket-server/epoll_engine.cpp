@@ -0,0 +1,909 @@
+//
+// Readiness based engine: one epoll instance per worker thread.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include "server.h"
+#include "async_handler.h"
+#include "http2_session.h"
+#include "tls.h"
+
+const int max_epoll_events = 256;
+
+//
+// Largest piece of a streamed body moved per splice; the default pipe
+// capacity.
+//
+const size_t splice_chunk_size = 64 * 1024;
+
+//
+// File bodies up to this size go out in one writev together with the
+// headers, straight from the file's mapping; larger ones use sendfile.
+//
+const uint64_t writev_file_limit = 64 * 1024;
+
+struct epoll_connection : connection
+{
+	int pipe_fds[2];         // socket -> pipe -> socket for echoed bodies
+	size_t pipe_pending;     // body bytes in the pipe, not yet sent
+};
+
+//
+// send and recv, or their TLS counterparts on a connection from tls_port.
+//
+static ssize_t
+SendBytes(
+	connection* pConnection,
+	const char* pData,
+	size_t length,
+	int flags
+)
+{
+	if (pConnection->tls != nullptr)
+		return TlsSend(pConnection->tls, pData, length);
+
+	return send(pConnection->fd, pData, length, flags);
+}
+
+static ssize_t
+ReceiveBytes(
+	connection* pConnection,
+	char* pBuffer,
+	size_t length
+)
+{
+	if (pConnection->tls != nullptr)
+		return TlsReceive(pConnection->tls, pBuffer, length);
+
+	return recv(pConnection->fd, pBuffer, length, 0);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Writes as much pending response data as the socket will take.
+
+Arguments:
+	pConnection - The connection to flush.
+
+Return Value:
+	false if the connection failed and should be closed.
+
+--***************************************************************************/
+static bool
+FlushConnection(
+	connection* pConnection
+)
+{
+	while (pConnection->out_sent < pConnection->out.size())
+	{
+		ssize_t sent = SendBytes(pConnection,
+			pConnection->out.data() + pConnection->out_sent,
+			pConnection->out.size() - pConnection->out_sent,
+			MSG_NOSIGNAL);
+
+		if (sent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			StatAdd(thread_stats->io_errors, 1);
+			return false;
+		}
+
+		StatAdd(thread_stats->bytes_out, sent);
+		pConnection->out_sent += sent;
+	}
+
+	pConnection->out.clear();
+	pConnection->out_sent = 0;
+	return true;
+}
+
+static void
+CloseConnection(
+	int epoll_fd,
+	epoll_connection* pConnection
+)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pConnection->fd, NULL);
+
+	if (pConnection->tls != nullptr)
+		CloseTls(pConnection->tls);
+
+	close(pConnection->fd);
+	CancelAsyncCall(pConnection);
+	EndHttp2Session(pConnection);
+	CancelThreadTimer(&pConnection->timer);
+
+	if (pConnection->pipe_fds[0] >= 0)
+	{
+		close(pConnection->pipe_fds[0]);
+		close(pConnection->pipe_fds[1]);
+	}
+
+	delete pConnection;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Echoes a Content-Length request body by splicing it from the socket
+	into a pipe and from the pipe back into the socket, so the body never
+	passes through user space. Only the chunk framing goes through the
+	output buffer, which has to be empty before each splice out.
+
+Arguments:
+	pConnection - A connection with an echoed body and no buffered input.
+
+Return Value:
+	1 once the body is done, 0 if the socket would block, -1 on failure.
+
+--***************************************************************************/
+static int
+SpliceRequestBody(
+	epoll_connection* pConnection
+)
+{
+	if (pConnection->pipe_fds[0] < 0 &&
+		pipe2(pConnection->pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		pConnection->pipe_fds[0] = -1;
+		return -1;
+	}
+
+	for (;;)
+	{
+		if (!FlushConnection(pConnection))
+			return -1;
+
+		if (!pConnection->out.empty())
+			return 0;
+
+		if (pConnection->pipe_pending != 0)
+		{
+			ssize_t sent = splice(pConnection->pipe_fds[0], NULL, pConnection->fd, NULL,
+				pConnection->pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+			if (sent < 0)
+				return errno == EAGAIN ? 0 : -1;
+
+			StatAdd(thread_stats->bytes_out, sent);
+			pConnection->pipe_pending -= sent;
+
+			if (pConnection->pipe_pending != 0)
+				continue;
+
+			EndEchoChunk(pConnection);
+
+			if (pConnection->body.remaining == 0)
+			{
+				EndRequestBody(pConnection);
+				return FlushConnection(pConnection) ? 1 : -1;
+			}
+
+			continue;
+		}
+
+		size_t length = splice_chunk_size;
+
+		if (length > pConnection->body.remaining)
+			length = (size_t)pConnection->body.remaining;
+
+		ssize_t received = splice(pConnection->fd, NULL, pConnection->pipe_fds[1], NULL,
+			length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (received == 0)
+			return -1;
+
+		if (received < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		StatAdd(thread_stats->bytes_in, received);
+		pConnection->body.remaining -= received;
+		pConnection->pipe_pending = received;
+		BeginEchoChunk(pConnection, received);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Drains a Content-Length /sink upload from the socket into a large
+	buffer of the thread's, sink_receive_size bytes per recv rather than
+	the receive_chunk_size used for requests, and checksums it there.
+
+Arguments:
+	pConnection - A connection with a sunk body and no buffered input.
+
+Return Value:
+	1 once the body is done, 0 if the socket would block, -1 on failure.
+
+--***************************************************************************/
+static int
+DrainRequestBody(
+	epoll_connection* pConnection
+)
+{
+	static thread_local std::unique_ptr<char[]> buffer;
+
+	if (buffer == nullptr)
+		buffer.reset(new char[sink_receive_size]);
+
+	for (;;)
+	{
+		size_t length = sink_receive_size;
+
+		if (length > pConnection->body.remaining)
+			length = (size_t)pConnection->body.remaining;
+
+		ssize_t received = ReceiveBytes(pConnection, buffer.get(), length);
+
+		if (received == 0)
+			return -1;
+
+		if (received < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		StatAdd(thread_stats->bytes_in, received);
+		SinkRequestBody(pConnection, buffer.get(), received);
+		pConnection->body.remaining -= received;
+
+		if (pConnection->body.remaining == 0)
+		{
+			EndRequestBody(pConnection);
+			return FlushConnection(pConnection) ? 1 : -1;
+		}
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends the body of a /files/ response on a TLS connection. Where the
+	kernel does the record layer, the file goes out through SSL_sendfile
+	and is encrypted straight from the page cache. Otherwise it has to be
+	encrypted in user space: a small file is copied in behind the headers
+	so both go out in one record, and a big one is encrypted from the
+	file's mapping tls_file_chunk bytes at a time.
+
+Arguments:
+	pConnection - A TLS connection with a file body pending.
+
+Return Value:
+	1 once the file is sent, 0 if the socket would block, -1 on failure.
+
+--***************************************************************************/
+static int
+SendTlsFileData(
+	epoll_connection* pConnection
+)
+{
+	file_send& send_state = pConnection->file;
+	bool kernel = TlsKernelSend(pConnection->tls);
+
+	if (!kernel && send_state.remaining <= writev_file_limit)
+	{
+		pConnection->out.append(send_state.file->map + send_state.offset, (size_t)send_state.remaining);
+		send_state = {};
+		return 1;
+	}
+
+	while (send_state.remaining != 0)
+	{
+		if (!FlushConnection(pConnection))
+			return -1;
+
+		if (!pConnection->out.empty())
+			return 0;
+
+		ssize_t sent;
+
+		if (kernel)
+		{
+			size_t length = send_state.remaining > (1u << 30) ? (1u << 30) : (size_t)send_state.remaining;
+
+			sent = TlsSendFile(pConnection->tls, send_state.file->fd, (off_t)send_state.offset, length);
+
+			if (sent == 0)
+			{
+				// The file shrank under us.
+				return -1;
+			}
+		}
+		else
+		{
+			size_t length = send_state.remaining > tls_file_chunk ? tls_file_chunk : (size_t)send_state.remaining;
+
+			sent = TlsSend(pConnection->tls, send_state.file->map + send_state.offset, length);
+		}
+
+		if (sent < 0)
+		{
+			if (errno == EAGAIN)
+				return 0;
+
+			StatAdd(thread_stats->io_errors, 1);
+			return -1;
+		}
+
+		StatAdd(thread_stats->bytes_out, sent);
+		send_state.offset += sent;
+		send_state.remaining -= sent;
+	}
+
+	send_state = {};
+	return 1;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends the body of a /files/ response, and the headers in front of it,
+	without copying the file through user space. Small files are written
+	together with the headers by one writev from the mapping; big ones
+	follow the headers (sent with MSG_MORE) through sendfile.
+
+Arguments:
+	pConnection - A connection with a file body pending.
+
+Return Value:
+	1 once the file is sent, 0 if the socket would block, -1 on failure.
+
+--***************************************************************************/
+static int
+SendFileData(
+	epoll_connection* pConnection
+)
+{
+	file_send& send_state = pConnection->file;
+
+	if (pConnection->tls != nullptr)
+		return SendTlsFileData(pConnection);
+
+	while (send_state.remaining != 0)
+	{
+		size_t pending = pConnection->out.size() - pConnection->out_sent;
+		ssize_t sent;
+
+		if (send_state.remaining <= writev_file_limit)
+		{
+			iovec iov[2];
+
+			iov[0].iov_base = &pConnection->out[pConnection->out_sent];
+			iov[0].iov_len = pending;
+			iov[1].iov_base = const_cast<char*>(send_state.file->map + send_state.offset);
+			iov[1].iov_len = (size_t)send_state.remaining;
+
+			sent = writev(pConnection->fd, pending ? iov : iov + 1, pending ? 2 : 1);
+		}
+		else if (pending != 0)
+		{
+			sent = send(pConnection->fd, &pConnection->out[pConnection->out_sent],
+				pending, MSG_NOSIGNAL | MSG_MORE);
+		}
+		else
+		{
+			off_t offset = (off_t)send_state.offset;
+			size_t length = send_state.remaining > (1u << 30) ? (1u << 30) : (size_t)send_state.remaining;
+
+			sent = sendfile(pConnection->fd, send_state.file->fd, &offset, length);
+
+			if (sent == 0)
+			{
+				// The file shrank under us.
+				return -1;
+			}
+		}
+
+		if (sent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			StatAdd(thread_stats->io_errors, 1);
+			return -1;
+		}
+
+		StatAdd(thread_stats->bytes_out, sent);
+
+		size_t from_out = (size_t)sent < pending ? (size_t)sent : pending;
+
+		pConnection->out_sent += from_out;
+		send_state.offset += sent - from_out;
+		send_state.remaining -= sent - from_out;
+
+		if (pConnection->out_sent == pConnection->out.size())
+		{
+			pConnection->out.clear();
+			pConnection->out_sent = 0;
+		}
+	}
+
+	send_state = {};
+	return 1;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Receives from a connection's socket and sets receive_time. With
+	admission control on, connections carry SO_TIMESTAMPNS, so the time
+	the kernel received the data comes back with it, and how long it sat
+	in the socket waiting for this thread counts towards its queueing
+	delay. The kernel stamps it from CLOCK_REALTIME, so the delay is
+	measured on that clock and carried over to steady_clock. TLS
+	connections are not stamped.
+
+Arguments:
+	pConnection - The connection.
+	pBuffer     - Receives the data.
+	length      - Size of pBuffer.
+
+Return Value:
+	As recv.
+
+--***************************************************************************/
+static ssize_t
+ReceiveData(
+	connection* pConnection,
+	char* pBuffer,
+	size_t length
+)
+{
+	if (!admission.enabled || pConnection->tls != nullptr)
+	{
+		receive_time = std::chrono::steady_clock::now();
+		return ReceiveBytes(pConnection, pBuffer, length);
+	}
+
+	iovec iov = { pBuffer, length };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+	msghdr message = {};
+
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received = recvmsg(pConnection->fd, &message, 0);
+	auto now = std::chrono::steady_clock::now();
+
+	receive_time = now;
+
+	for (cmsghdr* pHeader = CMSG_FIRSTHDR(&message); received > 0 && pHeader != NULL;
+		pHeader = CMSG_NXTHDR(&message, pHeader))
+	{
+		if (pHeader->cmsg_level == SOL_SOCKET && pHeader->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			timespec stamp, realtime;
+
+			memcpy(&stamp, CMSG_DATA(pHeader), sizeof(stamp));
+			clock_gettime(CLOCK_REALTIME, &realtime);
+
+			auto waited = std::chrono::seconds(realtime.tv_sec - stamp.tv_sec) +
+				std::chrono::nanoseconds(realtime.tv_nsec - stamp.tv_nsec);
+
+			if (waited > std::chrono::nanoseconds(0))
+				receive_time = now - waited;
+		}
+	}
+
+	return received;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Moves data for a connection until the socket would block: receives
+	and handles requests, streams request bodies and file bodies and
+	flushes responses.
+	Reading stops while the client leaves more than echo_window bytes of
+	response unread; the next EPOLLOUT resumes it. HTTP/2 responses held
+	back by the same limit are framed each time the output drains.
+
+Arguments:
+	pConnection  - The connection.
+	pHandled     - Incremented for each request handled.
+	hangup       - The event reported that the peer closed its side.
+	pPeerClosed  - Set once that close has been read.
+
+Return Value:
+	false if the connection failed and should be closed.
+
+--***************************************************************************/
+static bool
+ServiceConnection(
+	epoll_connection* pConnection,
+	int* pHandled,
+	bool hangup,
+	bool* pPeerClosed
+)
+{
+	for (;;)
+	{
+		if (pConnection->file.remaining != 0)
+		{
+			int result = SendFileData(pConnection);
+
+			if (result <= 0)
+				return result == 0;
+		}
+
+		if (!FlushConnection(pConnection))
+			return false;
+
+		if (pConnection->out.empty() && ResumeHttp2Output(pConnection))
+			continue;
+
+		if (pConnection->out.size() >= echo_window)
+			return true;
+
+		if (pConnection->close_after_send && pConnection->body.state == body_idle)
+			return true;
+
+		if (pConnection->body.state == body_data && pConnection->body.echo &&
+			pConnection->in.empty() && pConnection->tls == nullptr)
+		{
+			int result = SpliceRequestBody(pConnection);
+
+			if (result <= 0)
+				return result == 0;
+
+			continue;
+		}
+
+		if (pConnection->body.state == body_data && pConnection->body.sink &&
+			pConnection->in.empty())
+		{
+			int result = DrainRequestBody(pConnection);
+
+			if (result <= 0)
+				return result == 0;
+
+			continue;
+		}
+
+		//
+		// Edge triggered: read until the socket is drained, handling each
+		// read as one batch so its responses are flushed together. A
+		// short read means the socket was empty, and any later data
+		// raises a new edge, so the recv that would only return EAGAIN is
+		// skipped, unless the peer has hung up and the EOF must be seen.
+		// A TLS read returns at most one record, so a short one says
+		// nothing about the socket.
+		//
+		char buffer[receive_chunk_size];
+		size_t room = echo_window - pConnection->in.size();
+		bool would_block = false;
+
+		if (room == 0)
+		{
+			// Input held back behind a file body; handle it first.
+			HandleRequests(pConnection, pHandled);
+			continue;
+		}
+
+		if (room > sizeof(buffer))
+			room = sizeof(buffer);
+
+		ssize_t received = ReceiveData(pConnection, buffer, room);
+
+		if (received > 0)
+		{
+			HandleReceivedData(pConnection, buffer, received, pHandled);
+
+			if ((size_t)received < room && !hangup && pConnection->tls == nullptr)
+				would_block = true;
+		}
+		else
+		{
+			if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				*pPeerClosed = true;
+			else
+				would_block = true;
+
+			if (received < 0 && *pPeerClosed)
+				StatAdd(thread_stats->io_errors, 1);
+
+			if (!pConnection->in.empty())
+			{
+				// Requests held back behind a file body.
+				HandleRequests(pConnection, pHandled);
+			}
+		}
+
+		if ((would_block || *pPeerClosed) && pConnection->file.remaining == 0)
+		{
+			if (!FlushConnection(pConnection))
+				return false;
+
+			//
+			// Output that drained here raises no EPOLLOUT edge, so held
+			// back HTTP/2 data has to be framed now.
+			//
+			if (*pPeerClosed || !pConnection->out.empty() || !ResumeHttp2Output(pConnection))
+				return true;
+		}
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Services a connection after an event (or after its coroutine handler
+	finished) and closes it if it is done or failed.
+
+Arguments:
+	epoll_fd    - The thread's epoll instance.
+	pConnection - The connection.
+	events      - The epoll events reported, 0 if none.
+	pHandled    - Incremented for each request handled.
+	connections - The thread's live connections.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+ProcessConnection(
+	int epoll_fd,
+	epoll_connection* pConnection,
+	uint32_t events,
+	int* pHandled,
+	std::unordered_set<epoll_connection*>& connections
+)
+{
+	bool keep = (events & EPOLLERR) == 0;
+	bool peer_closed = false;
+
+	if (keep)
+	{
+		keep = ServiceConnection(pConnection, pHandled, (events & EPOLLRDHUP) != 0, &peer_closed);
+	}
+
+	if (peer_closed || (events & EPOLLHUP) ||
+		(pConnection->close_after_send && pConnection->out.empty() &&
+			pConnection->body.state == body_idle && pConnection->file.remaining == 0 &&
+			pConnection->async == nullptr))
+	{
+		keep = false;
+	}
+
+	if (!keep)
+	{
+		connections.erase(pConnection);
+		CloseConnection(epoll_fd, pConnection);
+		return;
+	}
+
+	UpdateConnectionTimeout(pConnection,
+		!pConnection->out.empty() || pConnection->file.remaining != 0 || pConnection->pipe_pending != 0);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	The per-thread epoll event loop. Each thread owns an epoll instance,
+	accepts connections from the shared listening socket and handles the
+	requests on those connections until the shutdown event is signalled.
+
+Arguments:
+	listen_fd     - The listening socket: shared, or this thread's own (--shards).
+	tls_listen_fd - Likewise for TLS connections (--tls), or -1.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+int
+DoReceiveRequests(
+	int listen_fd,
+	int tls_listen_fd
+)
+{
+	int epoll_fd;
+	epoll_event ev = {};
+	epoll_event events[max_epoll_events];
+	std::unordered_set<epoll_connection*> connections;
+	std::vector<connection*> finished;
+	std::vector<connection*> expired;
+	int async_fd;
+	bool async_ready = false;
+	int kill_server = 0;
+	int requests_handled = 0;
+	int result = 0;
+
+	RegisterStatsThread();
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (epoll_fd < 0)
+	{
+		printf("epoll_create1 failed with %d \n", errno);
+		return errno;
+	}
+
+	//
+	// EPOLLEXCLUSIVE wakes only one of the threads waiting on the shared
+	// listener, much like a single HttpReceiveHttpRequest completing.
+	//
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
+	{
+		result = errno;
+		printf("epoll_ctl failed with %d \n", result);
+		close(epoll_fd);
+		return result;
+	}
+
+	if (tls_listen_fd >= 0)
+	{
+		ev.data.ptr = &tls_listen_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tls_listen_fd, &ev);
+	}
+
+	//
+	// The shutdown eventfd is never read, so once signalled it stays
+	// readable and every thread sees it.
+	//
+	ev.events = EPOLLIN;
+	ev.data.ptr = &shutdown_event;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shutdown_event, &ev);
+
+	//
+	// Timers and waits of suspended coroutine handlers.
+	//
+	async_fd = InitializeAsyncEvents();
+
+	if (async_fd >= 0)
+	{
+		ev.events = EPOLLIN;
+		ev.data.ptr = &async_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, async_fd, &ev);
+	}
+
+	while (!kill_server)
+	{
+		int count = epoll_wait(epoll_fd, events, max_epoll_events, -1);
+
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			result = errno;
+			printf("epoll_wait failed with %d \n", result);
+			break;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			epoll_connection* pConnection = static_cast<epoll_connection*>(events[i].data.ptr);
+
+			if (events[i].data.ptr == &shutdown_event)
+			{
+				kill_server = 1;
+				continue;
+			}
+
+			if (pConnection == NULL || events[i].data.ptr == &tls_listen_fd)
+			{
+				bool tls = pConnection != NULL;
+
+				//
+				// New connections on a listener.
+				//
+				for (;;)
+				{
+					int fd = accept4(tls ? tls_listen_fd : listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+					if (fd < 0)
+						break;
+
+					int one = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+					if (admission.enabled && !tls)
+						setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+
+					pConnection = new epoll_connection{};
+					pConnection->fd = fd;
+					pConnection->pipe_fds[0] = -1;
+					pConnection->pipe_fds[1] = -1;
+
+					if (tls && (pConnection->tls = AcceptTls(fd)) == nullptr)
+					{
+						close(fd);
+						delete pConnection;
+						continue;
+					}
+
+					ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+					ev.data.ptr = pConnection;
+
+					if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+					{
+						if (tls)
+							CloseTls(pConnection->tls);
+
+						close(fd);
+						delete pConnection;
+						continue;
+					}
+
+					connections.insert(pConnection);
+					UpdateConnectionTimeout(pConnection, false);
+				}
+				continue;
+			}
+
+			if (events[i].data.ptr == &async_fd)
+			{
+				async_ready = true;
+				continue;
+			}
+
+			ProcessConnection(epoll_fd, pConnection, events[i].events, &requests_handled, connections);
+		}
+
+		//
+		// Coroutine handlers are resumed once the batch is done, so a
+		// connection they finish on cannot be closed under a later event
+		// in the same batch.
+		//
+		if (async_ready)
+		{
+			async_ready = false;
+			RunAsyncEvents(&finished, &expired);
+
+			for (auto pFinished : finished)
+			{
+				ProcessConnection(epoll_fd, static_cast<epoll_connection*>(pFinished), 0,
+					&requests_handled, connections);
+			}
+
+			for (auto pExpired : expired)
+			{
+				StatAdd(thread_stats->timeouts, 1);
+				connections.erase(static_cast<epoll_connection*>(pExpired));
+				CloseConnection(epoll_fd, static_cast<epoll_connection*>(pExpired));
+			}
+
+			finished.clear();
+			expired.clear();
+		}
+	}
+
+	for (auto pConnection : connections)
+	{
+		FlushConnection(pConnection);
+		CloseConnection(epoll_fd, pConnection);
+	}
+
+	CleanupAsyncEvents();
+	close(epoll_fd);
+
+	printf("Thread completed after %d requests \n", requests_handled);
+
+	return result;
+}
@@ -0,0 +1,190 @@
+//
+// Open-file cache for the /files/ route.
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unordered_map>
+
+#include "file_cache.h"
+#include "../static_files.h"
+
+//
+// Most distinct files a thread keeps open.
+//
+const size_t max_cached_files = 256;
+
+static int root_fd = -1;
+
+cached_file::~cached_file()
+{
+	if (map)
+		munmap(const_cast<char*>(map), size);
+
+	close(fd);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Opens the directory that /files/ is served from. Files are opened
+	relative to it, so the root is resolved once.
+
+Arguments:
+	pRoot - Directory path.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SetFileRoot(
+	const char* pRoot
+)
+{
+	root_fd = open(pRoot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	if (root_fd < 0)
+	{
+		printf("cannot open file root %s (%d), /files/ will return 404 \n", pRoot, errno);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Opens a regular file below the root and maps it.
+
+Arguments:
+	path - Path relative to the root, already checked by DecodeFilePath.
+	now  - Current time.
+
+Return Value:
+	The new entry, or NULL if the file cannot be served.
+
+--***************************************************************************/
+static std::shared_ptr<cached_file>
+OpenFile(
+	const std::string& path,
+	time_t now
+)
+{
+	int fd = openat(root_fd, path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	struct stat st;
+
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	auto file = std::make_shared<cached_file>();
+	file->fd = fd;
+	file->size = st.st_size;
+	file->map = NULL;
+	file->mtime = st.st_mtime;
+	file->inode = st.st_ino;
+	file->checked = now;
+	file->content_type = ContentTypeForPath(path);
+
+	tm utc;
+	gmtime_r(&file->mtime, &utc);
+	strftime(file->last_modified, sizeof(file->last_modified),
+		"Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &utc);
+
+	//
+	// The mapping is what gets sent when headers and body go out in a
+	// single writev or io_uring send; sendfile uses the descriptor.
+	//
+	if (file->size != 0)
+	{
+		void* map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (map == MAP_FAILED)
+		{
+			return nullptr;
+		}
+
+		file->map = static_cast<const char*>(map);
+	}
+
+	return file;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Returns the calling thread's cached entry for a file, opening it (or
+	reopening it if it changed on disk) as needed.
+
+Arguments:
+	path - Path relative to the root, already checked by DecodeFilePath.
+
+Return Value:
+	The entry, or NULL if the file does not exist or is not a regular file.
+
+--***************************************************************************/
+std::shared_ptr<const cached_file>
+OpenCachedFile(
+	const std::string& path
+)
+{
+	thread_local std::unordered_map<std::string, std::shared_ptr<cached_file>> files;
+	time_t now = time(NULL);
+
+	if (root_fd < 0)
+	{
+		return nullptr;
+	}
+
+	auto it = files.find(path);
+
+	if (it != files.end())
+	{
+		cached_file* file = it->second.get();
+
+		if (now - file->checked < (time_t)file_revalidate_seconds)
+		{
+			return it->second;
+		}
+
+		struct stat st;
+
+		if (fstatat(root_fd, path.c_str(), &st, 0) == 0 &&
+			(unsigned long long)st.st_ino == file->inode &&
+			st.st_mtime == file->mtime &&
+			(uint64_t)st.st_size == file->size)
+		{
+			file->checked = now;
+			return it->second;
+		}
+
+		files.erase(it);
+	}
+
+	auto file = OpenFile(path, now);
+
+	if (file == nullptr)
+	{
+		return nullptr;
+	}
+
+	if (files.size() >= max_cached_files)
+	{
+		files.erase(files.begin());
+	}
+
+	files.emplace(path, file);
+
+	return file;
+}
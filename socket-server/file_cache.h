@@ -0,0 +1,45 @@
+//
+// Open-file cache for the /files/ route.
+//
+// Each worker thread keeps its own map from relative path to an open,
+// mapped file and its metadata, so serving a hot file costs no open(),
+// stat() or lock. Entries are re-validated against the file system every
+// few seconds and are reference counted, so a response that is still
+// being sent keeps its file open after the entry is replaced.
+//
+
+#ifndef __FILE_CACHE__
+#define __FILE_CACHE__
+
+#include <stdint.h>
+#include <time.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct cached_file
+{
+	int fd;
+	uint64_t size;
+	const char* map;         // whole file, read-only; NULL when empty
+	time_t mtime;
+	unsigned long long inode;
+	time_t checked;          // when the metadata was last validated
+	std::string_view content_type;
+	char last_modified[64];  // "Last-Modified: ...\r\n"
+
+	~cached_file();
+};
+
+void
+SetFileRoot(
+	const char* pRoot
+);
+
+std::shared_ptr<const cached_file>
+OpenCachedFile(
+	const std::string& path
+);
+
+#endif
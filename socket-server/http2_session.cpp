@@ -0,0 +1,1386 @@
+//
+// Cleartext HTTP/2: framing, flow control and the mapping of streams onto
+// the HTTP/1.1 route handlers.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "http2_session.h"
+#include "async_handler.h"
+#include "response_cache.h"
+#include "../http2.h"
+
+struct http2_stream
+{
+	uint32_t id;
+	http2_session* pSession;
+	connection request;      // stand-in the request is handled on
+	std::string head;        // the request as HTTP/1.1, without the blank line
+	std::string body;
+	bool end_stream;         // the client has sent all of the request
+	bool too_large;          // the body passed max_async_body
+	bool dispatched;         // handed to the route handler
+	int64_t send_window;
+	std::string data;        // the response; the body starts at data_sent
+	size_t data_sent;
+	file_send file;          // a /files/ body, after data
+};
+
+struct http2_session
+{
+	connection* pConnection;
+	bool preface_received;
+	bool goaway_received;
+	bool closing;            // sent GOAWAY after a connection error
+	uint32_t last_stream;    // highest stream the client opened
+	std::unordered_map<uint32_t, std::unique_ptr<http2_stream>> streams;
+	std::vector<http2_stream*> sending;  // responses waiting for window
+	uint32_t continuation;   // stream whose header block is incomplete
+	uint8_t continuation_flags;
+	std::string header_block;
+	hpack_decoder decoder;
+	hpack_encoder encoder;
+	int64_t send_window;
+	uint32_t peer_initial_window;
+	uint32_t peer_max_frame;
+	uint64_t receive_unacked; // DATA bytes not yet returned to the client's window
+	int* pHandled;           // the engine's count, during HandleHttp2Input
+};
+
+//
+// Request headers that only mean something to HTTP/1.1, or that are
+// written afresh for the stand-in request.
+//
+static bool
+IsDroppedRequestHeader(
+	std::string_view name
+)
+{
+	return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+		name == "transfer-encoding" || name == "upgrade" || name == "te" ||
+		name == "content-length" || name == "host" || name == "http2-settings";
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Checks whether received bytes start the HTTP/2 client preface.
+
+Arguments:
+	pData     - The bytes at a request boundary.
+	length    - Number of bytes at pData.
+	pComplete - Set if the whole preface is there.
+
+Return Value:
+	true if the bytes match the preface as far as they go.
+
+--***************************************************************************/
+bool
+IsHttp2Preface(
+	const char* pData,
+	size_t length,
+	bool* pComplete
+)
+{
+	size_t compared = length < http2_preface_length ? length : http2_preface_length;
+
+	*pComplete = length >= http2_preface_length;
+
+	return length != 0 && memcmp(pData, http2_preface, compared) == 0;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Checks whether an HTTP/1.1 request asks to switch to h2c.
+
+Arguments:
+	request   - The parsed request.
+	pSettings - Receives the HTTP2-Settings header value.
+
+Return Value:
+	true if the request has "Upgrade: h2c" and HTTP2-Settings.
+
+--***************************************************************************/
+bool
+WantsHttp2Upgrade(
+	const http_request& request,
+	std::string_view* pSettings
+)
+{
+	bool h2c = false;
+	bool settings = false;
+
+	if (request.minor_version < 1)
+		return false;
+
+	for (size_t i = 0; i < request.header_count; i++)
+	{
+		const http_header& header = request.headers[i];
+
+		if (HeaderNameEquals(header.name, "upgrade"))
+		{
+			//
+			// A list of protocols in order of preference; h2c anywhere in
+			// it will do.
+			//
+			std::string_view value = header.value;
+
+			while (!value.empty())
+			{
+				size_t comma = value.find(',');
+				std::string_view token = value.substr(0, comma);
+
+				while (!token.empty() && token.front() == ' ')
+					token.remove_prefix(1);
+
+				while (!token.empty() && token.back() == ' ')
+					token.remove_suffix(1);
+
+				h2c |= HeaderNameEquals(token, "h2c");
+				value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+			}
+		}
+		else if (HeaderNameEquals(header.name, "http2-settings"))
+		{
+			*pSettings = header.value;
+			settings = true;
+		}
+	}
+
+	return h2c && settings;
+}
+
+static void
+ConnectionError(
+	http2_session* pSession,
+	http2_error error
+)
+{
+	if (pSession->closing)
+		return;
+
+	Http2AppendGoaway(pSession->pConnection->out, pSession->last_stream, error);
+	pSession->closing = true;
+	pSession->pConnection->close_after_send = true;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Applies the parameters of a SETTINGS frame (or of an HTTP2-Settings
+	header) from the client.
+
+Arguments:
+	pSession - The session.
+	pData    - The settings, six bytes each.
+	length   - Number of bytes at pData.
+
+Return Value:
+	The error to end the connection with, or http2_no_error.
+
+--***************************************************************************/
+static http2_error
+ApplySettings(
+	http2_session* pSession,
+	const unsigned char* pData,
+	size_t length
+)
+{
+	if (length % 6 != 0)
+		return http2_frame_size_error;
+
+	for (const unsigned char* p = pData; p < pData + length; p += 6)
+	{
+		uint16_t id = (uint16_t)(p[0] << 8 | p[1]);
+		uint32_t value = Http2ReadUint32(p + 2);
+
+		switch (id)
+		{
+		case http2_settings_header_table_size:
+			pSession->encoder.set_table_size(value);
+			break;
+
+		case http2_settings_initial_window_size:
+		{
+			//
+			// Moves the window of every open stream by the change.
+			//
+			if (value > http2_max_window)
+				return http2_flow_control_error;
+
+			int64_t delta = (int64_t)value - pSession->peer_initial_window;
+
+			for (auto& entry : pSession->streams)
+				entry.second->send_window += delta;
+
+			pSession->peer_initial_window = value;
+			break;
+		}
+
+		case http2_settings_max_frame_size:
+			if (value < http2_default_frame_size || value > http2_max_frame_size)
+				return http2_protocol_error;
+
+			pSession->peer_max_frame = value;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return http2_no_error;
+}
+
+static http2_session*
+CreateSession(
+	connection* pConnection
+)
+{
+	http2_session* pSession = new http2_session{};
+
+	pSession->pConnection = pConnection;
+	pSession->send_window = http2_default_window;
+	pSession->peer_initial_window = http2_default_window;
+	pSession->peer_max_frame = http2_default_frame_size;
+
+	//
+	// The server preface: our settings, then the connection window raised
+	// from its default of 64 KB.
+	//
+	std::string& out = pConnection->out;
+
+	Http2AppendFrameHeader(out, 12, http2_settings, 0, 0);
+	Http2AppendSetting(out, http2_settings_max_concurrent_streams, http2_max_streams);
+	Http2AppendSetting(out, http2_settings_initial_window_size, http2_stream_window);
+	Http2AppendWindowUpdate(out, 0, http2_connection_window - http2_default_window);
+
+	pConnection->h2 = pSession;
+	return pSession;
+}
+
+void
+StartHttp2Session(
+	connection* pConnection
+)
+{
+	CreateSession(pConnection);
+}
+
+//
+// Finds an open stream.
+//
+static http2_stream*
+FindStream(
+	http2_session* pSession,
+	uint32_t id
+)
+{
+	auto found = pSession->streams.find(id);
+
+	return found == pSession->streams.end() ? nullptr : found->second.get();
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Forgets a stream: destroys its handler if one is still running and
+	takes it off the list waiting for window. A stream whose response
+	went out before the client finished its request is reset, so the
+	client stops sending.
+
+Arguments:
+	pSession - The session.
+	pStream  - The stream.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+CloseStream(
+	http2_session* pSession,
+	http2_stream* pStream
+)
+{
+	if (!pStream->end_stream && pStream->dispatched && !pSession->closing)
+		Http2AppendRstStream(pSession->pConnection->out, pStream->id, http2_no_error);
+
+	CancelAsyncCall(&pStream->request);
+
+	auto sending = std::find(pSession->sending.begin(), pSession->sending.end(), pStream);
+
+	if (sending != pSession->sending.end())
+		pSession->sending.erase(sending);
+
+	uint32_t id = pStream->id;
+
+	pSession->streams.erase(id);
+
+	if (pSession->goaway_received && pSession->streams.empty())
+		pSession->pConnection->close_after_send = true;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends as much of a stream's response body as the flow-control windows
+	allow, in DATA frames no larger than the client takes. It stops once
+	echo_window bytes of output are waiting, so a client that opens huge
+	windows and never reads can't make the server copy a whole file into
+	memory; the rest waits for ResumeHttp2Output.
+
+Arguments:
+	pSession - The session.
+	pStream  - A stream whose response headers went out.
+
+Return Value:
+	true once the whole body has been sent.
+
+--***************************************************************************/
+static bool
+SendStreamData(
+	http2_session* pSession,
+	http2_stream* pStream
+)
+{
+	std::string& out = pSession->pConnection->out;
+
+	for (;;)
+	{
+		uint64_t buffered = pStream->data.size() - pStream->data_sent;
+		uint64_t left = buffered + pStream->file.remaining;
+		int64_t window = std::min(pStream->send_window, pSession->send_window);
+
+		if (left == 0)
+			return true;
+
+		if (window <= 0 || out.size() >= echo_window)
+			return false;
+
+		uint64_t length = std::min<uint64_t>({ left, (uint64_t)window, pSession->peer_max_frame });
+
+		Http2AppendFrameHeader(out, length, http2_data, length == left ? http2_flag_end_stream : 0,
+			pStream->id);
+
+		uint64_t copied = std::min(length, buffered);
+
+		out.append(pStream->data, pStream->data_sent, copied);
+		pStream->data_sent += copied;
+
+		if (length > copied)
+		{
+			file_send& file = pStream->file;
+
+			out.append(file.file->map + file.offset, length - copied);
+			file.offset += length - copied;
+			file.remaining -= length - copied;
+		}
+
+		pStream->send_window -= length;
+		pSession->send_window -= length;
+	}
+}
+
+//
+// Sends what the windows and the output limit allow of every response
+// waiting for them, in the order they became ready.
+//
+static void
+SendWaitingData(
+	http2_session* pSession
+)
+{
+	const std::string& out = pSession->pConnection->out;
+
+	for (size_t i = 0; i < pSession->sending.size() && pSession->send_window > 0 && out.size() < echo_window;)
+	{
+		http2_stream* pStream = pSession->sending[i];
+
+		if (!SendStreamData(pSession, pStream))
+		{
+			i++;
+			continue;
+		}
+
+		CloseStream(pSession, pStream);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends the response a handler left in a stream's stand-in connection:
+	the HTTP/1.1 head becomes a HEADERS frame (and CONTINUATION frames if
+	it doesn't fit in one), and the body is sent as DATA frames as the
+	windows allow.
+
+Arguments:
+	pSession - The session.
+	pStream  - The stream, whose handler has finished.
+
+Return Value:
+	None. The stream is closed once its response is out.
+
+--***************************************************************************/
+static void
+SendStreamResponse(
+	http2_session* pSession,
+	http2_stream* pStream
+)
+{
+	static thread_local std::string block;
+	static thread_local std::string name;
+	std::string& response = pStream->request.out;
+	size_t head_end = response.find("\r\n\r\n");
+
+	if (response.size() < 12 || head_end == std::string::npos)
+	{
+		if (!pSession->closing)
+			Http2AppendRstStream(pSession->pConnection->out, pStream->id, http2_internal_error);
+
+		pStream->end_stream = true;
+		CloseStream(pSession, pStream);
+		return;
+	}
+
+	block.clear();
+	pSession->encoder.begin(block);
+	pSession->encoder.encode(block, ":status", std::string_view(response.data() + 9, 3));
+
+	//
+	// "HTTP/1.1 200 OK\r\n", then one field per line.
+	//
+	for (size_t line = response.find("\r\n") + 2; line < head_end + 2;)
+	{
+		size_t end = response.find("\r\n", line);
+		size_t colon = response.find(':', line);
+
+		if (colon < end)
+		{
+			std::string_view value(response.data() + colon + 1, end - colon - 1);
+
+			while (!value.empty() && value.front() == ' ')
+				value.remove_prefix(1);
+
+			name.assign(response, line, colon - line);
+
+			for (char& c : name)
+			{
+				if (c >= 'A' && c <= 'Z')
+					c += 'a' - 'A';
+			}
+
+			if (name != "connection" && name != "keep-alive" && name != "transfer-encoding")
+				pSession->encoder.encode(block, name, value, name != "content-length");
+		}
+
+		line = end + 2;
+	}
+
+	//
+	// The body stays where the handler put it.
+	//
+	pStream->data = std::move(response);
+	pStream->data_sent = head_end + 4;
+	pStream->file = std::move(pStream->request.file);
+	pStream->request.out.clear();
+	pStream->request.file = {};
+
+	bool empty = pStream->data_sent == pStream->data.size() && pStream->file.remaining == 0;
+
+	if (pSession->closing)
+		return;
+
+	std::string& out = pSession->pConnection->out;
+	uint8_t type = http2_headers;
+	uint8_t flags = empty ? http2_flag_end_stream : 0;
+
+	for (size_t sent = 0; type == http2_headers || sent < block.size();)
+	{
+		size_t length = std::min<size_t>(block.size() - sent, pSession->peer_max_frame);
+
+		if (sent + length == block.size())
+			flags |= http2_flag_end_headers;
+
+		Http2AppendFrameHeader(out, length, type, flags, pStream->id);
+		out.append(block, sent, length);
+		sent += length;
+		type = http2_continuation;
+		flags = 0;
+	}
+
+	if (empty || SendStreamData(pSession, pStream))
+	{
+		CloseStream(pSession, pStream);
+		return;
+	}
+
+	pSession->sending.push_back(pStream);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Runs a complete request through the route handlers on the stream's
+	stand-in connection, and sends the response unless a coroutine
+	handler is still working on it (see FinishHttp2Stream).
+
+Arguments:
+	pSession - The session.
+	pStream  - The stream.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+DispatchStream(
+	http2_session* pSession,
+	http2_stream* pStream
+)
+{
+	connection* pRequest = &pStream->request;
+
+	pStream->dispatched = true;
+
+	if (pStream->too_large)
+	{
+		SendHttpResponse(pRequest, http_response{ 413, "text/plain", "Content Too Large\r\n" });
+		*pSession->pHandled += 1;
+	}
+	else
+	{
+		std::string& head = pStream->head;
+
+		if (!pStream->body.empty())
+		{
+			head += "Content-Length: ";
+			head += std::to_string(pStream->body.size());
+			head += "\r\n";
+		}
+
+		head += "\r\n";
+		head += pStream->body;
+		pStream->body.clear();
+
+		HandleRequestBuffer(pRequest, head.data(), head.size(), pSession->pHandled);
+	}
+
+	if (pRequest->async == nullptr)
+		SendStreamResponse(pSession, pStream);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Handles a complete header block: opens a stream and writes its request
+	head, or takes the trailers that end a request body.
+
+Arguments:
+	pSession - The session.
+	id       - The stream.
+	flags    - Flags of the HEADERS frame that started the block.
+	pBlock   - The header block.
+	length   - Its length.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+HandleHeaderBlock(
+	http2_session* pSession,
+	uint32_t id,
+	uint8_t flags,
+	const unsigned char* pBlock,
+	size_t length
+)
+{
+	static thread_local std::string fields;
+	http2_stream* pStream = FindStream(pSession, id);
+	bool opening = pStream == nullptr && id > pSession->last_stream;
+	bool malformed = false;
+	bool regular = false;
+	std::string method;
+	std::string path;
+	std::string authority;
+
+	fields.clear();
+
+	//
+	// Every block goes through the decoder, refused or not, to keep its
+	// table in step with the client's. Blocks for a stream we reset or
+	// refused (which the client may not know yet) are then dropped.
+	//
+	bool decoded = pSession->decoder.decode(pBlock, length,
+		[&](std::string_view name, std::string_view value)
+	{
+		if (!opening)
+			return;
+
+		if (!name.empty() && name[0] == ':')
+		{
+			if (regular)
+				malformed = true;
+			else if (name == ":method")
+				method = value;
+			else if (name == ":path")
+				path = value;
+			else if (name == ":authority")
+				authority = value;
+
+			return;
+		}
+
+		regular = true;
+
+		for (char c : name)
+		{
+			if (c >= 'A' && c <= 'Z')
+				malformed = true;
+		}
+
+		if (name == "host" && authority.empty())
+			authority = value;
+
+		if (IsDroppedRequestHeader(name) || fields.size() > max_request_head)
+			return;
+
+		fields.append(name);
+		fields.append(": ");
+		fields.append(value);
+		fields.append("\r\n");
+	});
+
+	if (!decoded)
+	{
+		ConnectionError(pSession, http2_compression_error);
+		return;
+	}
+
+	if (pStream == nullptr && !opening)
+		return;
+
+	if (!opening)
+	{
+		//
+		// Trailers; they have to end the request, and are dropped.
+		//
+		if ((flags & http2_flag_end_stream) == 0 || pStream->end_stream)
+		{
+			ConnectionError(pSession, http2_protocol_error);
+			return;
+		}
+
+		pStream->end_stream = true;
+
+		if (!pStream->dispatched)
+			DispatchStream(pSession, pStream);
+
+		return;
+	}
+
+	pSession->last_stream = id;
+
+	if (pSession->goaway_received || pSession->streams.size() >= http2_max_streams)
+	{
+		Http2AppendRstStream(pSession->pConnection->out, id, http2_refused_stream);
+		return;
+	}
+
+	if (malformed || method.empty() || path.empty() || fields.size() > max_request_head)
+	{
+		Http2AppendRstStream(pSession->pConnection->out, id, http2_protocol_error);
+		return;
+	}
+
+	auto created = std::make_unique<http2_stream>();
+
+	pStream = created.get();
+	pStream->id = id;
+	pStream->pSession = pSession;
+	pStream->request.fd = -1;
+	pStream->request.stream = pStream;
+	pStream->send_window = pSession->peer_initial_window;
+	pStream->end_stream = (flags & http2_flag_end_stream) != 0;
+
+	pStream->head.reserve(method.size() + path.size() + authority.size() + fields.size() + 64);
+	pStream->head += method;
+	pStream->head += ' ';
+	pStream->head += path;
+	pStream->head += " HTTP/1.1\r\n";
+
+	if (!authority.empty())
+	{
+		pStream->head += "Host: ";
+		pStream->head += authority;
+		pStream->head += "\r\n";
+	}
+
+	pStream->head += fields;
+	pSession->streams.emplace(id, std::move(created));
+
+	if (pStream->end_stream)
+		DispatchStream(pSession, pStream);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Takes a DATA frame's payload into its stream's request body.
+
+Arguments:
+	pSession - The session.
+	header   - The frame header.
+	pPayload - The payload, padding included.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+HandleDataFrame(
+	http2_session* pSession,
+	const http2_frame_header& header,
+	const unsigned char* pPayload
+)
+{
+	const unsigned char* p = pPayload;
+	size_t length = header.length;
+
+	if (header.stream == 0 || header.stream > pSession->last_stream)
+	{
+		ConnectionError(pSession, http2_protocol_error);
+		return;
+	}
+
+	if (header.flags & http2_flag_padded)
+	{
+		if (length == 0 || p[0] >= length)
+		{
+			ConnectionError(pSession, http2_protocol_error);
+			return;
+		}
+
+		length -= 1 + p[0];
+		p++;
+	}
+
+	//
+	// Padding counts against the window too. The whole connection window
+	// is given back once half of it has been used; a stream's is never
+	// given back, since it is a byte bigger than the largest body we take,
+	// so a client sending one too big always gets far enough to show it.
+	//
+	pSession->receive_unacked += header.length;
+
+	if (pSession->receive_unacked >= http2_connection_window / 2)
+	{
+		Http2AppendWindowUpdate(pSession->pConnection->out, 0, (uint32_t)pSession->receive_unacked);
+		pSession->receive_unacked = 0;
+	}
+
+	http2_stream* pStream = FindStream(pSession, header.stream);
+
+	if (pStream == nullptr)
+	{
+		// A stream we reset or refused; the client may not know yet.
+		return;
+	}
+
+	if (pStream->end_stream)
+	{
+		ConnectionError(pSession, http2_stream_closed);
+		return;
+	}
+
+	if (pStream->too_large)
+	{
+		pStream->end_stream = (header.flags & http2_flag_end_stream) != 0;
+		return;
+	}
+
+	if (pStream->body.size() + length > max_async_body)
+	{
+		//
+		// Answered at once; CloseStream resets the stream once the answer
+		// is out, so the client stops sending.
+		//
+		pStream->too_large = true;
+		pStream->body.clear();
+		pStream->end_stream = (header.flags & http2_flag_end_stream) != 0;
+		DispatchStream(pSession, pStream);
+		return;
+	}
+
+	pStream->body.append(reinterpret_cast<const char*>(p), length);
+
+	if (header.flags & http2_flag_end_stream)
+	{
+		pStream->end_stream = true;
+		DispatchStream(pSession, pStream);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Handles one frame other than DATA and CONTINUATION.
+
+Arguments:
+	pSession - The session.
+	header   - The frame header.
+	pPayload - The payload.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+HandleFrame(
+	http2_session* pSession,
+	const http2_frame_header& header,
+	const unsigned char* pPayload
+)
+{
+	std::string& out = pSession->pConnection->out;
+	const unsigned char* p = pPayload;
+	size_t length = header.length;
+
+	switch (header.type)
+	{
+	case http2_headers:
+	{
+		if (header.stream == 0 || (header.stream & 1) == 0)
+		{
+			ConnectionError(pSession, http2_protocol_error);
+			return;
+		}
+
+		size_t pad = 0;
+
+		if (header.flags & http2_flag_padded)
+		{
+			if (length == 0)
+			{
+				ConnectionError(pSession, http2_protocol_error);
+				return;
+			}
+
+			pad = *p++;
+			length--;
+		}
+
+		if (header.flags & http2_flag_priority)
+		{
+			if (length < 5)
+			{
+				ConnectionError(pSession, http2_frame_size_error);
+				return;
+			}
+
+			p += 5;
+			length -= 5;
+		}
+
+		if (pad > length)
+		{
+			ConnectionError(pSession, http2_protocol_error);
+			return;
+		}
+
+		length -= pad;
+
+		if (header.flags & http2_flag_end_headers)
+		{
+			HandleHeaderBlock(pSession, header.stream, header.flags, p, length);
+			return;
+		}
+
+		pSession->continuation = header.stream;
+		pSession->continuation_flags = header.flags;
+		pSession->header_block.assign(reinterpret_cast<const char*>(p), length);
+		return;
+	}
+
+	case http2_priority:
+		if (header.stream == 0 || length != 5)
+			ConnectionError(pSession, header.stream == 0 ? http2_protocol_error : http2_frame_size_error);
+		return;
+
+	case http2_rst_stream:
+	{
+		if (header.stream == 0 || header.stream > pSession->last_stream || length != 4)
+		{
+			ConnectionError(pSession, length != 4 ? http2_frame_size_error : http2_protocol_error);
+			return;
+		}
+
+		http2_stream* pStream = FindStream(pSession, header.stream);
+
+		if (pStream != nullptr)
+		{
+			pStream->end_stream = true;
+			pStream->dispatched = false;
+			CloseStream(pSession, pStream);
+		}
+		return;
+	}
+
+	case http2_settings:
+	{
+		if (header.stream != 0)
+		{
+			ConnectionError(pSession, http2_protocol_error);
+			return;
+		}
+
+		if (header.flags & http2_flag_ack)
+		{
+			if (length != 0)
+				ConnectionError(pSession, http2_frame_size_error);
+			return;
+		}
+
+		http2_error error = ApplySettings(pSession, p, length);
+
+		if (error != http2_no_error)
+		{
+			ConnectionError(pSession, error);
+			return;
+		}
+
+		Http2AppendFrameHeader(out, 0, http2_settings, http2_flag_ack, 0);
+		SendWaitingData(pSession);
+		return;
+	}
+
+	case http2_push_promise:
+		ConnectionError(pSession, http2_protocol_error);
+		return;
+
+	case http2_ping:
+		if (header.stream != 0 || length != 8)
+		{
+			ConnectionError(pSession, header.stream != 0 ? http2_protocol_error : http2_frame_size_error);
+			return;
+		}
+
+		if ((header.flags & http2_flag_ack) == 0)
+		{
+			Http2AppendFrameHeader(out, 8, http2_ping, http2_flag_ack, 0);
+			out.append(reinterpret_cast<const char*>(p), 8);
+		}
+		return;
+
+	case http2_goaway:
+		//
+		// The client opens no more streams; the ones open are finished.
+		//
+		pSession->goaway_received = true;
+
+		if (pSession->streams.empty())
+			pSession->pConnection->close_after_send = true;
+		return;
+
+	case http2_window_update:
+	{
+		if (length != 4)
+		{
+			ConnectionError(pSession, http2_frame_size_error);
+			return;
+		}
+
+		uint32_t increment = Http2ReadUint32(p) & 0x7fffffff;
+
+		if (header.stream == 0)
+		{
+			pSession->send_window += increment;
+
+			if (increment == 0 || pSession->send_window > http2_max_window)
+			{
+				ConnectionError(pSession, increment == 0 ? http2_protocol_error : http2_flow_control_error);
+				return;
+			}
+
+			SendWaitingData(pSession);
+			return;
+		}
+
+		http2_stream* pStream = FindStream(pSession, header.stream);
+
+		if (pStream == nullptr)
+			return;
+
+		pStream->send_window += increment;
+
+		if (increment == 0 || pStream->send_window > http2_max_window)
+		{
+			Http2AppendRstStream(out, pStream->id,
+				increment == 0 ? http2_protocol_error : http2_flow_control_error);
+			pStream->end_stream = true;
+			pStream->dispatched = false;
+			CloseStream(pSession, pStream);
+			return;
+		}
+
+		if (std::find(pSession->sending.begin(), pSession->sending.end(), pStream) !=
+			pSession->sending.end() && SendStreamData(pSession, pStream))
+		{
+			CloseStream(pSession, pStream);
+		}
+		return;
+	}
+
+	default:
+		// Unknown frame types are ignored.
+		return;
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Handles every complete frame in a block of bytes received on an HTTP/2
+	connection. This is the HTTP/2 counterpart of HandleRequestBuffer,
+	which hands a connection's input here once it has switched.
+
+Arguments:
+	pConnection - The connection.
+	pBuffer     - The received bytes, starting at a frame boundary (or at
+	              the client preface).
+	length      - Number of bytes in pBuffer.
+	pHandled    - Incremented for each request handled.
+
+Return Value:
+	Number of bytes consumed; the rest is an incomplete frame.
+
+--***************************************************************************/
+size_t
+HandleHttp2Input(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length,
+	int* pHandled
+)
+{
+	http2_session* pSession = pConnection->h2;
+	const unsigned char* pData = reinterpret_cast<const unsigned char*>(pBuffer);
+	size_t used = 0;
+
+	if (pSession->closing)
+		return length;
+
+	if (!pSession->preface_received)
+	{
+		bool complete;
+
+		if (!IsHttp2Preface(pBuffer, length, &complete))
+		{
+			ConnectionError(pSession, http2_protocol_error);
+			return length;
+		}
+
+		if (!complete)
+			return 0;
+
+		pSession->preface_received = true;
+		used = http2_preface_length;
+	}
+
+	pSession->pHandled = pHandled;
+
+	while (!pSession->closing && length - used >= http2_frame_header_size)
+	{
+		http2_frame_header header;
+
+		Http2ReadFrameHeader(pData + used, &header);
+
+		//
+		// We never raise SETTINGS_MAX_FRAME_SIZE, so a frame always fits
+		// in a connection's input buffer.
+		//
+		if (header.length > http2_default_frame_size)
+		{
+			ConnectionError(pSession, http2_frame_size_error);
+			break;
+		}
+
+		if (length - used - http2_frame_header_size < header.length)
+			break;
+
+		const unsigned char* pPayload = pData + used + http2_frame_header_size;
+
+		used += http2_frame_header_size + header.length;
+
+		//
+		// A header block split over frames has to be finished before
+		// anything else on the connection.
+		//
+		if (pSession->continuation != 0)
+		{
+			if (header.type != http2_continuation || header.stream != pSession->continuation)
+			{
+				ConnectionError(pSession, http2_protocol_error);
+				break;
+			}
+
+			pSession->header_block.append(reinterpret_cast<const char*>(pPayload), header.length);
+
+			if (pSession->header_block.size() > max_request_head)
+			{
+				ConnectionError(pSession, http2_enhance_your_calm);
+				break;
+			}
+
+			if (header.flags & http2_flag_end_headers)
+			{
+				std::string block = std::move(pSession->header_block);
+
+				pSession->continuation = 0;
+				HandleHeaderBlock(pSession, header.stream, pSession->continuation_flags,
+					reinterpret_cast<const unsigned char*>(block.data()), block.size());
+			}
+			continue;
+		}
+
+		if (header.type == http2_data)
+			HandleDataFrame(pSession, header, pPayload);
+		else if (header.type == http2_continuation)
+			ConnectionError(pSession, http2_protocol_error);
+		else
+			HandleFrame(pSession, header, pPayload);
+	}
+
+	pSession->pHandled = nullptr;
+
+	return pSession->closing ? length : used;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Switches a connection to HTTP/2 after an HTTP/1.1 request with
+	"Upgrade: h2c": answers 101, sends the server preface and runs the
+	request as stream 1. The client sends its preface next.
+
+Arguments:
+	pConnection - The connection.
+	head        - The request head, which has no body.
+	settings    - Its HTTP2-Settings header: a SETTINGS payload in
+	              base64url.
+	pHandled    - Incremented for the request.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+UpgradeToHttp2(
+	connection* pConnection,
+	std::string_view head,
+	std::string_view settings,
+	int* pHandled
+)
+{
+	std::string payload;
+	uint32_t bits = 0;
+	int count = 0;
+
+	for (char c : settings)
+	{
+		int value;
+
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			value = 62;
+		else if (c == '_' || c == '/')
+			value = 63;
+		else
+			continue;
+
+		bits = bits << 6 | value;
+		count += 6;
+
+		if (count >= 8)
+		{
+			count -= 8;
+			payload.push_back((char)(bits >> count));
+		}
+	}
+
+	pConnection->out.append("HTTP/1.1 101 Switching Protocols\r\n");
+	pConnection->out.append(server_header);
+	pConnection->out.append("Connection: Upgrade\r\n"
+		"Upgrade: h2c\r\n"
+		"\r\n");
+
+	http2_session* pSession = CreateSession(pConnection);
+	http2_error error = ApplySettings(pSession,
+		reinterpret_cast<const unsigned char*>(payload.data()), payload.size());
+
+	if (error != http2_no_error)
+	{
+		ConnectionError(pSession, error);
+		return;
+	}
+
+	//
+	// The request is already complete, and goes in as it came: the
+	// stand-in never upgrades, so its Upgrade headers do no harm.
+	//
+	auto created = std::make_unique<http2_stream>();
+	http2_stream* pStream = created.get();
+
+	pStream->id = 1;
+	pStream->pSession = pSession;
+	pStream->request.fd = -1;
+	pStream->request.stream = pStream;
+	pStream->send_window = pSession->peer_initial_window;
+	pStream->end_stream = true;
+	pStream->dispatched = true;
+	pStream->head.assign(head);
+
+	pSession->last_stream = 1;
+	pSession->streams.emplace(1, std::move(created));
+
+	HandleRequestBuffer(&pStream->request, pStream->head.data(), pStream->head.size(), pHandled);
+
+	if (pStream->request.async == nullptr)
+		SendStreamResponse(pSession, pStream);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends a stream's response once its coroutine handler has queued it
+	on the stand-in connection (called from CompleteAsyncCall).
+
+Arguments:
+	pRequestConnection - The stream's stand-in connection.
+
+Return Value:
+	The stream's connection, which the engine has to flush.
+
+--***************************************************************************/
+connection*
+FinishHttp2Stream(
+	connection* pRequestConnection
+)
+{
+	http2_stream* pStream = pRequestConnection->stream;
+	http2_session* pSession = pStream->pSession;
+
+	SendStreamResponse(pSession, pStream);
+
+	return pSession->pConnection;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Frames more of the responses that were held back by the output limit.
+	The engines call it once everything queued on the connection has
+	gone to the socket.
+
+Arguments:
+	pConnection - The connection.
+
+Return Value:
+	true if output was added, which the engine has to send.
+
+--***************************************************************************/
+bool
+ResumeHttp2Output(
+	connection* pConnection
+)
+{
+	http2_session* pSession = pConnection->h2;
+
+	if (pSession == nullptr || pSession->closing || pSession->sending.empty())
+		return false;
+
+	size_t before = pConnection->out.size();
+
+	SendWaitingData(pSession);
+
+	return pConnection->out.size() != before;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Tells the connection timeouts about an HTTP/2 connection's streams.
+
+Arguments:
+	pConnection      - The connection.
+	pHandlerRunning  - Set if a stream waits on a coroutine handler.
+
+Return Value:
+	true if a stream is open: its request or response is in progress.
+
+--***************************************************************************/
+bool
+Http2StreamsPending(
+	const connection* pConnection,
+	bool* pHandlerRunning
+)
+{
+	*pHandlerRunning = false;
+
+	if (pConnection->h2 == nullptr)
+		return false;
+
+	for (auto& entry : pConnection->h2->streams)
+	{
+		if (entry.second->request.async != nullptr)
+			*pHandlerRunning = true;
+	}
+
+	return !pConnection->h2->streams.empty();
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Destroys a connection's HTTP/2 state, and the handlers of its open
+	streams, when the engine closes it.
+
+Arguments:
+	pConnection - The connection.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+EndHttp2Session(
+	connection* pConnection
+)
+{
+	http2_session* pSession = pConnection->h2;
+
+	if (pSession == nullptr)
+		return;
+
+	for (auto& entry : pSession->streams)
+		CancelAsyncCall(&entry.second->request);
+
+	pConnection->h2 = nullptr;
+	delete pSession;
+}
@@ -0,0 +1,103 @@
+//
+// Cleartext HTTP/2 (h2c) for the socket backend.
+//
+// A connection switches to HTTP/2 when it opens with the client preface
+// (prior knowledge) or asks to with "Upgrade: h2c". From then on its input
+// goes to HandleHttp2Input instead of the HTTP/1.1 parser, and any number
+// of request streams are in flight on it at once.
+//
+// Each stream's request runs through the same route handlers as an
+// HTTP/1.1 request. Once its headers and body are in, it is written out
+// as an HTTP/1.1 request and handled on a stand-in connection of the
+// stream's own, and the response the handler leaves in that connection's
+// output buffer is sent as HEADERS and DATA frames. So every route works
+// unchanged, coroutine handlers included, and a stream waiting in one
+// holds up no other stream: responses go out in the order they finish.
+//
+// Request bodies are collected in full before the handler runs, up to
+// max_async_body, and each stream's receive window is big enough for
+// that, so a client never waits for a window update to send one.
+// Response bodies, files included, go out as the client's flow-control
+// windows allow, but only while less than echo_window bytes of output are
+// waiting for the socket, however big the windows are. Once the engine
+// has sent the output, ResumeHttp2Output frames the next piece.
+//
+
+#ifndef __HTTP2_SESSION__
+#define __HTTP2_SESSION__
+
+#include <stddef.h>
+
+#include <string_view>
+
+#include "server.h"
+#include "async_handler.h"
+#include "http_parser.h"
+
+//
+// Streams a client may have open at once (more are refused), and the
+// receive windows of the connection and of each stream.
+//
+const uint32_t http2_max_streams = 128;
+const uint32_t http2_connection_window = 16 * 1024 * 1024;
+const uint32_t http2_stream_window = max_async_body + 1;
+
+//
+// Prototypes.
+//
+bool
+IsHttp2Preface(
+	const char* pData,
+	size_t length,
+	bool* pComplete
+);
+
+bool
+WantsHttp2Upgrade(
+	const http_request& request,
+	std::string_view* pSettings
+);
+
+void
+StartHttp2Session(
+	connection* pConnection
+);
+
+void
+UpgradeToHttp2(
+	connection* pConnection,
+	std::string_view head,
+	std::string_view settings,
+	int* pHandled
+);
+
+size_t
+HandleHttp2Input(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length,
+	int* pHandled
+);
+
+connection*
+FinishHttp2Stream(
+	connection* pRequestConnection
+);
+
+bool
+ResumeHttp2Output(
+	connection* pConnection
+);
+
+bool
+Http2StreamsPending(
+	const connection* pConnection,
+	bool* pHandlerRunning
+);
+
+void
+EndHttp2Session(
+	connection* pConnection
+);
+
+#endif
@@ -0,0 +1,640 @@
+//
+// HTTP/1.x request parser for the socket backend.
+//
+// http.sys parses requests in the kernel and hands us a HTTP_REQUEST. The
+// socket backend has to do that work itself, so this header turns a raw
+// receive buffer into method, path and header views that point straight
+// into the buffer (nothing is copied).
+//
+// The head is parsed in a single pass. Method and header names are short
+// and are checked a byte at a time against the token table; the path and
+// header values, which make up most of a request, are scanned for their
+// terminating byte 16 or 32 bytes at a time:
+//
+//   * AVX2     - byte compares over 32 bytes, folded into one bit mask,
+//   * SSE4.2   - pcmpestri with byte ranges over 16 bytes,
+//   * scalar   - a table lookup per byte, for other CPUs and the tail of
+//                a buffer.
+//
+// The variant is picked once at startup from the CPU's features; all of
+// them accept exactly the same requests (micro-bench checks that on a
+// fuzzed corpus).
+//
+
+#ifndef __HTTP_PARSER__
+#define __HTTP_PARSER__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HTTP_PARSER_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define HTTP_PARSER_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define HTTP_PARSER_TARGET_AVX2 __attribute__((target("avx2,bmi")))
+#define HTTP_PARSER_FLATTEN __attribute__((flatten))
+#else
+#define HTTP_PARSER_TARGET_SSE42
+#define HTTP_PARSER_TARGET_AVX2
+#define HTTP_PARSER_FLATTEN
+#endif
+
+const size_t max_request_headers = 32;
+
+struct http_header
+{
+	std::string_view name;
+	std::string_view value;
+};
+
+struct http_request
+{
+	std::string_view method;
+	std::string_view path;
+	int minor_version;
+	http_header headers[max_request_headers];
+	size_t header_count;
+	uint64_t content_length;
+	bool chunked;
+	bool keep_alive;
+};
+
+enum http_parser_isa
+{
+	parser_isa_scalar,
+	parser_isa_sse42,
+	parser_isa_avx2,
+	parser_isa_count
+};
+
+inline const char* HttpParserIsaName(http_parser_isa isa)
+{
+	static const char* names[parser_isa_count] = { "scalar", "sse4.2", "avx2" };
+	return names[isa];
+}
+
+inline bool HeaderNameEquals(std::string_view name, std::string_view expected)
+{
+	if (name.size() != expected.size())
+		return false;
+
+	for (size_t i = 0; i < name.size(); i++)
+	{
+		char c = name[i];
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != expected[i])
+			return false;
+	}
+
+	return true;
+}
+
+inline std::string_view TrimHeaderValue(std::string_view value)
+{
+	while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+		value.remove_prefix(1);
+	while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+		value.remove_suffix(1);
+	return value;
+}
+
+//
+// Takes the next element off a comma-separated header value, trimmed;
+// empty elements come back empty and are skipped by the callers.
+//
+inline std::string_view NextListElement(std::string_view& list)
+{
+	size_t comma = list.find(',');
+	std::string_view element = list.substr(0, comma);
+
+	list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+	return TrimHeaderValue(element);
+}
+
+//
+// Byte classes, as 256-entry tables for the scalar paths.
+//
+struct http_char_table
+{
+	bool match[256];
+};
+
+// tchar from RFC 9110: what a method or header name may contain.
+constexpr http_char_table MakeTokenTable()
+{
+	http_char_table table = {};
+	const char* extra = "!#$%&'*+-.^_`|~";
+
+	for (int c = '0'; c <= '9'; c++) table.match[c] = true;
+	for (int c = 'a'; c <= 'z'; c++) table.match[c] = true;
+	for (int c = 'A'; c <= 'Z'; c++) table.match[c] = true;
+	for (const char* p = extra; *p; p++) table.match[static_cast<unsigned char>(*p)] = true;
+
+	return table;
+}
+
+// Bytes that end a request target: controls, space and DEL.
+constexpr http_char_table MakePathStopTable()
+{
+	http_char_table table = {};
+
+	for (int c = 0; c <= 0x20; c++) table.match[c] = true;
+	table.match[0x7f] = true;
+
+	return table;
+}
+
+// Bytes that end a header value: controls other than HTAB, and DEL.
+constexpr http_char_table MakeValueStopTable()
+{
+	http_char_table table = {};
+
+	for (int c = 0; c < 0x20; c++) table.match[c] = c != '\t';
+	table.match[0x7f] = true;
+
+	return table;
+}
+
+inline constexpr http_char_table token_chars = MakeTokenTable();
+inline constexpr http_char_table path_stop_chars = MakePathStopTable();
+inline constexpr http_char_table value_stop_chars = MakeValueStopTable();
+
+inline const char* ScanUntil(const char* p, const char* end, const http_char_table& stop)
+{
+	while (p < end && !stop.match[static_cast<unsigned char>(*p)])
+		p++;
+
+	return p;
+}
+
+//
+// Each scanner returns the first byte in [p, end) that ends a path or a
+// header value, or end if there is none.
+//
+struct scalar_scanner
+{
+	static const char* FindPathEnd(const char* p, const char* end)
+	{
+		return ScanUntil(p, end, path_stop_chars);
+	}
+
+	static const char* FindValueEnd(const char* p, const char* end)
+	{
+		return ScanUntil(p, end, value_stop_chars);
+	}
+};
+
+#ifdef HTTP_PARSER_X86
+
+struct sse42_scanner
+{
+	//
+	// pcmpestri in ranges mode returns the index of the first byte that
+	// falls in any of the (low, high) pairs, or 16 if none does.
+	//
+	HTTP_PARSER_TARGET_SSE42
+	static const char* FindInRanges(const char* p, const char* end,
+		const char* ranges, int range_length, const http_char_table& stop)
+	{
+		__m128i set = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ranges));
+
+		while (end - p >= 16)
+		{
+			__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			int index = _mm_cmpestri(set, range_length, data, 16,
+				_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+
+			if (index != 16)
+				return p + index;
+
+			p += 16;
+		}
+
+		return ScanUntil(p, end, stop);
+	}
+
+	HTTP_PARSER_TARGET_SSE42
+	static const char* FindPathEnd(const char* p, const char* end)
+	{
+		alignas(16) static const char ranges[16] = "\x00\x20\x7f\x7f";
+		return FindInRanges(p, end, ranges, 4, path_stop_chars);
+	}
+
+	HTTP_PARSER_TARGET_SSE42
+	static const char* FindValueEnd(const char* p, const char* end)
+	{
+		alignas(16) static const char ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+		return FindInRanges(p, end, ranges, 6, value_stop_chars);
+	}
+};
+
+struct avx2_scanner
+{
+	//
+	// Unsigned "byte <= limit" is "min(byte, limit) == byte".
+	//
+	HTTP_PARSER_TARGET_AVX2
+	static __m256i AtMost(__m256i data, char limit)
+	{
+		return _mm256_cmpeq_epi8(_mm256_min_epu8(data, _mm256_set1_epi8(limit)), data);
+	}
+
+	HTTP_PARSER_TARGET_AVX2
+	static const char* FindPathEnd(const char* p, const char* end)
+	{
+		while (end - p >= 32)
+		{
+			__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			__m256i stop = _mm256_or_si256(AtMost(data, 0x20),
+				_mm256_cmpeq_epi8(data, _mm256_set1_epi8(0x7f)));
+			unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(stop));
+
+			if (mask != 0)
+				return p + _tzcnt_u32(mask);
+
+			p += 32;
+		}
+
+		return ScanUntil(p, end, path_stop_chars);
+	}
+
+	HTTP_PARSER_TARGET_AVX2
+	static const char* FindValueEnd(const char* p, const char* end)
+	{
+		while (end - p >= 32)
+		{
+			__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			__m256i control = _mm256_andnot_si256(
+				_mm256_cmpeq_epi8(data, _mm256_set1_epi8('\t')), AtMost(data, 0x1f));
+			__m256i stop = _mm256_or_si256(control,
+				_mm256_cmpeq_epi8(data, _mm256_set1_epi8(0x7f)));
+			unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(stop));
+
+			if (mask != 0)
+				return p + _tzcnt_u32(mask);
+
+			p += 32;
+		}
+
+		return ScanUntil(p, end, value_stop_chars);
+	}
+};
+
+#endif
+
+/***************************************************************************++
+
+Routine Description:
+	Parses the request line and headers at the start of a receive buffer,
+	scanning paths and header values with the given scanner.
+
+Arguments:
+	pBuffer - Received bytes.
+	length  - Number of valid bytes in pBuffer.
+	request - Receives the parsed request. Views point into pBuffer.
+
+Return Value:
+	Length of the request head (including the blank line) on success,
+	0 if the head is not complete yet, -1 if the request is malformed.
+
+--***************************************************************************/
+template <typename Scanner>
+inline ptrdiff_t
+ParseHttpRequestWith(
+	const char* pBuffer,
+	size_t length,
+	http_request& request
+)
+{
+	const char* p = pBuffer;
+	const char* end = pBuffer + length;
+
+	//
+	// Request line: METHOD SP PATH SP HTTP/1.x CRLF
+	//
+	const char* method = p;
+
+	while (p < end && token_chars.match[static_cast<unsigned char>(*p)])
+		p++;
+
+	if (p == end)
+		return 0;
+
+	if (p == method || *p != ' ')
+		return -1;
+
+	const char* path = ++p;
+	p = Scanner::FindPathEnd(p, end);
+
+	if (p == end)
+		return 0;
+
+	if (p == path || *p != ' ')
+		return -1;
+
+	const char* version = ++p;
+
+	if (end - version < 10)
+	{
+		//
+		// Reject a bad version as soon as the bytes we have show it.
+		//
+		const char expected[] = "HTTP/1.";
+		size_t known = end - version < 7 ? end - version : 7;
+
+		return memcmp(version, expected, known) == 0 ? 0 : -1;
+	}
+
+	if (memcmp(version, "HTTP/1.", 7) != 0 ||
+		(version[7] != '0' && version[7] != '1') ||
+		version[8] != '\r' || version[9] != '\n')
+	{
+		return -1;
+	}
+
+	request.method = std::string_view(method, path - 1 - method);
+	request.path = std::string_view(path, version - 1 - path);
+	request.minor_version = version[7] - '0';
+	request.header_count = 0;
+	request.content_length = 0;
+	request.chunked = false;
+	request.keep_alive = request.minor_version >= 1;
+
+	//
+	// Framing headers that would let us and a proxy in front of us see
+	// different request boundaries are refused: a second Content-Length,
+	// a Transfer-Encoding whose last coding is not chunked, or both
+	// together (RFC 9112 section 6.3).
+	//
+	bool has_length = false;
+	bool has_coding = false;
+	bool close = false;
+	bool keep_alive = false;
+
+	p = version + 10;
+
+	//
+	// Header lines: NAME ":" OWS VALUE OWS CRLF, then an empty line.
+	//
+	for (;;)
+	{
+		if (p == end)
+			return 0;
+
+		if (*p == '\r')
+		{
+			if (p + 1 == end)
+				return 0;
+
+			if (p[1] != '\n')
+				return -1;
+
+			if (has_coding && (!request.chunked || has_length))
+				return -1;
+
+			if (close)
+				request.keep_alive = false;
+			else if (keep_alive)
+				request.keep_alive = true;
+
+			return p + 2 - pBuffer;
+		}
+
+		const char* name = p;
+
+		while (p < end && token_chars.match[static_cast<unsigned char>(*p)])
+			p++;
+
+		if (p == end)
+			return 0;
+
+		//
+		// An empty name covers obsolete line folding and stray bytes;
+		// white space before the colon is not allowed either.
+		//
+		if (p == name || *p != ':')
+			return -1;
+
+		const char* value = ++p;
+		p = Scanner::FindValueEnd(p, end);
+
+		if (p == end || (*p == '\r' && p + 1 == end))
+			return 0;
+
+		if (*p != '\r' || p[1] != '\n')
+			return -1;
+
+		if (request.header_count == max_request_headers)
+			return -1;
+
+		http_header& header = request.headers[request.header_count++];
+		header.name = std::string_view(name, value - 1 - name);
+		header.value = TrimHeaderValue(std::string_view(value, p - value));
+
+		p += 2;
+
+		if (HeaderNameEquals(header.name, "content-length"))
+		{
+			uint64_t number = 0;
+			if (has_length || header.value.empty() || header.value.size() > 19)
+				return -1;
+			for (char c : header.value)
+			{
+				if (c < '0' || c > '9')
+					return -1;
+				number = number * 10 + (c - '0');
+			}
+			request.content_length = number;
+			has_length = true;
+		}
+		else if (HeaderNameEquals(header.name, "transfer-encoding"))
+		{
+			//
+			// The codings of all Transfer-Encoding lines form one list,
+			// and chunked may only be the last of it.
+			//
+			for (std::string_view list = header.value; !list.empty();)
+			{
+				std::string_view coding = NextListElement(list);
+
+				if (coding.empty())
+					continue;
+
+				if (request.chunked)
+					return -1;
+
+				request.chunked = HeaderNameEquals(coding, "chunked");
+				has_coding = true;
+			}
+		}
+		else if (HeaderNameEquals(header.name, "connection"))
+		{
+			for (std::string_view list = header.value; !list.empty();)
+			{
+				std::string_view option = NextListElement(list);
+
+				if (HeaderNameEquals(option, "close"))
+					close = true;
+				else if (HeaderNameEquals(option, "keep-alive"))
+					keep_alive = true;
+			}
+		}
+	}
+}
+
+//
+// One entry point per variant. Each is compiled for its instruction set
+// and has the scanners inlined into it, so the choice between them is
+// made once per request rather than once per scan.
+//
+inline ptrdiff_t
+ParseHttpRequestScalar(
+	const char* pBuffer,
+	size_t length,
+	http_request& request
+)
+{
+	return ParseHttpRequestWith<scalar_scanner>(pBuffer, length, request);
+}
+
+#ifdef HTTP_PARSER_X86
+
+HTTP_PARSER_TARGET_SSE42 HTTP_PARSER_FLATTEN inline ptrdiff_t
+ParseHttpRequestSse42(
+	const char* pBuffer,
+	size_t length,
+	http_request& request
+)
+{
+	return ParseHttpRequestWith<sse42_scanner>(pBuffer, length, request);
+}
+
+HTTP_PARSER_TARGET_AVX2 HTTP_PARSER_FLATTEN inline ptrdiff_t
+ParseHttpRequestAvx2(
+	const char* pBuffer,
+	size_t length,
+	http_request& request
+)
+{
+	return ParseHttpRequestWith<avx2_scanner>(pBuffer, length, request);
+}
+
+#endif
+
+/***************************************************************************++
+
+Routine Description:
+	Reports whether the CPU (and, for AVX2, the OS) supports a parser
+	variant.
+
+Arguments:
+	isa - The variant.
+
+Return Value:
+	true if ParseHttpRequest may use it.
+
+--***************************************************************************/
+inline bool
+HttpParserIsaSupported(
+	http_parser_isa isa
+)
+{
+	if (isa == parser_isa_scalar)
+		return true;
+
+#if defined(HTTP_PARSER_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+
+	bool sse42 = (info[2] & (1 << 20)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	if (isa == parser_isa_sse42)
+		return sse42;
+
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+
+	return (info[1] & (1 << 5)) != 0 && (info[1] & (1 << 3)) != 0;
+#elif defined(HTTP_PARSER_X86)
+	__builtin_cpu_init();
+
+	if (isa == parser_isa_sse42)
+		return __builtin_cpu_supports("sse4.2");
+
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi");
+#else
+	return false;
+#endif
+}
+
+inline http_parser_isa
+DetectHttpParserIsa()
+{
+	if (HttpParserIsaSupported(parser_isa_avx2))
+		return parser_isa_avx2;
+
+	if (HttpParserIsaSupported(parser_isa_sse42))
+		return parser_isa_sse42;
+
+	return parser_isa_scalar;
+}
+
+//
+// The variant ParseHttpRequest uses. Set once at startup; micro-bench
+// switches it to compare the variants.
+//
+inline http_parser_isa http_parser_isa_in_use = DetectHttpParserIsa();
+
+/***************************************************************************++
+
+Routine Description:
+	Parses the request line and headers at the start of a receive buffer.
+
+Arguments:
+	pBuffer - Received bytes.
+	length  - Number of valid bytes in pBuffer.
+	request - Receives the parsed request. Views point into pBuffer.
+
+Return Value:
+	Length of the request head (including the blank line) on success,
+	0 if the head is not complete yet, -1 if the request is malformed.
+
+--***************************************************************************/
+inline ptrdiff_t
+ParseHttpRequest(
+	const char* pBuffer,
+	size_t length,
+	http_request& request
+)
+{
+#ifdef HTTP_PARSER_X86
+	switch (http_parser_isa_in_use)
+	{
+	case parser_isa_avx2:
+		return ParseHttpRequestAvx2(pBuffer, length, request);
+
+	case parser_isa_sse42:
+		return ParseHttpRequestSse42(pBuffer, length, request);
+
+	default:
+		break;
+	}
+#endif
+
+	return ParseHttpRequestScalar(pBuffer, length, request);
+}
+
+#endif
@@ -0,0 +1,2067 @@
+/*++
+ Linux socket backend for http-sys-bench.
+
+ Serves the same URLs as server/main.cpp from a user-space event loop, so
+ the http.sys numbers can be compared against a non-blocking socket server
+ on Linux hosts. Two engines are available:
+
+	--engine epoll   readiness based epoll loop (default)
+	--engine uring   completion based io_uring loop
+
+ --root DIR sets the directory served under /files/ (default "files").
+ --compute-threads N sets the size of the work-stealing pool that runs
+ /compute (default: one per CPU); 0 runs it on the I/O threads instead.
+
+ --threads N runs N engine threads instead of request_thread_count, and
+ --cpus LIST pins thread i to the i-th CPU of LIST (e.g. "0-15,32-47").
+ --shards gives every thread a listening socket of its own through
+ SO_REUSEPORT instead of sharing one, so threads share no accept queue.
+
+ --dynamic-compression gzips or deflates /sync and /text afresh for every
+ response instead of serving the variants compressed at startup.
+
+ --keep-alive-timeout, --header-timeout and --body-timeout set the
+ connection timeouts in seconds (60, 15 and 50 by default; 0 disables).
+
+ Clients may also speak cleartext HTTP/2 (h2c), with prior knowledge or
+ through "Upgrade: h2c", on the same port, and open a WebSocket on /ws,
+ which echoes every message back.
+
+ --tls also serves HTTPS on port 8443 (epoll engine only), with the
+ certificate chain and key in the PEM files given by --cert and --key, or
+ else a self-signed certificate for localhost made at startup.
+ --tls-resumption tickets|cache|off picks how sessions are resumed
+ (stateless tickets by default) and --ktls lets the kernel take over the
+ record layer where it can. Each of --cert, --key, --tls-resumption and
+ --ktls implies --tls.
+
+ --shed turns on admission control, answering 503 to requests that queued
+ too long once the server is overloaded. --shed-target and --shed-interval
+ set its target delay and interval in milliseconds (5 and 100), and
+ --max-in-flight N also sheds while a thread has N coroutine handlers
+ running; each of them implies --shed.
+
+ See README.md for the build command.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "server.h"
+#include "async_handler.h"
+#include "http2_session.h"
+#include "http_parser.h"
+#include "tls.h"
+#include "response_cache.h"
+#include "file_cache.h"
+#include "../router.h"
+#include "../static_files.h"
+#include "../cpu_list.h"
+#include "../json_writer.h"
+#include "../kv_store.h"
+#include "../crc32c.h"
+
+//
+// What a route handler gets to work with.
+//
+struct request_context
+{
+	connection* pConnection;
+	const http_request* pRequest;
+	std::string_view head;   // the raw request head
+	std::string_view entity;
+	bool body_complete;      // entity holds the whole body
+};
+
+typedef void (*request_handler)(request_context* pContext);
+
+int shutdown_event = -1;
+static std::atomic<size_t> kill_requests = 0;
+
+//
+// The body timeout matches the EntityBody limit the http.sys server sets.
+//
+connection_timeouts timeouts = {
+	std::chrono::seconds(60),
+	std::chrono::seconds(15),
+	std::chrono::seconds(50),
+};
+
+admission_settings admission;
+thread_local std::chrono::steady_clock::time_point receive_time;
+static thread_local admission_controller admission_state;
+
+//
+// Runs CPU-heavy handler work off the I/O threads; NULL when started with
+// --compute-threads 0.
+//
+static work_pool* compute_pool = nullptr;
+
+//
+// Largest /compute?n= accepted, and the rounds each piece of it covers
+// when spread over the pool.
+//
+const uint64_t max_compute_rounds = 4000000000ull;
+const uint64_t compute_grain = 64 * 1024;
+
+//
+// Size of the per-thread buffer JSON bodies are written into.
+//
+const size_t json_buffer_size = 4 * 1024;
+
+//
+// Backs /kv/.
+//
+static kv_store key_values;
+
+//
+// Prototypes.
+//
+void
+SendHttpResponse(
+	connection* pConnection,
+	static_response_id id,
+	content_coding coding = coding_identity
+);
+
+content_coding
+AcceptedCoding(
+	const http_request& request
+);
+
+void
+SendHttpPostResponse(
+	connection* pConnection,
+	std::string_view entity
+);
+
+void
+SendHttpPostStreamResponse(
+	connection* pConnection,
+	const http_request& request
+);
+
+void
+SendSinkResponse(
+	connection* pConnection,
+	uint64_t length,
+	uint32_t crc
+);
+
+void HandleSync(request_context* pContext);
+void HandleText(request_context* pContext);
+void HandlePlaintext(request_context* pContext);
+void HandleJson(request_context* pContext);
+void HandleEcho(request_context* pContext);
+void HandleKill(request_context* pContext);
+void HandleFile(request_context* pContext);
+void HandleStats(request_context* pContext);
+void HandleKv(request_context* pContext);
+void HandleSink(request_context* pContext);
+void HandleWebSocket(request_context* pContext);
+
+task<http_response> HandleDelay(async_request& request);
+task<http_response> HandleCompute(async_request& request);
+task<http_response> HandleKvPut(async_request& request);
+
+//
+// Runs a coroutine handler from the route table.
+//
+template <async_handler Handler>
+void HandleAsync(request_context* pContext)
+{
+	StartAsyncCall(pContext->pConnection, *pContext->pRequest, pContext->head,
+		pContext->entity, pContext->body_complete, Handler);
+}
+
+//
+// The route table; the same routes as server/main.cpp, dispatched through
+// a perfect hash built at compile time.
+//
+constexpr route<request_handler> routes[] = {
+	{ method_get,  "/sync", HandleSync },
+	{ method_post, "/sync", HandleEcho },
+	{ method_get,  "/text", HandleText },
+	{ method_get,  "/plaintext", HandlePlaintext },
+	{ method_get,  "/json", HandleJson },
+	{ method_get,  "/kill", HandleKill },
+	{ method_post, "/kill", HandleKill },
+	{ method_get,  "/files/*", HandleFile },
+	{ method_head, "/files/*", HandleFile },
+	{ method_get,  "/stats", HandleStats },
+	{ method_get,  "/delay", HandleAsync<HandleDelay> },
+	{ method_post, "/delay", HandleAsync<HandleDelay> },
+	{ method_get,  "/compute", HandleAsync<HandleCompute> },
+	{ method_get,  "/kv/*", HandleKv },
+	{ method_put,  "/kv/*", HandleKv },
+	{ method_delete, "/kv/*", HandleKv },
+	{ method_post, "/sink", HandleSink },
+	{ method_put,  "/sink", HandleSink },
+	{ method_get,  "/ws", HandleWebSocket },
+};
+
+const std::string_view files_prefix = "/files/";
+const std::string_view kv_prefix = "/kv/";
+
+static constexpr router<request_handler, std::size(routes)> Router(routes);
+
+//
+// Prototypes.
+//
+static size_t
+HandleWebSocketInput(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length
+);
+
+static int
+CreateListener(
+	unsigned short port,
+	bool nonblocking,
+	bool reuseport,
+	int cpu
+);
+
+static void
+PinThread(
+	unsigned cpu
+);
+
+/***************************************************************************++
+
+Routine Description:
+	main routine.
+
+Arguments:
+	argc - # of command line arguments.
+	argv - Arguments.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+int
+main(
+	int argc,
+	char* argv[]
+)
+{
+	std::vector<int> listen_fds;
+	std::vector<int> tls_listen_fds;
+	std::vector<unsigned> cpus;
+	bool use_uring = false;
+	bool shards = false;
+	bool dynamic_compression = false;
+	const char* file_root = default_file_root;
+	long compute_threads = std::thread::hardware_concurrency();
+	long thread_count = request_thread_count;
+	tls_settings tls = {};
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc &&
+			(strcmp(argv[i + 1], "epoll") == 0 || strcmp(argv[i + 1], "uring") == 0))
+		{
+			use_uring = strcmp(argv[++i], "uring") == 0;
+		}
+		else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
+		{
+			file_root = argv[++i];
+		}
+		else if (strcmp(argv[i], "--compute-threads") == 0 && i + 1 < argc)
+		{
+			compute_threads = strtol(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc &&
+			(thread_count = strtol(argv[i + 1], nullptr, 10)) > 0)
+		{
+			i++;
+		}
+		else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc && ParseCpuList(argv[i + 1], &cpus))
+		{
+			i++;
+		}
+		else if (strcmp(argv[i], "--shards") == 0)
+		{
+			shards = true;
+		}
+		else if (strcmp(argv[i], "--dynamic-compression") == 0)
+		{
+			dynamic_compression = true;
+		}
+		else if (strcmp(argv[i], "--keep-alive-timeout") == 0 && i + 1 < argc)
+		{
+			timeouts.keep_alive = std::chrono::seconds(strtol(argv[++i], nullptr, 10));
+		}
+		else if (strcmp(argv[i], "--header-timeout") == 0 && i + 1 < argc)
+		{
+			timeouts.header = std::chrono::seconds(strtol(argv[++i], nullptr, 10));
+		}
+		else if (strcmp(argv[i], "--body-timeout") == 0 && i + 1 < argc)
+		{
+			timeouts.body = std::chrono::seconds(strtol(argv[++i], nullptr, 10));
+		}
+		else if (strcmp(argv[i], "--shed") == 0)
+		{
+			admission.enabled = true;
+		}
+		else if (strcmp(argv[i], "--shed-target") == 0 && i + 1 < argc)
+		{
+			admission.enabled = true;
+			admission.target_ns = strtoull(argv[++i], nullptr, 10) * 1000000;
+		}
+		else if (strcmp(argv[i], "--shed-interval") == 0 && i + 1 < argc)
+		{
+			admission.enabled = true;
+			admission.interval_ns = strtoull(argv[++i], nullptr, 10) * 1000000;
+		}
+		else if (strcmp(argv[i], "--max-in-flight") == 0 && i + 1 < argc)
+		{
+			admission.enabled = true;
+			admission.max_in_flight = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--tls") == 0)
+		{
+			tls.enabled = true;
+		}
+		else if (strcmp(argv[i], "--cert") == 0 && i + 1 < argc)
+		{
+			tls.enabled = true;
+			tls.cert_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc)
+		{
+			tls.enabled = true;
+			tls.key_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "--tls-resumption") == 0 && i + 1 < argc &&
+			(strcmp(argv[i + 1], "tickets") == 0 || strcmp(argv[i + 1], "cache") == 0 ||
+				strcmp(argv[i + 1], "off") == 0))
+		{
+			tls.enabled = true;
+			i++;
+			tls.resumption = strcmp(argv[i], "tickets") == 0 ? tls_resume_tickets :
+				strcmp(argv[i], "cache") == 0 ? tls_resume_cache : tls_resume_off;
+		}
+		else if (strcmp(argv[i], "--ktls") == 0)
+		{
+			tls.enabled = true;
+			tls.ktls = true;
+		}
+		else
+		{
+			printf("usage: %s [--engine epoll|uring] [--root DIR] [--compute-threads N]\n"
+				"       [--threads N] [--cpus LIST] [--shards] [--dynamic-compression]\n"
+				"       [--keep-alive-timeout S] [--header-timeout S] [--body-timeout S]\n"
+				"       [--shed] [--shed-target MS] [--shed-interval MS] [--max-in-flight N]\n"
+				"       [--tls] [--cert FILE] [--key FILE] [--tls-resumption tickets|cache|off] [--ktls]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (tls.enabled && use_uring)
+	{
+		printf("--tls needs the epoll engine \n");
+		return 1;
+	}
+
+	if (tls.key_file != nullptr && tls.cert_file == nullptr)
+	{
+		printf("--key needs --cert \n");
+		return 1;
+	}
+
+	printf("Starting server (%s engine, %s request parser, %ld compute threads)\n",
+		use_uring ? "io_uring" : "epoll", HttpParserIsaName(http_parser_isa_in_use),
+		compute_threads > 0 ? compute_threads : 0);
+
+	printf("%ld threads, %s, %s\n", thread_count,
+		shards ? "one listener per thread" : "one shared listener",
+		cpus.empty() ? "not pinned" : "pinned");
+
+	printf("%s compression\n", dynamic_compression ? "dynamic" : "precompressed");
+
+	if (admission.enabled)
+	{
+		printf("shedding requests queued over %llu ms when overloaded "
+			"(interval %llu ms, in-flight cap %zu)\n",
+			(unsigned long long)(admission.target_ns / 1000000),
+			(unsigned long long)(admission.interval_ns / 1000000), admission.max_in_flight);
+	}
+
+	if (tls.enabled)
+	{
+		printf("TLS on port %u (%s certificate, resumption %s, kernel TLS %s)\n", tls_port,
+			tls.cert_file ? "given" : "self-signed", TlsResumptionName(tls.resumption),
+			tls.ktls ? "where available" : "off");
+
+		if (!InitializeTls(tls))
+			return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	shutdown_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (shutdown_event < 0)
+	{
+		printf("eventfd failed with %d \n", errno);
+		return errno;
+	}
+
+	//
+	// The epoll engine drains the listener with non-blocking accepts; the
+	// io_uring engine leaves waiting to the kernel.
+	//
+	for (long i = 0; i < (shards ? thread_count : 1); i++)
+	{
+		int cpu = shards && !cpus.empty() ? (int)cpus[i % cpus.size()] : -1;
+		int fd = CreateListener(server_port, !use_uring, shards, cpu);
+		int tls_fd = tls.enabled && fd >= 0 ? CreateListener(tls_port, true, shards, cpu) : -1;
+
+		if (fd < 0 || (tls.enabled && tls_fd < 0))
+		{
+			int error = errno;
+
+			if (fd >= 0)
+				close(fd);
+
+			for (int listen_fd : listen_fds)
+				close(listen_fd);
+
+			for (int listen_fd : tls_listen_fds)
+				close(listen_fd);
+
+			return error;
+		}
+
+		listen_fds.push_back(fd);
+
+		if (tls_fd >= 0)
+			tls_listen_fds.push_back(tls_fd);
+	}
+
+	InitializeResponseCache(dynamic_compression);
+	SetFileRoot(file_root);
+
+	if (compute_threads > 0)
+		compute_pool = new work_pool((size_t)compute_threads);
+
+	Router.for_each_path([&tls](std::string_view path)
+	{
+		printf("listening for requests on url: http://localhost:%u%.*s\n",
+			server_port, (int)path.size(), path.data());
+
+		if (tls.enabled)
+		{
+			printf("listening for requests on url: https://localhost:%u%.*s\n",
+				tls_port, (int)path.size(), path.data());
+		}
+	});
+
+	{
+		std::vector<std::thread> threads;
+
+		//
+		// Refresh the Date header of the cached responses once per second
+		// until shutdown.
+		//
+		threads.emplace_back(std::thread([]()
+		{
+			pollfd pfd = { shutdown_event, POLLIN, 0 };
+
+			while (poll(&pfd, 1, 1000) == 0)
+			{
+				RefreshResponseCache();
+			}
+		}));
+
+		for (long i = 0; i < thread_count; i++)
+		{
+			int fd = listen_fds[shards ? i : 0];
+			int tls_fd = tls_listen_fds.empty() ? -1 : tls_listen_fds[shards ? i : 0];
+			int cpu = cpus.empty() ? -1 : (int)cpus[i % cpus.size()];
+
+			threads.emplace_back(std::thread([fd, tls_fd, cpu, use_uring]()
+			{
+				//
+				// Pin before the engine allocates anything, so its ring,
+				// buffers and connections come from the local NUMA node.
+				//
+				if (cpu >= 0)
+					PinThread(cpu);
+
+				if (use_uring)
+					DoReceiveRequestsUring(fd);
+				else
+					DoReceiveRequests(fd, tls_fd);
+			}));
+		}
+
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+	}
+
+	//
+	// Waits for jobs still running on the pool.
+	//
+	delete compute_pool;
+
+	for (int listen_fd : listen_fds)
+		close(listen_fd);
+
+	for (int listen_fd : tls_listen_fds)
+		close(listen_fd);
+
+	if (tls.enabled)
+		CleanupTls();
+
+	close(shutdown_event);
+
+	return 0;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Creates a listening socket on a port. With reuseport, every
+	thread gets one of these and the kernel spreads new connections over
+	them; giving each the CPU its thread is pinned to (SO_INCOMING_CPU)
+	lets the kernel hand a connection to the listener on the CPU that
+	received it.
+
+Arguments:
+	port        - server_port, or tls_port.
+	nonblocking - Make the socket non-blocking.
+	reuseport   - Join the port's SO_REUSEPORT group.
+	cpu         - CPU of the thread that will accept from it, or -1.
+
+Return Value:
+	The socket, or -1 on failure.
+
+--***************************************************************************/
+static int
+CreateListener(
+	unsigned short port,
+	bool nonblocking,
+	bool reuseport,
+	int cpu
+)
+{
+	int one = 1;
+	sockaddr_in addr = {};
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+
+	if (listen_fd < 0)
+	{
+		printf("socket failed with %d \n", errno);
+		return -1;
+	}
+
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+	{
+		printf("SO_REUSEPORT failed with %d \n", errno);
+		close(listen_fd);
+		return -1;
+	}
+
+	if (reuseport && cpu >= 0)
+		setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+		listen(listen_fd, SOMAXCONN) != 0)
+	{
+		printf("bind/listen on port %u failed with %d \n", port, errno);
+		close(listen_fd);
+		return -1;
+	}
+
+	return listen_fd;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Pins the calling thread to one CPU.
+
+Arguments:
+	cpu - The CPU.
+
+Return Value:
+	None. A CPU that can't be used is reported and the thread stays
+	unpinned.
+
+--***************************************************************************/
+static void
+PinThread(
+	unsigned cpu
+)
+{
+	cpu_set_t set;
+	int error = EINVAL;
+
+	CPU_ZERO(&set);
+
+	if (cpu < CPU_SETSIZE)
+	{
+		CPU_SET(cpu, &set);
+		error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	if (error != 0)
+	{
+		printf("pinning a thread to CPU %u failed with %d \n", cpu, error);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Takes as much of the current request body as has arrived, decoding
+	chunked transfer coding, and echoes each piece back as it goes,
+	checksums it, hands it to a coroutine handler that is collecting it,
+	or drops it.
+
+Arguments:
+	pConnection - The connection whose body is in progress.
+	pData       - Received bytes that follow what was already consumed.
+	available   - Number of bytes at pData.
+
+Return Value:
+	Bytes consumed, or -1 if the chunked coding is malformed or the body
+	is too big for the handler collecting it.
+
+--***************************************************************************/
+static ptrdiff_t
+ConsumeRequestBody(
+	connection* pConnection,
+	const char* pData,
+	size_t available
+)
+{
+	body_stream& body = pConnection->body;
+	size_t used = 0;
+
+	while (body.state != body_idle)
+	{
+		switch (body.state)
+		{
+		case body_data:
+		case body_chunk_data:
+		{
+			size_t length = available - used;
+
+			if (length > body.remaining)
+				length = (size_t)body.remaining;
+
+			if (length != 0 && body.echo)
+			{
+				BeginEchoChunk(pConnection, length);
+				pConnection->out.append(pData + used, length);
+				EndEchoChunk(pConnection);
+			}
+			else if (length != 0 && body.sink)
+			{
+				SinkRequestBody(pConnection, pData + used, length);
+			}
+			else if (length != 0 && pConnection->async != nullptr &&
+				!AppendAsyncBody(pConnection, pData + used, length))
+			{
+				return -1;
+			}
+
+			used += length;
+			body.remaining -= length;
+
+			if (body.remaining != 0)
+				return used;
+
+			if (body.state == body_data)
+				EndRequestBody(pConnection);
+			else
+				body.state = body_chunk_end;
+			break;
+		}
+
+		case body_chunk_size:
+		{
+			//
+			// chunk-size [ chunk-ext ] CRLF
+			//
+			const char* line = pData + used;
+			const char* eol = static_cast<const char*>(memchr(line, '\n', available - used));
+			uint64_t size = 0;
+			size_t digits = 0;
+
+			if (eol == nullptr)
+				return available - used > max_chunk_line ? -1 : (ptrdiff_t)used;
+
+			for (const char* p = line; p < eol; p++, digits++)
+			{
+				int value;
+
+				if (*p >= '0' && *p <= '9')
+					value = *p - '0';
+				else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+					value = (*p | 0x20) - 'a' + 10;
+				else
+					break;
+
+				if (digits == 15)
+					return -1;
+
+				size = size * 16 + value;
+			}
+
+			if (digits == 0)
+				return -1;
+
+			used = eol + 1 - pData;
+			body.remaining = size;
+			body.state = size ? body_chunk_data : body_trailer;
+			break;
+		}
+
+		case body_chunk_end:
+			if (available - used < 2)
+				return used;
+
+			if (pData[used] != '\r' || pData[used + 1] != '\n')
+				return -1;
+
+			used += 2;
+			body.state = body_chunk_size;
+			break;
+
+		case body_trailer:
+		{
+			//
+			// Trailer fields are dropped; an empty line ends the body.
+			//
+			const char* line = pData + used;
+			const char* eol = static_cast<const char*>(memchr(line, '\n', available - used));
+
+			if (eol == nullptr)
+				return available - used > max_chunk_line ? -1 : (ptrdiff_t)used;
+
+			used = eol + 1 - pData;
+
+			if (eol == line || (eol == line + 1 && line[0] == '\r'))
+				EndRequestBody(pConnection);
+			break;
+		}
+
+		default:
+			return -1;
+		}
+	}
+
+	return used;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Asks the thread's admission controller whether to serve a request,
+	and counts it if not.
+
+Arguments:
+	received - When the server got to the request. Its queueing delay is
+	           the time since receive_time.
+
+Return Value:
+	false if the request should be shed.
+
+--***************************************************************************/
+static bool
+AdmitRequest(
+	std::chrono::steady_clock::time_point received
+)
+{
+	if (!admission.enabled)
+		return true;
+
+	auto delay = received > receive_time ? received - receive_time : std::chrono::nanoseconds(0);
+	uint64_t now = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		received.time_since_epoch()).count();
+
+	if (admission_state.admit(admission, now,
+		(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count(),
+		AsyncCallsInFlight()))
+	{
+		return true;
+	}
+
+	StatAdd(thread_stats->shed, 1);
+	return false;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Handles every complete request in a block of received bytes in one
+	pass. This is the socket equivalent of the http.sys DoReceiveRequests
+	loop, except that all the requests a client pipelined into one read
+	are parsed together and their responses pile up in the output buffer,
+	so the engine sends them with a single write.
+
+Arguments:
+	pConnection  - The connection the bytes arrived on.
+	pBuffer      - The received bytes, starting at a request boundary.
+	length       - Number of bytes in pBuffer.
+	pHandled     - Incremented for each request handled.
+
+Return Value:
+	Number of bytes consumed. The rest is an incomplete request (or
+	follows a request that must finish first) and has to be kept.
+
+--***************************************************************************/
+size_t
+HandleRequestBuffer(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length,
+	int* pHandled
+)
+{
+	size_t consumed = 0;
+	auto received = std::chrono::steady_clock::now();
+
+	if (pConnection->h2 != nullptr)
+		return HandleHttp2Input(pConnection, pBuffer, length, pHandled);
+
+	if (pConnection->websocket)
+		return HandleWebSocketInput(pConnection, pBuffer, length);
+
+	//
+	// Keep going while a body is arriving even if the connection is to be
+	// closed: the rest of the body still has to be echoed or dropped.
+	//
+	while (pConnection->body.state != body_idle || !pConnection->close_after_send)
+	{
+		http_request request;
+		const char* pData = pBuffer + consumed;
+		size_t available = length - consumed;
+
+		if (pConnection->body.state != body_idle)
+		{
+			ptrdiff_t used = ConsumeRequestBody(pConnection, pData, available);
+
+			if (used < 0)
+			{
+				//
+				// Malformed chunked body, or one too big to collect. The
+				// response is already under way, so all we can do is end
+				// the connection.
+				//
+				pConnection->body = {};
+				pConnection->close_after_send = true;
+				break;
+			}
+
+			consumed += used;
+
+			if (pConnection->body.state != body_idle)
+			{
+				// Wait for more of the body.
+				break;
+			}
+
+			continue;
+		}
+
+		if (pConnection->file.remaining != 0 || pConnection->async != nullptr)
+		{
+			//
+			// The engine is still sending a file, or a coroutine handler
+			// has yet to respond; responses stay in order.
+			//
+			break;
+		}
+
+		//
+		// An HTTP/2 client with prior knowledge starts with the preface
+		// instead of a request. Stand-ins of HTTP/2 streams never switch.
+		//
+		bool preface_complete;
+
+		if (pConnection->stream == nullptr && IsHttp2Preface(pData, available, &preface_complete))
+		{
+			if (!preface_complete)
+				break;
+
+			StartHttp2Session(pConnection);
+			return consumed + HandleHttp2Input(pConnection, pData, available, pHandled);
+		}
+
+		ptrdiff_t head = ParseHttpRequest(pData, available, request);
+
+		if (head == 0 && available <= max_request_head)
+		{
+			break;
+		}
+
+		if (head <= 0)
+		{
+			pConnection->close_after_send = true;
+			SendHttpResponse(pConnection, response_bad_request);
+			break;
+		}
+
+		//
+		// A body that is already here in full is handed to the handler
+		// as-is. Anything else is streamed through ConsumeRequestBody as
+		// it arrives, so a large upload never has to fit in memory.
+		//
+		bool complete = !request.chunked && available - head >= request.content_length;
+		std::string_view settings;
+
+		//
+		// Upgrade: h2c is only taken on requests without a body, which
+		// would otherwise have to be read as HTTP/1.1 first.
+		//
+		if (pConnection->stream == nullptr && !request.chunked && request.content_length == 0 &&
+			WantsHttp2Upgrade(request, &settings))
+		{
+			pConnection->timeout = timeout_none;
+			UpgradeToHttp2(pConnection, std::string_view(pData, head), settings, pHandled);
+			consumed += head;
+			return consumed + HandleHttp2Input(pConnection, pBuffer + consumed, length - consumed, pHandled);
+		}
+
+		request_context context = { pConnection, &request, std::string_view(pData, head),
+			std::string_view(pData + head, complete ? request.content_length : 0), complete };
+		route_result result;
+
+		consumed += head;
+		*pHandled += 1;
+
+		//
+		// The next request head to start arriving gets a header deadline
+		// of its own (see UpdateConnectionTimeout).
+		//
+		pConnection->timeout = timeout_none;
+
+		if (complete)
+		{
+			consumed += request.content_length;
+		}
+		else
+		{
+			pConnection->body.state = request.chunked ? body_chunk_size : body_data;
+			pConnection->body.remaining = request.content_length;
+
+			//
+			// Clients that wait for permission before sending a large
+			// body get it straight away; we never reject on size.
+			//
+			for (size_t i = 0; i < request.header_count; i++)
+			{
+				if (HeaderNameEquals(request.headers[i].name, "expect") &&
+					HeaderNameEquals(request.headers[i].value, "100-continue") &&
+					request.minor_version >= 1)
+				{
+					pConnection->out.append("HTTP/1.1 100 Continue\r\n\r\n");
+				}
+			}
+		}
+
+		if (!request.keep_alive)
+		{
+			pConnection->close_after_send = true;
+		}
+
+		request_handler handler = Router.lookup(
+			ParseHttpMethod(request.method), request.path, &result);
+
+		//
+		// /kill and /stats are never shed: an overloaded server still has
+		// to be observable and to stop when told.
+		//
+		if (result == route_found && handler != HandleKill && handler != HandleStats &&
+			!AdmitRequest(received))
+		{
+			SendHttpResponse(pConnection, response_overloaded);
+		}
+		else switch (result)
+		{
+		case route_found:
+			handler(&context);
+			break;
+
+		case route_method_not_allowed:
+			printf("Got a unknown request for %.*s \n",
+				(int)request.path.size(), request.path.data());
+
+			SendHttpResponse(pConnection, response_not_implemented);
+			break;
+
+		default:
+			SendHttpResponse(pConnection, response_not_found);
+			break;
+		}
+
+		//
+		// A coroutine handler that is still running records its latency
+		// when it finishes.
+		//
+		StatAdd(thread_stats->requests, 1);
+
+		if (pConnection->async == nullptr)
+			thread_stats->record_latency(std::chrono::steady_clock::now() - received);
+
+		//
+		// The rest of the input is the first of the client's frames.
+		//
+		if (pConnection->websocket)
+			return consumed + HandleWebSocketInput(pConnection, pBuffer + consumed, length - consumed);
+	}
+
+	return consumed;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Handles every complete request sitting in the connection's input
+	buffer.
+
+Arguments:
+	pConnection  - The connection with new data.
+	pHandled     - Incremented for each request handled.
+
+Return Value:
+	None. Responses are appended to the connection's output buffer.
+
+--***************************************************************************/
+void
+HandleRequests(
+	connection* pConnection,
+	int* pHandled
+)
+{
+	//
+	// Input held back until a file body was sent or a handler finished
+	// has been waiting on its own connection, not in a queue of the
+	// server's.
+	//
+	receive_time = std::chrono::steady_clock::now();
+
+	size_t consumed = HandleRequestBuffer(pConnection,
+		pConnection->in.data(), pConnection->in.size(), pHandled);
+
+	pConnection->in.erase(0, consumed);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Handles bytes just received on a connection. When nothing is left
+	over from earlier reads, the requests are parsed straight out of the
+	receive buffer and only an incomplete tail is copied into the
+	connection.
+
+Arguments:
+	pConnection  - The connection the bytes arrived on.
+	pBuffer      - The received bytes.
+	length       - Number of bytes in pBuffer.
+	pHandled     - Incremented for each request handled.
+
+Return Value:
+	None. Responses are appended to the connection's output buffer.
+
+--***************************************************************************/
+void
+HandleReceivedData(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length,
+	int* pHandled
+)
+{
+	StatAdd(thread_stats->bytes_in, length);
+
+	if (!pConnection->in.empty())
+	{
+		pConnection->in.append(pBuffer, length);
+		pConnection->in.erase(0, HandleRequestBuffer(pConnection,
+			pConnection->in.data(), pConnection->in.size(), pHandled));
+		return;
+	}
+
+	size_t consumed = HandleRequestBuffer(pConnection, pBuffer, length, pHandled);
+
+	//
+	// The socket counterpart of http.sys's ERROR_MORE_DATA: a request that
+	// didn't arrive in one read has to be copied aside.
+	//
+	if (consumed != length)
+		StatAdd(thread_stats->buffer_regrowths, 1);
+
+	pConnection->in.append(pBuffer + consumed, length - consumed);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	The routine queues a fixed HTTP response on the connection. The
+	response was serialized at startup (see response_cache.cpp), so this
+	is a single copy with no formatting.
+
+Arguments:
+	pConnection - The connection to respond on.
+	id          - The cached response to send.
+	coding      - The coding the client accepts (see AcceptedCoding).
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SendHttpResponse(
+	connection* pConnection,
+	static_response_id id,
+	content_coding coding
+)
+{
+	std::string_view response = GetStaticResponse(id, coding, pConnection->close_after_send);
+
+	thread_stats->record_status(GetStaticResponseStatus(id));
+	pConnection->out.append(response.data(), response.size());
+}
+
+/***************************************************************************++
+
+Routine Description:
+	The routine echoes the request entity body back to the client.
+
+Arguments:
+	pConnection - The connection to respond on.
+	entity      - The request entity body.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SendHttpPostResponse(
+	connection* pConnection,
+	std::string_view entity
+)
+{
+	BeginResponseHead(pConnection, 200);
+	AppendHeader(pConnection, "Content-Length", (uint64_t)entity.size());
+	EndResponseHead(pConnection);
+	pConnection->out.append(entity.data(), entity.size());
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Starts echoing a request body that is still arriving. HTTP/1.1
+	clients get a chunked response with one chunk per piece received;
+	HTTP/1.0 clients get the raw body and the connection is closed to
+	end it.
+
+Arguments:
+	pConnection - The connection to respond on.
+	request     - The request whose body is echoed.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SendHttpPostStreamResponse(
+	connection* pConnection,
+	const http_request& request
+)
+{
+	bool framed = request.minor_version >= 1;
+
+	if (!framed)
+	{
+		pConnection->close_after_send = true;
+	}
+
+	BeginResponseHead(pConnection, 200);
+
+	if (framed)
+	{
+		AppendHeader(pConnection, "Transfer-Encoding", "chunked");
+	}
+
+	EndResponseHead(pConnection);
+	pConnection->body.echo = true;
+	pConnection->body.framed = framed;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Chunk framing for an echoed body. The engines call these too when
+	they move body bytes themselves (see SpliceRequestBody).
+
+Arguments:
+	pConnection - The connection whose body is echoed.
+	length      - Size of the chunk that follows.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+BeginEchoChunk(
+	connection* pConnection,
+	uint64_t length
+)
+{
+	if (pConnection->body.framed)
+	{
+		AppendNumber(pConnection->out, length, 16);
+		pConnection->out.append("\r\n", 2);
+	}
+}
+
+void
+EndEchoChunk(
+	connection* pConnection
+)
+{
+	if (pConnection->body.framed)
+	{
+		pConnection->out.append("\r\n", 2);
+	}
+}
+
+void
+SinkRequestBody(
+	connection* pConnection,
+	const char* pData,
+	size_t length
+)
+{
+	pConnection->body.crc = Crc32c(pConnection->body.crc, pData, length);
+	pConnection->body.sunk += length;
+}
+
+void
+EndRequestBody(
+	connection* pConnection
+)
+{
+	if (pConnection->body.echo && pConnection->body.framed)
+	{
+		pConnection->out.append("0\r\n\r\n", 5);
+	}
+
+	if (pConnection->body.sink)
+	{
+		SendSinkResponse(pConnection, pConnection->body.sunk, pConnection->body.crc);
+	}
+
+	pConnection->body = {};
+
+	if (pConnection->async != nullptr)
+	{
+		FinishAsyncBody(pConnection);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Re-arms a connection's timeout for the state it is in now. Engines call
+	this after every pass over a connection, so the keep-alive and body
+	deadlines move on with each request or piece of progress. The header
+	deadline does not: it is set when a request head starts arriving and
+	stays put until the head is complete, so a client trickling a head in
+	a byte at a time is still cut off.
+
+Arguments:
+	pConnection    - The connection.
+	output_pending - Response bytes are waiting for the client to read
+	                 them (or a file body is still being sent).
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+UpdateConnectionTimeout(
+	connection* pConnection,
+	bool output_pending
+)
+{
+	timeout_phase phase;
+	std::chrono::milliseconds limit;
+	bool handler_running;
+	bool streams_open = Http2StreamsPending(pConnection, &handler_running);
+
+	//
+	// HTTP/2 streams count as requests in progress, so a connection isn't
+	// timed out while one of them waits for a coroutine handler.
+	//
+	if (pConnection->async != nullptr || handler_running)
+	{
+		phase = timeout_none;
+		limit = {};
+	}
+	else if (output_pending || pConnection->body.state != body_idle || streams_open ||
+		pConnection->ws.frame_remaining() != 0)
+	{
+		phase = timeout_body;
+		limit = timeouts.body;
+	}
+	else if (!pConnection->in.empty())
+	{
+		phase = timeout_header;
+		limit = timeouts.header;
+
+		if (pConnection->timeout == timeout_header)
+			return;
+	}
+	else
+	{
+		phase = timeout_keep_alive;
+		limit = timeouts.keep_alive;
+	}
+
+	pConnection->timeout = phase;
+
+	if (limit.count() == 0)
+	{
+		CancelThreadTimer(&pConnection->timer);
+		return;
+	}
+
+	pConnection->timer.fire = ConnectionTimerFired;
+	pConnection->timer.pConnection = pConnection;
+	ArmThreadTimer(&pConnection->timer, std::chrono::steady_clock::now() + limit);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /sync - sends the fixed greeting.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleSync(
+	request_context* pContext
+)
+{
+	SendHttpResponse(pContext->pConnection, response_sync, AcceptedCoding(*pContext->pRequest));
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /text - sends a 16 KB HTML page, gzip or deflate encoded if the
+	client accepts that.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleText(
+	request_context* pContext
+)
+{
+	SendHttpResponse(pContext->pConnection, response_text, AcceptedCoding(*pContext->pRequest));
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /plaintext - the TechEmpower plaintext test: "Hello, World!" as
+	text/plain. The rules allow the body to be reused, so the whole
+	response is a cached one.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandlePlaintext(
+	request_context* pContext
+)
+{
+	SendHttpResponse(pContext->pConnection, response_plaintext);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /json - the TechEmpower JSON test: {"message":"Hello, World!"},
+	serialized afresh for every request as the rules require. The body is
+	written into a buffer of the thread's and the head is formatted around
+	it, so nothing is allocated.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleJson(
+	request_context* pContext
+)
+{
+	static thread_local char buffer[json_buffer_size];
+	json_writer writer(buffer, sizeof(buffer));
+
+	writer.begin_object();
+	writer.key("message");
+	writer.value("Hello, World!");
+	writer.end_object();
+
+	SendHttpResponse(pContext->pConnection, 200, "application/json", writer.view());
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Finds the coding to answer a request with from its Accept-Encoding
+	header.
+
+Arguments:
+	request - The parsed request.
+
+Return Value:
+	The coding; identity if the header is missing.
+
+--***************************************************************************/
+content_coding
+AcceptedCoding(
+	const http_request& request
+)
+{
+	for (size_t i = 0; i < request.header_count; i++)
+	{
+		if (HeaderNameEquals(request.headers[i].name, "accept-encoding"))
+			return NegotiateContentCoding(request.headers[i].value);
+	}
+
+	return coding_identity;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	POST /sync - echoes the entity body back.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleEcho(
+	request_context* pContext
+)
+{
+	printf("Got a POST request for %.*s \n",
+		(int)pContext->pRequest->path.size(), pContext->pRequest->path.data());
+
+	if (pContext->body_complete)
+		SendHttpPostResponse(pContext->pConnection, pContext->entity);
+	else
+		SendHttpPostStreamResponse(pContext->pConnection, *pContext->pRequest);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET/HEAD /files/<path> - serves a file from the file root, whole or
+	as a single byte range. Only the headers are formatted here; the body
+	is left for the engine to send straight from the cached file.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleFile(
+	request_context* pContext
+)
+{
+	connection* pConnection = pContext->pConnection;
+	const http_request& request = *pContext->pRequest;
+	std::shared_ptr<const cached_file> file;
+	std::string path;
+
+	if (!DecodeFilePath(request.path.substr(files_prefix.size()), &path) ||
+		(file = OpenCachedFile(path)) == nullptr)
+	{
+		SendHttpResponse(pConnection, response_not_found);
+		return;
+	}
+
+	uint64_t first = 0;
+	uint64_t length = file->size;
+	byte_range_result range = range_none;
+
+	for (size_t i = 0; i < request.header_count; i++)
+	{
+		if (HeaderNameEquals(request.headers[i].name, "range"))
+		{
+			range = ParseByteRange(request.headers[i].value, file->size, &first, &length);
+		}
+	}
+
+	std::string& out = pConnection->out;
+
+	if (range == range_unsatisfiable)
+	{
+		length = 0;
+	}
+
+	BeginResponseHead(pConnection, range == range_satisfiable ? 206 :
+		range == range_unsatisfiable ? 416 : 200);
+	AppendHeader(pConnection, "Content-Type", file->content_type);
+	AppendHeader(pConnection, "Content-Length", length);
+	AppendHeader(pConnection, "Accept-Ranges", "bytes");
+
+	if (range == range_satisfiable)
+	{
+		out.append("Content-Range: bytes ");
+		AppendNumber(out, first);
+		out.append("-");
+		AppendNumber(out, first + length - 1);
+		out.append("/");
+		AppendNumber(out, file->size);
+		out.append("\r\n");
+	}
+	else if (range == range_unsatisfiable)
+	{
+		out.append("Content-Range: bytes */");
+		AppendNumber(out, file->size);
+		out.append("\r\n");
+	}
+
+	out.append(file->last_modified);
+	EndResponseHead(pConnection);
+
+	if (length != 0 && ParseHttpMethod(request.method) != method_head)
+	{
+		pConnection->file = { std::move(file), first, length };
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /stats - reports the counters and latency histograms of all
+	engine threads as JSON (see server_stats.h), summed without locking.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleStats(
+	request_context* pContext
+)
+{
+	http_response response{ 200, "application/json", "" };
+
+	FormatServerStats(&response.body);
+	SendHttpResponse(pContext->pConnection, response);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	/kill - answers like /sync. Once every server thread's worth of kill
+	requests has arrived, signals the engines to shut down.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleKill(
+	request_context* pContext
+)
+{
+	if (++kill_requests == request_thread_count)
+	{
+		uint64_t value = 1;
+		write(shutdown_event, &value, sizeof(value));
+	}
+
+	if (pContext->pRequest->method == "POST")
+		HandleEcho(pContext);
+	else
+		HandleSync(pContext);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	/delay?ms=N - a coroutine handler standing in for one that waits on
+	I/O. It answers after N milliseconds (default 100) without holding
+	the thread; POST waits for the whole body first and echoes it.
+
+Arguments:
+	request - The request being handled.
+
+Return Value:
+	The response.
+
+--***************************************************************************/
+task<http_response>
+HandleDelay(
+	async_request& request
+)
+{
+	std::string_view text = request.query("ms");
+	unsigned long ms = text.empty() ? 100 : strtoul(std::string(text).c_str(), nullptr, 10);
+
+	if (ms > 60000)
+		ms = 60000;
+
+	if (ParseHttpMethod(request.parsed.method) == method_post)
+	{
+		co_await read_body(request);
+		co_await sleep_for(std::chrono::milliseconds(ms));
+		co_return http_response{ 200, "application/octet-stream", std::move(request.body) };
+	}
+
+	co_await sleep_for(std::chrono::milliseconds(ms));
+
+	char body[64];
+	snprintf(body, sizeof(body), "Delayed %lu ms\r\n", ms);
+
+	co_return http_response{ 200, "text/plain", body };
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Burns CPU deterministically: mixes each round number through a few
+	rounds of splitmix64 and sums the results. On a pool worker the rounds
+	are spread over the pool; the sum doesn't depend on how.
+
+Arguments:
+	rounds - Number of rounds.
+
+Return Value:
+	The sum, so the work can't be optimized away.
+
+--***************************************************************************/
+static uint64_t
+BurnCpu(
+	uint64_t rounds
+)
+{
+	std::atomic<uint64_t> total = 0;
+
+	auto burn = [&total](uint64_t first, uint64_t last)
+	{
+		uint64_t sum = 0;
+
+		for (uint64_t i = first; i < last; i++)
+		{
+			uint64_t z = i;
+
+			for (int round = 0; round < 4; round++)
+			{
+				z += 0x9e3779b97f4a7c15ull;
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+				z ^= z >> 31;
+			}
+
+			sum += z;
+		}
+
+		total.fetch_add(sum, std::memory_order_relaxed);
+	};
+
+	if (work_pool* pPool = work_pool::current())
+		ParallelFor(pPool, 0, rounds, compute_grain, burn);
+	else
+		burn(0, rounds);
+
+	return total.load(std::memory_order_relaxed);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	/compute?n=N - a CPU-bound handler: burns N rounds (default 1000000,
+	about a millisecond of one core) on the compute pool, or on the I/O
+	thread when there is no pool, so the cost of heavy requests to the
+	other connections on a thread can be measured both ways.
+
+Arguments:
+	request - The request being handled.
+
+Return Value:
+	The response.
+
+--***************************************************************************/
+task<http_response>
+HandleCompute(
+	async_request& request
+)
+{
+	std::string_view text = request.query("n");
+	uint64_t rounds = text.empty() ? 1000000 : strtoull(std::string(text).c_str(), nullptr, 10);
+
+	if (rounds > max_compute_rounds)
+		rounds = max_compute_rounds;
+
+	uint64_t sum = co_await run_on_pool(compute_pool, [rounds]() { return BurnCpu(rounds); });
+
+	char body[96];
+	snprintf(body, sizeof(body), "Computed %llu rounds: %016llx\r\n",
+		(unsigned long long)rounds, (unsigned long long)sum);
+
+	co_return http_response{ 200, "text/plain", body };
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Finds the key in a /kv/ path: everything after the prefix up to any
+	query string, taken as raw bytes.
+
+Arguments:
+	path - The request path.
+
+Return Value:
+	The key; empty if there is none or it is longer than kv_max_key.
+
+--***************************************************************************/
+static std::string_view
+KvKey(
+	std::string_view path
+)
+{
+	std::string_view key = path.substr(kv_prefix.size());
+
+	key = key.substr(0, key.find('?'));
+	return key.size() <= kv_max_key ? key : std::string_view();
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET/PUT/DELETE /kv/<key> - reads, stores or deletes a value in the
+	in-process store. GET copies the value into a buffer of the thread's
+	without taking a lock; PUT answers 201 for a new key and 200 for a
+	replaced one. A PUT whose body hasn't all arrived yet finishes in
+	HandleKvPut.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleKv(
+	request_context* pContext
+)
+{
+	static thread_local char buffer[kv_max_value];
+	connection* pConnection = pContext->pConnection;
+	const http_request& request = *pContext->pRequest;
+	std::string_view key = KvKey(request.path);
+	size_t length;
+
+	if (key.empty())
+	{
+		SendHttpResponse(pConnection, response_bad_request);
+		return;
+	}
+
+	switch (ParseHttpMethod(request.method))
+	{
+	case method_get:
+		if (key_values.get(key, buffer, sizeof(buffer), &length))
+			SendHttpResponse(pConnection, 200, "application/octet-stream", std::string_view(buffer, length));
+		else
+			SendHttpResponse(pConnection, response_not_found);
+		break;
+
+	case method_delete:
+		if (key_values.erase(key))
+			SendHttpResponse(pConnection, 200, "text/plain", std::string_view());
+		else
+			SendHttpResponse(pConnection, response_not_found);
+		break;
+
+	default:
+		if (!pContext->body_complete)
+		{
+			StartAsyncCall(pConnection, request, pContext->head, pContext->entity, false, HandleKvPut);
+			break;
+		}
+
+		switch (key_values.put(key, pContext->entity))
+		{
+		case kv_created:
+			SendHttpResponse(pConnection, 201, "text/plain", std::string_view());
+			break;
+		case kv_replaced:
+			SendHttpResponse(pConnection, 200, "text/plain", std::string_view());
+			break;
+		default:
+			SendHttpResponse(pConnection, 413, "text/plain", "Content Too Large\r\n");
+			break;
+		}
+
+		break;
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	PUT /kv/<key> for a body that arrives after the head: waits for all of
+	it and stores it.
+
+Arguments:
+	request - The request being handled.
+
+Return Value:
+	The response.
+
+--***************************************************************************/
+task<http_response>
+HandleKvPut(
+	async_request& request
+)
+{
+	co_await read_body(request);
+
+	switch (key_values.put(KvKey(request.parsed.path), request.body))
+	{
+	case kv_created:
+		co_return http_response{ 201, "text/plain", "" };
+	case kv_replaced:
+		co_return http_response{ 200, "text/plain", "" };
+	default:
+		co_return http_response{ 413, "text/plain", "Content Too Large\r\n" };
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	POST/PUT /sink - takes an upload of any size and answers with its
+	length and CRC32C. A body still arriving is checksummed piece by
+	piece straight out of the engine's receive buffers, and never kept.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleSink(
+	request_context* pContext
+)
+{
+	if (pContext->body_complete)
+	{
+		SendSinkResponse(pContext->pConnection, pContext->entity.size(),
+			Crc32c(0, pContext->entity.data(), pContext->entity.size()));
+		return;
+	}
+
+	pContext->pConnection->body.sink = true;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Answers a /sink upload: {"bytes":N,"crc32c":"xxxxxxxx"}.
+
+Arguments:
+	pConnection - The connection to respond on.
+	length      - Bytes received.
+	crc         - Their CRC32C.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+SendSinkResponse(
+	connection* pConnection,
+	uint64_t length,
+	uint32_t crc
+)
+{
+	char buffer[64];
+	char hex[8];
+	json_writer writer(buffer, sizeof(buffer));
+
+	Crc32cToHex(crc, hex);
+
+	writer.begin_object();
+	writer.key("bytes");
+	writer.value(length);
+	writer.key("crc32c");
+	writer.value(std::string_view(hex, sizeof(hex)));
+	writer.end_object();
+
+	SendHttpResponse(pConnection, 200, "application/json", writer.view());
+}
+
+/***************************************************************************++
+
+Routine Description:
+	GET /ws - opens a WebSocket that echoes every message back. From the
+	101 response on, the connection's input goes to HandleWebSocketInput
+	instead of the request parser.
+
+Arguments:
+	pContext - The request being handled.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+HandleWebSocket(
+	request_context* pContext
+)
+{
+	connection* pConnection = pContext->pConnection;
+	const http_request& request = *pContext->pRequest;
+	std::string_view upgrade, connectionHeader, version, key;
+	char accept[websocket_accept_length];
+
+	for (size_t i = 0; i < request.header_count; i++)
+	{
+		const http_header& header = request.headers[i];
+
+		if (HeaderNameEquals(header.name, "upgrade"))
+			upgrade = header.value;
+		else if (HeaderNameEquals(header.name, "connection"))
+			connectionHeader = header.value;
+		else if (HeaderNameEquals(header.name, "sec-websocket-version"))
+			version = header.value;
+		else if (HeaderNameEquals(header.name, "sec-websocket-key"))
+			key = header.value;
+	}
+
+	//
+	// HTTP/2 streams can't be upgraded, and a handshake has no body.
+	//
+	if (pConnection->stream != nullptr || request.minor_version < 1 || !request.keep_alive ||
+		!pContext->body_complete || !pContext->entity.empty() ||
+		!WebSocketIsUpgrade(upgrade, connectionHeader, version, key))
+	{
+		SendHttpResponse(pConnection, response_bad_request);
+		return;
+	}
+
+	WebSocketAcceptKey(key, accept);
+
+	pConnection->out.append("HTTP/1.1 101 Switching Protocols\r\n");
+	pConnection->out.append(server_header);
+	pConnection->out.append("Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+	pConnection->out.append(accept, sizeof(accept));
+	pConnection->out.append("\r\n\r\n");
+
+	thread_stats->record_status(101);
+	pConnection->websocket = true;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Echoes the frames a WebSocket client sent. Data frames are echoed as
+	their bytes arrive; the engine stops reading while more than
+	echo_window bytes of echo wait for the client to read them.
+
+Arguments:
+	pConnection - The upgraded connection.
+	pBuffer     - Received bytes, starting at a frame or inside one.
+	length      - Number of bytes in pBuffer.
+
+Return Value:
+	Number of bytes consumed. The rest is the start of a frame header or
+	of a control frame, and has to be kept.
+
+--***************************************************************************/
+static size_t
+HandleWebSocketInput(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length
+)
+{
+	uint64_t messages = 0;
+	size_t used = pConnection->ws.consume(pBuffer, length, pConnection->out, &messages);
+
+	StatAdd(thread_stats->ws_messages, messages);
+
+	if (pConnection->ws.closed())
+		pConnection->close_after_send = true;
+
+	return used;
+}
@@ -0,0 +1,535 @@
+//
+// Pre-serialized responses for the fixed routes, and Accept-Encoding
+// negotiation.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+
+#include <zlib.h>
+
+#include "response_cache.h"
+#include "http_parser.h"
+
+struct static_response_definition
+{
+	int status;
+	const char* reason;
+	const char* content_type;
+	const char* entity;
+};
+
+//
+// The /text body is generated at startup (see MakeTextEntity).
+//
+static const static_response_definition definitions[static_response_count] = {
+	{ 200, "OK", "text/html", "Hey! You hit the server \r\n" },
+	{ 200, "OK", "text/html", NULL },
+	{ 200, "OK", "text/plain", "Hello, World!" },
+	{ 400, "Bad Request", "text/html", NULL },
+	{ 404, "Not Found", "text/html", NULL },
+	{ 503, "Not Implemented", "text/html", NULL },
+	{ 503, "Service Unavailable", "text/html", NULL },
+};
+
+//
+// Size of the generated /text page.
+//
+const size_t text_entity_size = 16 * 1024;
+
+//
+// zlib window bits for each coding: gzip wraps deflate data in a gzip
+// header and trailer, and HTTP's "deflate" is the zlib format.
+//
+static const int coding_window_bits[content_coding_count] = { 0, 15 + 16, 15 };
+static const char* coding_names[content_coding_count] = { NULL, "gzip", "deflate" };
+
+//
+// Readers copy out of a generation without locking, so a generation is
+// only rewritten several refreshes (seconds) after it was retired.
+//
+const unsigned response_generation_count = 4;
+
+struct response_generation
+{
+	char date[64];
+	size_t date_length;
+	std::string responses[static_response_count][content_coding_count][2];   // [id][coding][close]
+};
+
+//
+// Entity bodies by coding, fixed after startup. An empty compressed body
+// means that variant is not served.
+//
+static std::string entities[static_response_count][content_coding_count];
+static bool dynamic_compression = false;
+
+static response_generation generations[response_generation_count];
+static std::atomic<unsigned> current_generation = 0;
+static unsigned next_generation = 0;
+
+/***************************************************************************++
+
+Routine Description:
+	Builds the /text page: about 16 KB of HTML paragraphs made of words
+	picked by a fixed pseudo-random sequence, so it compresses roughly as
+	well as real text rather than as well as one repeated line.
+
+Arguments:
+	None.
+
+Return Value:
+	The page.
+
+--***************************************************************************/
+static std::string
+MakeTextEntity()
+{
+	static const char* words[] = {
+		"server", "request", "response", "thread", "queue", "kernel", "buffer", "latency",
+		"the", "of", "and", "a", "to", "in", "is", "for", "that", "with", "on", "as",
+		"connection", "header", "body", "cache", "socket", "event", "completion", "port",
+		"throughput", "benchmark", "compression", "variant", "encoding", "client", "load",
+		"pipeline", "memory", "page", "core", "shard", "timer", "route", "handler", "path",
+		"measure", "sends", "receives", "waits", "copies", "parses", "returns", "keeps",
+		"every", "each", "some", "many", "few", "fast", "slow", "large", "small", "once",
+	};
+	const size_t word_count = sizeof(words) / sizeof(words[0]);
+	std::string page = "<!DOCTYPE html>\n<html><head><title>Sample text</title></head><body>\n";
+	uint32_t state = 12345;
+	int paragraphWords = 0;
+
+	page.reserve(text_entity_size + 64);
+	page += "<p>";
+
+	while (page.size() < text_entity_size - 32)
+	{
+		state = state * 1103515245 + 12345;
+		page += words[(state >> 16) % word_count];
+
+		if (++paragraphWords % 12 == 0)
+			page += paragraphWords % 96 == 0 ? ".</p>\n<p>" : ".\n";
+		else
+			page += ' ';
+	}
+
+	page += "</p>\n</body></html>\n";
+	return page;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Compresses a body with zlib.
+
+Arguments:
+	pStream - A deflate stream set up for the coding and level, reset here.
+	entity  - The body.
+	pOut    - Receives the compressed body.
+
+Return Value:
+	false if zlib failed.
+
+--***************************************************************************/
+static bool
+CompressEntity(
+	z_stream* pStream,
+	std::string_view entity,
+	std::string* pOut
+)
+{
+	if (deflateReset(pStream) != Z_OK)
+		return false;
+
+	pOut->resize(deflateBound(pStream, (uLong)entity.size()));
+
+	pStream->next_in = (Bytef*)entity.data();
+	pStream->avail_in = (uInt)entity.size();
+	pStream->next_out = (Bytef*)pOut->data();
+	pStream->avail_out = (uInt)pOut->size();
+
+	if (deflate(pStream, Z_FINISH) != Z_STREAM_END)
+		return false;
+
+	pOut->resize(pStream->total_out);
+	return true;
+}
+
+//
+// A deflate stream per coding, set up on first use; for compressing on the
+// fly without a deflateInit per response.
+//
+struct deflate_streams
+{
+	z_stream streams[content_coding_count] = {};
+	bool ready[content_coding_count] = {};
+
+	z_stream* get(content_coding coding, int level)
+	{
+		if (!ready[coding])
+		{
+			if (deflateInit2(&streams[coding], level, Z_DEFLATED, coding_window_bits[coding],
+				8, Z_DEFAULT_STRATEGY) != Z_OK)
+			{
+				return nullptr;
+			}
+
+			ready[coding] = true;
+		}
+
+		return &streams[coding];
+	}
+
+	~deflate_streams()
+	{
+		for (int coding = 0; coding < content_coding_count; coding++)
+		{
+			if (ready[coding])
+				deflateEnd(&streams[coding]);
+		}
+	}
+};
+
+/***************************************************************************++
+
+Routine Description:
+	Formats one response: status line, headers with the given Date, and
+	body.
+
+Arguments:
+	id     - Which response.
+	coding - The coding the body is in.
+	close  - Whether to add Connection: close.
+	date   - The Date header line.
+	entity - The body, already encoded.
+	pOut   - Receives the response.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+FormatResponse(
+	int id,
+	int coding,
+	bool close,
+	std::string_view date,
+	std::string_view entity,
+	std::string* pOut
+)
+{
+	const static_response_definition& definition = definitions[id];
+	char head[384];
+
+	//
+	// Bodies that come in several codings say so to caches, whichever
+	// coding this one is in.
+	//
+	bool varies = !entities[id][coding_gzip].empty() || !entities[id][coding_deflate].empty();
+
+	int length = snprintf(head, sizeof(head),
+		"HTTP/1.1 %d %s\r\n"
+		"%s"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"%s%s%s"
+		"%s"
+		"%.*s"
+		"%s"
+		"\r\n",
+		definition.status,
+		definition.reason,
+		server_header,
+		definition.content_type,
+		entity.size(),
+		coding != coding_identity ? "Content-Encoding: " : "",
+		coding != coding_identity ? coding_names[coding] : "",
+		coding != coding_identity ? "\r\n" : "",
+		varies ? "Vary: Accept-Encoding\r\n" : "",
+		(int)date.size(), date.data(),
+		close ? "Connection: close\r\n" : "");
+
+	pOut->assign(head, (size_t)length < sizeof(head) ? length : 0);
+	pOut->append(entity.data(), entity.size());
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Formats every fixed response with the current Date into a spare
+	generation and makes it the current one. Called once at startup and
+	then once per second from a single timer thread. The sizes never
+	change, so after the first round every string is rewritten in place.
+
+Arguments:
+	None.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+RefreshResponseCache()
+{
+	response_generation* pGeneration = &generations[next_generation];
+	time_t now = time(NULL);
+	tm utc;
+
+	gmtime_r(&now, &utc);
+
+	pGeneration->date_length = strftime(pGeneration->date, sizeof(pGeneration->date),
+		"Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &utc);
+
+	std::string_view date(pGeneration->date, pGeneration->date_length);
+
+	for (int id = 0; id < static_response_count; id++)
+	{
+		for (int coding = 0; coding < content_coding_count; coding++)
+		{
+			if (coding != coding_identity && entities[id][coding].empty())
+				continue;
+
+			for (int close = 0; close < 2; close++)
+			{
+				FormatResponse(id, coding, close, date, entities[id][coding],
+					&pGeneration->responses[id][coding][close]);
+			}
+		}
+	}
+
+	current_generation.store(next_generation, std::memory_order_release);
+	next_generation = (next_generation + 1) % response_generation_count;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Builds the bodies of the fixed responses and their compressed variants,
+	then the first generation of responses.
+
+Arguments:
+	dynamicCompression - Compress on every response instead of serving the
+	                     variants compressed here.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+InitializeResponseCache(
+	bool dynamicCompression
+)
+{
+	deflate_streams streams;
+
+	dynamic_compression = dynamicCompression;
+
+	for (int id = 0; id < static_response_count; id++)
+	{
+		std::string* pVariants = entities[id];
+
+		pVariants[coding_identity] = id == response_text ? MakeTextEntity() :
+			definitions[id].entity ? definitions[id].entity : "";
+
+		for (int coding = coding_gzip; coding < content_coding_count; coding++)
+		{
+			z_stream* pStream = streams.get((content_coding)coding, Z_BEST_COMPRESSION);
+
+			if (pStream == nullptr ||
+				!CompressEntity(pStream, pVariants[coding_identity], &pVariants[coding]) ||
+				pVariants[coding].size() >= pVariants[coding_identity].size())
+			{
+				pVariants[coding].clear();
+			}
+		}
+	}
+
+	RefreshResponseCache();
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Returns a fixed response, with its body in the given coding if that
+	variant exists and as-is otherwise. With dynamic compression the body
+	is compressed here, at zlib's default level, into a buffer that stays
+	valid until the thread's next call.
+
+Arguments:
+	id     - Which response.
+	coding - The coding the client prefers (see NegotiateContentCoding).
+	close  - Whether the connection closes after it.
+
+Return Value:
+	The serialized response.
+
+--***************************************************************************/
+std::string_view
+GetStaticResponse(
+	static_response_id id,
+	content_coding coding,
+	bool close
+)
+{
+	const response_generation& generation =
+		generations[current_generation.load(std::memory_order_acquire)];
+
+	if (entities[id][coding].empty())
+		coding = coding_identity;
+
+	if (dynamic_compression && coding != coding_identity)
+	{
+		static thread_local deflate_streams streams;
+		static thread_local std::string entity;
+		static thread_local std::string response;
+		z_stream* pStream = streams.get(coding, Z_DEFAULT_COMPRESSION);
+
+		if (pStream != nullptr && CompressEntity(pStream, entities[id][coding_identity], &entity))
+		{
+			FormatResponse(id, coding, close,
+				std::string_view(generation.date, generation.date_length), entity, &response);
+			return response;
+		}
+
+		coding = coding_identity;
+	}
+
+	return generation.responses[id][coding][close ? 1 : 0];
+}
+
+int
+GetStaticResponseStatus(
+	static_response_id id
+)
+{
+	return definitions[id].status;
+}
+
+std::string_view
+GetDateHeader()
+{
+	const response_generation& generation =
+		generations[current_generation.load(std::memory_order_acquire)];
+
+	return std::string_view(generation.date, generation.date_length);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Reads the weight of one Accept-Encoding entry: the parameters after
+	its coding name, "q=" and a value from 0 to 1 with up to three
+	decimals.
+
+Arguments:
+	parameters - What follows the first ';' of the entry.
+
+Return Value:
+	The weight in thousandths, or -1 if it is malformed.
+
+--***************************************************************************/
+static int
+ParseQuality(
+	std::string_view parameters
+)
+{
+	parameters = TrimHeaderValue(parameters);
+
+	if (parameters.size() < 3 || (parameters[0] != 'q' && parameters[0] != 'Q') || parameters[1] != '=')
+		return -1;
+
+	std::string_view value = parameters.substr(2);
+
+	if (value[0] != '0' && value[0] != '1')
+		return -1;
+
+	int quality = (value[0] - '0') * 1000;
+	int scale = 100;
+
+	if (value.size() > 1)
+	{
+		if (value[1] != '.' || value.size() > 5)
+			return -1;
+
+		for (size_t i = 2; i < value.size(); i++, scale /= 10)
+		{
+			if (value[i] < '0' || value[i] > '9')
+				return -1;
+
+			quality += (value[i] - '0') * scale;
+		}
+	}
+
+	return quality <= 1000 ? quality : -1;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Picks the coding to answer with from an Accept-Encoding header value,
+	following RFC 9110: the highest weight wins, "*" covers codings not
+	named, and identity is acceptable unless excluded. On a tie a
+	compression beats identity, and gzip beats deflate. If nothing is
+	acceptable the body goes out as-is rather than as a 406.
+
+Arguments:
+	acceptEncoding - The header value; empty if there was none.
+
+Return Value:
+	The coding.
+
+--***************************************************************************/
+content_coding
+NegotiateContentCoding(
+	std::string_view acceptEncoding
+)
+{
+	int quality[content_coding_count] = { -1, -1, -1 };
+	int anyQuality = -1;
+
+	while (!acceptEncoding.empty())
+	{
+		size_t end = acceptEncoding.find(',');
+		std::string_view item = acceptEncoding.substr(0, end);
+		size_t semicolon = item.find(';');
+		std::string_view name = TrimHeaderValue(item.substr(0, semicolon));
+		int q = semicolon == std::string_view::npos ? 1000 : ParseQuality(item.substr(semicolon + 1));
+
+		acceptEncoding = end == std::string_view::npos ? std::string_view() : acceptEncoding.substr(end + 1);
+
+		if (q < 0)
+			continue;
+
+		if (HeaderNameEquals(name, "gzip") || HeaderNameEquals(name, "x-gzip"))
+			quality[coding_gzip] = q;
+		else if (HeaderNameEquals(name, "deflate"))
+			quality[coding_deflate] = q;
+		else if (HeaderNameEquals(name, "identity"))
+			quality[coding_identity] = q;
+		else if (name == "*")
+			anyQuality = q;
+	}
+
+	for (int coding = 0; coding < content_coding_count; coding++)
+	{
+		if (quality[coding] < 0)
+			quality[coding] = anyQuality >= 0 ? anyQuality : coding == coding_identity ? 1000 : 0;
+	}
+
+	content_coding best = coding_identity;
+
+	for (int coding = coding_gzip; coding < content_coding_count; coding++)
+	{
+		if (quality[coding] > 0 &&
+			(quality[coding] > quality[best] || (best == coding_identity && quality[coding] == quality[best])))
+		{
+			best = (content_coding)coding;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,80 @@
+//
+// Pre-serialized responses for the fixed routes.
+//
+// Every fixed response (status line, headers, Content-Length and body) is
+// formatted once, so handling a request is a single copy of read-only
+// bytes. The only part that changes is the Date header, which a timer
+// refreshes once per second by formatting a new generation of responses
+// into a spare slot and publishing it.
+//
+// Bodies that compress are also stored gzip and deflate encoded, compressed
+// once at startup at the highest zlib level, and the variant a request
+// gets is picked from its Accept-Encoding header. A variant is only kept
+// if it is smaller than the plain body. With dynamic compression turned on
+// the stored variants are ignored and the body is compressed again for
+// every response instead, for comparison.
+//
+
+#ifndef __RESPONSE_CACHE__
+#define __RESPONSE_CACHE__
+
+#include <string_view>
+
+//
+// Every response names the server, as http.sys does for its own (and as
+// the TechEmpower benchmarks require).
+//
+const char server_header[] = "Server: socket-srv\r\n";
+
+enum static_response_id
+{
+	response_sync,
+	response_text,
+	response_plaintext,
+	response_bad_request,
+	response_not_found,
+	response_not_implemented,
+	response_overloaded,
+	static_response_count
+};
+
+enum content_coding
+{
+	coding_identity,
+	coding_gzip,
+	coding_deflate,
+	content_coding_count
+};
+
+//
+// Prototypes.
+//
+void
+InitializeResponseCache(
+	bool dynamicCompression
+);
+
+void
+RefreshResponseCache();
+
+std::string_view
+GetStaticResponse(
+	static_response_id id,
+	content_coding coding,
+	bool close
+);
+
+int
+GetStaticResponseStatus(
+	static_response_id id
+);
+
+std::string_view
+GetDateHeader();
+
+content_coding
+NegotiateContentCoding(
+	std::string_view acceptEncoding
+);
+
+#endif
@@ -0,0 +1,226 @@
+//
+// Shared declarations for the socket backend. main.cpp owns the routes and
+// request handling; each engine file owns one way of moving bytes between
+// the sockets and a connection's buffers.
+//
+
+#ifndef __SOCKET_SERVER__
+#define __SOCKET_SERVER__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <string>
+
+#include "../common.h"
+#include "../server_stats.h"
+#include "../admission_control.h"
+#include "../websocket.h"
+#include "file_cache.h"
+#include "timing_wheel.h"
+
+const unsigned short server_port = 8080;
+
+//
+// Most bytes taken from a socket per read. A read this size holds a deep
+// batch of pipelined requests, which are then parsed in one pass.
+//
+const size_t receive_chunk_size = 64 * 1024;
+
+//
+// Longest request head, and longest chunk-size or trailer line, that we
+// wait for before giving up on the request. HTTP/2 header blocks have
+// the same limit.
+//
+const size_t max_request_head = 64 * 1024;
+const size_t max_chunk_line = 1024;
+
+//
+// A request body that has not been received in full when its request is
+// dispatched is streamed: each piece is echoed back as a chunk of a
+// chunked response, checksummed (for /sink) or dropped as soon as it
+// arrives. An engine stops reading while more than echo_window bytes of
+// response are waiting for a slow client.
+//
+const size_t echo_window = 256 * 1024;
+
+//
+// Most bytes of a /sink upload taken from a socket per read. Uploads are
+// bandwidth bound, so they get far bigger reads than request heads.
+//
+const size_t sink_receive_size = 1024 * 1024;
+
+enum body_state : unsigned char
+{
+	body_idle,               // no body in progress
+	body_data,               // Content-Length body, remaining bytes to go
+	body_chunk_size,         // waiting for a chunk-size line
+	body_chunk_data,         // inside a chunk, remaining bytes to go
+	body_chunk_end,          // waiting for the CRLF after a chunk
+	body_trailer,            // waiting for the trailer section to end
+};
+
+struct body_stream
+{
+	body_state state;
+	uint64_t remaining;
+	bool echo;               // echo the body back (else discard it)
+	bool framed;             // echo as a chunked response (HTTP/1.1)
+	bool sink;               // checksum the body and answer once it ends
+	uint32_t crc;            // CRC32C of the sunk body so far
+	uint64_t sunk;           // bytes of it so far
+};
+
+//
+// The body of a /files/ response. It follows the bytes in the output
+// buffer and is sent by the engine straight from the file (sendfile, or
+// the file's mapping), never copied into the buffer. No further requests
+// are handled on the connection until it has been sent. HTTP/2 is the
+// exception: it frames the body as DATA, copied from the mapping into
+// the buffer at most echo_window bytes at a time (http2_session.h).
+//
+struct file_send
+{
+	std::shared_ptr<const cached_file> file;
+	uint64_t offset;
+	uint64_t remaining;
+};
+
+//
+// How long a connection may sit in each state before it is closed; zero
+// means forever. The keep-alive timeout covers a connection with no
+// request in progress, the header timeout runs from the first byte of a
+// request head to its end however slowly it trickles in, and the body
+// timeout allows that long without progress while a request body is
+// arriving or a response is waiting for the client to read it.
+//
+struct connection_timeouts
+{
+	std::chrono::milliseconds keep_alive;
+	std::chrono::milliseconds header;
+	std::chrono::milliseconds body;
+};
+
+extern connection_timeouts timeouts;
+
+enum timeout_phase : unsigned char
+{
+	timeout_none,            // a coroutine handler is running
+	timeout_keep_alive,
+	timeout_header,
+	timeout_body,
+};
+
+struct async_call;
+struct connection;
+struct http2_session;
+struct http2_stream;
+struct ssl_st;
+
+struct connection_timer : wheel_timer
+{
+	connection* pConnection;
+};
+
+struct connection
+{
+	int fd;
+	ssl_st* tls;             // set on connections accepted on tls_port (tls.h)
+	std::string in;          // received bytes not yet handled
+	std::string out;         // response bytes not yet sent
+	size_t out_sent;
+	bool close_after_send;
+	body_stream body;        // request body still arriving
+	file_send file;          // file body still to send
+	async_call* async;       // suspended coroutine handler (async_handler.h)
+	connection_timer timer;  // on the thread's timing wheel (async_handler.h)
+	timeout_phase timeout;
+	http2_session* h2;       // set once the connection speaks HTTP/2 (http2_session.h)
+	http2_stream* stream;    // set on the stand-in an HTTP/2 request runs on
+	bool websocket;          // upgraded on /ws; all input then goes to ws
+	websocket_echo ws;
+};
+
+//
+// Admission control (see admission_control.h), off unless asked for. A
+// request's queueing delay runs from receive_time, which each engine sets
+// before handing over received bytes: the epoll engine to when the kernel
+// received them, the io_uring engine to when its wait for completions
+// returned.
+//
+extern admission_settings admission;
+extern thread_local std::chrono::steady_clock::time_point receive_time;
+
+//
+// eventfd that is signalled once every worker thread should exit. Like
+// the http.sys server, the socket backend shuts down after it has served
+// request_thread_count kill requests.
+//
+extern int shutdown_event;
+
+//
+// Prototypes.
+//
+size_t
+HandleRequestBuffer(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length,
+	int* pHandled
+);
+
+void
+HandleRequests(
+	connection* pConnection,
+	int* pHandled
+);
+
+void
+HandleReceivedData(
+	connection* pConnection,
+	const char* pBuffer,
+	size_t length,
+	int* pHandled
+);
+
+void
+BeginEchoChunk(
+	connection* pConnection,
+	uint64_t length
+);
+
+void
+EndEchoChunk(
+	connection* pConnection
+);
+
+void
+SinkRequestBody(
+	connection* pConnection,
+	const char* pData,
+	size_t length
+);
+
+void
+EndRequestBody(
+	connection* pConnection
+);
+
+void
+UpdateConnectionTimeout(
+	connection* pConnection,
+	bool output_pending
+);
+
+int
+DoReceiveRequests(
+	int listen_fd,
+	int tls_listen_fd
+);
+
+int
+DoReceiveRequestsUring(
+	int listen_fd
+);
+
+#endif
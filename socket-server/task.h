@@ -0,0 +1,164 @@
+//
+// Minimal C++20 coroutine task for async route handlers.
+//
+// A task<T> is a lazily started coroutine that produces a T. Awaiting a
+// task starts it and resumes the awaiter when it finishes, by symmetric
+// transfer, so chains of nested tasks don't grow the stack. The task owns
+// its coroutine frame: destroying an unfinished task destroys the frame,
+// and with it whatever the coroutine was suspended on.
+//
+
+#ifndef __TASK__
+#define __TASK__
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+template <typename T>
+class task;
+
+namespace task_detail
+{
+	//
+	// Parts of the promise that don't depend on the result type.
+	//
+	struct promise_base
+	{
+		std::coroutine_handle<> continuation;
+		std::exception_ptr exception;
+
+		struct final_awaiter
+		{
+			bool await_ready() noexcept { return false; }
+
+			template <typename Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+			{
+				auto continuation = handle.promise().continuation;
+				return continuation ? continuation : std::noop_coroutine();
+			}
+
+			void await_resume() noexcept {}
+		};
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		final_awaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() noexcept { exception = std::current_exception(); }
+	};
+
+	template <typename T>
+	struct promise : promise_base
+	{
+		std::optional<T> value;
+
+		task<T> get_return_object() noexcept;
+
+		template <typename U>
+		void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+
+		T take_result()
+		{
+			if (exception)
+				std::rethrow_exception(exception);
+			return std::move(*value);
+		}
+	};
+
+	template <>
+	struct promise<void> : promise_base
+	{
+		task<void> get_return_object() noexcept;
+
+		void return_void() noexcept {}
+
+		void take_result()
+		{
+			if (exception)
+				std::rethrow_exception(exception);
+		}
+	};
+}
+
+template <typename T = void>
+class task
+{
+public:
+	using promise_type = task_detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	task() noexcept = default;
+	explicit task(handle_type handle) noexcept : handle_(handle) {}
+	task(task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	task& operator=(task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			handle_ = std::exchange(other.handle_, {});
+		}
+		return *this;
+	}
+
+	~task() { reset(); }
+
+	void reset() noexcept
+	{
+		if (handle_)
+			std::exchange(handle_, {}).destroy();
+	}
+
+	explicit operator bool() const noexcept { return static_cast<bool>(handle_); }
+
+	//
+	// For the code that drives a top-level task: start() runs it until its
+	// first suspension, done() says whether it has finished, and result()
+	// returns its value (or rethrows what it threw).
+	//
+	void start() { handle_.resume(); }
+	bool done() const noexcept { return handle_.done(); }
+	T result() { return handle_.promise().take_result(); }
+
+	auto operator co_await() && noexcept
+	{
+		struct awaiter
+		{
+			handle_type handle;
+
+			bool await_ready() noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				handle.promise().continuation = awaiting;
+				return handle;
+			}
+
+			T await_resume() { return handle.promise().take_result(); }
+		};
+
+		return awaiter{ handle_ };
+	}
+
+private:
+	handle_type handle_;
+};
+
+namespace task_detail
+{
+	template <typename T>
+	task<T> promise<T>::get_return_object() noexcept
+	{
+		return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+	}
+
+	inline task<void> promise<void>::get_return_object() noexcept
+	{
+		return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+	}
+}
+
+#endif
@@ -0,0 +1,237 @@
+//
+// Hierarchical timing wheel: arming, cascading and firing timers.
+//
+
+#include <bit>
+
+#include "timing_wheel.h"
+
+//
+// Slot value of a timer that has been taken off its slot to be fired.
+//
+const unsigned short firing_slot = 0xffff;
+
+timing_wheel::timing_wheel(
+	uint64_t now
+)
+	: now_(now)
+{
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Links a timer into the slot its expiry falls in: level 0 if it is due
+	within 64 ticks, otherwise the lowest level whose span reaches it.
+
+Arguments:
+	pTimer - The timer, not linked anywhere.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+timing_wheel::insert(
+	wheel_timer* pTimer
+)
+{
+	uint64_t expires = pTimer->expires;
+	uint64_t delta = expires - now_;
+	unsigned level = 0;
+
+	while (level + 1 < level_count && delta >= (uint64_t)1 << ((level + 1) * level_bits))
+		level++;
+
+	if (delta >= (uint64_t)1 << (level_count * level_bits))
+	{
+		//
+		// Beyond the top level: park it in the last slot the top level
+		// reaches, and it cascades back up to here when that comes round.
+		//
+		expires = now_ + ((uint64_t)1 << (level_count * level_bits)) - 1;
+	}
+
+	unsigned slot = (unsigned)(expires >> (level * level_bits)) & (slots_per_level - 1);
+	slot_list& list = slots_[level][slot];
+
+	pTimer->slot = (unsigned short)(level * slots_per_level + slot);
+	pTimer->prev = list.head.prev;
+	pTimer->next = &list.head;
+	list.head.prev->next = pTimer;
+	list.head.prev = pTimer;
+
+	occupied_[level] |= (uint64_t)1 << slot;
+}
+
+void
+timing_wheel::schedule(
+	wheel_timer* pTimer,
+	uint64_t expires
+)
+{
+	if (pTimer->armed())
+		cancel(pTimer);
+
+	//
+	// The slot for now has already been fired.
+	//
+	pTimer->expires = expires > now_ ? expires : now_ + 1;
+	insert(pTimer);
+}
+
+void
+timing_wheel::cancel(
+	wheel_timer* pTimer
+)
+{
+	if (!pTimer->armed())
+		return;
+
+	pTimer->prev->next = pTimer->next;
+	pTimer->next->prev = pTimer->prev;
+	pTimer->next = nullptr;
+	pTimer->prev = nullptr;
+
+	if (pTimer->slot != firing_slot)
+	{
+		unsigned level = pTimer->slot / slots_per_level;
+		unsigned slot = pTimer->slot % slots_per_level;
+
+		if (slots_[level][slot].empty())
+			occupied_[level] &= ~((uint64_t)1 << slot);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Empties a slot of an upper level into the levels below, now that time
+	has reached its start.
+
+Arguments:
+	level - The level.
+	slot  - The slot.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+timing_wheel::cascade(
+	unsigned level,
+	unsigned slot
+)
+{
+	slot_list& list = slots_[level][slot];
+
+	occupied_[level] &= ~((uint64_t)1 << slot);
+
+	while (!list.empty())
+	{
+		wheel_timer* pTimer = list.head.next;
+
+		pTimer->prev->next = pTimer->next;
+		pTimer->next->prev = pTimer->prev;
+		insert(pTimer);
+	}
+}
+
+uint64_t
+timing_wheel::next_event() const
+{
+	uint64_t next = never;
+
+	for (unsigned level = 0; level < level_count; level++)
+	{
+		if (occupied_[level] == 0)
+			continue;
+
+		//
+		// Slots are visited in order from the one after the current
+		// position, wrapping round; the first occupied one is due first.
+		//
+		unsigned shift = level * level_bits;
+		uint64_t position = now_ >> shift;
+		unsigned start = (unsigned)(position + 1) & (slots_per_level - 1);
+		uint64_t ahead = std::rotr(occupied_[level], (int)start);
+		uint64_t tick = (position + 1 + std::countr_zero(ahead)) << shift;
+
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Moves time forward, stopping only at ticks where a slot has to be
+	cascaded or fired. At each such tick the upper levels cascade first,
+	highest level first, so that their timers due now reach level 0 in
+	time to fire with it.
+
+Arguments:
+	now - The current tick.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+timing_wheel::advance(
+	uint64_t now
+)
+{
+	for (;;)
+	{
+		uint64_t tick = next_event();
+
+		if (tick > now)
+			break;
+
+		now_ = tick;
+
+		for (unsigned level = level_count - 1; level > 0; level--)
+		{
+			unsigned shift = level * level_bits;
+
+			if ((tick & (((uint64_t)1 << shift) - 1)) == 0)
+				cascade(level, (unsigned)(tick >> shift) & (slots_per_level - 1));
+		}
+
+		//
+		// Take the due timers off their slot before firing any, so a fire
+		// function can re-arm its timer for this same slot, or cancel one
+		// still waiting here, safely.
+		//
+		unsigned slot = (unsigned)tick & (slots_per_level - 1);
+		slot_list& list = slots_[0][slot];
+		slot_list due;
+
+		if (list.empty())
+			continue;
+
+		due.head.next = list.head.next;
+		due.head.prev = list.head.prev;
+		due.head.next->prev = &due.head;
+		due.head.prev->next = &due.head;
+		list.head.next = list.head.prev = &list.head;
+		occupied_[0] &= ~((uint64_t)1 << slot);
+
+		for (wheel_timer* pTimer = due.head.next; pTimer != &due.head; pTimer = pTimer->next)
+			pTimer->slot = firing_slot;
+
+		while (!due.empty())
+		{
+			wheel_timer* pTimer = due.head.next;
+
+			cancel(pTimer);
+			pTimer->fire(pTimer);
+		}
+	}
+
+	if (now > now_)
+		now_ = now;
+}
@@ -0,0 +1,96 @@
+//
+// Hierarchical timing wheel for per-thread timeouts.
+//
+// Every worker thread may have a timer running on each of tens of
+// thousands of connections, re-armed on every request, so arming and
+// cancelling must be cheap. Timers are intrusive: each one is a node of a
+// doubly-linked list hanging off a wheel slot, so arming and cancelling
+// are a few pointer writes with no allocation and no search. Time is
+// counted in ticks (milliseconds for the socket backend).
+//
+// The wheel has 4 levels of 64 slots. Level 0 holds the timers due in the
+// next 64 ticks, one slot per tick; each level above covers 64 times the
+// span of the one below, and its slots are emptied ("cascaded") into the
+// lower levels when time reaches them. A timer is moved at most once per
+// level over its life. Timers further out than the top level (about 4.6
+// hours of milliseconds) wait in its last slot and cascade again.
+//
+// A bitmap of occupied slots per level lets advance jump straight to the
+// next tick that has anything to do, and gives the next wake-up time in
+// a few instructions, so an idle thread never ticks.
+//
+
+#ifndef __TIMING_WHEEL__
+#define __TIMING_WHEEL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct wheel_timer
+{
+	void (*fire)(wheel_timer* pTimer);
+	wheel_timer* next = nullptr;      // null when not armed
+	wheel_timer* prev = nullptr;
+	uint64_t expires = 0;             // tick
+	unsigned short slot = 0;          // level * 64 + slot, while armed
+
+	wheel_timer() : fire(nullptr) {}
+	explicit wheel_timer(void (*function)(wheel_timer*)) : fire(function) {}
+	wheel_timer(const wheel_timer&) = delete;
+	wheel_timer& operator=(const wheel_timer&) = delete;
+
+	bool armed() const { return next != nullptr; }
+};
+
+class timing_wheel
+{
+public:
+	static const unsigned level_bits = 6;
+	static const unsigned slots_per_level = 1 << level_bits;
+	static const unsigned level_count = 4;
+	static const uint64_t never = ~0ull;
+
+	explicit timing_wheel(uint64_t now);
+	timing_wheel(const timing_wheel&) = delete;
+	timing_wheel& operator=(const timing_wheel&) = delete;
+
+	uint64_t now() const { return now_; }
+
+	//
+	// Arms a timer to fire at the given tick (or re-arms it, if it was
+	// armed already). A tick that has passed fires on the next advance.
+	//
+	void schedule(wheel_timer* pTimer, uint64_t expires);
+	void cancel(wheel_timer* pTimer);
+
+	//
+	// Moves time forward to now, firing every timer due by then in
+	// order. A timer's fire function may arm or cancel any timer.
+	//
+	void advance(uint64_t now);
+
+	//
+	// The next tick at which advance has work to do, or never. It can be
+	// earlier than the next timer is due, when a slot has to cascade
+	// first.
+	//
+	uint64_t next_event() const;
+
+private:
+	struct slot_list
+	{
+		wheel_timer head;
+
+		slot_list() { head.next = head.prev = &head; }
+		bool empty() const { return head.next == &head; }
+	};
+
+	void insert(wheel_timer* pTimer);
+	void cascade(unsigned level, unsigned slot);
+
+	uint64_t now_;
+	uint64_t occupied_[level_count] = {};
+	slot_list slots_[level_count][slots_per_level];
+};
+
+#endif
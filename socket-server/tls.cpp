@@ -0,0 +1,481 @@
+//
+// TLS termination for the socket backend, on OpenSSL.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "../server_stats.h"
+
+static SSL_CTX* tls_context = nullptr;
+
+//
+// Protocols offered through ALPN, in order of preference.
+//
+static const unsigned char alpn_protocols[] = "\x02h2\x08http/1.1";
+
+/***************************************************************************++
+
+Routine Description:
+	Gives the context a certificate for "localhost" and 127.0.0.1, signed
+	with its own freshly generated P-256 key, for when none was given. A
+	client has to be told not to verify it.
+
+Arguments:
+	pContext - The context.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+static bool
+UseSelfSignedCertificate(
+	SSL_CTX* pContext
+)
+{
+	EVP_PKEY* pKey = EVP_EC_gen("P-256");
+	X509* pCert = X509_new();
+	bool result = false;
+
+	if (pKey != nullptr && pCert != nullptr)
+	{
+		X509V3_CTX extensionContext;
+		X509_NAME* pName = X509_get_subject_name(pCert);
+
+		X509_set_version(pCert, X509_VERSION_3);
+		ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+		X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+		X509_gmtime_adj(X509_getm_notAfter(pCert), 365 * 24 * 3600);
+		X509_set_pubkey(pCert, pKey);
+		X509_NAME_add_entry_by_txt(pName, "CN", MBSTRING_ASC,
+			reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+		X509_set_issuer_name(pCert, pName);
+
+		X509V3_set_ctx_nodb(&extensionContext);
+		X509V3_set_ctx(&extensionContext, pCert, pCert, nullptr, nullptr, 0);
+
+		X509_EXTENSION* pNames = X509V3_EXT_conf_nid(nullptr, &extensionContext,
+			NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+
+		result = pNames != nullptr && X509_add_ext(pCert, pNames, -1) == 1 &&
+			X509_sign(pCert, pKey, EVP_sha256()) != 0 &&
+			SSL_CTX_use_certificate(pContext, pCert) == 1 &&
+			SSL_CTX_use_PrivateKey(pContext, pKey) == 1;
+
+		X509_EXTENSION_free(pNames);
+	}
+
+	X509_free(pCert);
+	EVP_PKEY_free(pKey);
+
+	return result;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	ALPN callback: picks h2 if the client offers it, else http/1.1. Either
+	way the connection starts out on the HTTP/1.1 parser, which switches
+	to HTTP/2 when it sees the client preface.
+
+Arguments:
+	As SSL_CTX_alpn_select_cb_func.
+
+Return Value:
+	SSL_TLSEXT_ERR_OK, or SSL_TLSEXT_ERR_NOACK if nothing matched.
+
+--***************************************************************************/
+static int
+SelectAlpnProtocol(
+	[[maybe_unused]] SSL* pTls,
+	const unsigned char** ppOut,
+	unsigned char* pOutLength,
+	const unsigned char* pIn,
+	unsigned int inLength,
+	[[maybe_unused]] void* pArgument
+)
+{
+	unsigned char* pSelected;
+
+	if (SSL_select_next_proto(&pSelected, pOutLength, alpn_protocols, sizeof(alpn_protocols) - 1,
+		pIn, inLength) != OPENSSL_NPN_NEGOTIATED)
+	{
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+
+	*ppOut = pSelected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Creates the context every TLS connection is made from: certificate,
+	session resumption and kernel TLS as the settings ask.
+
+Arguments:
+	settings - What --tls, --cert, --key, --tls-resumption and --ktls set.
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+bool
+InitializeTls(
+	const tls_settings& settings
+)
+{
+	tls_context = SSL_CTX_new(TLS_server_method());
+
+	if (tls_context == nullptr)
+	{
+		printf("SSL_CTX_new failed \n");
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+
+	//
+	// Sends may stop after any record and be retried from a buffer that
+	// has since grown and moved; a peer that closes without close_notify
+	// reads as a plain end of stream.
+	//
+	SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_options(tls_context, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+
+	bool loaded;
+
+	if (settings.cert_file == nullptr)
+	{
+		loaded = UseSelfSignedCertificate(tls_context);
+	}
+	else
+	{
+		loaded = SSL_CTX_use_certificate_chain_file(tls_context, settings.cert_file) == 1 &&
+			SSL_CTX_use_PrivateKey_file(tls_context,
+				settings.key_file ? settings.key_file : settings.cert_file, SSL_FILETYPE_PEM) == 1 &&
+			SSL_CTX_check_private_key(tls_context) == 1;
+	}
+
+	if (!loaded)
+	{
+		printf("cannot load the TLS certificate and key: %s \n",
+			ERR_error_string(ERR_get_error(), nullptr));
+		CleanupTls();
+		return false;
+	}
+
+	static const unsigned char session_context[] = "socket-srv";
+
+	SSL_CTX_set_session_id_context(tls_context, session_context, sizeof(session_context) - 1);
+
+	switch (settings.resumption)
+	{
+	case tls_resume_tickets:
+		//
+		// One ticket per handshake: a client resumes one connection at a
+		// time, and every ticket costs an encryption.
+		//
+		SSL_CTX_set_num_tickets(tls_context, 1);
+		break;
+
+	case tls_resume_cache:
+		SSL_CTX_set_options(tls_context, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(tls_context, 1);
+		break;
+
+	case tls_resume_off:
+		SSL_CTX_set_options(tls_context, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(tls_context, 0);
+		SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_OFF);
+		break;
+	}
+
+	if (settings.ktls)
+	{
+		//
+		// The kernel can take over receiving only if OpenSSL has not read
+		// past the handshake, so records are read one at a time.
+		//
+		SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS);
+	}
+	else
+	{
+		SSL_CTX_set_read_ahead(tls_context, 1);
+	}
+
+	SSL_CTX_set_alpn_select_cb(tls_context, SelectAlpnProtocol, nullptr);
+
+	if (settings.ktls)
+	{
+		char ulps[256] = {};
+		FILE* pFile = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+
+		if (pFile != nullptr)
+		{
+			fgets(ulps, sizeof(ulps), pFile);
+			fclose(pFile);
+		}
+
+		if (strstr(ulps, "tls") == nullptr)
+		{
+			printf("the kernel has no tls module loaded (modprobe tls); "
+				"TLS records will be handled in user space \n");
+		}
+	}
+
+	return true;
+}
+
+void
+CleanupTls()
+{
+	SSL_CTX_free(tls_context);
+	tls_context = nullptr;
+}
+
+const char*
+TlsResumptionName(
+	tls_resumption resumption
+)
+{
+	switch (resumption)
+	{
+	case tls_resume_tickets:
+		return "tickets";
+	case tls_resume_cache:
+		return "cache";
+	default:
+		return "off";
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Starts the server side of a TLS connection on an accepted socket. The
+	handshake itself runs as the engine first receives from it.
+
+Arguments:
+	fd - The socket.
+
+Return Value:
+	The connection's SSL object, or NULL on failure.
+
+--***************************************************************************/
+SSL*
+AcceptTls(
+	int fd
+)
+{
+	SSL* pTls = SSL_new(tls_context);
+
+	if (pTls == nullptr)
+		return nullptr;
+
+	if (SSL_set_fd(pTls, fd) != 1)
+	{
+		SSL_free(pTls);
+		return nullptr;
+	}
+
+	SSL_set_accept_state(pTls);
+	return pTls;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Turns the result of an SSL call into that of the system call it
+	stands in for, and counts the handshake if the call finished it.
+
+Arguments:
+	pTls        - The connection.
+	result      - What the call returned.
+	handshaking - The handshake was not done before the call.
+	receiving   - The call read; a clean close then reads as 0.
+
+Return Value:
+	result, 0 for the end of the stream, or -1 with errno set: EAGAIN
+	if the call has to wait for the socket either way.
+
+--***************************************************************************/
+static ssize_t
+TlsResult(
+	SSL* pTls,
+	int result,
+	bool handshaking,
+	bool receiving
+)
+{
+	if (handshaking && SSL_is_init_finished(pTls))
+	{
+		StatAdd(SSL_session_reused(pTls) ? thread_stats->tls_resumed : thread_stats->tls_full, 1);
+
+		if (BIO_get_ktls_send(SSL_get_wbio(pTls)))
+			StatAdd(thread_stats->ktls, 1);
+	}
+
+	if (result > 0)
+		return result;
+
+	int error = errno;
+
+	switch (SSL_get_error(pTls, result))
+	{
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_ZERO_RETURN:
+		if (receiving)
+			return 0;
+
+		errno = EPIPE;
+		return -1;
+
+	case SSL_ERROR_SYSCALL:
+		ERR_clear_error();
+		errno = error != 0 && error != EAGAIN ? error : ECONNRESET;
+		return -1;
+
+	default:
+		//
+		// Leave nothing on the thread's error queue to be mistaken for
+		// the failure of another connection's call.
+		//
+		ERR_clear_error();
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Receives and decrypts data, handshaking first if need be.
+
+Arguments:
+	pTls    - The connection.
+	pBuffer - Receives the data.
+	length  - Size of pBuffer.
+
+Return Value:
+	As recv.
+
+--***************************************************************************/
+ssize_t
+TlsReceive(
+	SSL* pTls,
+	char* pBuffer,
+	size_t length
+)
+{
+	bool handshaking = !SSL_is_init_finished(pTls);
+
+	errno = 0;
+	return TlsResult(pTls, SSL_read(pTls, pBuffer, length > INT_MAX ? INT_MAX : (int)length),
+		handshaking, true);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Encrypts and sends data, handshaking first if need be. After a send
+	that would block, the next one has to start with the same bytes and
+	be at least as long.
+
+Arguments:
+	pTls   - The connection.
+	pData  - The data.
+	length - Its length.
+
+Return Value:
+	As send.
+
+--***************************************************************************/
+ssize_t
+TlsSend(
+	SSL* pTls,
+	const char* pData,
+	size_t length
+)
+{
+	bool handshaking = !SSL_is_init_finished(pTls);
+
+	errno = 0;
+	return TlsResult(pTls, SSL_write(pTls, pData, length > INT_MAX ? INT_MAX : (int)length),
+		handshaking, false);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends part of a file on a connection whose record layer is in the
+	kernel (TlsKernelSend), which encrypts it from the page cache.
+
+Arguments:
+	pTls   - The connection.
+	fd     - The file.
+	offset - Where in the file to start.
+	length - Bytes to send.
+
+Return Value:
+	As sendfile.
+
+--***************************************************************************/
+ssize_t
+TlsSendFile(
+	SSL* pTls,
+	int fd,
+	off_t offset,
+	size_t length
+)
+{
+	errno = 0;
+
+	ossl_ssize_t sent = SSL_sendfile(pTls, fd, offset, length, 0);
+
+	return sent > 0 ? (ssize_t)sent : TlsResult(pTls, (int)sent, false, false);
+}
+
+bool
+TlsKernelSend(
+	SSL* pTls
+)
+{
+	return BIO_get_ktls_send(SSL_get_wbio(pTls)) != 0;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Sends close_notify if the socket takes it at once, and frees the
+	connection's SSL object. The socket is left open.
+
+Arguments:
+	pTls - The connection.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+CloseTls(
+	SSL* pTls
+)
+{
+	if (SSL_is_init_finished(pTls))
+		SSL_shutdown(pTls);
+
+	SSL_free(pTls);
+	ERR_clear_error();
+}
@@ -0,0 +1,107 @@
+//
+// TLS termination for the socket backend, on OpenSSL.
+//
+// With --tls the epoll engine also listens on tls_port and runs every
+// connection accepted there through an SSL object. Handshakes happen on
+// the engine thread as the first reads and writes of the connection, and
+// after that the engine moves bytes with TlsReceive and TlsSend where it
+// would otherwise call recv and send, so every route, HTTP/2 (negotiated
+// through ALPN) and WebSocket work over TLS unchanged.
+//
+// Sessions can be resumed from stateless tickets (the default), from a
+// server-side session cache, or not at all, so the cost of a full
+// handshake can be measured against that of a resumed one.
+//
+// With --ktls, OpenSSL hands the record layer to the kernel once a
+// handshake is done, where the kernel supports it. File bodies then go
+// out through SSL_sendfile, encrypted in the kernel straight from the
+// page cache; without it they are encrypted from the file's mapping.
+//
+
+#ifndef __SOCKET_TLS__
+#define __SOCKET_TLS__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <openssl/ssl.h>
+
+const unsigned short tls_port = 8443;
+
+//
+// Largest piece of a file body encrypted per SSL_write when the kernel
+// does not do the record layer. A write that would block is retried with
+// the same piece, as OpenSSL requires.
+//
+const size_t tls_file_chunk = 256 * 1024;
+
+enum tls_resumption : unsigned char
+{
+	tls_resume_tickets,      // stateless session tickets
+	tls_resume_cache,        // session IDs looked up in a server-side cache
+	tls_resume_off,          // every handshake is a full one
+};
+
+struct tls_settings
+{
+	bool enabled;
+	const char* cert_file;   // PEM certificate chain; NULL for a self-signed one
+	const char* key_file;    // PEM private key; defaults to cert_file
+	tls_resumption resumption;
+	bool ktls;
+};
+
+//
+// Prototypes.
+//
+bool
+InitializeTls(
+	const tls_settings& settings
+);
+
+void
+CleanupTls();
+
+const char*
+TlsResumptionName(
+	tls_resumption resumption
+);
+
+SSL*
+AcceptTls(
+	int fd
+);
+
+ssize_t
+TlsReceive(
+	SSL* pTls,
+	char* pBuffer,
+	size_t length
+);
+
+ssize_t
+TlsSend(
+	SSL* pTls,
+	const char* pData,
+	size_t length
+);
+
+ssize_t
+TlsSendFile(
+	SSL* pTls,
+	int fd,
+	off_t offset,
+	size_t length
+);
+
+bool
+TlsKernelSend(
+	SSL* pTls
+);
+
+void
+CloseTls(
+	SSL* pTls
+);
+
+#endif
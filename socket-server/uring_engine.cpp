@@ -0,0 +1,1056 @@
+//
+// Completion based engine: one io_uring instance per worker thread.
+//
+// Each ring keeps a multishot accept armed on the shared listener and a
+// multishot recv armed on every connection. Received data lands in a
+// provided-buffer ring registered with the kernel, so no submission is
+// needed per read. A connection that streams a /sink upload moves to a
+// second ring of much bigger buffers, so a megabyte of upload is a few
+// completions rather than hundreds. Responses go out as sendmsg submissions (file bodies
+// straight from the file's mapping, behind their headers), and a response
+// that ends the connection is linked to a shutdown. While a streamed
+// request body is being echoed to a client that reads slower than it
+// sends, the multishot recv is cancelled and re-armed once the backlog
+// drains. A single io_uring_enter submits the sends queued while
+// handling one batch of completions and waits for the next batch.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <unordered_set>
+#include <vector>
+
+#include "server.h"
+#include "async_handler.h"
+#include "http2_session.h"
+
+const unsigned uring_entries = 1024;
+const unsigned uring_buffer_count = 1024;     // must be a power of two
+const unsigned uring_buffer_size = 4096;
+const unsigned short uring_buffer_group = 0;
+const unsigned uring_sink_buffer_count = 16;  // must be a power of two
+const unsigned uring_sink_buffer_size = 256 * 1024;
+const unsigned short uring_sink_buffer_group = 1;
+const size_t max_file_send = 1 << 30;
+
+//
+// The low bits of a submission's user_data say what kind of operation it
+// was; the rest is the connection pointer (if any).
+//
+enum uring_op : unsigned long long
+{
+	op_accept = 0,
+	op_shutdown_event = 1,
+	op_recv = 2,
+	op_send = 3,
+	op_shutdown = 4,
+	op_cancel = 5,
+	op_async_event = 6,
+};
+
+const unsigned long long op_mask = 7;
+
+struct uring_connection : connection
+{
+	std::string sending;     // bytes owned by the in-flight send
+	size_t sending_offset;
+	int inflight;            // submissions that still reference us
+	iovec iov[2];            // buffered bytes, then file bytes
+	size_t iov_count;
+	msghdr msg;
+	bool send_armed;
+	bool recv_armed;
+	bool recv_paused;        // recv cancelled until the client catches up,
+	                         // or to move it to the sink buffers
+	bool recv_sink;          // the armed recv uses the sink buffers
+	bool send_deferred;      // new output, sent once the batch is reaped
+	bool closing;
+};
+
+//
+// A ring of provided buffers registered with the kernel under a group.
+//
+struct uring_buffers
+{
+	io_uring_buf* ring;
+	size_t ring_size;
+	unsigned short tail;
+	char* memory;
+	unsigned count;
+	unsigned size;
+};
+
+struct uring
+{
+	int fd;
+	unsigned sq_entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sqe_tail;       // next free SQE, published on enter
+	io_uring_sqe* sqes;
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe* cqes;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	uring_buffers buffers;
+	uring_buffers sink_buffers;
+};
+
+/***************************************************************************++
+
+Routine Description:
+	Registers a ring of provided buffers for multishot receives to pick
+	from: the kernel takes one per completion and we hand it back as soon
+	as its bytes have been handled.
+
+	The ring is addressed as a plain io_uring_buf array with the tail in
+	bufs[0].resv. io_uring_buf_ring's flexible array member is laid out
+	differently when the kernel header is compiled as C++.
+
+Arguments:
+	pRing    - The ring.
+	pBuffers - Receives the buffers.
+	group    - Buffer group id to register them under.
+	count    - Number of buffers; a power of two.
+	size     - Size of each.
+
+Return Value:
+	0 on success, otherwise an errno value.
+
+--***************************************************************************/
+static int
+UringRegisterBuffers(
+	uring* pRing,
+	uring_buffers* pBuffers,
+	unsigned short group,
+	unsigned count,
+	unsigned size
+)
+{
+	pBuffers->count = count;
+	pBuffers->size = size;
+	pBuffers->ring_size = count * sizeof(io_uring_buf);
+	pBuffers->ring = static_cast<io_uring_buf*>(mmap(NULL, pBuffers->ring_size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+
+	if (pBuffers->ring == MAP_FAILED)
+	{
+		return errno;
+	}
+
+	pBuffers->memory = static_cast<char*>(mmap(NULL, (size_t)count * size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+
+	if (pBuffers->memory == MAP_FAILED)
+	{
+		return errno;
+	}
+
+	io_uring_buf_reg reg = {};
+	reg.ring_addr = reinterpret_cast<unsigned long long>(pBuffers->ring);
+	reg.ring_entries = count;
+	reg.bgid = group;
+
+	if (syscall(__NR_io_uring_register, pRing->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+	{
+		return errno;
+	}
+
+	for (unsigned bid = 0; bid < count; bid++)
+	{
+		io_uring_buf* buf = &pBuffers->ring[pBuffers->tail++ & (count - 1)];
+		buf->addr = reinterpret_cast<unsigned long long>(pBuffers->memory + (size_t)bid * size);
+		buf->len = size;
+		buf->bid = (unsigned short)bid;
+	}
+
+	__atomic_store_n(&pBuffers->ring[0].resv, pBuffers->tail, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void
+UringReleaseBuffers(
+	uring_buffers* pBuffers
+)
+{
+	if (pBuffers->memory && pBuffers->memory != MAP_FAILED)
+		munmap(pBuffers->memory, (size_t)pBuffers->count * pBuffers->size);
+	if (pBuffers->ring && pBuffers->ring != MAP_FAILED)
+		munmap(pBuffers->ring, pBuffers->ring_size);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Creates the ring, maps its queues and registers the provided-buffer
+	rings that multishot receives pick their buffers from.
+
+Arguments:
+	pRing - Ring to initialize.
+
+Return Value:
+	0 on success, otherwise an errno value.
+
+--***************************************************************************/
+static int
+UringSetup(
+	uring* pRing
+)
+{
+	io_uring_params params = {};
+
+	memset(pRing, 0, sizeof(*pRing));
+
+	//
+	// Only this thread submits, so let the kernel defer completion work
+	// until we ask for completions. Older kernels reject the flags.
+	//
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = uring_entries * 4;
+
+	pRing->fd = (int)syscall(__NR_io_uring_setup, uring_entries, &params);
+
+	if (pRing->fd < 0 && errno == EINVAL)
+	{
+		params = {};
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = uring_entries * 4;
+		pRing->fd = (int)syscall(__NR_io_uring_setup, uring_entries, &params);
+	}
+
+	if (pRing->fd < 0)
+	{
+		return errno;
+	}
+
+	pRing->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	pRing->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (pRing->cq_ring_size > pRing->sq_ring_size)
+			pRing->sq_ring_size = pRing->cq_ring_size;
+		pRing->cq_ring_size = 0;
+	}
+
+	pRing->sq_ring = mmap(NULL, pRing->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQ_RING);
+
+	if (pRing->sq_ring == MAP_FAILED)
+	{
+		return errno;
+	}
+
+	pRing->cq_ring = pRing->sq_ring;
+
+	if (pRing->cq_ring_size != 0)
+	{
+		pRing->cq_ring = mmap(NULL, pRing->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_CQ_RING);
+
+		if (pRing->cq_ring == MAP_FAILED)
+		{
+			return errno;
+		}
+	}
+
+	pRing->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	pRing->sqes = static_cast<io_uring_sqe*>(mmap(NULL, pRing->sqes_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQES));
+
+	if (pRing->sqes == MAP_FAILED)
+	{
+		return errno;
+	}
+
+	char* sq = static_cast<char*>(pRing->sq_ring);
+	char* cq = static_cast<char*>(pRing->cq_ring);
+
+	pRing->sq_entries = params.sq_entries;
+	pRing->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	pRing->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	pRing->sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	pRing->sqe_tail = *pRing->sq_tail;
+
+	//
+	// SQEs are always used in ring order, so the index array is fixed.
+	//
+	unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++)
+		sq_array[i] = i;
+
+	pRing->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	pRing->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	pRing->cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	pRing->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	int result = UringRegisterBuffers(pRing, &pRing->buffers, uring_buffer_group,
+		uring_buffer_count, uring_buffer_size);
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	return UringRegisterBuffers(pRing, &pRing->sink_buffers, uring_sink_buffer_group,
+		uring_sink_buffer_count, uring_sink_buffer_size);
+}
+
+static void
+UringCleanup(
+	uring* pRing
+)
+{
+	if (pRing->fd >= 0)
+		close(pRing->fd);
+	UringReleaseBuffers(&pRing->buffers);
+	UringReleaseBuffers(&pRing->sink_buffers);
+	if (pRing->sqes && pRing->sqes != MAP_FAILED)
+		munmap(pRing->sqes, pRing->sqes_size);
+	if (pRing->cq_ring_size && pRing->cq_ring && pRing->cq_ring != MAP_FAILED)
+		munmap(pRing->cq_ring, pRing->cq_ring_size);
+	if (pRing->sq_ring && pRing->sq_ring != MAP_FAILED)
+		munmap(pRing->sq_ring, pRing->sq_ring_size);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Submits the queued SQEs and waits for at least wait_count completions.
+
+Arguments:
+	pRing      - The ring.
+	wait_count - Completions to wait for (0 just submits).
+
+Return Value:
+	0 on success, otherwise an errno value.
+
+--***************************************************************************/
+static int
+UringEnter(
+	uring* pRing,
+	unsigned wait_count
+)
+{
+	__atomic_store_n(pRing->sq_tail, pRing->sqe_tail, __ATOMIC_RELEASE);
+
+	unsigned to_submit = pRing->sqe_tail - __atomic_load_n(pRing->sq_head, __ATOMIC_ACQUIRE);
+
+	if (syscall(__NR_io_uring_enter, pRing->fd, to_submit, wait_count,
+		wait_count ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+	{
+		return errno;
+	}
+
+	return 0;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Submits the queued SQEs and posts the completions that are already
+	due, without waiting for any.
+
+Arguments:
+	pRing - The ring.
+
+Return Value:
+	0 on success, otherwise an errno value.
+
+--***************************************************************************/
+static int
+UringReap(
+	uring* pRing
+)
+{
+	__atomic_store_n(pRing->sq_tail, pRing->sqe_tail, __ATOMIC_RELEASE);
+
+	unsigned to_submit = pRing->sqe_tail - __atomic_load_n(pRing->sq_head, __ATOMIC_ACQUIRE);
+
+	if (syscall(__NR_io_uring_enter, pRing->fd, to_submit, 0,
+		IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+	{
+		return errno;
+	}
+
+	return 0;
+}
+
+static io_uring_sqe*
+UringGetSqe(
+	uring* pRing
+)
+{
+	if (pRing->sqe_tail - __atomic_load_n(pRing->sq_head, __ATOMIC_ACQUIRE) == pRing->sq_entries)
+	{
+		UringEnter(pRing, 0);
+	}
+
+	io_uring_sqe* sqe = &pRing->sqes[pRing->sqe_tail & pRing->sq_mask];
+	pRing->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void
+UringRecycleBuffer(
+	uring_buffers* pBuffers,
+	unsigned short bid
+)
+{
+	io_uring_buf* buf = &pBuffers->ring[pBuffers->tail++ & (pBuffers->count - 1)];
+	buf->addr = reinterpret_cast<unsigned long long>(pBuffers->memory + (size_t)bid * pBuffers->size);
+	buf->len = pBuffers->size;
+	buf->bid = bid;
+
+	__atomic_store_n(&pBuffers->ring[0].resv, pBuffers->tail, __ATOMIC_RELEASE);
+}
+
+static void
+ArmAccept(
+	uring* pRing,
+	int listen_fd
+)
+{
+	io_uring_sqe* sqe = UringGetSqe(pRing);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = op_accept;
+}
+
+static void
+ArmAsyncEvents(
+	uring* pRing,
+	int async_fd
+)
+{
+	io_uring_sqe* sqe = UringGetSqe(pRing);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = async_fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = op_async_event;
+}
+
+//
+// A connection receives into the sink buffers while a /sink body is
+// streaming in.
+//
+static bool
+WantsSinkBuffers(
+	uring_connection* pConnection
+)
+{
+	return pConnection->body.sink && pConnection->body.state != body_idle;
+}
+
+static void
+ArmRecv(
+	uring* pRing,
+	uring_connection* pConnection
+)
+{
+	io_uring_sqe* sqe = UringGetSqe(pRing);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = pConnection->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = WantsSinkBuffers(pConnection) ? uring_sink_buffer_group : uring_buffer_group;
+	sqe->user_data = reinterpret_cast<unsigned long long>(pConnection) | op_recv;
+
+	pConnection->recv_sink = WantsSinkBuffers(pConnection);
+	pConnection->recv_armed = true;
+	pConnection->inflight++;
+}
+
+static size_t
+PendingOutput(
+	uring_connection* pConnection
+)
+{
+	return pConnection->out.size() +
+		(pConnection->sending.size() - pConnection->sending_offset);
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Applies back pressure for streamed request bodies: cancels the
+	connection's multishot recv once echo_window bytes of response are
+	waiting, and re-arms it when less than half of that is left. Also
+	cancels and re-arms it to move it to or from the sink buffers when a
+	/sink body starts or ends.
+
+Arguments:
+	pRing       - The ring.
+	pConnection - The connection.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+UpdateRecvFlow(
+	uring* pRing,
+	uring_connection* pConnection
+)
+{
+	if (pConnection->closing)
+	{
+		return;
+	}
+
+	size_t pending = PendingOutput(pConnection);
+
+	if (!pConnection->recv_paused)
+	{
+		if (pConnection->recv_armed &&
+			(pending >= echo_window || pConnection->recv_sink != WantsSinkBuffers(pConnection)))
+		{
+			io_uring_sqe* sqe = UringGetSqe(pRing);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = reinterpret_cast<unsigned long long>(pConnection) | op_recv;
+			sqe->user_data = reinterpret_cast<unsigned long long>(pConnection) | op_cancel;
+			pConnection->inflight++;
+			pConnection->recv_paused = true;
+		}
+	}
+	else if (!pConnection->recv_armed && pending < echo_window / 2)
+	{
+		pConnection->recv_paused = false;
+		ArmRecv(pRing, pConnection);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Starts sending whatever the handlers queued on the connection, unless
+	a send is already in flight. The last response on a connection is
+	linked to a shutdown so both go to the kernel in the same submission.
+
+Arguments:
+	pRing       - The ring.
+	pConnection - The connection.
+	pSends      - Count of sends in flight on this ring.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+QueueSend(
+	uring* pRing,
+	uring_connection* pConnection,
+	int* pSends
+)
+{
+	if (pConnection->closing || pConnection->send_armed)
+	{
+		return;
+	}
+
+	if (pConnection->sending.empty() && !pConnection->out.empty())
+	{
+		pConnection->sending.swap(pConnection->out);
+		pConnection->sending_offset = 0;
+	}
+
+	//
+	// A pending file body follows the buffered bytes directly, so it goes
+	// out in the same sendmsg straight from the file's mapping.
+	//
+	size_t pending = pConnection->sending.size() - pConnection->sending_offset;
+	file_send& file = pConnection->file;
+	size_t file_part = 0;
+
+	if (file.remaining != 0 && pConnection->out.empty())
+	{
+		file_part = file.remaining > max_file_send ? max_file_send : (size_t)file.remaining;
+	}
+
+	if (pending == 0 && file_part == 0)
+	{
+		return;
+	}
+
+	bool last = pConnection->close_after_send && pConnection->out.empty() &&
+		pConnection->body.state == body_idle && file.remaining == file_part &&
+		pConnection->async == nullptr;
+
+	pConnection->iov_count = 0;
+
+	if (pending != 0)
+	{
+		pConnection->iov[pConnection->iov_count].iov_base = &pConnection->sending[pConnection->sending_offset];
+		pConnection->iov[pConnection->iov_count++].iov_len = pending;
+	}
+
+	if (file_part != 0)
+	{
+		pConnection->iov[pConnection->iov_count].iov_base = const_cast<char*>(file.file->map + file.offset);
+		pConnection->iov[pConnection->iov_count++].iov_len = file_part;
+	}
+
+	pConnection->msg = {};
+	pConnection->msg.msg_iov = pConnection->iov;
+	pConnection->msg.msg_iovlen = pConnection->iov_count;
+
+	io_uring_sqe* sqe = UringGetSqe(pRing);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = pConnection->fd;
+	sqe->addr = reinterpret_cast<unsigned long long>(&pConnection->msg);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | (last ? MSG_WAITALL : 0);
+	sqe->user_data = reinterpret_cast<unsigned long long>(pConnection) | op_send;
+	pConnection->send_armed = true;
+	pConnection->inflight++;
+	*pSends += 1;
+
+	if (last)
+	{
+		sqe->flags = IOSQE_IO_LINK;
+
+		sqe = UringGetSqe(pRing);
+		sqe->opcode = IORING_OP_SHUTDOWN;
+		sqe->fd = pConnection->fd;
+		sqe->len = SHUT_RDWR;
+		sqe->user_data = reinterpret_cast<unsigned long long>(pConnection) | op_shutdown;
+		pConnection->inflight++;
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Closes and frees a connection once it is closing and the kernel holds
+	no more submissions that reference it.
+
+Arguments:
+	pConnection - The connection.
+	connections - The ring's live connections.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+static void
+ReleaseConnection(
+	uring_connection* pConnection,
+	std::unordered_set<uring_connection*>& connections
+)
+{
+	if (!pConnection->closing)
+	{
+		return;
+	}
+
+	if (pConnection->recv_armed)
+	{
+		//
+		// Ends the multishot recv; its final completion releases us.
+		//
+		shutdown(pConnection->fd, SHUT_RDWR);
+		return;
+	}
+
+	if (pConnection->inflight == 0)
+	{
+		connections.erase(pConnection);
+		close(pConnection->fd);
+		CancelAsyncCall(pConnection);
+		EndHttp2Session(pConnection);
+		CancelThreadTimer(&pConnection->timer);
+		delete pConnection;
+	}
+}
+
+//
+// Re-arms a live connection's timeout after its completions were handled.
+//
+static void
+UpdateTimeout(
+	uring_connection* pConnection
+)
+{
+	if (!pConnection->closing)
+	{
+		UpdateConnectionTimeout(pConnection,
+			PendingOutput(pConnection) != 0 || pConnection->file.remaining != 0);
+	}
+}
+
+/***************************************************************************++
+
+Routine Description:
+	The per-thread io_uring event loop. Each thread owns a ring, accepts
+	connections from the shared listening socket and handles the requests
+	on those connections until the shutdown event is signalled.
+
+Arguments:
+	listen_fd - The listening socket: shared, or this thread's own (--shards).
+
+Return Value:
+	Success/Failure.
+
+--***************************************************************************/
+int
+DoReceiveRequestsUring(
+	int listen_fd
+)
+{
+	uring ring;
+	std::unordered_set<uring_connection*> connections;
+	std::vector<uring_connection*> deferred_sends;
+	std::vector<connection*> finished;
+	std::vector<connection*> expired;
+	int async_fd;
+	bool async_ready = false;
+	int kill_server = 0;
+	int requests_handled = 0;
+	int sends_inflight = 0;
+	auto batch_time = std::chrono::steady_clock::now();
+	int result;
+
+	RegisterStatsThread();
+
+	result = UringSetup(&ring);
+
+	if (result != 0)
+	{
+		printf("io_uring setup failed with %d \n", result);
+		UringCleanup(&ring);
+		return result;
+	}
+
+	ArmAccept(&ring, listen_fd);
+
+	io_uring_sqe* sqe = UringGetSqe(&ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shutdown_event;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = op_shutdown_event;
+
+	//
+	// Timers and waits of suspended coroutine handlers.
+	//
+	async_fd = InitializeAsyncEvents();
+
+	if (async_fd >= 0)
+	{
+		ArmAsyncEvents(&ring, async_fd);
+	}
+
+	//
+	// After the shutdown event we keep going until the responses already
+	// queued (including the final kill response) have been sent.
+	//
+	while (!kill_server || sends_inflight != 0)
+	{
+		//
+		// Completions carry no arrival time, so for admission control a
+		// request's queueing delay counts from when the thread got back
+		// to the ring. Completions that were already due then waited
+		// behind the whole previous pass, and are charged from its start;
+		// they are reaped without waiting first, to tell them apart from
+		// ones the thread sleeps for.
+		//
+		auto pass_start = batch_time;
+		bool backlog = false;
+
+		result = 0;
+
+		if (admission.enabled)
+		{
+			result = UringReap(&ring);
+			backlog = result == 0 && *ring.cq_head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		}
+
+		if (result == 0 && !backlog)
+			result = UringEnter(&ring, 1);
+
+		if (result != 0)
+		{
+			if (result == EINTR || result == EAGAIN || result == EBUSY)
+				continue;
+
+			printf("io_uring_enter failed with %d \n", result);
+			break;
+		}
+
+		batch_time = std::chrono::steady_clock::now();
+
+		auto arrival = backlog ? pass_start : batch_time;
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++)
+		{
+			io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+			unsigned long long op = cqe->user_data & op_mask;
+			uring_connection* pConnection =
+				reinterpret_cast<uring_connection*>(cqe->user_data & ~op_mask);
+			bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+			switch (op)
+			{
+			case op_shutdown_event:
+				kill_server = 1;
+				break;
+
+			case op_async_event:
+				async_ready = true;
+
+				if (!more)
+				{
+					ArmAsyncEvents(&ring, async_fd);
+				}
+				break;
+
+			case op_accept:
+				if (cqe->res >= 0)
+				{
+					int one = 1;
+					setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+					pConnection = new uring_connection{};
+					pConnection->fd = cqe->res;
+					connections.insert(pConnection);
+
+					ArmRecv(&ring, pConnection);
+					UpdateConnectionTimeout(pConnection, false);
+				}
+
+				if (!more && !kill_server)
+				{
+					ArmAccept(&ring, listen_fd);
+				}
+				break;
+
+			case op_recv:
+				if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+				{
+					unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+					uring_buffers* pBuffers = pConnection->recv_sink ? &ring.sink_buffers : &ring.buffers;
+
+					receive_time = arrival;
+					HandleReceivedData(pConnection,
+						pBuffers->memory + (size_t)bid * pBuffers->size, cqe->res, &requests_handled);
+					UringRecycleBuffer(pBuffers, bid);
+
+					//
+					// A pipelined batch bigger than one provided buffer
+					// completes as several receives; their responses go out
+					// in one send once this batch of completions is reaped.
+					// The deferral holds a reference so the connection stays
+					// alive until then.
+					//
+					if (!pConnection->send_deferred)
+					{
+						pConnection->send_deferred = true;
+						pConnection->inflight++;
+						deferred_sends.push_back(pConnection);
+					}
+				}
+
+				if (!more)
+				{
+					pConnection->recv_armed = false;
+					pConnection->inflight--;
+
+					if (cqe->res == -ENOBUFS && !pConnection->closing)
+					{
+						// Buffers ran out; they have been recycled by now.
+						ArmRecv(&ring, pConnection);
+					}
+					else if (pConnection->recv_paused && cqe->res != 0)
+					{
+						// Cancelled by UpdateRecvFlow, which re-arms it.
+						UpdateRecvFlow(&ring, pConnection);
+					}
+					else
+					{
+						// Answer what the client sent before it went away.
+						QueueSend(&ring, pConnection, &sends_inflight);
+						pConnection->closing = true;
+					}
+				}
+
+				ReleaseConnection(pConnection, connections);
+				break;
+
+			case op_send:
+				pConnection->send_armed = false;
+				pConnection->inflight--;
+				sends_inflight--;
+
+				if (cqe->res < 0)
+				{
+					StatAdd(thread_stats->io_errors, 1);
+					pConnection->closing = true;
+				}
+				else
+				{
+					size_t sent = cqe->res;
+
+					StatAdd(thread_stats->bytes_out, sent);
+					size_t from_buffer = pConnection->sending.size() - pConnection->sending_offset;
+
+					if (from_buffer > sent)
+						from_buffer = sent;
+
+					pConnection->sending_offset += from_buffer;
+
+					if (pConnection->sending_offset == pConnection->sending.size())
+					{
+						pConnection->sending.clear();
+						pConnection->sending_offset = 0;
+					}
+
+					if (sent > from_buffer)
+					{
+						pConnection->file.offset += sent - from_buffer;
+						pConnection->file.remaining -= sent - from_buffer;
+
+						if (pConnection->file.remaining == 0)
+						{
+							//
+							// Requests that arrived behind the file can go now.
+							//
+							pConnection->file = {};
+							HandleRequests(pConnection, &requests_handled);
+						}
+					}
+
+					//
+					// HTTP/2 responses held back by the output limit go
+					// on once everything queued has been sent.
+					//
+					if (pConnection->sending.empty() && pConnection->out.empty() && !pConnection->closing)
+						ResumeHttp2Output(pConnection);
+
+					QueueSend(&ring, pConnection, &sends_inflight);
+					UpdateRecvFlow(&ring, pConnection);
+					UpdateTimeout(pConnection);
+				}
+
+				ReleaseConnection(pConnection, connections);
+				break;
+
+			case op_cancel:
+				pConnection->inflight--;
+				ReleaseConnection(pConnection, connections);
+				break;
+
+			case op_shutdown:
+				//
+				// -ECANCELED means the linked send came up short; QueueSend
+				// has already resubmitted the rest with a new shutdown.
+				//
+				pConnection->inflight--;
+				ReleaseConnection(pConnection, connections);
+				break;
+			}
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		//
+		// Connections whose coroutine handler finished have a response
+		// queued, and maybe requests held back behind it.
+		//
+		if (async_ready)
+		{
+			async_ready = false;
+			RunAsyncEvents(&finished, &expired);
+
+			for (auto pFinished : finished)
+			{
+				uring_connection* pConnection = static_cast<uring_connection*>(pFinished);
+
+				HandleRequests(pConnection, &requests_handled);
+
+				if (!pConnection->send_deferred)
+				{
+					pConnection->send_deferred = true;
+					pConnection->inflight++;
+					deferred_sends.push_back(pConnection);
+				}
+			}
+
+			//
+			// Shutting the socket down ends its recv and any send, and
+			// the last completion frees the connection.
+			//
+			for (auto pExpired : expired)
+			{
+				uring_connection* pConnection = static_cast<uring_connection*>(pExpired);
+
+				StatAdd(thread_stats->timeouts, 1);
+
+				if (!pConnection->closing)
+				{
+					pConnection->closing = true;
+					shutdown(pConnection->fd, SHUT_RDWR);
+				}
+
+				ReleaseConnection(pConnection, connections);
+			}
+
+			finished.clear();
+			expired.clear();
+		}
+
+		for (auto pConnection : deferred_sends)
+		{
+			pConnection->send_deferred = false;
+			pConnection->inflight--;
+
+			QueueSend(&ring, pConnection, &sends_inflight);
+			UpdateRecvFlow(&ring, pConnection);
+			UpdateTimeout(pConnection);
+			ReleaseConnection(pConnection, connections);
+		}
+
+		deferred_sends.clear();
+	}
+
+	UringCleanup(&ring);
+
+	for (auto pConnection : connections)
+	{
+		close(pConnection->fd);
+		CancelAsyncCall(pConnection);
+		EndHttp2Session(pConnection);
+		CancelThreadTimer(&pConnection->timer);
+		delete pConnection;
+	}
+
+	CleanupAsyncEvents();
+
+	printf("Thread completed after %d requests \n", requests_handled);
+
+	return result;
+}
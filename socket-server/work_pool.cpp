@@ -0,0 +1,350 @@
+//
+// Work-stealing thread pool: the Chase-Lev deque and the worker loop.
+//
+
+#include "work_pool.h"
+
+//
+// Rounds of looking for work, yielding in between, before an idle worker
+// goes to sleep.
+//
+const int idle_spins = 64;
+
+static thread_local work_pool* current_pool = nullptr;
+thread_local work_pool::worker* work_pool::current_worker_ = nullptr;
+
+//
+// work_deque
+//
+work_deque::work_deque(
+	size_t capacity
+)
+	: top_(0), bottom_(0)
+{
+	size_t size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	rings_.emplace_back(new ring(size));
+	ring_.store(rings_.back().get(), std::memory_order_relaxed);
+}
+
+work_deque::ring*
+work_deque::grow(
+	ring* pRing,
+	int64_t bottom,
+	int64_t top
+)
+{
+	ring* pBigger = new ring((pRing->mask + 1) * 2);
+
+	for (int64_t i = top; i < bottom; i++)
+		pBigger->put(i, pRing->get(i));
+
+	rings_.emplace_back(pBigger);
+	ring_.store(pBigger, std::memory_order_release);
+	return pBigger;
+}
+
+void
+work_deque::push(
+	work_item* pItem
+)
+{
+	int64_t bottom = bottom_.load(std::memory_order_relaxed);
+	int64_t top = top_.load(std::memory_order_acquire);
+	ring* pRing = ring_.load(std::memory_order_relaxed);
+
+	if (bottom - top > (int64_t)pRing->mask)
+		pRing = grow(pRing, bottom, top);
+
+	pRing->put(bottom, pItem);
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom_.store(bottom + 1, std::memory_order_relaxed);
+}
+
+work_item*
+work_deque::take()
+{
+	int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+	ring* pRing = ring_.load(std::memory_order_relaxed);
+	work_item* pItem = nullptr;
+
+	bottom_.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	int64_t top = top_.load(std::memory_order_relaxed);
+
+	if (top <= bottom)
+	{
+		pItem = pRing->get(bottom);
+
+		if (top == bottom)
+		{
+			//
+			// The last item: race thieves for it.
+			//
+			if (!top_.compare_exchange_strong(top, top + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				pItem = nullptr;
+			}
+
+			bottom_.store(bottom + 1, std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+	}
+
+	return pItem;
+}
+
+work_item*
+work_deque::steal()
+{
+	int64_t top = top_.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t bottom = bottom_.load(std::memory_order_acquire);
+
+	if (top >= bottom)
+		return nullptr;
+
+	ring* pRing = ring_.load(std::memory_order_acquire);
+	work_item* pItem = pRing->get(top);
+
+	if (!top_.compare_exchange_strong(top, top + 1,
+		std::memory_order_seq_cst, std::memory_order_relaxed))
+	{
+		return nullptr;
+	}
+
+	return pItem;
+}
+
+//
+// work_pool
+//
+work_pool::work_pool(
+	size_t thread_count
+)
+{
+	for (size_t i = 0; i < thread_count; i++)
+	{
+		workers_.emplace_back(new worker{});
+		workers_.back()->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+	}
+
+	//
+	// Start the threads only once every deque exists, since each worker
+	// steals from all of them.
+	//
+	for (size_t i = 0; i < thread_count; i++)
+	{
+		workers_[i]->thread = std::thread([this, i]() { run_worker(i); });
+	}
+}
+
+work_pool::~work_pool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		stopping_ = true;
+	}
+
+	wake_.notify_all();
+
+	for (auto& pWorker : workers_)
+	{
+		pWorker->thread.join();
+	}
+}
+
+work_pool*
+work_pool::current()
+{
+	return current_pool;
+}
+
+void
+work_pool::submit(
+	work_item* pItem
+)
+{
+	if (current_pool == this)
+	{
+		current_worker_->deque.push(pItem);
+
+		//
+		// Pairs with the fence in run_worker: either a worker about to
+		// sleep sees the item, or we see it sleeping and wake it.
+		//
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (sleeping_.load(std::memory_order_relaxed) != 0)
+			wake_one();
+
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		injected_.push_back(pItem);
+		injected_count_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	wake_.notify_one();
+}
+
+void
+work_pool::wake_one()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	wake_.notify_one();
+}
+
+bool
+work_pool::run_one()
+{
+	if (current_pool != this)
+		return false;
+
+	work_item* pItem = find_work(current_worker_);
+
+	if (pItem == nullptr)
+		return false;
+
+	pItem->run(pItem);
+	return true;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Finds the next item for a worker: its own newest item, then the oldest
+	injected item, then an item stolen from another worker, starting at a
+	random victim.
+
+Arguments:
+	pSelf - The worker looking for work.
+
+Return Value:
+	The item, or NULL if none was found.
+
+--***************************************************************************/
+work_item*
+work_pool::find_work(
+	worker* pSelf
+)
+{
+	work_item* pItem = pSelf->deque.take();
+
+	if (pItem != nullptr)
+		return pItem;
+
+	if (injected_count_.load(std::memory_order_relaxed) != 0)
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+
+		if (!injected_.empty())
+		{
+			pItem = injected_.front();
+			injected_.pop_front();
+			injected_count_.fetch_sub(1, std::memory_order_relaxed);
+			return pItem;
+		}
+	}
+
+	size_t count = workers_.size();
+
+	pSelf->rng ^= pSelf->rng << 13;
+	pSelf->rng ^= pSelf->rng >> 7;
+	pSelf->rng ^= pSelf->rng << 17;
+
+	for (size_t i = 0, start = pSelf->rng % count; i < count; i++)
+	{
+		worker* pVictim = workers_[(start + i) % count].get();
+
+		if (pVictim == pSelf)
+			continue;
+
+		pItem = pVictim->deque.steal();
+
+		if (pItem != nullptr)
+			return pItem;
+	}
+
+	return nullptr;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	A worker thread: runs items until the pool is destroyed, sleeping when
+	there is nothing to run or steal.
+
+Arguments:
+	index - The worker's slot.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+void
+work_pool::run_worker(
+	size_t index
+)
+{
+	worker* pSelf = workers_[index].get();
+	int idle = 0;
+
+	current_pool = this;
+	current_worker_ = pSelf;
+
+	for (;;)
+	{
+		work_item* pItem = find_work(pSelf);
+
+		if (pItem != nullptr)
+		{
+			idle = 0;
+			pItem->run(pItem);
+			continue;
+		}
+
+		if (++idle < idle_spins)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(lock_);
+
+		if (stopping_ && injected_.empty())
+			break;
+
+		sleeping_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		//
+		// Look once more now that submitters can see us asleep.
+		//
+		bool found = !injected_.empty();
+
+		for (size_t i = 0; !found && i < workers_.size(); i++)
+		{
+			found = !workers_[i]->deque.empty();
+		}
+
+		if (!found)
+			wake_.wait(guard);
+
+		sleeping_.fetch_sub(1, std::memory_order_relaxed);
+		idle = 0;
+	}
+
+	current_pool = nullptr;
+	current_worker_ = nullptr;
+}
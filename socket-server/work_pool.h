@@ -0,0 +1,198 @@
+//
+// Work-stealing thread pool for CPU-heavy handler work.
+//
+// The I/O threads only parse requests and move bytes; a handler with real
+// computation to do hands it to this pool (see run_on_pool in
+// async_handler.h) and its I/O thread carries on serving other
+// connections. Each worker owns a Chase-Lev deque: it pushes and pops
+// work at the bottom without locking, and idle workers steal from the
+// top. Work submitted from outside the pool goes through a shared
+// injection queue. Idle workers sleep on a condition variable.
+//
+// Work items are intrusive and never allocated by the pool; whoever
+// submits an item keeps it alive until it has run.
+//
+
+#ifndef __WORK_POOL__
+#define __WORK_POOL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct work_item
+{
+	void (*run)(work_item* pItem);
+};
+
+//
+// Chase-Lev work-stealing deque ("Dynamic Circular Work-Stealing Deque",
+// with the C11 memory orderings of Le et al., PPoPP 2013). push and take
+// are for the owning worker only; steal may be called from any thread.
+// The ring grows when full; old rings are kept until the deque is
+// destroyed because a thief may still be reading one.
+//
+class work_deque
+{
+public:
+	explicit work_deque(size_t capacity = 256);
+	work_deque(const work_deque&) = delete;
+	work_deque& operator=(const work_deque&) = delete;
+
+	void push(work_item* pItem);
+	work_item* take();
+	work_item* steal();
+
+	bool empty() const
+	{
+		return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct ring
+	{
+		size_t mask;
+		std::unique_ptr<std::atomic<work_item*>[]> slots;
+
+		explicit ring(size_t capacity)
+			: mask(capacity - 1), slots(new std::atomic<work_item*>[capacity]) {}
+
+		work_item* get(int64_t index) const
+		{
+			return slots[index & mask].load(std::memory_order_relaxed);
+		}
+
+		void put(int64_t index, work_item* pItem)
+		{
+			slots[index & mask].store(pItem, std::memory_order_relaxed);
+		}
+	};
+
+	ring* grow(ring* pRing, int64_t bottom, int64_t top);
+
+	alignas(64) std::atomic<int64_t> top_;
+	alignas(64) std::atomic<int64_t> bottom_;
+	std::atomic<ring*> ring_;
+	std::vector<std::unique_ptr<ring>> rings_;    // owner only
+};
+
+class work_pool
+{
+public:
+	explicit work_pool(size_t thread_count);
+	work_pool(const work_pool&) = delete;
+	work_pool& operator=(const work_pool&) = delete;
+	~work_pool();
+
+	size_t size() const { return workers_.size(); }
+
+	//
+	// Queues an item. From one of this pool's workers it goes on that
+	// worker's own deque, where other workers can steal it; from any
+	// other thread it goes on the injection queue.
+	//
+	void submit(work_item* pItem);
+
+	//
+	// Runs one queued item on the calling worker if there is one. For
+	// workers that wait on work they spawned (see ParallelFor).
+	//
+	bool run_one();
+
+	//
+	// The pool the calling thread works for, if any.
+	//
+	static work_pool* current();
+
+private:
+	struct worker
+	{
+		work_deque deque;
+		std::thread thread;
+		uint64_t rng;
+	};
+
+	void run_worker(size_t index);
+	work_item* find_work(worker* pSelf);
+	void wake_one();
+
+	static thread_local worker* current_worker_;
+
+	std::vector<std::unique_ptr<worker>> workers_;
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::deque<work_item*> injected_;                // under lock_
+	std::atomic<size_t> injected_count_{ 0 };
+	std::atomic<int> sleeping_{ 0 };
+	bool stopping_ = false;                          // under lock_
+};
+
+//
+// Runs body(first, last) over [begin, end) in pieces of about grain,
+// splitting the range onto the calling worker's deque so idle workers can
+// steal halves of it. Must be called on a worker of pool; the caller
+// runs pieces itself (its own or stolen ones) until all are done.
+//
+template <typename Body>
+void ParallelFor(work_pool* pPool, uint64_t begin, uint64_t end, uint64_t grain, Body& body)
+{
+	struct shared_state
+	{
+		Body* pBody;
+		uint64_t grain;
+		work_pool* pPool;
+		std::atomic<size_t> pending;
+	};
+
+	struct range_item : work_item
+	{
+		shared_state* pState;
+		uint64_t first;
+		uint64_t last;
+
+		static void Run(work_item* pItem)
+		{
+			range_item* pRange = static_cast<range_item*>(pItem);
+			shared_state* pState = pRange->pState;
+
+			//
+			// Give away the upper half until what is left is one piece.
+			//
+			while (pRange->last - pRange->first > pState->grain)
+			{
+				uint64_t middle = pRange->first + (pRange->last - pRange->first) / 2;
+
+				pState->pending.fetch_add(1, std::memory_order_relaxed);
+				pState->pPool->submit(new range_item{ { Run }, pState, middle, pRange->last });
+				pRange->last = middle;
+			}
+
+			(*pState->pBody)(pRange->first, pRange->last);
+
+			delete pRange;
+			pState->pending.fetch_sub(1, std::memory_order_acq_rel);
+		}
+	};
+
+	if (begin >= end)
+		return;
+
+	shared_state state = { &body, grain ? grain : 1, pPool, { 1 } };
+
+	range_item::Run(new range_item{ { range_item::Run }, &state, begin, end });
+
+	while (state.pending.load(std::memory_order_acquire) != 0)
+	{
+		if (!pPool->run_one())
+			std::this_thread::yield();
+	}
+}
+
+#endif
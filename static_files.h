@@ -0,0 +1,244 @@
+//
+// Helpers for serving files under /files/, shared by the http.sys server
+// and the socket backend: turning a request path into a path relative to
+// the file root, parsing a single byte range, and picking a content type.
+//
+
+#ifndef __STATIC_FILES__
+#define __STATIC_FILES__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+//
+// Files are served from this directory unless --root says otherwise.
+//
+const char default_file_root[] = "files";
+
+//
+// Cached file metadata is trusted for this long before it is checked
+// against the file system again.
+//
+const unsigned file_revalidate_seconds = 2;
+
+enum byte_range_result
+{
+	range_none,              // no usable Range header: send the whole file
+	range_satisfiable,       // send *pFirst, *pLength
+	range_unsatisfiable      // 416
+};
+
+inline int HexDigitValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+		return (c | 0x20) - 'a' + 10;
+	return -1;
+}
+
+//
+// Turns the part of a URL path after "/files/" into a relative file path.
+// Percent escapes are decoded and the query string is dropped. Paths that
+// could leave the root (".." segments, absolute or drive paths, back
+// slashes, NULs) and empty segments are rejected.
+//
+inline bool DecodeFilePath(std::string_view url_path, std::string* pPath)
+{
+	pPath->clear();
+
+	auto query = url_path.find('?');
+	if (query != std::string_view::npos)
+		url_path = url_path.substr(0, query);
+
+	for (size_t i = 0; i < url_path.size(); i++)
+	{
+		char c = url_path[i];
+
+		if (c == '%')
+		{
+			if (i + 2 >= url_path.size())
+				return false;
+
+			int high = HexDigitValue(url_path[i + 1]);
+			int low = HexDigitValue(url_path[i + 2]);
+
+			if (high < 0 || low < 0)
+				return false;
+
+			c = static_cast<char>(high * 16 + low);
+			i += 2;
+		}
+
+		if (c == '\0' || c == '\\' || c == ':')
+			return false;
+
+		pPath->push_back(c);
+	}
+
+	if (pPath->empty())
+		return false;
+
+	//
+	// Check each segment.
+	//
+	size_t start = 0;
+
+	for (;;)
+	{
+		size_t end = pPath->find('/', start);
+		std::string_view segment(pPath->data() + start,
+			(end == std::string::npos ? pPath->size() : end) - start);
+
+		if (segment.empty() || segment == "." || segment == "..")
+			return false;
+
+		if (end == std::string::npos)
+			break;
+
+		start = end + 1;
+	}
+
+	return true;
+}
+
+//
+// Parses a Range header value against a file of the given size. Only a
+// single range is supported ("bytes=first-last", "bytes=first-" or
+// "bytes=-suffix"); anything else is ignored and the whole file is sent,
+// which RFC 9110 allows.
+//
+inline byte_range_result ParseByteRange(
+	std::string_view value,
+	uint64_t size,
+	uint64_t* pFirst,
+	uint64_t* pLength)
+{
+	const std::string_view unit = "bytes=";
+
+	if (value.size() <= unit.size() || value.substr(0, unit.size()) != unit)
+		return range_none;
+
+	value.remove_prefix(unit.size());
+
+	if (value.find(',') != std::string_view::npos)
+		return range_none;
+
+	auto dash = value.find('-');
+	if (dash == std::string_view::npos)
+		return range_none;
+
+	auto parse = [](std::string_view digits, uint64_t* pValue)
+	{
+		uint64_t v = 0;
+
+		if (digits.empty() || digits.size() > 19)
+			return false;
+
+		for (char c : digits)
+		{
+			if (c < '0' || c > '9')
+				return false;
+			v = v * 10 + (c - '0');
+		}
+
+		*pValue = v;
+		return true;
+	};
+
+	std::string_view first_text = value.substr(0, dash);
+	std::string_view last_text = value.substr(dash + 1);
+	uint64_t first;
+	uint64_t last;
+
+	if (first_text.empty())
+	{
+		//
+		// Suffix range: the last N bytes.
+		//
+		uint64_t suffix;
+
+		if (!parse(last_text, &suffix))
+			return range_none;
+
+		if (suffix == 0 || size == 0)
+			return range_unsatisfiable;
+
+		if (suffix > size)
+			suffix = size;
+
+		*pFirst = size - suffix;
+		*pLength = suffix;
+		return range_satisfiable;
+	}
+
+	if (!parse(first_text, &first))
+		return range_none;
+
+	if (last_text.empty())
+		last = size - 1;
+	else if (!parse(last_text, &last) || last < first)
+		return range_none;
+
+	if (first >= size)
+		return range_unsatisfiable;
+
+	if (last >= size)
+		last = size - 1;
+
+	*pFirst = first;
+	*pLength = last - first + 1;
+	return range_satisfiable;
+}
+
+inline std::string_view ContentTypeForPath(std::string_view path)
+{
+	struct extension_type
+	{
+		const char* extension;
+		const char* type;
+	};
+
+	static const extension_type types[] = {
+		{ ".html", "text/html" },
+		{ ".htm",  "text/html" },
+		{ ".txt",  "text/plain" },
+		{ ".css",  "text/css" },
+		{ ".js",   "application/javascript" },
+		{ ".json", "application/json" },
+		{ ".png",  "image/png" },
+		{ ".jpg",  "image/jpeg" },
+		{ ".jpeg", "image/jpeg" },
+		{ ".gif",  "image/gif" },
+		{ ".svg",  "image/svg+xml" },
+		{ ".mp4",  "video/mp4" },
+	};
+
+	auto dot = path.rfind('.');
+
+	if (dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos)
+	{
+		std::string_view extension = path.substr(dot);
+
+		for (const auto& t : types)
+		{
+			std::string_view candidate = t.extension;
+
+			if (candidate.size() != extension.size())
+				continue;
+
+			size_t i = 0;
+			while (i < candidate.size() && (extension[i] | 0x20) == candidate[i])
+				i++;
+
+			if (i == candidate.size())
+				return t.type;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+#endif
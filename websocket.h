@@ -0,0 +1,800 @@
+//
+// WebSocket (RFC 6455) framing, shared by both servers' /ws echo and by
+// the load tester.
+//
+// Every frame a client sends is masked: its payload is XORed with a
+// 4-byte key that repeats along it. Unmasking is the only per-byte work an
+// echo server does, so it runs 16 (SSE2) or 32 (AVX2) bytes per step, and
+// 8 per step on other CPUs. As with the request parser, the variant is
+// picked once at startup; micro-bench checks that all of them agree.
+//
+// websocket_echo turns a client's frames into the server's replies as
+// they arrive. A data frame's header is answered straight away and its
+// payload is unmasked into the reply piece by piece, so frames of any
+// size pass through without being collected; only control frames, at
+// most 125 bytes, are waited for whole.
+//
+
+#ifndef __WEBSOCKET__
+#define __WEBSOCKET__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define WEBSOCKET_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define WEBSOCKET_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define WEBSOCKET_TARGET_AVX2
+#endif
+
+//
+// Appended to a client's Sec-WebSocket-Key before hashing it for
+// Sec-WebSocket-Accept.
+//
+const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const size_t websocket_accept_length = 28;
+
+//
+// Longest frame header: 2 bytes, an 8-byte length and a mask key.
+//
+const size_t websocket_max_header = 14;
+const size_t websocket_max_control_payload = 125;
+
+enum websocket_opcode : uint8_t
+{
+	websocket_continuation = 0x0,
+	websocket_text = 0x1,
+	websocket_binary = 0x2,
+	websocket_close = 0x8,
+	websocket_ping = 0x9,
+	websocket_pong = 0xa,
+};
+
+enum websocket_close_code : uint16_t
+{
+	websocket_close_normal = 1000,
+	websocket_close_protocol_error = 1002,
+};
+
+struct websocket_frame
+{
+	bool fin;
+	uint8_t opcode;
+	bool masked;
+	uint8_t mask[4];
+	uint64_t length;
+};
+
+/***************************************************************************++
+
+Routine Description:
+	Parses the frame header at the start of a buffer.
+
+Arguments:
+	pData   - Received bytes, starting at a frame.
+	length  - Number of bytes at pData.
+	pFrame  - Receives the header.
+
+Return Value:
+	Length of the header, 0 if more bytes are needed, or -1 if the frame
+	is malformed: reserved bits or opcodes, a length with its top bit
+	set, or a fragmented or oversized control frame.
+
+--***************************************************************************/
+inline ptrdiff_t
+WebSocketReadFrameHeader(
+	const void* pData,
+	size_t length,
+	websocket_frame* pFrame
+)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(pData);
+	size_t header = 2;
+
+	if (length < 2)
+		return 0;
+
+	pFrame->fin = (p[0] & 0x80) != 0;
+	pFrame->opcode = p[0] & 0x0f;
+	pFrame->masked = (p[1] & 0x80) != 0;
+	pFrame->length = p[1] & 0x7f;
+
+	// No extensions are negotiated, so no reserved bit may be set.
+	if ((p[0] & 0x70) != 0 || (pFrame->opcode & 7) > websocket_binary)
+		return -1;
+
+	if (pFrame->length == 126)
+		header += 2;
+	else if (pFrame->length == 127)
+		header += 8;
+
+	if (pFrame->masked)
+		header += 4;
+
+	if (length < header)
+		return 0;
+
+	if (pFrame->length == 126)
+	{
+		pFrame->length = (uint64_t)p[2] << 8 | p[3];
+	}
+	else if (pFrame->length == 127)
+	{
+		pFrame->length = 0;
+
+		for (int i = 2; i < 10; i++)
+			pFrame->length = pFrame->length << 8 | p[i];
+
+		if (pFrame->length >> 63)
+			return -1;
+	}
+
+	if (pFrame->masked)
+		memcpy(pFrame->mask, p + header - 4, 4);
+
+	if ((pFrame->opcode & 0x8) &&
+		(!pFrame->fin || pFrame->length > websocket_max_control_payload))
+	{
+		return -1;
+	}
+
+	return (ptrdiff_t)header;
+}
+
+//
+// Appends a frame header; pMask is the key for a masked (client) frame.
+//
+inline void
+WebSocketAppendFrameHeader(
+	std::string& out,
+	uint8_t opcode,
+	bool fin,
+	uint64_t length,
+	const uint8_t* pMask = nullptr
+)
+{
+	unsigned char header[websocket_max_header];
+	size_t size = 2;
+	uint8_t maskBit = pMask != nullptr ? 0x80 : 0;
+
+	header[0] = (fin ? 0x80 : 0) | opcode;
+
+	if (length < 126)
+	{
+		header[1] = maskBit | (uint8_t)length;
+	}
+	else if (length <= 0xffff)
+	{
+		header[1] = maskBit | 126;
+		header[2] = (uint8_t)(length >> 8);
+		header[3] = (uint8_t)length;
+		size = 4;
+	}
+	else
+	{
+		header[1] = maskBit | 127;
+
+		for (int i = 0; i < 8; i++)
+			header[2 + i] = (uint8_t)(length >> (56 - 8 * i));
+
+		size = 10;
+	}
+
+	if (pMask != nullptr)
+	{
+		memcpy(header + size, pMask, 4);
+		size += 4;
+	}
+
+	out.append(reinterpret_cast<const char*>(header), size);
+}
+
+enum websocket_mask_isa
+{
+	mask_isa_scalar,
+	mask_isa_sse2,
+	mask_isa_avx2,
+	mask_isa_count
+};
+
+inline const char* WebSocketMaskIsaName(websocket_mask_isa isa)
+{
+	static const char* names[mask_isa_count] = { "scalar", "sse2", "avx2" };
+	return names[isa];
+}
+
+//
+// The 4 key bytes as they apply from payload offset onwards, loaded as a
+// word in memory order.
+//
+inline uint32_t
+WebSocketMaskWord(
+	const uint8_t mask[4],
+	uint64_t offset
+)
+{
+	uint8_t rotated[4];
+	uint32_t word;
+
+	for (int i = 0; i < 4; i++)
+		rotated[i] = mask[(offset + i) & 3];
+
+	memcpy(&word, rotated, sizeof(word));
+	return word;
+}
+
+//
+// The variants below XOR length bytes of pSource with the key word into
+// pDest, which may be pSource. Each step covers a multiple of 4 bytes, so
+// the key lines up the same way for the tail.
+//
+inline void
+WebSocketMaskScalar(
+	unsigned char* pDest,
+	const unsigned char* pSource,
+	size_t length,
+	uint32_t key
+)
+{
+	uint64_t key64 = (uint64_t)key << 32 | key;
+	uint8_t bytes[4];
+
+	for (; length >= 8; pDest += 8, pSource += 8, length -= 8)
+	{
+		uint64_t word;
+
+		memcpy(&word, pSource, 8);
+		word ^= key64;
+		memcpy(pDest, &word, 8);
+	}
+
+	memcpy(bytes, &key, 4);
+
+	for (size_t i = 0; i < length; i++)
+		pDest[i] = pSource[i] ^ bytes[i & 3];
+}
+
+#ifdef WEBSOCKET_X86
+
+inline void
+WebSocketMaskSse2(
+	unsigned char* pDest,
+	const unsigned char* pSource,
+	size_t length,
+	uint32_t key
+)
+{
+	__m128i key128 = _mm_set1_epi32((int)key);
+
+	for (; length >= 16; pDest += 16, pSource += 16, length -= 16)
+	{
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSource));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDest), _mm_xor_si128(data, key128));
+	}
+
+	WebSocketMaskScalar(pDest, pSource, length, key);
+}
+
+WEBSOCKET_TARGET_AVX2 inline void
+WebSocketMaskAvx2(
+	unsigned char* pDest,
+	const unsigned char* pSource,
+	size_t length,
+	uint32_t key
+)
+{
+	__m256i key256 = _mm256_set1_epi32((int)key);
+
+	//
+	// Two vectors per step keep both load ports busy.
+	//
+	for (; length >= 64; pDest += 64, pSource += 64, length -= 64)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSource));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSource + 32));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDest), _mm256_xor_si256(a, key256));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDest + 32), _mm256_xor_si256(b, key256));
+	}
+
+	if (length >= 32)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSource));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDest), _mm256_xor_si256(a, key256));
+		pDest += 32;
+		pSource += 32;
+		length -= 32;
+	}
+
+	WebSocketMaskSse2(pDest, pSource, length, key);
+}
+
+#endif
+
+inline bool
+WebSocketMaskIsaSupported(
+	websocket_mask_isa isa
+)
+{
+	if (isa == mask_isa_scalar)
+		return true;
+
+#if defined(WEBSOCKET_X86) && defined(_MSC_VER)
+	int info[4];
+
+	if (isa == mask_isa_sse2)
+		return true;
+
+	__cpuid(info, 1);
+
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(WEBSOCKET_X86)
+	// SSE2 is part of x86-64.
+	if (isa == mask_isa_sse2)
+		return true;
+
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+//
+// The variant WebSocketMask uses. Set once at startup; micro-bench
+// switches it to compare the variants.
+//
+inline websocket_mask_isa websocket_mask_isa_in_use =
+	WebSocketMaskIsaSupported(mask_isa_avx2) ? mask_isa_avx2 :
+	WebSocketMaskIsaSupported(mask_isa_sse2) ? mask_isa_sse2 : mask_isa_scalar;
+
+/***************************************************************************++
+
+Routine Description:
+	Masks or unmasks part of a frame payload; the two are the same XOR.
+
+Arguments:
+	pDest    - Receives the result. May be pSource.
+	pSource  - The payload bytes.
+	length   - Number of bytes.
+	mask     - The frame's key.
+	offset   - Where pSource starts within the payload, so a payload can
+	           be unmasked in pieces as it arrives.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+inline void
+WebSocketMask(
+	void* pDest,
+	const void* pSource,
+	size_t length,
+	const uint8_t mask[4],
+	uint64_t offset
+)
+{
+	unsigned char* d = static_cast<unsigned char*>(pDest);
+	const unsigned char* s = static_cast<const unsigned char*>(pSource);
+	uint32_t key = WebSocketMaskWord(mask, offset);
+
+#ifdef WEBSOCKET_X86
+	switch (websocket_mask_isa_in_use)
+	{
+	case mask_isa_avx2:
+		WebSocketMaskAvx2(d, s, length, key);
+		return;
+
+	case mask_isa_sse2:
+		WebSocketMaskSse2(d, s, length, key);
+		return;
+
+	default:
+		break;
+	}
+#endif
+
+	WebSocketMaskScalar(d, s, length, key);
+}
+
+//
+// SHA-1, which the handshake needs for one short string per connection.
+//
+inline void
+WebSocketSha1(
+	const void* pData,
+	size_t length,
+	uint8_t digest[20]
+)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(pData);
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	unsigned char block[64];
+	uint64_t bits = (uint64_t)length * 8;
+	size_t blocks = (length + 8) / 64 + 1;
+
+	auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+
+	for (size_t b = 0; b < blocks; b++)
+	{
+		uint32_t w[80];
+
+		//
+		// The message, then 0x80, zeros and its length in bits.
+		//
+		for (size_t i = 0; i < 64; i++)
+		{
+			size_t at = b * 64 + i;
+
+			if (at < length)
+				block[i] = p[at];
+			else if (at == length)
+				block[i] = 0x80;
+			else if (b == blocks - 1 && i >= 56)
+				block[i] = (unsigned char)(bits >> (8 * (63 - i)));
+			else
+				block[i] = 0;
+		}
+
+		for (int i = 0; i < 16; i++)
+		{
+			w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+				(uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+		}
+
+		for (int i = 16; i < 80; i++)
+			w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+
+		for (int i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+
+			if (i < 20)
+			{
+				f = (bb & c) | (~bb & d);
+				k = 0x5a827999;
+			}
+			else if (i < 40)
+			{
+				f = bb ^ c ^ d;
+				k = 0x6ed9eba1;
+			}
+			else if (i < 60)
+			{
+				f = (bb & c) | (bb & d) | (c & d);
+				k = 0x8f1bbcdc;
+			}
+			else
+			{
+				f = bb ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			uint32_t t = rotl(a, 5) + f + e + k + w[i];
+
+			e = d;
+			d = c;
+			c = rotl(bb, 30);
+			bb = a;
+			a = t;
+		}
+
+		h[0] += a;
+		h[1] += bb;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+
+	for (int i = 0; i < 20; i++)
+		digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+//
+// Whether a comma-separated header value lists a token, in any case.
+//
+inline bool
+WebSocketHeaderHasToken(
+	std::string_view list,
+	std::string_view token
+)
+{
+	while (!list.empty())
+	{
+		size_t comma = list.find(',');
+		std::string_view item = list.substr(0, comma);
+
+		while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+			item.remove_prefix(1);
+
+		while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+			item.remove_suffix(1);
+
+		if (item.size() == token.size())
+		{
+			size_t i = 0;
+
+			while (i < item.size() && (item[i] | 0x20) == (token[i] | 0x20))
+				i++;
+
+			if (i == item.size())
+				return true;
+		}
+
+		list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+	}
+
+	return false;
+}
+
+//
+// Whether a request's Upgrade, Connection, Sec-WebSocket-Version and
+// Sec-WebSocket-Key headers open a WebSocket. The key is 16 bytes in
+// base64.
+//
+inline bool
+WebSocketIsUpgrade(
+	std::string_view upgrade,
+	std::string_view connection,
+	std::string_view version,
+	std::string_view key
+)
+{
+	return WebSocketHeaderHasToken(upgrade, "websocket") &&
+		WebSocketHeaderHasToken(connection, "upgrade") &&
+		version == "13" && key.size() == 24;
+}
+
+/***************************************************************************++
+
+Routine Description:
+	Computes the Sec-WebSocket-Accept value for a client's key: the
+	base64 of the SHA-1 of the key followed by websocket_guid.
+
+Arguments:
+	key     - The Sec-WebSocket-Key header value.
+	accept  - Receives websocket_accept_length characters.
+
+Return Value:
+	None.
+
+--***************************************************************************/
+inline void
+WebSocketAcceptKey(
+	std::string_view key,
+	char accept[websocket_accept_length]
+)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string input(key);
+	uint8_t digest[21];
+
+	input += websocket_guid;
+	WebSocketSha1(input.data(), input.size(), digest);
+	digest[20] = 0;
+
+	//
+	// 20 bytes: six groups of three, then two bytes and one '='.
+	//
+	for (int i = 0; i < 7; i++)
+	{
+		uint32_t group = (uint32_t)digest[3 * i] << 16 | (uint32_t)digest[3 * i + 1] << 8 |
+			(i < 6 ? digest[3 * i + 2] : 0);
+
+		accept[4 * i] = digits[group >> 18];
+		accept[4 * i + 1] = digits[(group >> 12) & 63];
+		accept[4 * i + 2] = digits[(group >> 6) & 63];
+		accept[4 * i + 3] = i < 6 ? digits[group & 63] : '=';
+	}
+}
+
+//
+// Echoes a client's messages back as they arrive (see the top of the
+// file). Pings are answered with pongs and a Close with a Close; pongs
+// are dropped. Text is echoed without checking that it is UTF-8.
+//
+class websocket_echo
+{
+public:
+	/***************************************************************************++
+
+	Routine Description:
+		Answers the frames at the start of a buffer.
+
+	Arguments:
+		pData      - Bytes received from the client.
+		length     - Number of bytes at pData.
+		out        - The replies are appended here.
+		pMessages  - Incremented for each whole message echoed.
+
+	Return Value:
+		Bytes used. The rest is the start of a frame header or of a
+		control frame, and has to be passed in again with more bytes.
+
+	--***************************************************************************/
+	size_t
+	consume(
+		const char* pData,
+		size_t length,
+		std::string& out,
+		uint64_t* pMessages
+	)
+	{
+		size_t used = 0;
+
+		while (!closed_ && used < length)
+		{
+			if (remaining_ != 0)
+			{
+				size_t piece = length - used;
+
+				if (piece > remaining_)
+					piece = (size_t)remaining_;
+
+				size_t at = out.size();
+
+				out.append(pData + used, piece);
+				WebSocketMask(&out[at], &out[at], piece, mask_, offset_);
+
+				used += piece;
+				offset_ += piece;
+				remaining_ -= piece;
+
+				if (remaining_ == 0 && fin_)
+					*pMessages += 1;
+
+				continue;
+			}
+
+			websocket_frame frame;
+			ptrdiff_t header = WebSocketReadFrameHeader(pData + used, length - used, &frame);
+
+			if (header == 0)
+				break;
+
+			//
+			// Clients must mask, and a fragmented message must go on with
+			// continuation frames and nothing else.
+			//
+			if (header < 0 || !frame.masked ||
+				((frame.opcode & 0x8) == 0 && (frame.opcode == websocket_continuation) != in_message_))
+			{
+				fail(out, websocket_close_protocol_error);
+				break;
+			}
+
+			if (frame.opcode & 0x8)
+			{
+				if (length - used - header < frame.length)
+					break;
+
+				control(frame, pData + used + header, out);
+				used += header + (size_t)frame.length;
+				continue;
+			}
+
+			WebSocketAppendFrameHeader(out, frame.opcode, frame.fin, frame.length);
+
+			memcpy(mask_, frame.mask, sizeof(mask_));
+			offset_ = 0;
+			remaining_ = frame.length;
+			fin_ = frame.fin;
+			in_message_ = !frame.fin;
+			used += header;
+
+			if (remaining_ == 0 && fin_)
+				*pMessages += 1;
+		}
+
+		//
+		// Once closed, whatever else the client sends is dropped.
+		//
+		return closed_ ? length : used;
+	}
+
+	//
+	// Set once a Close has gone out; the connection should then be closed
+	// after sending what is queued.
+	//
+	bool
+	closed() const
+	{
+		return closed_;
+	}
+
+	//
+	// Payload bytes of the current data frame still to arrive.
+	//
+	uint64_t
+	frame_remaining() const
+	{
+		return remaining_;
+	}
+
+private:
+	void
+	control(
+		const websocket_frame& frame,
+		const char* pPayload,
+		std::string& out
+	)
+	{
+		char payload[websocket_max_control_payload];
+
+		WebSocketMask(payload, pPayload, (size_t)frame.length, frame.mask, 0);
+
+		switch (frame.opcode)
+		{
+		case websocket_ping:
+			WebSocketAppendFrameHeader(out, websocket_pong, true, frame.length);
+			out.append(payload, (size_t)frame.length);
+			break;
+
+		case websocket_close:
+			//
+			// Answer with the client's status code, or none if it sent
+			// none; a 1-byte body is malformed.
+			//
+			if (frame.length == 1)
+			{
+				fail(out, websocket_close_protocol_error);
+				break;
+			}
+
+			WebSocketAppendFrameHeader(out, websocket_close, true, frame.length >= 2 ? 2 : 0);
+			out.append(payload, frame.length >= 2 ? 2 : 0);
+			closed_ = true;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void
+	fail(
+		std::string& out,
+		uint16_t code
+	)
+	{
+		char payload[2] = { (char)(code >> 8), (char)code };
+
+		WebSocketAppendFrameHeader(out, websocket_close, true, sizeof(payload));
+		out.append(payload, sizeof(payload));
+		closed_ = true;
+	}
+
+	uint64_t remaining_ = 0;
+	uint64_t offset_ = 0;
+	uint8_t mask_[4] = {};
+	bool fin_ = false;
+	bool in_message_ = false;
+	bool closed_ = false;
+};
+
+#endif